@@ -0,0 +1,247 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
+
+/*
+    Where MSG_ZEROCOPY starts to pay, for picking --zerocopy BYTES: the
+    sending thread's CPU time per GiB, by send size, sent by copy and
+    then zerocopy. Sends are made from a ring of buffers deep enough
+    that completions, not the ring, set the pace.
+
+    zerocopy_crossover [HOST PORT [SMALLEST_SEND]]
+
+    Without HOST and PORT, to a sink on loopback. Loopback copies on
+    receive whatever the sender does: only the sender's CPU time tells
+    there. Against a sink across a NIC with scatter-gather transmit,
+    taking a connection per run (e.g. `socat -u TCP-LISTEN:PORT,fork
+    /dev/null`), wall time does too.
+*/
+
+enum {OK=0,ERR=-1};
+enum {ZERO=0};
+
+enum {RING_DEPTH=512};
+enum {LARGEST_SEND=256 * 1024};
+enum {DEFAULT_SMALLEST_SEND=4096};
+static const size_t BYTES_PER_RUN = (size_t)1 << 30;
+
+struct Destination
+{
+    struct sockaddr_in address;
+    /* loopback: a sink is started per run, listening here */
+    int listener_fd;
+};
+
+struct Ring
+{
+    char* buffers[RING_DEPTH];
+    uint32_t sends;
+    /* the sends numbered below this are done */
+    uint32_t completed;
+};
+
+static double thread_cpu_seconds(void)
+{
+    struct timespec now;
+    const int _ignored = clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static double wall_seconds(void)
+{
+    struct timespec now;
+    const int _ignored = clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void* sink_one_connection(
+    void* arg)
+{
+    const int listener_fd = *(const int*)arg;
+    const int socket_fd = accept(listener_fd, NULL, NULL);
+    if (socket_fd < ZERO) {
+        return NULL;
+    }
+    char* space = malloc(LARGEST_SEND);
+    while (NULL != space && read(socket_fd, space, LARGEST_SEND) > ZERO) {
+    }
+    free(space);
+    const int _ignored = close(socket_fd);
+    return NULL;
+}
+
+static int listen_on_loopback(
+    struct Destination* destination)
+{
+    destination->listener_fd = socket(AF_INET, SOCK_STREAM, ZERO);
+    destination->address = (struct sockaddr_in) {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+    socklen_t addr_len = sizeof(destination->address);
+    if (destination->listener_fd < ZERO
+        || OK != bind(destination->listener_fd, (struct sockaddr*)&destination->address, addr_len)
+        || OK != listen(destination->listener_fd, 1)
+        || OK != getsockname(destination->listener_fd, (struct sockaddr*)&destination->address, &addr_len)
+    ) {
+        return ERR;
+    }
+    return OK;
+}
+
+/* completion ranges off the error queue; block: wait for at least one */
+static void ring_reap(
+    struct Ring* ring,
+    const int socket_fd,
+    bool block)
+{
+    for (;;) {
+        char control[128];
+        struct msghdr msg = {
+            .msg_control = control,
+            .msg_controllen = sizeof(control)
+        };
+        if (recvmsg(socket_fd, &msg, MSG_ERRQUEUE | (block ? ZERO : MSG_DONTWAIT)) < ZERO) {
+            if (EAGAIN != errno || !block) {
+                return;
+            }
+            struct pollfd pollfd = {.fd = socket_fd};
+            const int _ignored = poll(&pollfd, 1, 1);
+            continue;
+        }
+        const struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if (NULL != cmsg) {
+            const struct sock_extended_err* err = (const struct sock_extended_err*)CMSG_DATA(cmsg);
+            ring->completed = err->ee_data + 1;
+        }
+        block = false;
+    }
+}
+
+static int run(
+    const struct Destination* destination,
+    const size_t send_size,
+    const bool zerocopy)
+{
+    pthread_t sink;
+    const bool loopback = destination->listener_fd >= ZERO;
+    if (loopback
+        && OK != pthread_create(&sink, NULL, sink_one_connection, (void*)&destination->listener_fd)
+    ) {
+        return ERR;
+    }
+
+    const int one = 1;
+    const int socket_fd = socket(AF_INET, SOCK_STREAM, ZERO);
+    if (socket_fd < ZERO
+        || (zerocopy && OK != setsockopt(socket_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)))
+        || OK != connect(socket_fd, (const struct sockaddr*)&destination->address, sizeof(destination->address))
+    ) {
+        perror("zerocopy_crossover: connect");
+        return ERR;
+    }
+
+    struct Ring ring = {.sends = ZERO, .completed = ZERO};
+    for (ptrdiff_t i = 0; i < RING_DEPTH; i++) {
+        ring.buffers[i] = malloc(send_size);
+        if (NULL == ring.buffers[i]) {
+            return ERR;
+        }
+        const void* _ = memset(ring.buffers[i], (int)i, send_size);
+    }
+
+    const double cpu_began = thread_cpu_seconds();
+    const double wall_began = wall_seconds();
+    for (size_t sent = ZERO; sent < BYTES_PER_RUN;) {
+        /* a buffer is written again only once the kernel is done with it */
+        while (zerocopy && ring.sends - ring.completed >= RING_DEPTH) {
+            ring_reap(&ring, socket_fd, true);
+        }
+        const ssize_t sent_now =
+            send(
+                socket_fd,
+                ring.buffers[ring.sends % RING_DEPTH],
+                send_size,
+                zerocopy ? MSG_ZEROCOPY : ZERO
+            );
+        if (sent_now <= ZERO) {
+            perror("zerocopy_crossover: send");
+            return ERR;
+        }
+        sent += (size_t)sent_now;
+        ring.sends++;
+        if (zerocopy) {
+            ring_reap(&ring, socket_fd, false);
+        }
+    }
+    const int _ignored = shutdown(socket_fd, SHUT_WR);
+    while (zerocopy && ring.completed != ring.sends) {
+        ring_reap(&ring, socket_fd, true);
+    }
+    if (loopback) {
+        const int _joined = pthread_join(sink, NULL);
+    }
+    const double cpu = thread_cpu_seconds() - cpu_began;
+    const double wall = wall_seconds() - wall_began;
+
+    printf(
+        "%7zu %-8s  cpu %.2f s/GiB  wall %.2f s/GiB\n",
+        send_size,
+        zerocopy ? "zerocopy" : "copy",
+        cpu,
+        wall
+    );
+
+    const int _closed = close(socket_fd);
+    for (ptrdiff_t i = 0; i < RING_DEPTH; i++) {
+        free(ring.buffers[i]);
+    }
+    return OK;
+}
+
+int main(
+    int argc,
+    char* argv[])
+{
+    struct Destination destination = {.listener_fd = ERR};
+    size_t smallest_send = DEFAULT_SMALLEST_SEND;
+    if (argc >= 3) {
+        destination.address = (struct sockaddr_in) {
+            .sin_family = AF_INET,
+            .sin_port = htons((in_port_t)atoi(argv[2]))
+        };
+        if (1 != inet_pton(AF_INET, argv[1], &destination.address.sin_addr)) {
+            fprintf(stderr, "%s: %s is not an IPv4 address\n", argv[0], argv[1]);
+            return ERR;
+        }
+        if (argc >= 4) {
+            smallest_send = strtoul(argv[3], NULL, 10);
+        }
+    } else if (OK != listen_on_loopback(&destination)) {
+        perror("zerocopy_crossover: listen");
+        return ERR;
+    }
+
+    setvbuf(stdout, NULL, _IOLBF, ZERO);
+    for (size_t send_size = smallest_send; ZERO != send_size && send_size <= LARGEST_SEND; send_size *= 2) {
+        if (OK != run(&destination, send_size, false)
+            || OK != run(&destination, send_size, true)
+        ) {
+            return ERR;
+        }
+    }
+    return OK;
+}
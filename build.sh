@@ -1,5 +1,5 @@
-CFLAGS="-I./include -I./src -I$HOME/.local/include"
-LFLAGS="-L./bin -L$HOME/.local/lib -l:libhashpipe.a"
+CFLAGS="-I./include -I./src"
+LFLAGS="-L./bin"
 
 for dotc_file in ./src/*.c; do
   clang -g -DDEBUG=1 -fPIC -c "$dotc_file" $CFLAGS -o "$dotc_file.o"
@@ -14,7 +14,10 @@ done
 ar rcs bin/librfc1928socks5.a $doto_files
 clang -g -DDEBUG=1 -shared -o bin/librfc1928socks5.so $doto_files $CFLAGS -l:librfc1928socks5.a $LFLAGS 
  
-clang -g -DDEBUG=1 -o bin/program program/program.c -I./include -L./bin $CFLAGS -l:librfc1928socks5.a $LFLAGS 
+clang -g -DDEBUG=1 -o bin/program program/*.c -I./include -L./bin $CFLAGS -l:librfc1928socks5.a $LFLAGS -lpthread -lssl -lcrypto
+
+# where MSG_ZEROCOPY pays, for --zerocopy BYTES
+clang -g -o bin/zerocopy_crossover bench/zerocopy_crossover.c -lpthread
 
 rm ./src/*.c.o
 
@@ -3,15 +3,16 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
 #include <netdb.h>
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
 
 
-#include "hashpipe.h"
 
-#define CLIENT_TEMP_SPACE 8192
+#define CLIENT_TEMP_SPACE 16384
 
 enum Socks5RequestReply
 {
@@ -28,11 +29,37 @@ enum Socks5RequestReply
 
 enum Socks5ClientPhase
 {
+    /* with cfg.tls: until the session's keys are handed to the kernel */
+    SOCKS5_CLIENT_PHASE_TLS_HANDSHAKE,
     SOCKS5_CLIENT_PHASE_BEGIN_RECVING_CLIENT_VERSION_CHOICE_METHODS_ARRAY_REQ,
     SOCKS5_CLIENT_PHASE_AWAITING_EVENT_RECVD_CLIENT_VERSION_CHOICE_METHODS_ARRAY_REQ,
     SOCKS5_CLIENT_PHASE_BEGIN_SENDING_AUTH_METHOD_CHOICE_RESP,
     SOCKS5_CLIENT_PHASE_AWAITING_EVENT_SENT_AUTH_METHOD_CHOICE_RESP,
-    SOCKS5_CLIENT_PHASE_RECV_REQUEST
+    /* RFC 1929 sub-negotiation, when username/password was chosen */
+    SOCKS5_CLIENT_PHASE_RECV_USERNAME_PASSWORD_AUTH,
+    SOCKS5_CLIENT_PHASE_RECV_REQUEST,
+    SOCKS5_CLIENT_PHASE_BEGIN_RESOLVING_DESTINATION,
+    SOCKS5_CLIENT_PHASE_AWAITING_EVENT_DESTINATION_RESOLVED,
+    SOCKS5_CLIENT_PHASE_BEGIN_CONNECTING_OUTBOUND,
+    SOCKS5_CLIENT_PHASE_AWAITING_EVENT_OUTBOUND_CONNECTED,
+    /* BIND: the first reply is sent once listening, the second once accepted */
+    SOCKS5_CLIENT_PHASE_BEGIN_BINDING,
+    SOCKS5_CLIENT_PHASE_AWAITING_EVENT_BIND_ACCEPTED,
+    SOCKS5_CLIENT_PHASE_BEGIN_ASSOCIATING_UDP,
+    SOCKS5_CLIENT_PHASE_BEGIN_SENDING_REQUEST_REPLY,
+    SOCKS5_CLIENT_PHASE_RELAYING,
+    /* UDP ASSOCIATE: the TCP connection only holds the association open */
+    SOCKS5_CLIENT_PHASE_RELAYING_DATAGRAMS
+};
+
+/* which of the cfg timeouts a client's phase is held to */
+enum Socks5ClientDeadline
+{
+    SOCKS5_CLIENT_DEADLINE_NONE=0,
+    SOCKS5_CLIENT_DEADLINE_HANDSHAKE,
+    SOCKS5_CLIENT_DEADLINE_AUTH,
+    SOCKS5_CLIENT_DEADLINE_CONNECT,
+    SOCKS5_CLIENT_DEADLINE_IDLE
 };
 
 enum Socks5ReceivingRequestOrSendingResponse
@@ -49,6 +76,13 @@ struct ClientHello
     uint8_t methods[MAX_METHODS];
 };
 
+enum Socks5AuthMethod
+{
+    SOCKS5_AUTH_METHOD_NO_AUTHENTICATION_REQUIRED = 0x00,
+    SOCKS5_AUTH_METHOD_USERNAME_PASSWORD = 0x02,
+    SOCKS5_AUTH_METHOD_NO_ACCEPTABLE_METHODS = 0xFF
+};
+
 enum Socks5RequestCmd
 {
     SOCKS5_REQUEST_CMD_CONNECT = 1,
@@ -67,7 +101,7 @@ union DestinationAddress
 {
     enum {FOUR=4};
     char ipv4[FOUR];
-    char domain_name[UINT8_MAX];
+    char domain_name[UINT8_MAX + 1];
     enum {SIXTEEN=16};
     char ipv6[16];
 };
@@ -80,8 +114,9 @@ struct ClientRequest
     uint8_t _reserved;
     enum Socks5AddrType addr_type;
     union DestinationAddress dst_addr;
-    
-    
+    uint8_t dst_addr_len;
+    /* network octet order, as received */
+    uint16_t dst_port;
 };
 
 union Socks5Request
@@ -90,27 +125,346 @@ union Socks5Request
     struct ClientRequest client_request;
 };
 
+/*
+    recv_space holds bytes read from the inbound (client) socket,
+    [forwarded, recvd) of it still owed to the outbound socket.
+    send_space holds bytes owed to the inbound socket, [sent, to_send).
+    Either space is NULL unless bytes are pending: it is taken from the
+    server's IOBufferPool on demand and handed back once drained.
+*/
 struct IOBuffer
 {
-    char recv_space[CLIENT_TEMP_SPACE];
-    char send_space[CLIENT_TEMP_SPACE];
+    char* recv_space;
+    char* send_space;
+    size_t recv_capacity;
+    size_t send_capacity;
     ptrdiff_t sent;
     ptrdiff_t to_send;
     ptrdiff_t recvd;
+    ptrdiff_t forwarded;
+};
+
+enum {IO_BUFFER_CLASS_COUNT=5};
+
+struct IOBufferClass
+{
+    void* idle;
+    size_t idle_count;
+};
+
+/* size classed (256 B .. 64 KiB) free lists, at most idle_capacity kept per class */
+struct IOBufferPool
+{
+    struct IOBufferClass classes[IO_BUFFER_CLASS_COUNT];
+    size_t idle_capacity;
+};
+
+struct PipePair
+{
+    int read_fd;
+    int write_fd;
+    size_t in_pipe;
+};
+
+/* idle, empty pipe pairs kept open so relays need not pipe2() per tunnel */
+struct PipePairPool
+{
+    struct PipePair* idle;
+    size_t idle_count;
+    size_t capacity;
+};
+
+/*
+    Listening sockets for BIND requests, bound to ephemeral ports next
+    to the server's own listener: taken ready to accept, handed back
+    once their connection is accepted.
+*/
+struct ListenerPool
+{
+    int* idle;
+    size_t idle_count;
+    size_t capacity;
+    struct sockaddr_storage address;
+    socklen_t address_len;
+};
+
+struct Socks5Server;
+struct TimerWheelEntry;
+
+typedef void (*TimerWheelExpire)(struct Socks5Server* server, struct TimerWheelEntry* entry);
+
+/* embedded in what it times; expire is called once its deadline has passed */
+struct TimerWheelEntry
+{
+    struct TimerWheelEntry* prev;
+    struct TimerWheelEntry* next;
+    TimerWheelExpire expire;
+    int64_t tick;
+    /* of the wheel's slots; -1 when not armed */
+    ptrdiff_t slot;
+};
+
+enum {TIMER_WHEEL_LEVELS=4};
+enum {TIMER_WHEEL_LEVEL_BITS=6};
+enum {TIMER_WHEEL_LEVEL_SLOTS=1 << TIMER_WHEEL_LEVEL_BITS};
+enum {TIMER_WHEEL_SLOTS=TIMER_WHEEL_LEVELS * TIMER_WHEEL_LEVEL_SLOTS};
+
+/*
+    A hierarchical timing wheel: level 0 has a slot per tick for the
+    next 64 ticks, and each level above spans 64 slots of the whole
+    level below. Arming and unarming are O(1) however many are armed;
+    an entry moves down a level only as its deadline nears, so most
+    are unarmed again before they are ever touched.
+*/
+struct TimerWheel
+{
+    /* level by level; one past them: entries found expired, not yet handed out */
+    struct TimerWheelEntry* slots[TIMER_WHEEL_SLOTS + 1];
+    size_t level_counts[TIMER_WHEEL_LEVELS];
+    /* the next tick to be collected */
+    int64_t cursor_tick;
+    size_t armed_count;
+};
+
+/*
+    bytes_per_s of zero: unshaped. burst of zero: an eighth of a
+    second's worth; never less than a thirty-second's, the most a
+    parked relay oversleeps by.
+*/
+struct ShapingRate
+{
+    uint64_t bytes_per_s;
+    uint64_t burst;
+};
+
+/*
+    Refilled lazily, as it is drawn on; in thousandths of a byte so no
+    millisecond's share is lost. Refilled and drawn on with atomics: one
+    may be drawn on by servers on other threads.
+*/
+struct TokenBucket
+{
+    int64_t millibytes;
+    int64_t refilled_ms;
+};
+
+/*
+    READINESS: the event source reports FdEventNotification and the
+    library does its own recv.
+    COMPLETION: the event source does the reads and hands the bytes to
+    socks5server_proc_recvd; relayed bytes are sent by the event source.
+*/
+enum Socks5EventModel
+{
+    SOCKS5_EVENT_MODEL_READINESS,
+    SOCKS5_EVENT_MODEL_COMPLETION
+};
+
+enum Socks5RelayMode
+{
+    SOCKS5_RELAY_MODE_BUFFERED,
+    SOCKS5_RELAY_MODE_SPLICE
+};
+
+enum FDIOEvent
+{
+    FDIOEVENT_READABLE = 1,
+    FDIOEVENT_WRITABLE = 2,
+    /*
+        Readability only, reported as FDIOEVENT_READABLE, under either
+        event model: datagram sockets, which the library reads itself
+        for the source addresses, and BIND listeners it accepts on.
+    */
+    FDIOEVENT_POLL_READABLE = 4,
+    /*
+        Reported, never subscribed to: the socket's error queue holds
+        something (EPOLLERR). Sockets with cfg.zerocopy_threshold
+        completions pending also have it drained as their relay needs
+        pins freed, so an event source may leave it out.
+    */
+    FDIOEVENT_ERROR_QUEUE = 8
+};
+
+/*
+    wanted is what the library currently wants to hear about, registered
+    what the event source was last told; they differ only until the
+    server's interest queue is flushed.
+*/
+struct SocketInterest
+{
+    enum FDIOEvent wanted;
+    enum FDIOEvent registered;
+    bool subscribed;
+};
+
+struct AccessPolicy;
+struct CredentialStore;
+struct FailedAuthCache;
+struct DnsAnswer;
+struct DnsCache;
+struct DomainIndex;
+struct DnsResolver;
+struct ShapingBuckets;
+struct TlsContext;
+struct TlsHandshake;
+struct UdpAssociation;
+struct UdpBatch;
+
+/* a client's place in the queue of a pending DOMAINNAME lookup */
+struct DnsWaiter
+{
+    struct DnsWaiter* next;
+    void* lookup;
+};
+
+/*
+    One of a client's sockets besides the inbound and outbound ones: a
+    connect racing to become the outbound socket (RFC 8305), its BIND
+    listener, or one of the sockets of its UDP association.
+*/
+struct ClientSocket
+{
+    int socket_fd;
+    bool subscribed;
+    struct Socks5Client* client;
+    /* a connection attempt: bytes of the client's early data its SYN carried */
+    size_t early_sent;
+};
+
+/*
+    A buffer a relay leg has let go of with MSG_ZEROCOPY sends from it
+    still in flight: the kernel may yet read its pages.
+*/
+struct ZerocopyPin
+{
+    char* space;
+    size_t capacity;
+    /* released once the sends numbered below this are done */
+    uint32_t sends_through;
 };
 
+enum {MAX_ZEROCOPY_PINS=4};
+
+/*
+    The MSG_ZEROCOPY sends of one relay leg. The kernel numbers a
+    socket's zerocopy sends from zero and reports them done, in ranges,
+    on the socket's error queue. Counters wrap.
+*/
+struct ZerocopyLeg
+{
+    bool enabled;
+    uint32_t sends;
+    /* the sends numbered below this are done */
+    uint32_t completed;
+    /* reported done, in whatever order: once it reaches sends, all are */
+    uint32_t reported;
+    /* the leg's buffer was sent from: pinned when let go of, until then */
+    bool space_sent;
+    uint32_t space_sends_through;
+    struct ZerocopyPin pins[MAX_ZEROCOPY_PINS];
+    uint8_t pin_count;
+};
+
+enum {MAX_OUTBOUND_ATTEMPTS=4};
+/* the method selection reply and the RFC 1929 status */
+enum {MAX_HELD_REPLIES=2};
+
 struct Socks5Client
 {
     enum Socks5ClientPhase phase;
     enum Socks5ReceivingRequestOrSendingResponse status;
+    enum Socks5AuthMethod auth_method;
     int inbound_socket_fd;
-    int inbound_write_subscribed_socket_fd;
-    struct sockaddr address;
+    int outbound_socket_fd;
+    struct SocketInterest inbound_interest;
+    struct SocketInterest outbound_interest;
+    bool inbound_end_of_stream;
+    bool outbound_end_of_stream;
+    bool inbound_shut_wr;
+    bool outbound_shut_wr;
+    /* SOCKS5_EVENT_MODEL_COMPLETION: read interest withdrawn until the upstream leg drains */
+    bool inbound_reads_held;
+    struct sockaddr_storage address;
     socklen_t addr_len;
     struct IOBuffer io;
+    /*
+        Handshake replies from static tables, not sent yet: the client
+        pipelined past them, so they go out ahead of the next reply,
+        in the same sendmsg.
+    */
+    struct iovec held_replies[MAX_HELD_REPLIES];
+    uint8_t held_reply_count;
+    bool relay_spliced;
+    struct PipePair upstream_pipe;
+    struct PipePair downstream_pipe;
+    /*
+        With cfg.zerocopy_threshold, once relaying: the upstream leg's,
+        then the downstream leg's, from the buffer pool. NULL otherwise.
+    */
+    struct ZerocopyLeg* zerocopy_legs;
     union Socks5Request current_request;
+    struct DnsWaiter destination_waiter;
+    /* addresses of a DOMAINNAME destination, once resolved */
+    struct DnsAnswer* destination_answer;
+    struct ClientSocket outbound_attempts[MAX_OUTBOUND_ATTEMPTS];
+    /* BIND: where the remote's connection is accepted from */
+    struct ClientSocket bind_listener;
+    /* of the destination addresses, in the order they are tried */
+    uint8_t next_destination;
+    int last_connect_errno;
+    /* the Connection Attempt Delay ran out: the next address may be tried */
+    bool attempt_due;
+    /* armed for the Connection Attempt Delay while an attempt is in flight */
+    struct TimerWheelEntry attempt_timer;
+    /* SOCKS5_CLIENT_PHASE_RELAYING_DATAGRAMS */
+    struct UdpAssociation* udp_association;
+    /* SOCKS5_CLIENT_PHASE_TLS_HANDSHAKE; let go of once the kernel has the keys */
+    struct TlsHandshake* tls_handshake;
+    /* armed as the client enters a phase held to a different deadline */
+    struct TimerWheelEntry deadline_timer;
+    enum Socks5ClientDeadline deadline;
+    /* relaying: the idle deadline is pushed back only once it is reached */
+    int64_t last_active_ms;
+    /* shaping: drawn on with the user's and the server's buckets */
+    struct TokenBucket shaping_bucket;
+    /* NULL until authenticated as a user, or when users aren't shaped */
+    struct TokenBucket* user_bucket;
+    /* armed while a relay waits for tokens: parked, not reading */
+    struct TimerWheelEntry shaping_timer;
+    /* bytes left of the relay's turn; a turn is cfg.relay_turn_bytes times the weight */
+    int64_t relay_budget;
+    uint32_t relay_weight;
+    /* out of turn with bytes still unread: queued for its next one */
+    bool runnable;
+    struct Socks5Client* prev_runnable;
+    struct Socks5Client* next_runnable;
+    /* set by destruction; the memory outlives the current event batch */
+    bool destructed;
+    struct Socks5Client* next_destructed;
+    bool interest_queued;
+    struct Socks5Client* next_interest_queued;
+};
+
+
+enum Socks5ClientSlabFlags
+{
+    /* touch every page at construction instead of on first accept */
+    SOCKS5_CLIENT_SLAB_PREFAULT = 1 << 0,
+    /* keep the slab resident; implies PREFAULT */
+    SOCKS5_CLIENT_SLAB_MLOCK = 1 << 1,
+    /* MAP_HUGETLB if pages are reserved, transparent huge pages otherwise */
+    SOCKS5_CLIENT_SLAB_HUGE_PAGES = 1 << 2
 };
 
+/* fixed capacity, mmap'd once; idle clients are a LIFO stack of pointers into it */
+struct Socks5ClientSlab
+{
+    struct Socks5Client* clients;
+    struct Socks5Client** idle;
+    size_t idle_count;
+    size_t capacity;
+    size_t mapped_size;
+};
 
 typedef struct Socks5Client* (*AcquireResourceSocks5Client)(void);
 typedef void (*RelenquishResourceSocks5Client)(struct Socks5Client* socks5_client);
@@ -121,19 +475,186 @@ struct Socks5ServerCfg
 {
     AcquireResourceSocks5Client acquire_client_resources;
     RelenquishResourceSocks5Client relenquish_client_resources;
-    int (*sub_to_socket_read_activity_event)(struct Socks5Server* server, const int socket_fd);
-    int (*unsub_all_socket_events)(struct Socks5Server* server, const int socket_fd);
-    int (*sub_to_socket_write_activity_event)(struct Socks5Server* server, const int socket_fd);
-    int (*unsub_to_socket_write_activity_event)(struct Socks5Server* server, const int socket_fd);
+    /*
+        One registration per socket: subscribed once, its interest set
+        modified in place, unsubscribed before close. Changes are
+        coalesced, so a socket sees at most one call per
+        socks5server_proc_* invocation.
+        context is opaque; an event source that can keep it per
+        subscription (epoll data.ptr) may hand it back in
+        FdEventNotification to spare the library the fd lookup.
+    */
+    int (*subscribe_socket)(struct Socks5Server* server, const int socket_fd, const enum FDIOEvent interest, void* context);
+    int (*modify_socket_interest)(struct Socks5Server* server, const int socket_fd, const enum FDIOEvent interest, void* context);
+    int (*unsubscribe_socket)(struct Socks5Server* server, const int socket_fd);
 
     struct addrinfo listener_address;
+    /* several servers, one per reactor thread, may share the listener address */
+    bool reuse_port;
+    /*
+        TCP Fast Open. Non-zero backlog: the listener takes data in the
+        SYN, with at most this many such connections pending. connect:
+        bytes the client sent past its CONNECT request go out in the
+        SYN of an attempt no other can race (the only destination
+        address, or the last one left), once the kernel holds a cookie
+        for it; never twice, to two servers.
+    */
+    uint32_t tcp_fast_open_backlog;
+    bool tcp_fast_open_connect;
+
+    enum Socks5EventModel event_model;
+    enum Socks5RelayMode relay_mode;
+    /* SOCKS5_RELAY_MODE_SPLICE: idle pipe pairs kept, two per tunnel */
+    size_t pipe_pool_capacity;
+    /* BIND listeners opened up front and kept for reuse */
+    size_t bind_listener_pool_capacity;
+
+    /*
+        non-zero: clients come from a slab of this many, built by the server.
+        acquire/relenquish_client_resources, when set, serve the overflow.
+    */
+    size_t client_slab_capacity;
+    unsigned client_slab_flags;
+
+    /* drained I/O buffers kept for reuse, per size class */
+    size_t io_buffer_pool_idle_capacity;
+
+    /* DOMAINNAME destinations are asked of this; zero length: /etc/resolv.conf */
+    struct sockaddr_storage dns_nameserver;
+    socklen_t dns_nameserver_len;
+    /* NULL: no caching; one cache may be shared by every server */
+    struct DnsCache* dns_cache;
+
+    /*
+        non-NULL: clients must authenticate by username/password (RFC
+        1929) as one of these users; one store may be shared by every
+        server.
+    */
+    const struct CredentialStore* credentials;
+
+    /*
+        non-NULL: client sources, and the destinations they ask for, are
+        held to these rules; one policy may be shared by every server.
+    */
+    const struct AccessPolicy* access_policy;
+
+    /*
+        non-NULL: DOMAINNAME destinations under any of these suffixes
+        are refused; one index may be shared by every server.
+    */
+    const struct DomainIndex* domain_blocklist;
+
+    /*
+        non-zero: fragmented UDP datagrams (FRAG) are reassembled, in at
+        most this many bytes across the server's associations; zero:
+        they are dropped.
+    */
+    size_t udp_reassembly_capacity;
+
+    /*
+        In milliseconds, zero: none. handshake: each stretch of the
+        handshake either side of authentication; auth: the RFC 1929
+        sub-negotiation; connect: from the request until its reply is
+        sent; idle: a relay or UDP association with nothing moving.
+    */
+    uint32_t handshake_timeout_ms;
+    uint32_t auth_timeout_ms;
+    uint32_t connect_timeout_ms;
+    uint32_t idle_timeout_ms;
+
+    /*
+        Bytes relayed either way, per client, per authenticated user and
+        for the whole server; a relay reads only what all three allow,
+        and waits for tokens on the timer wheel. SOCKS5_EVENT_MODEL_READINESS
+        only: the server isn't constructed if shaping is asked of the
+        completion model, whose event source does the reads.
+    */
+    struct ShapingRate client_shaping;
+    struct ShapingRate user_shaping;
+    struct ShapingRate server_shaping;
+    /*
+        non-NULL: the user and server buckets, one table that may be
+        shared by every server, so user_shaping and server_shaping hold
+        across all of them; constructed for the same credentials and
+        rates. NULL: the server keeps its own.
+    */
+    struct ShapingBuckets* shaping_buckets;
+
+    /*
+        non-zero: a relay moves at most this many bytes, times its
+        weight, before yielding to the others; what it leaves unread
+        waits its next turn on the run queue, served a turn per relay
+        by each socks5server_proc_timeouts. Zero: a relay reads until
+        its socket would block. SOCKS5_EVENT_MODEL_READINESS only.
+    */
+    size_t relay_turn_bytes;
+    /* asked once, as the relay begins; NULL, or a weight of zero: 1 */
+    uint32_t (*weigh_relay)(struct Socks5Server* server, const struct Socks5Client* client);
+
+    /*
+        non-zero: buffered relay sends of at least this many bytes go
+        with MSG_ZEROCOPY, the pages they are sent from pinned until the
+        kernel reports them done on the socket's error queue; a leg
+        whose sends the kernel ends up copying anyway, as on loopback,
+        goes back to plain sends. The event source reports a socket with
+        completions queued with FDIOEVENT_ERROR_QUEUE.
+        SOCKS5_EVENT_MODEL_READINESS only.
+    */
+    size_t zerocopy_threshold;
+
+    /*
+        non-NULL: clients speak SOCKS5 inside TLS 1.3. The library does
+        each handshake, then hands the session's keys to the kernel
+        (TCP_ULP "tls"): from there on the client's socket reads and
+        writes plaintext, relayed like any other. A client whose keys
+        the kernel won't take is closed. One context may be shared by
+        every server. SOCKS5_EVENT_MODEL_READINESS only.
+    */
+    const struct TlsContext* tls;
+};
+
+/* client of each fd, indexed by the fd itself; sized from RLIMIT_NOFILE */
+struct Socks5ClientTable
+{
+    struct Socks5Client** clients;
+    size_t capacity;
 };
 
 struct Socks5Server
 {
     int listener_socket_fd;
     struct Socks5ServerCfg cfg;
-    struct Hash clients;
+    struct Socks5ClientTable clients;
+    /*
+        Work deferred to the end of the outermost socks5server_proc_*
+        call: interest changes are flushed, then destructed clients are
+        relinquished.
+    */
+    unsigned batch_depth;
+    struct Socks5Client* interest_queue;
+    struct Socks5Client* destructed_clients;
+    /* relays waiting their next turn, in the order they ran out of it */
+    struct Socks5Client* run_queue_head;
+    struct Socks5Client* run_queue_tail;
+    size_t runnable_count;
+    struct PipePairPool pipes;
+    struct ListenerPool bind_listeners;
+    struct Socks5ClientSlab client_slab;
+    struct IOBufferPool io_buffers;
+    struct DnsResolver* resolver;
+    /* with cfg.credentials: recent failures, turned away unchecked */
+    struct FailedAuthCache* failed_auths;
+    /* datagrams in flight through the UDP associations, allocated with the first */
+    struct UdpBatch* udp_batch;
+    /* held by the associations' reassembly queues, against cfg.udp_reassembly_capacity */
+    size_t udp_reassembly_space;
+    struct TimerWheel timers;
+    /* monotonic, read as the outermost batch begins */
+    int64_t now_ms;
+    /* cfg.shaping_buckets, or the server's own */
+    struct ShapingBuckets* shaping_buckets;
+    /* every read lands here first; only leftovers are copied into a client's buffer */
+    char scratch_space[CLIENT_TEMP_SPACE];
     void* data;
 };
 
@@ -142,22 +663,61 @@ int socks5server_construct(
     const struct Socks5ServerCfg* cfg
 );
 
+/* answers by name, for cfg.dns_cache; reads from any thread take no lock */
+struct DnsCache* socks5server_construct_dns_cache(
+    const size_t capacity
+);
+
+/* user and server buckets for cfg.shaping_buckets, full; users: NULL, or the credentials they are shaped by */
+struct ShapingBuckets* socks5server_construct_shaping_buckets(
+    const struct CredentialStore* credentials,
+    const struct ShapingRate* user_shaping,
+    const struct ShapingRate* server_shaping
+);
+
+/* users for cfg.credentials, "name:password" per line; NULL if the file can't be loaded */
+struct CredentialStore* socks5server_load_credentials(
+    const char* path
+);
+
+/* rules for cfg.access_policy, "allow|deny src|dst PREFIX[/LEN]" per line; NULL if the file can't be loaded */
+struct AccessPolicy* socks5server_load_access_policy(
+    const char* path
+);
+
+/* certificate chain and private key, PEM, for cfg.tls; NULL, errno ENOPROTOOPT, if the kernel has no tls ULP, or EINVAL if they can't be loaded */
+struct TlsContext* socks5server_load_tls(
+    const char* cert_path,
+    const char* key_path
+);
+
+/* one domain suffix per line, compiled ahead of time into a file for socks5server_map_domain_blocklist */
+int socks5server_compile_domain_blocklist(
+    const char* list_path,
+    const char* index_path
+);
+
+/* for cfg.domain_blocklist; NULL if the file isn't a compiled index */
+struct DomainIndex* socks5server_map_domain_blocklist(
+    const char* index_path
+);
+
 int socks5server_begin_listening(
     const struct Socks5Server* socks5_server,
     const int back_log
 );
 
-enum FDIOEvent
-{
-    FDIOEVENT_READABLE = 1,
-    FDIOEVENT_WRITABLE = 2
-};
-
 
+/*
+    context: NULL, or what the library passed when subscribing to the
+    socket; when set fd_of_interest is not consulted. The listener is
+    always reported by fd with a NULL context.
+*/
 struct FdEventNotification
 {
     int fd_of_interest;
     enum FDIOEvent events_of_occurrence;
+    void* context;
 };
 
 int socks5server_proc_io_events(
@@ -172,4 +732,49 @@ int socks5server_proc_io_events(
     const size_t event_noti_count
 );
 
+int socks5server_proc_accepted_connection(
+    struct Socks5Server* socks5_server,
+    const int socket_fd,
+    struct sockaddr_storage* address,
+    const socklen_t addr_len
+);
+
+/*
+    SOCKS5_EVENT_MODEL_COMPLETION only. len of 0 is end of stream.
+    *forward_to_fd is set when the bytes weren't consumed and the event
+    source is to send them, in order, to that socket (shutting down its
+    write side once the end of stream is reached).
+*/
+int socks5server_proc_recvd(
+    struct Socks5Server* socks5_server,
+    const int socket_fd,
+    const char data[],
+    const size_t len,
+    int* forward_to_fd
+);
+
+int socks5server_proc_forwarded_end_of_stream(
+    struct Socks5Server* socks5_server,
+    const int socket_fd
+);
+
+int socks5server_proc_socket_failure(
+    struct Socks5Server* socks5_server,
+    const int socket_fd
+);
+
+/*
+    Milliseconds until socks5server_proc_timeouts has work, -1 if
+    nothing is pending; event sources bound their wait by it. Zero
+    while relays wait their turn: the event source polls, and the
+    turns are taken between its batches of events.
+*/
+int socks5server_next_timeout_ms(
+    const struct Socks5Server* socks5_server
+);
+
+int socks5server_proc_timeouts(
+    struct Socks5Server* socks5_server
+);
+
 #endif
\ No newline at end of file
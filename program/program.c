@@ -1,8 +1,16 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <sys/epoll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 #include "rfc1928socks5.h"
+#include "uring_event_loop.h"
 #include <errno.h>
 #include <stdio.h>
+#include <signal.h>
+#include <string.h>
+#include <arpa/inet.h>
 
 
 enum {OK=0,ERR=-1};
@@ -30,40 +38,77 @@ static void free_socks5_client(
 
 #define ARRAY_COUNT(a) (sizeof(a)/sizeof(*a))
 
-static int subscribe_to_socket_writable(
+/* relays to these destination ports weigh this much; set before the shards start */
+struct PortWeight
+{
+    in_port_t port;
+    uint32_t weight;
+};
+
+static struct PortWeight port_weights[16];
+static size_t port_weight_count;
+
+static uint32_t weigh_relay_by_port(
     struct Socks5Server* socks5_server,
-    const int socket_fd)
+    const struct Socks5Client* socks5_client)
 {
-    struct epoll_event events_of_interest = {
-        .events = EPOLLOUT,
-        .data = {.fd = socket_fd }
-    };
-    if (OK != 
-        epoll_ctl(
-            *(int*)socks5_server->data,
-            EPOLL_CTL_ADD,
-            socket_fd,
-            &events_of_interest
-        )
+    (void)socks5_server;
+    const in_port_t port =
+        ntohs(socks5_client->current_request.client_request.dst_port);
+    for (size_t i = 0; i < port_weight_count; i++) {
+        if (port == port_weights[i].port) {
+            return port_weights[i].weight;
+        }
+    }
+    return 1;
+}
+
+/* PORT:WEIGHT */
+static int parse_port_weight(
+    const char* arg)
+{
+    char* end = NULL;
+    const unsigned long port = strtoul(arg, &end, 10);
+    if (end == arg || ':' != *end || 0 == port || port > UINT16_MAX
+        || port_weight_count == ARRAY_COUNT(port_weights)
     ) {
         return ERR;
     }
 
+    const char* weight = &end[1];
+    const unsigned long parsed = strtoul(weight, &end, 10);
+    if (end == weight || '\0' != *end || 0 == parsed || parsed > UINT32_MAX) {
+        return ERR;
+    }
+
+    port_weights[port_weight_count].port = port;
+    port_weights[port_weight_count].weight = parsed;
+    port_weight_count++;
     return OK;
 }
 
-static int subscribe_to_socket_readable(
+static int epoll_ctl_interest(
     struct Socks5Server* socks5_server,
-    const int socket_fd)
+    const int op,
+    const int socket_fd,
+    const enum FDIOEvent interest,
+    void* context)
 {
     struct epoll_event events_of_interest = {
-        .events = EPOLLIN | EPOLLRDHUP | EPOLLET,
-        .data = {.fd = socket_fd }
+        .events = EPOLLET,
+        .data = {.ptr = context }
     };
+    if (interest & (FDIOEVENT_READABLE | FDIOEVENT_POLL_READABLE)) {
+        events_of_interest.events |= EPOLLIN | EPOLLRDHUP;
+    }
+    if (interest & FDIOEVENT_WRITABLE) {
+        events_of_interest.events |= EPOLLOUT;
+    }
+
     if (OK != 
         epoll_ctl(
             *(int*)socks5_server->data,
-            EPOLL_CTL_ADD,
+            op,
             socket_fd,
             &events_of_interest
         )
@@ -74,6 +119,36 @@ static int subscribe_to_socket_readable(
     return OK;
 }
 
+static int epoll_subscribe(
+    struct Socks5Server* socks5_server,
+    const int socket_fd,
+    const enum FDIOEvent interest,
+    void* context)
+{
+    return epoll_ctl_interest(
+        socks5_server,
+        EPOLL_CTL_ADD,
+        socket_fd,
+        interest,
+        context
+    );
+}
+
+static int epoll_modify_interest(
+    struct Socks5Server* socks5_server,
+    const int socket_fd,
+    const enum FDIOEvent interest,
+    void* context)
+{
+    return epoll_ctl_interest(
+        socks5_server,
+        EPOLL_CTL_MOD,
+        socket_fd,
+        interest,
+        context
+    );
+}
+
 static int epoll_unsubscribe(
     struct Socks5Server* socks5_server,
     const int socket_fd)
@@ -135,61 +210,78 @@ static int epoll_unsubscribe(
 
 
 
-int main(void)
-{    
-    const int epoll_fd =
-        epoll_create1(0);
-    if (ERR == epoll_fd) {
-        return ERR;
-    }
-    static struct Socks5Server socks5_server = {0};
-
-    socks5_server.data = (void*)&epoll_fd;
-    
-    struct addrinfo hints = {
-        .ai_family = AF_INET,
-        .ai_socktype = SOCK_STREAM,
-        .ai_flags = AI_PASSIVE
-    };
-    struct addrinfo *server_info = NULL;
-    
-    if (OK != getaddrinfo(NULL, "1080", &hints, &server_info)) {
-        return ERR;
-    }
-    
-    struct Socks5ServerCfg cfg = {
-        .acquire_client_resources = alloc_socks5_client,
-        .relenquish_client_resources = free_socks5_client,
-        .sub_to_socket_read_activity_event = subscribe_to_socket_readable,
-        .unsub_all_socket_events = epoll_unsubscribe,
-        .listener_address = *server_info,
-    };
-
-    int sequence[] = {
-        socks5server_construct(
-            &socks5_server,
-            &cfg
-        ),
-        socks5server_begin_listening(
-            &socks5_server,
-            1024
-        )
-    };
-    for (size_t i = 0; i < ARRAY_COUNT(sequence); i++) {
-        if (OK != sequence[i]) {
-            return ERR;
-        }
-    }
+struct ProgramOptions
+{
+    enum Socks5RelayMode relay_mode;
+    bool io_uring;
+    long shard_count;
+    size_t client_slab_capacity;
+    unsigned client_slab_flags;
+    struct sockaddr_storage nameserver;
+    socklen_t nameserver_len;
+    size_t dns_cache_capacity;
+    size_t bind_pool_capacity;
+    /* shared by every shard */
+    struct DnsCache* dns_cache;
+    const char* users_path;
+    /* shared by every shard; NULL: no authentication */
+    struct CredentialStore* credentials;
+    const char* acl_path;
+    /* shared by every shard; NULL: everything is allowed */
+    struct AccessPolicy* access_policy;
+    const char* blocklist_path;
+    /* shared by every shard; NULL: no domain is refused */
+    struct DomainIndex* domain_blocklist;
+    /* in all; each shard gets its share */
+    size_t udp_reassembly_capacity;
+    uint32_t handshake_timeout_ms;
+    uint32_t auth_timeout_ms;
+    uint32_t connect_timeout_ms;
+    uint32_t idle_timeout_ms;
+    struct ShapingRate client_shaping;
+    struct ShapingRate user_shaping;
+    struct ShapingRate server_shaping;
+    /* shared by every shard, each drawing on them at the full rates */
+    struct ShapingBuckets* shaping_buckets;
+    size_t relay_turn_bytes;
+    bool fast_open;
+    size_t zerocopy_threshold;
+    const char* tls_cert_path;
+    const char* tls_key_path;
+    /* shared by every shard; NULL: clients speak SOCKS5 in the clear */
+    struct TlsContext* tls;
+};
 
+/*
+    A shard is one reactor thread: its own Socks5Server, its own
+    SO_REUSEPORT listener and its own epoll/io_uring instance. The kernel
+    spreads incoming connections over the listeners, and a connection
+    never leaves the shard that accepted it.
+*/
+struct Shard
+{
+    pthread_t thread;
+    long index;
+    int epoll_fd;
+    struct Socks5Server socks5_server;
+    const struct ProgramOptions* options;
+    const struct addrinfo* listener_address;
+};
+
+static int run_epoll_event_loop(
+    struct Socks5Server* socks5_server,
+    const int epoll_fd)
+{
     struct epoll_event listener_events_of_interest = {
         .events = EPOLLIN | EPOLLET,
-        .data = { . fd = socks5_server.listener_socket_fd },
+        /* client sockets carry the library's context, the listener none */
+        .data = { .ptr = NULL },
     };
     if (OK !=
         epoll_ctl(
             epoll_fd,
             EPOLL_CTL_ADD,
-            socks5_server.listener_socket_fd,
+            socks5_server->listener_socket_fd,
             &listener_events_of_interest
         )
     ) {
@@ -198,13 +290,14 @@ int main(void)
 
     enum {MAX_EVENTS=23};
     for (;;) {
+        const int timeout_ms = socks5server_next_timeout_ms(socks5_server);
         struct epoll_event events[MAX_EVENTS] = {0};
         const int active_fds =
             epoll_wait(
                 epoll_fd,
                 &events[0],
                 MAX_EVENTS,
-                23232
+                ERR == timeout_ms ? 23232 : timeout_ms
             );
         if (ERR == active_fds && errno == EINTR) {
             continue;
@@ -214,6 +307,9 @@ int main(void)
             
             return ERR;
         } else if (0 == active_fds) {
+            if (OK != socks5server_proc_timeouts(socks5_server)) {
+                return ERR;
+            }
             continue;
         }
 
@@ -222,11 +318,16 @@ int main(void)
         for (ptrdiff_t i = 0; i < active_fds; i++) {
             struct epoll_event* epoll_event = &events[i];
             const bool 
-                readable = (epoll_event->events & EPOLLIN) > 0,
-                writable = (epoll_event->events & EPOLLOUT) > 0;
+                failed = (epoll_event->events & (EPOLLERR | EPOLLHUP)) > 0,
+                readable = (epoll_event->events & (EPOLLIN | EPOLLRDHUP)) > 0 || failed,
+                writable = (epoll_event->events & EPOLLOUT) > 0 || failed;
             
             struct FdEventNotification* ev = &event_notifications[i];
-            ev->fd_of_interest = epoll_event->data.fd;
+            ev->context = epoll_event->data.ptr;
+            ev->fd_of_interest =
+                NULL == ev->context
+                ? socks5_server->listener_socket_fd
+                : ERR;
 
             if (readable) {                
                 ev->events_of_occurrence |= FDIOEVENT_READABLE;
@@ -234,6 +335,9 @@ int main(void)
             if (writable) {
                 ev->events_of_occurrence |= FDIOEVENT_WRITABLE;
             }
+            if ((epoll_event->events & EPOLLERR) > 0) {
+                ev->events_of_occurrence |= FDIOEVENT_ERROR_QUEUE;
+            }
 
             if (!readable && !writable) {
                 return ERR;
@@ -244,15 +348,454 @@ int main(void)
 
         if (OK !=
             socks5server_proc_io_events(
-                &socks5_server,
+                socks5_server,
                 event_notifications,
                 active_fds
             )
         ) {
             return ERR;
         }
+
+        if (OK != socks5server_proc_timeouts(socks5_server)) {
+            return ERR;
+        }
+    }
+}
+
+static void pin_shard_to_cpu(
+    const struct Shard* shard)
+{
+    const long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpu_count <= 1 || shard->options->shard_count <= 1) {
+        return;
+    }
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(shard->index % cpu_count, &cpus);
+    const int _ignored =
+        pthread_setaffinity_np(
+            pthread_self(),
+            sizeof(cpus),
+            &cpus
+        );
+}
+
+static int run_shard(
+    struct Shard* shard)
+{
+    const struct ProgramOptions* options = shard->options;
+
+    pin_shard_to_cpu(shard);
+
+    struct Socks5ServerCfg cfg = {
+        .acquire_client_resources = alloc_socks5_client,
+        .relenquish_client_resources = free_socks5_client,
+        .subscribe_socket = epoll_subscribe,
+        .modify_socket_interest = epoll_modify_interest,
+        .unsubscribe_socket = epoll_unsubscribe,
+        .listener_address = *shard->listener_address,
+        .reuse_port = options->shard_count > 1,
+        .tcp_fast_open_backlog = options->fast_open ? 256 : 0,
+        .tcp_fast_open_connect = options->fast_open,
+        .relay_mode = options->relay_mode,
+        .pipe_pool_capacity = 256,
+        .bind_listener_pool_capacity = options->bind_pool_capacity,
+        .io_buffer_pool_idle_capacity = 256,
+        .client_slab_capacity = options->client_slab_capacity,
+        .client_slab_flags = options->client_slab_flags,
+        .dns_nameserver = options->nameserver,
+        .dns_nameserver_len = options->nameserver_len,
+        .dns_cache = options->dns_cache,
+        .credentials = options->credentials,
+        .access_policy = options->access_policy,
+        .domain_blocklist = options->domain_blocklist,
+        .udp_reassembly_capacity = options->udp_reassembly_capacity / options->shard_count,
+        .handshake_timeout_ms = options->handshake_timeout_ms,
+        .auth_timeout_ms = options->auth_timeout_ms,
+        .connect_timeout_ms = options->connect_timeout_ms,
+        .idle_timeout_ms = options->idle_timeout_ms,
+        .client_shaping = options->client_shaping,
+        .user_shaping = options->user_shaping,
+        .server_shaping = options->server_shaping,
+        .shaping_buckets = options->shaping_buckets,
+        .relay_turn_bytes = options->relay_turn_bytes,
+        .weigh_relay = weigh_relay_by_port,
+        .zerocopy_threshold = options->zerocopy_threshold,
+        .tls = options->tls,
+    };
+
+    if (options->io_uring) {
+        uring_event_loop_fill_cfg(&cfg);
+    } else {
+        shard->epoll_fd = epoll_create1(0);
+        if (ERR == shard->epoll_fd) {
+            return ERR;
+        }
+        shard->socks5_server.data = (void*)&shard->epoll_fd;
+    }
+
+    int sequence[] = {
+        socks5server_construct(
+            &shard->socks5_server,
+            &cfg
+        ),
+        socks5server_begin_listening(
+            &shard->socks5_server,
+            1024
+        )
+    };
+    for (size_t i = 0; i < ARRAY_COUNT(sequence); i++) {
+        if (OK != sequence[i]) {
+            return ERR;
+        }
+    }
+
+    if (options->io_uring) {
+        return uring_event_loop_run(&shard->socks5_server);
+    }
+
+    return run_epoll_event_loop(
+        &shard->socks5_server,
+        shard->epoll_fd
+    );
+}
+
+/* BYTES_PER_S or BYTES_PER_S:BURST */
+static int parse_shaping_rate(
+    const char* arg,
+    struct ShapingRate* rate)
+{
+    char* end = NULL;
+    rate->bytes_per_s = strtoull(arg, &end, 10);
+    rate->burst = 0;
+    if (end == arg) {
+        return ERR;
+    }
+    if (':' == *end) {
+        const char* burst = &end[1];
+        rate->burst = strtoull(burst, &end, 10);
+        if (end == burst) {
+            return ERR;
+        }
+    }
+    return '\0' == *end ? OK : ERR;
+}
+
+/* IP, IP:PORT or [IPv6]:PORT */
+static int parse_nameserver(
+    const char* arg,
+    struct ProgramOptions* options)
+{
+    char host[INET6_ADDRSTRLEN] = {0};
+    long port = 53;
+
+    const char* port_sep = NULL;
+    if ('[' == arg[0]) {
+        const char* close = strchr(arg, ']');
+        if (NULL == close || (size_t)(close - arg - 1) >= sizeof(host)) {
+            return ERR;
+        }
+        memcpy(host, &arg[1], close - arg - 1);
+        port_sep = ':' == close[1] ? &close[1] : NULL;
+    } else if (NULL != strchr(arg, ':') && strchr(arg, ':') == strrchr(arg, ':')) {
+        port_sep = strchr(arg, ':');
+        if ((size_t)(port_sep - arg) >= sizeof(host)) {
+            return ERR;
+        }
+        memcpy(host, arg, port_sep - arg);
+    } else if (strlen(arg) < sizeof(host)) {
+        strcpy(host, arg);
+    } else {
+        return ERR;
+    }
+
+    if (NULL != port_sep) {
+        port = strtol(&port_sep[1], NULL, 10);
+        if (port <= 0 || port > UINT16_MAX) {
+            return ERR;
+        }
+    }
+
+    struct sockaddr_in* in = (struct sockaddr_in*)&options->nameserver;
+    struct sockaddr_in6* in6 = (struct sockaddr_in6*)&options->nameserver;
+    if (1 == inet_pton(AF_INET, host, &in->sin_addr)) {
+        in->sin_family = AF_INET;
+        in->sin_port = htons(port);
+        options->nameserver_len = sizeof(*in);
+        return OK;
+    }
+    if (1 == inet_pton(AF_INET6, host, &in6->sin6_addr)) {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(port);
+        options->nameserver_len = sizeof(*in6);
+        return OK;
+    }
+    return ERR;
+}
+
+static void* run_shard_thread(
+    void* arg)
+{
+    struct Shard* shard = arg;
+    if (OK != run_shard(shard)) {
+        fprintf(stderr, "shard %ld: %s\n", shard->index, strerror(errno));
+        exit(1);
+    }
+    return NULL;
+}
+
+int main(int argc, char* argv[])
+{    
+    struct ProgramOptions options = {
+        .relay_mode = SOCKS5_RELAY_MODE_BUFFERED,
+        .io_uring = false,
+        .shard_count = 1,
+        .dns_cache_capacity = 4096,
+        .bind_pool_capacity = 16,
+        .handshake_timeout_ms = 10000,
+        .auth_timeout_ms = 10000,
+        .connect_timeout_ms = 30000,
+        .idle_timeout_ms = 300000,
+        .relay_turn_bytes = 65536
+    };
+    for (int i = 1; i < argc; i++) {
+        if (0 == strcmp(argv[i], "--splice")) {
+            options.relay_mode = SOCKS5_RELAY_MODE_SPLICE;
+        } else if (0 == strcmp(argv[i], "--io-uring")) {
+            options.io_uring = true;
+        } else if (0 == strcmp(argv[i], "--fast-open")) {
+            options.fast_open = true;
+        } else if (0 == strcmp(argv[i], "--shards") && i + 1 < argc) {
+            options.shard_count = strtol(argv[++i], NULL, 10);
+            if (0 == options.shard_count) {
+                options.shard_count = sysconf(_SC_NPROCESSORS_ONLN);
+            }
+        } else if (0 == strcmp(argv[i], "--client-slab") && i + 1 < argc) {
+            options.client_slab_capacity = strtoul(argv[++i], NULL, 10);
+            options.client_slab_flags |= SOCKS5_CLIENT_SLAB_PREFAULT;
+        } else if (0 == strcmp(argv[i], "--client-slab-mlock")) {
+            options.client_slab_flags |= SOCKS5_CLIENT_SLAB_MLOCK;
+        } else if (0 == strcmp(argv[i], "--client-slab-huge-pages")) {
+            options.client_slab_flags |= SOCKS5_CLIENT_SLAB_HUGE_PAGES;
+        } else if (0 == strcmp(argv[i], "--nameserver")
+            && i + 1 < argc
+            && OK == parse_nameserver(argv[++i], &options)
+        ) {
+            continue;
+        } else if (0 == strcmp(argv[i], "--dns-cache") && i + 1 < argc) {
+            options.dns_cache_capacity = strtoul(argv[++i], NULL, 10);
+        } else if (0 == strcmp(argv[i], "--bind-pool") && i + 1 < argc) {
+            options.bind_pool_capacity = strtoul(argv[++i], NULL, 10);
+        } else if (0 == strcmp(argv[i], "--udp-reassembly") && i + 1 < argc) {
+            options.udp_reassembly_capacity = strtoul(argv[++i], NULL, 10);
+        } else if (0 == strcmp(argv[i], "--handshake-timeout") && i + 1 < argc) {
+            options.handshake_timeout_ms = strtoul(argv[++i], NULL, 10);
+        } else if (0 == strcmp(argv[i], "--auth-timeout") && i + 1 < argc) {
+            options.auth_timeout_ms = strtoul(argv[++i], NULL, 10);
+        } else if (0 == strcmp(argv[i], "--connect-timeout") && i + 1 < argc) {
+            options.connect_timeout_ms = strtoul(argv[++i], NULL, 10);
+        } else if (0 == strcmp(argv[i], "--idle-timeout") && i + 1 < argc) {
+            options.idle_timeout_ms = strtoul(argv[++i], NULL, 10);
+        } else if (0 == strcmp(argv[i], "--client-rate")
+            && i + 1 < argc
+            && OK == parse_shaping_rate(argv[++i], &options.client_shaping)
+        ) {
+            continue;
+        } else if (0 == strcmp(argv[i], "--user-rate")
+            && i + 1 < argc
+            && OK == parse_shaping_rate(argv[++i], &options.user_shaping)
+        ) {
+            continue;
+        } else if (0 == strcmp(argv[i], "--server-rate")
+            && i + 1 < argc
+            && OK == parse_shaping_rate(argv[++i], &options.server_shaping)
+        ) {
+            continue;
+        } else if (0 == strcmp(argv[i], "--relay-turn") && i + 1 < argc) {
+            options.relay_turn_bytes = strtoul(argv[++i], NULL, 10);
+        } else if (0 == strcmp(argv[i], "--zerocopy") && i + 1 < argc) {
+            options.zerocopy_threshold = strtoul(argv[++i], NULL, 10);
+        } else if (0 == strcmp(argv[i], "--tls") && i + 2 < argc) {
+            options.tls_cert_path = argv[++i];
+            options.tls_key_path = argv[++i];
+        } else if (0 == strcmp(argv[i], "--weigh-port")
+            && i + 1 < argc
+            && OK == parse_port_weight(argv[++i])
+        ) {
+            continue;
+        } else if (0 == strcmp(argv[i], "--users") && i + 1 < argc) {
+            options.users_path = argv[++i];
+        } else if (0 == strcmp(argv[i], "--acl") && i + 1 < argc) {
+            options.acl_path = argv[++i];
+        } else if (0 == strcmp(argv[i], "--blocklist") && i + 1 < argc) {
+            options.blocklist_path = argv[++i];
+        } else if (0 == strcmp(argv[i], "--compile-blocklist") && i + 2 < argc) {
+            const char* list_path = argv[++i];
+            const char* index_path = argv[++i];
+            return socks5server_compile_domain_blocklist(list_path, index_path);
+        } else {
+            fprintf(
+                stderr,
+                "usage: %s [--splice] [--io-uring] [--fast-open] [--shards N (0: one per cpu)]"
+                " [--client-slab N (per shard) [--client-slab-mlock] [--client-slab-huge-pages]]"
+                " [--nameserver IP[:PORT]] [--dns-cache N (0: off)]"
+                " [--bind-pool N (per shard)] [--udp-reassembly BYTES (0: off)]"
+                " [--handshake-timeout MS] [--auth-timeout MS] [--connect-timeout MS] [--idle-timeout MS] (0: none)"
+                " [--client-rate BYTES_PER_S[:BURST]] [--user-rate BYTES_PER_S[:BURST]] [--server-rate BYTES_PER_S[:BURST]] (not with --io-uring)"
+                " [--relay-turn BYTES (0: read until EAGAIN)] [--weigh-port PORT:WEIGHT (up to 16)]"
+                " [--zerocopy BYTES (sends of at least, 0: off; not with --io-uring)]"
+                " [--tls CERT KEY (PEM; kernel TLS, not with --io-uring)]"
+                " [--users FILE (name:password per line)]"
+                " [--acl FILE (allow|deny src|dst PREFIX[/LEN] per line)]"
+                " [--blocklist INDEX] [--compile-blocklist SUFFIX_LIST INDEX]\n",
+                argv[0]
+            );
+            return ERR;
+        }
+    }
+    if (options.shard_count < 1) {
+        return ERR;
+    }
+    if (options.io_uring
+        && (0 != options.client_shaping.bytes_per_s
+            || 0 != options.user_shaping.bytes_per_s
+            || 0 != options.server_shaping.bytes_per_s)
+    ) {
+        fprintf(stderr, "%s: rates are shaped by the epoll event loop only\n", argv[0]);
+        return ERR;
+    }
+    if (options.io_uring && 0 != options.zerocopy_threshold) {
+        fprintf(stderr, "%s: zerocopy sends are made by the epoll event loop only\n", argv[0]);
+        return ERR;
+    }
+    if (options.io_uring && NULL != options.tls_cert_path) {
+        fprintf(stderr, "%s: TLS handshakes are made by the epoll event loop only\n", argv[0]);
+        return ERR;
+    }
+
+    if (SIG_ERR == signal(SIGPIPE, SIG_IGN)) {
+        return ERR;
+    }
+
+    if (options.dns_cache_capacity > 0) {
+        options.dns_cache =
+            socks5server_construct_dns_cache(
+                options.dns_cache_capacity
+            );
+        if (NULL == options.dns_cache) {
+            return ERR;
+        }
+    }
+
+    if (NULL != options.users_path) {
+        options.credentials =
+            socks5server_load_credentials(
+                options.users_path
+            );
+        if (NULL == options.credentials) {
+            fprintf(stderr, "%s: cannot load users from %s\n", argv[0], options.users_path);
+            return ERR;
+        }
+    }
+
+    options.shaping_buckets =
+        socks5server_construct_shaping_buckets(
+            options.credentials,
+            &options.user_shaping,
+            &options.server_shaping
+        );
+    if (NULL == options.shaping_buckets) {
+        return ERR;
+    }
+
+    if (NULL != options.acl_path) {
+        options.access_policy =
+            socks5server_load_access_policy(
+                options.acl_path
+            );
+        if (NULL == options.access_policy) {
+            fprintf(stderr, "%s: cannot load rules from %s\n", argv[0], options.acl_path);
+            return ERR;
+        }
+    }
+
+    if (NULL != options.blocklist_path) {
+        options.domain_blocklist =
+            socks5server_map_domain_blocklist(
+                options.blocklist_path
+            );
+        if (NULL == options.domain_blocklist) {
+            fprintf(stderr, "%s: cannot map a compiled blocklist from %s\n", argv[0], options.blocklist_path);
+            return ERR;
+        }
+    }
+
+    if (NULL != options.tls_cert_path) {
+        options.tls =
+            socks5server_load_tls(
+                options.tls_cert_path,
+                options.tls_key_path
+            );
+        if (NULL == options.tls && ENOPROTOOPT == errno) {
+            fprintf(stderr, "%s: the kernel has no tls ULP for --tls (modprobe tls, CONFIG_TLS)\n", argv[0]);
+            return ERR;
+        }
+        if (NULL == options.tls) {
+            fprintf(stderr, "%s: cannot load a certificate and key from %s and %s\n", argv[0], options.tls_cert_path, options.tls_key_path);
+            return ERR;
+        }
+    }
+
+    struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_PASSIVE
+    };
+    struct addrinfo *server_info = NULL;
+    
+    if (OK != getaddrinfo(NULL, "1080", &hints, &server_info)) {
+        return ERR;
+    }
+
+    struct Shard* shards =
+        calloc(
+            options.shard_count,
+            sizeof(struct Shard)
+        );
+    if (NULL == shards) {
+        return ERR;
+    }
+
+    for (long i = 0; i < options.shard_count; i++) {
+        shards[i].index = i;
+        shards[i].options = &options;
+        shards[i].listener_address = server_info;
+    }
+
+    if (1 == options.shard_count) {
+        const int ret = run_shard(&shards[0]);
+        freeaddrinfo(server_info);
+        return ret;
+    }
+
+    for (long i = 0; i < options.shard_count; i++) {
+        if (OK !=
+            pthread_create(
+                &shards[i].thread,
+                NULL,
+                run_shard_thread,
+                &shards[i]
+            )
+        ) {
+            return ERR;
+        }
+    }
+
+    for (long i = 0; i < options.shard_count; i++) {
+        const int _ignored = pthread_join(shards[i].thread, NULL);
     }
 
     freeaddrinfo(server_info);
     return 0;
-}
\ No newline at end of file
+}
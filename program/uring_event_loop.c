@@ -0,0 +1,1216 @@
+#define _GNU_SOURCE
+#include "uring_event_loop.h"
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+enum {OK=0,ERR=-1};
+enum {ZERO=0};
+
+enum {URING_ENTRIES=4096};
+enum {BUF_GROUP=0};
+/* power of two, at most 2^15 */
+enum {BUF_COUNT=4096};
+enum {BUF_SIZE=16384};
+enum {NO_BUF=UINT16_MAX};
+/* per destination socket: stop reading its source past HIGH, resume under LOW */
+enum {SEND_HIGH_WATER=256 * 1024, SEND_LOW_WATER=64 * 1024};
+enum {MAX_LINKED_SENDS=64};
+
+enum UringOp
+{
+    URING_OP_ACCEPT = 1,
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_POLL_WRITABLE,
+    URING_OP_CANCEL,
+    URING_OP_TIMEOUT,
+    URING_OP_POLL_READABLE
+};
+
+/*
+    user_data layout: op:4 | generation:20 | bid:16 | fd:24
+    The generation of an fd is bumped whenever it is unsubscribed, so
+    completions that outlive a closed (and possibly reused) fd are
+    recognised as stale.
+*/
+static uint64_t pack_user_data(
+    const enum UringOp op,
+    const uint32_t generation,
+    const uint16_t bid,
+    const int fd)
+{
+    return (uint64_t)op << 60
+        | (uint64_t)(generation & 0xFFFFF) << 40
+        | (uint64_t)bid << 24
+        | (uint64_t)(fd & 0xFFFFFF);
+}
+
+static enum UringOp user_data_op(const uint64_t user_data) { return user_data >> 60; }
+static uint32_t user_data_generation(const uint64_t user_data) { return (user_data >> 40) & 0xFFFFF; }
+static uint16_t user_data_bid(const uint64_t user_data) { return (user_data >> 24) & 0xFFFF; }
+static int user_data_fd(const uint64_t user_data) { return user_data & 0xFFFFFF; }
+
+struct UringBufState
+{
+    uint16_t next;
+    uint32_t off;
+    uint32_t len;
+};
+
+struct UringFdState
+{
+    uint32_t generation;
+    bool recv_wanted;
+    bool recv_armed;
+    bool recv_paused;
+    bool recv_starved;
+    bool write_wanted;
+    /* FDIOEVENT_POLL_READABLE: the library reads the socket itself */
+    bool poll_read_wanted;
+    int paused_src_fd;
+    uint32_t paused_src_generation;
+    /* buffers owed to this fd, oldest first; the first in_flight are submitted */
+    uint16_t queue_head;
+    uint16_t queue_tail;
+    uint32_t queued_bytes;
+    uint32_t in_flight;
+    bool shut_wr_pending;
+    /* received after read interest was withdrawn, oldest first: handed over once it is back */
+    uint16_t held_head;
+    uint16_t held_tail;
+    bool held_end_of_stream;
+    bool held_resume_queued;
+};
+
+struct UringSubmissionQueue
+{
+    unsigned* head;
+    unsigned* tail;
+    unsigned* mask;
+    unsigned* array;
+    unsigned entries;
+    unsigned local_tail;
+    unsigned unsubmitted;
+    struct io_uring_sqe* sqes;
+};
+
+struct UringCompletionQueue
+{
+    unsigned* head;
+    unsigned* tail;
+    unsigned* mask;
+    struct io_uring_cqe* cqes;
+};
+
+struct UringEventLoop
+{
+    int ring_fd;
+    struct UringSubmissionQueue sq;
+    struct UringCompletionQueue cq;
+    struct io_uring_buf_ring* buf_ring;
+    uint16_t buf_ring_tail;
+    char* bufs;
+    bool bufs_recycled;
+    struct UringBufState buf_states[BUF_COUNT];
+    struct UringFdState* fds;
+    size_t fd_capacity;
+    int* starved;
+    size_t starved_count;
+    /* fds whose read interest came back with received bytes held for them */
+    int* resumed;
+    size_t resumed_count;
+    /* earliest deadline an IORING_OP_TIMEOUT is in flight for, INT64_MAX if none is known */
+    int64_t timeout_deadline_ms;
+    struct __kernel_timespec timeout;
+    struct Socks5Server* socks5_server;
+};
+
+static int sys_io_uring_setup(
+    const unsigned entries,
+    struct io_uring_params* params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(
+    const int ring_fd,
+    const unsigned to_submit,
+    const unsigned min_complete,
+    const unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(
+    const int ring_fd,
+    const unsigned opcode,
+    void* arg,
+    const unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+static struct UringEventLoop* loop_of(
+    struct Socks5Server* socks5_server)
+{
+    return socks5_server->data;
+}
+
+static struct UringFdState* fd_state_of(
+    struct UringEventLoop* loop,
+    const int fd)
+{
+    if (fd < 0 || (size_t)fd >= loop->fd_capacity) {
+        return NULL;
+    }
+    return &loop->fds[fd];
+}
+
+static int uring_submit(
+    struct UringEventLoop* loop,
+    const unsigned min_complete)
+{
+    __atomic_store_n(loop->sq.tail, loop->sq.local_tail, __ATOMIC_RELEASE);
+
+    for (;;) {
+        const int submitted =
+            sys_io_uring_enter(
+                loop->ring_fd,
+                loop->sq.unsubmitted,
+                min_complete,
+                min_complete > ZERO ? IORING_ENTER_GETEVENTS : ZERO
+            );
+        if (ERR == submitted && EINTR == errno) {
+            continue;
+        }
+        if (ERR == submitted && EBUSY == errno) {
+            /* completion queue is full; draining it makes room */
+            return OK;
+        }
+        if (ERR == submitted) {
+            return ERR;
+        }
+        loop->sq.unsubmitted -= submitted;
+        return OK;
+    }
+}
+
+static struct io_uring_sqe* uring_get_sqe(
+    struct UringEventLoop* loop)
+{
+    const unsigned head =
+        __atomic_load_n(loop->sq.head, __ATOMIC_ACQUIRE);
+    if (loop->sq.local_tail - head >= loop->sq.entries) {
+        if (OK != uring_submit(loop, ZERO)) {
+            return NULL;
+        }
+    }
+
+    const unsigned index = loop->sq.local_tail & *loop->sq.mask;
+    struct io_uring_sqe* sqe = &loop->sq.sqes[index];
+    const void* _ = memset(sqe, ZERO, sizeof(*sqe));
+    loop->sq.array[index] = index;
+    loop->sq.local_tail++;
+    loop->sq.unsubmitted++;
+    return sqe;
+}
+
+static void uring_provide_buf(
+    struct UringEventLoop* loop,
+    const uint16_t bid)
+{
+    struct io_uring_buf* buf =
+        &loop->buf_ring->bufs[loop->buf_ring_tail & (BUF_COUNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)&loop->bufs[(size_t)bid * BUF_SIZE];
+    buf->len = BUF_SIZE;
+    buf->bid = bid;
+    loop->buf_ring_tail++;
+    __atomic_store_n(&loop->buf_ring->tail, loop->buf_ring_tail, __ATOMIC_RELEASE);
+    loop->bufs_recycled = true;
+}
+
+static int uring_arm_accept(
+    struct UringEventLoop* loop,
+    const int listener_fd)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(loop);
+    if (NULL == sqe) {
+        return ERR;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listener_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = pack_user_data(URING_OP_ACCEPT, ZERO, ZERO, listener_fd);
+    return OK;
+}
+
+static int uring_maybe_arm_recv(
+    struct UringEventLoop* loop,
+    const int fd)
+{
+    struct UringFdState* state = fd_state_of(loop, fd);
+    if (!state->recv_wanted
+        || state->recv_armed
+        || state->recv_paused
+        || state->recv_starved
+        || NO_BUF != state->held_head
+        || state->held_end_of_stream
+    ) {
+        return OK;
+    }
+
+    struct io_uring_sqe* sqe = uring_get_sqe(loop);
+    if (NULL == sqe) {
+        return ERR;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = pack_user_data(URING_OP_RECV, state->generation, ZERO, fd);
+    state->recv_armed = true;
+    return OK;
+}
+
+static int uring_cancel(
+    struct UringEventLoop* loop,
+    const uint8_t opcode,
+    const uint64_t target_user_data)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(loop);
+    if (NULL == sqe) {
+        return ERR;
+    }
+    sqe->opcode = opcode;
+    sqe->addr = target_user_data;
+    sqe->user_data = pack_user_data(URING_OP_CANCEL, ZERO, ZERO, ZERO);
+    return OK;
+}
+
+static void fd_state_reset(
+    struct UringFdState* state)
+{
+    const uint32_t generation = state->generation + 1;
+    const void* _ = memset(state, ZERO, sizeof(*state));
+    state->generation = generation;
+    state->paused_src_fd = ERR;
+    state->queue_head = NO_BUF;
+    state->queue_tail = NO_BUF;
+    state->held_head = NO_BUF;
+    state->held_tail = NO_BUF;
+}
+
+static int uring_flush_send_queue(
+    struct UringEventLoop* loop,
+    const int fd)
+{
+    struct UringFdState* state = fd_state_of(loop, fd);
+    if (state->in_flight > ZERO) {
+        return OK;
+    }
+
+    /*
+        One chain per flush: each send only starts once the one before it
+        went out whole (MSG_WAITALL makes a short send break the link), so
+        the stream stays in order without waiting a loop turn per buffer.
+    */
+    struct io_uring_sqe* previous = NULL;
+    for (uint16_t bid = state->queue_head;
+        NO_BUF != bid && state->in_flight < MAX_LINKED_SENDS;
+        bid = loop->buf_states[bid].next
+    ) {
+        struct io_uring_sqe* sqe = uring_get_sqe(loop);
+        if (NULL == sqe) {
+            return ERR;
+        }
+        const struct UringBufState* buf = &loop->buf_states[bid];
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)&loop->bufs[(size_t)bid * BUF_SIZE + buf->off];
+        sqe->len = buf->len;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->user_data = pack_user_data(URING_OP_SEND, state->generation, bid, fd);
+        if (NULL != previous) {
+            previous->flags |= IOSQE_IO_LINK;
+        }
+        previous = sqe;
+        state->in_flight++;
+    }
+
+    return OK;
+}
+
+static int uring_enqueue_send(
+    struct UringEventLoop* loop,
+    const int src_fd,
+    const int dst_fd,
+    const uint16_t bid,
+    const uint32_t len)
+{
+    struct UringFdState* dst = fd_state_of(loop, dst_fd);
+    if (NULL == dst) {
+        uring_provide_buf(loop, bid);
+        return ERR;
+    }
+
+    struct UringBufState* buf = &loop->buf_states[bid];
+    buf->next = NO_BUF;
+    buf->off = ZERO;
+    buf->len = len;
+
+    if (NO_BUF == dst->queue_tail) {
+        dst->queue_head = bid;
+    } else {
+        loop->buf_states[dst->queue_tail].next = bid;
+    }
+    dst->queue_tail = bid;
+    dst->queued_bytes += len;
+
+    if (dst->queued_bytes > SEND_HIGH_WATER && ERR == dst->paused_src_fd) {
+        struct UringFdState* src = fd_state_of(loop, src_fd);
+        src->recv_paused = true;
+        dst->paused_src_fd = src_fd;
+        dst->paused_src_generation = src->generation;
+        if (src->recv_armed
+            && OK !=
+            uring_cancel(
+                loop,
+                IORING_OP_ASYNC_CANCEL,
+                pack_user_data(URING_OP_RECV, src->generation, ZERO, src_fd)
+            )
+        ) {
+            return ERR;
+        }
+    }
+
+    return uring_flush_send_queue(loop, dst_fd);
+}
+
+static void uring_proc_send_queue_progress(
+    struct UringEventLoop* loop,
+    const int fd)
+{
+    struct UringFdState* state = fd_state_of(loop, fd);
+
+    if (state->queued_bytes <= SEND_LOW_WATER && ERR != state->paused_src_fd) {
+        struct UringFdState* src = fd_state_of(loop, state->paused_src_fd);
+        if (src->generation == state->paused_src_generation) {
+            src->recv_paused = false;
+            const int _ignored =
+                uring_maybe_arm_recv(loop, state->paused_src_fd);
+        }
+        state->paused_src_fd = ERR;
+    }
+
+    if (state->in_flight > ZERO) {
+        return;
+    }
+
+    if (NO_BUF != state->queue_head) {
+        if (OK != uring_flush_send_queue(loop, fd)) {
+            const int _ignored =
+                socks5server_proc_socket_failure(loop->socks5_server, fd);
+        }
+        return;
+    }
+
+    if (state->shut_wr_pending) {
+        state->shut_wr_pending = false;
+        const int _ = shutdown(fd, SHUT_WR);
+        const int _ignored =
+            socks5server_proc_forwarded_end_of_stream(loop->socks5_server, fd);
+    }
+}
+
+static void uring_proc_accept_completion(
+    struct UringEventLoop* loop,
+    const struct io_uring_cqe* cqe)
+{
+    const int listener_fd = user_data_fd(cqe->user_data);
+
+    if (cqe->res >= ZERO) {
+        const int _ignored =
+            socks5server_proc_accepted_connection(
+                loop->socks5_server,
+                cqe->res,
+                NULL,
+                ZERO
+            );
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        const int _ignored = uring_arm_accept(loop, listener_fd);
+    }
+}
+
+static void uring_hand_over_recvd(
+    struct UringEventLoop* loop,
+    const int fd,
+    const uint16_t bid,
+    const uint32_t len)
+{
+    int forward_to_fd = ERR;
+    const int _ignored =
+        socks5server_proc_recvd(
+            loop->socks5_server,
+            fd,
+            &loop->bufs[(size_t)bid * BUF_SIZE],
+            len,
+            &forward_to_fd
+        );
+    if (ERR == forward_to_fd) {
+        uring_provide_buf(loop, bid);
+    } else if (OK !=
+        uring_enqueue_send(
+            loop,
+            fd,
+            forward_to_fd,
+            bid,
+            len
+        )
+    ) {
+        const int _ignored =
+            socks5server_proc_socket_failure(loop->socks5_server, forward_to_fd);
+    }
+}
+
+static void uring_hand_over_end_of_stream(
+    struct UringEventLoop* loop,
+    const int fd)
+{
+    fd_state_of(loop, fd)->recv_wanted = false;
+    int forward_to_fd = ERR;
+    const int _ignored =
+        socks5server_proc_recvd(
+            loop->socks5_server,
+            fd,
+            NULL,
+            ZERO,
+            &forward_to_fd
+        );
+    struct UringFdState* dst = fd_state_of(loop, forward_to_fd);
+    if (NULL != dst) {
+        dst->shut_wr_pending = true;
+        uring_proc_send_queue_progress(loop, forward_to_fd);
+    }
+}
+
+static void uring_hold_recvd(
+    struct UringEventLoop* loop,
+    const int fd,
+    const uint16_t bid,
+    const uint32_t len)
+{
+    struct UringFdState* state = fd_state_of(loop, fd);
+    struct UringBufState* buf = &loop->buf_states[bid];
+    buf->next = NO_BUF;
+    buf->off = ZERO;
+    buf->len = len;
+
+    if (NO_BUF == state->held_tail) {
+        state->held_head = bid;
+    } else {
+        loop->buf_states[state->held_tail].next = bid;
+    }
+    state->held_tail = bid;
+}
+
+static void uring_proc_recv_completion(
+    struct UringEventLoop* loop,
+    const struct io_uring_cqe* cqe)
+{
+    const int fd = user_data_fd(cqe->user_data);
+    struct UringFdState* state = fd_state_of(loop, fd);
+    const bool has_buf = (cqe->flags & IORING_CQE_F_BUFFER) > 0;
+    const uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+    if (user_data_generation(cqe->user_data) != (state->generation & 0xFFFFF)) {
+        if (has_buf) {
+            uring_provide_buf(loop, bid);
+        }
+        return;
+    }
+
+    const uint32_t generation = state->generation;
+    const bool more = (cqe->flags & IORING_CQE_F_MORE) > 0;
+    if (!more) {
+        state->recv_armed = false;
+    }
+
+    /* the multishot recv outran the cancel of a withdrawn read interest */
+    if (!state->recv_wanted && cqe->res >= ZERO) {
+        if (cqe->res > ZERO) {
+            uring_hold_recvd(loop, fd, bid, cqe->res);
+        } else {
+            state->held_end_of_stream = true;
+        }
+        return;
+    }
+
+    if (cqe->res > ZERO) {
+        uring_hand_over_recvd(loop, fd, bid, cqe->res);
+    } else if (ZERO == cqe->res) {
+        uring_hand_over_end_of_stream(loop, fd);
+        return;
+    } else if (-ENOBUFS == cqe->res) {
+        if (loop->starved_count >= loop->fd_capacity) {
+            const int _ignored =
+                socks5server_proc_socket_failure(loop->socks5_server, fd);
+            return;
+        }
+        state->recv_starved = true;
+        loop->starved[loop->starved_count++] = fd;
+        return;
+    } else if (-ECANCELED != cqe->res) {
+        const int _ignored =
+            socks5server_proc_socket_failure(loop->socks5_server, fd);
+        return;
+    }
+
+    if (!more && state->generation == generation) {
+        const int _ignored = uring_maybe_arm_recv(loop, fd);
+    }
+}
+
+static void uring_proc_send_completion(
+    struct UringEventLoop* loop,
+    const struct io_uring_cqe* cqe)
+{
+    const int fd = user_data_fd(cqe->user_data);
+    const uint16_t bid = user_data_bid(cqe->user_data);
+    struct UringFdState* state = fd_state_of(loop, fd);
+
+    if (user_data_generation(cqe->user_data) != (state->generation & 0xFFFFF)) {
+        /* the fd was torn down while this buffer was with the kernel */
+        uring_provide_buf(loop, bid);
+        return;
+    }
+
+    state->in_flight--;
+
+    struct UringBufState* buf = &loop->buf_states[bid];
+    if (cqe->res > ZERO) {
+        buf->off += cqe->res;
+        buf->len -= cqe->res;
+        state->queued_bytes -= cqe->res;
+    }
+
+    if (ZERO == buf->len && state->queue_head == bid) {
+        state->queue_head = buf->next;
+        if (NO_BUF == state->queue_head) {
+            state->queue_tail = NO_BUF;
+        }
+        uring_provide_buf(loop, bid);
+    }
+
+    if (cqe->res < ZERO && -ECANCELED != cqe->res) {
+        const int _ignored =
+            socks5server_proc_socket_failure(loop->socks5_server, fd);
+        return;
+    }
+
+    uring_proc_send_queue_progress(loop, fd);
+}
+
+/*
+    multishot, so a writer that is still blocked, or a datagram socket
+    the library drains itself, hears about every wakeup
+*/
+static int uring_arm_poll(
+    struct UringEventLoop* loop,
+    const int fd,
+    const enum UringOp op)
+{
+    struct UringFdState* state = fd_state_of(loop, fd);
+
+    struct io_uring_sqe* sqe = uring_get_sqe(loop);
+    if (NULL == sqe) {
+        return ERR;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = URING_OP_POLL_WRITABLE == op ? POLLOUT : POLLIN;
+    sqe->user_data = pack_user_data(op, state->generation, ZERO, fd);
+    return OK;
+}
+
+static void uring_proc_poll_completion(
+    struct UringEventLoop* loop,
+    const struct io_uring_cqe* cqe)
+{
+    const int fd = user_data_fd(cqe->user_data);
+    struct UringFdState* state = fd_state_of(loop, fd);
+    const enum UringOp op = user_data_op(cqe->user_data);
+    const bool writable = URING_OP_POLL_WRITABLE == op;
+
+    if (user_data_generation(cqe->user_data) != (state->generation & 0xFFFFF)
+        || -ECANCELED == cqe->res
+        || !(writable ? state->write_wanted : state->poll_read_wanted)
+    ) {
+        return;
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)
+        && OK != uring_arm_poll(loop, fd, op)
+    ) {
+        return;
+    }
+
+    struct FdEventNotification noti = {
+        .fd_of_interest = fd,
+        .events_of_occurrence = writable ? FDIOEVENT_WRITABLE : FDIOEVENT_READABLE
+    };
+    const int _ignored =
+        socks5server_proc_io_events(
+            loop->socks5_server,
+            &noti,
+            1
+        );
+}
+
+static int64_t monotonic_ms(void)
+{
+    struct timespec ts = {0};
+    const int _ignored = clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* wakes the loop for the library's next deadline; its completion carries no work of its own */
+static int uring_arm_timeout(
+    struct UringEventLoop* loop)
+{
+    const int timeout_ms =
+        socks5server_next_timeout_ms(loop->socks5_server);
+    if (ERR == timeout_ms) {
+        return OK;
+    }
+
+    const int64_t deadline_ms = monotonic_ms() + timeout_ms;
+    if (deadline_ms >= loop->timeout_deadline_ms) {
+        return OK;
+    }
+
+    struct io_uring_sqe* sqe = uring_get_sqe(loop);
+    if (NULL == sqe) {
+        return ERR;
+    }
+    loop->timeout.tv_sec = timeout_ms / 1000;
+    loop->timeout.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = ERR;
+    sqe->addr = (uint64_t)(uintptr_t)&loop->timeout;
+    sqe->len = 1;
+    sqe->user_data = pack_user_data(URING_OP_TIMEOUT, ZERO, ZERO, ZERO);
+    loop->timeout_deadline_ms = deadline_ms;
+    return OK;
+}
+
+static void uring_proc_completion(
+    struct UringEventLoop* loop,
+    const struct io_uring_cqe* cqe)
+{
+    switch (user_data_op(cqe->user_data)) {
+        case URING_OP_ACCEPT:
+            uring_proc_accept_completion(loop, cqe);
+            return;
+        case URING_OP_RECV:
+            uring_proc_recv_completion(loop, cqe);
+            return;
+        case URING_OP_SEND:
+            uring_proc_send_completion(loop, cqe);
+            return;
+        case URING_OP_POLL_WRITABLE:
+        case URING_OP_POLL_READABLE:
+            uring_proc_poll_completion(loop, cqe);
+            return;
+        case URING_OP_TIMEOUT:
+            /* any still in flight are later; the next arm re-learns the earliest */
+            loop->timeout_deadline_ms = INT64_MAX;
+            return;
+        case URING_OP_CANCEL: default:
+            return;
+    }
+}
+
+static void uring_rearm_starved(
+    struct UringEventLoop* loop)
+{
+    if (!loop->bufs_recycled) {
+        return;
+    }
+    loop->bufs_recycled = false;
+
+    const size_t starved_count = loop->starved_count;
+    loop->starved_count = ZERO;
+    for (size_t i = 0; i < starved_count; i++) {
+        const int fd = loop->starved[i];
+        struct UringFdState* state = fd_state_of(loop, fd);
+        if (!state->recv_starved) {
+            continue;
+        }
+        state->recv_starved = false;
+        const int _ignored = uring_maybe_arm_recv(loop, fd);
+    }
+}
+
+/*
+    Out of the completion loop, not from within the library's interest
+    flush: what was held is handed over in order, for as long as the
+    library keeps wanting it, before the recv is armed again.
+*/
+static void uring_resume_held(
+    struct UringEventLoop* loop)
+{
+    /* handing over may queue an fd again: taken from the end, not walked */
+    while (ZERO != loop->resumed_count) {
+        const int fd = loop->resumed[--loop->resumed_count];
+        struct UringFdState* state = fd_state_of(loop, fd);
+        if (!state->held_resume_queued) {
+            continue;
+        }
+        state->held_resume_queued = false;
+
+        const uint32_t generation = state->generation;
+        while (generation == state->generation
+            && state->recv_wanted
+            && NO_BUF != state->held_head
+        ) {
+            const uint16_t bid = state->held_head;
+            state->held_head = loop->buf_states[bid].next;
+            if (NO_BUF == state->held_head) {
+                state->held_tail = NO_BUF;
+            }
+            uring_hand_over_recvd(loop, fd, bid, loop->buf_states[bid].len);
+        }
+
+        if (generation != state->generation || !state->recv_wanted) {
+            continue;
+        }
+        if (state->held_end_of_stream) {
+            state->held_end_of_stream = false;
+            uring_hand_over_end_of_stream(loop, fd);
+            continue;
+        }
+        const int _ignored = uring_maybe_arm_recv(loop, fd);
+    }
+}
+
+/*
+    Read interest arms the multishot recv; withdrawing it cancels the
+    recv, and anything it still completes with is held for the fd. Write interest is a multishot POLLOUT, and
+    poll-read interest a multishot POLLIN, removed again once the library
+    no longer wants it.
+*/
+static int uring_apply_interest(
+    struct UringEventLoop* loop,
+    const int socket_fd,
+    const enum FDIOEvent interest)
+{
+    struct UringFdState* state = fd_state_of(loop, socket_fd);
+    if (NULL == state) {
+        return ERR;
+    }
+
+    const bool read_wanted = (interest & FDIOEVENT_READABLE) > 0;
+    const bool write_wanted = (interest & FDIOEVENT_WRITABLE) > 0;
+    const bool poll_read_wanted = (interest & FDIOEVENT_POLL_READABLE) > 0;
+
+    if (write_wanted != state->write_wanted) {
+        state->write_wanted = write_wanted;
+        const int applied =
+            write_wanted
+            ? uring_arm_poll(loop, socket_fd, URING_OP_POLL_WRITABLE)
+            : uring_cancel(
+                loop,
+                IORING_OP_POLL_REMOVE,
+                pack_user_data(URING_OP_POLL_WRITABLE, state->generation, ZERO, socket_fd)
+            );
+        if (OK != applied) {
+            return ERR;
+        }
+    }
+
+    if (poll_read_wanted != state->poll_read_wanted) {
+        state->poll_read_wanted = poll_read_wanted;
+        const int applied =
+            poll_read_wanted
+            ? uring_arm_poll(loop, socket_fd, URING_OP_POLL_READABLE)
+            : uring_cancel(
+                loop,
+                IORING_OP_POLL_REMOVE,
+                pack_user_data(URING_OP_POLL_READABLE, state->generation, ZERO, socket_fd)
+            );
+        if (OK != applied) {
+            return ERR;
+        }
+    }
+
+    if (read_wanted != state->recv_wanted) {
+        state->recv_wanted = read_wanted;
+        if (!read_wanted) {
+            return state->recv_armed
+                ? uring_cancel(
+                    loop,
+                    IORING_OP_ASYNC_CANCEL,
+                    pack_user_data(URING_OP_RECV, state->generation, ZERO, socket_fd)
+                )
+                : OK;
+        }
+        if ((NO_BUF != state->held_head || state->held_end_of_stream)
+            && !state->held_resume_queued
+        ) {
+            if (loop->resumed_count >= loop->fd_capacity) {
+                return ERR;
+            }
+            state->held_resume_queued = true;
+            loop->resumed[loop->resumed_count++] = socket_fd;
+            return OK;
+        }
+        return uring_maybe_arm_recv(loop, socket_fd);
+    }
+
+    return OK;
+}
+
+static int uring_subscribe_socket(
+    struct Socks5Server* socks5_server,
+    const int socket_fd,
+    const enum FDIOEvent interest,
+    void* context)
+{
+    /* completions are handed back by fd: socks5server_proc_recvd and the like take no context */
+    (void)context;
+    return uring_apply_interest(
+        loop_of(socks5_server),
+        socket_fd,
+        interest
+    );
+}
+
+static int uring_modify_socket_interest(
+    struct Socks5Server* socks5_server,
+    const int socket_fd,
+    const enum FDIOEvent interest,
+    void* context)
+{
+    (void)context;
+    return uring_apply_interest(
+        loop_of(socks5_server),
+        socket_fd,
+        interest
+    );
+}
+
+static int uring_unsubscribe_socket(
+    struct Socks5Server* socks5_server,
+    const int socket_fd)
+{
+    struct UringEventLoop* loop = loop_of(socks5_server);
+    struct UringFdState* state = fd_state_of(loop, socket_fd);
+    if (NULL == state) {
+        return ERR;
+    }
+
+    if (state->write_wanted
+        && OK !=
+        uring_cancel(
+            loop,
+            IORING_OP_POLL_REMOVE,
+            pack_user_data(URING_OP_POLL_WRITABLE, state->generation, ZERO, socket_fd)
+        )
+    ) {
+        return ERR;
+    }
+
+    if (state->poll_read_wanted
+        && OK !=
+        uring_cancel(
+            loop,
+            IORING_OP_POLL_REMOVE,
+            pack_user_data(URING_OP_POLL_READABLE, state->generation, ZERO, socket_fd)
+        )
+    ) {
+        return ERR;
+    }
+
+    if (state->recv_armed
+        && OK !=
+        uring_cancel(
+            loop,
+            IORING_OP_ASYNC_CANCEL,
+            pack_user_data(URING_OP_RECV, state->generation, ZERO, socket_fd)
+        )
+    ) {
+        return ERR;
+    }
+
+    /* buffers already handed to the kernel come back through stale CQEs */
+    uint16_t bid = state->queue_head;
+    for (uint32_t i = 0; NO_BUF != bid; i++) {
+        const uint16_t next = loop->buf_states[bid].next;
+        if (i >= state->in_flight) {
+            uring_provide_buf(loop, bid);
+        }
+        bid = next;
+    }
+    for (bid = state->held_head; NO_BUF != bid; ) {
+        const uint16_t next = loop->buf_states[bid].next;
+        uring_provide_buf(loop, bid);
+        bid = next;
+    }
+
+    fd_state_reset(state);
+    return OK;
+}
+
+void uring_event_loop_fill_cfg(
+    struct Socks5ServerCfg* cfg)
+{
+    cfg->event_model = SOCKS5_EVENT_MODEL_COMPLETION;
+    cfg->subscribe_socket = uring_subscribe_socket;
+    cfg->modify_socket_interest = uring_modify_socket_interest;
+    cfg->unsubscribe_socket = uring_unsubscribe_socket;
+}
+
+static int uring_map_rings(
+    struct UringEventLoop* loop,
+    const struct io_uring_params* params)
+{
+    const size_t sq_ring_size =
+        params->sq_off.array + params->sq_entries * sizeof(unsigned);
+    const size_t cq_ring_size =
+        params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+    const bool single_mmap = (params->features & IORING_FEAT_SINGLE_MMAP) > 0;
+
+    const size_t sq_map_size =
+        single_mmap && cq_ring_size > sq_ring_size
+        ? cq_ring_size
+        : sq_ring_size;
+
+    char* sq_ring =
+        mmap(
+            NULL,
+            sq_map_size,
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE,
+            loop->ring_fd,
+            IORING_OFF_SQ_RING
+        );
+    if (MAP_FAILED == sq_ring) {
+        return ERR;
+    }
+
+    char* cq_ring = sq_ring;
+    if (!single_mmap) {
+        cq_ring =
+            mmap(
+                NULL,
+                cq_ring_size,
+                PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE,
+                loop->ring_fd,
+                IORING_OFF_CQ_RING
+            );
+        if (MAP_FAILED == cq_ring) {
+            return ERR;
+        }
+    }
+
+    struct io_uring_sqe* sqes =
+        mmap(
+            NULL,
+            params->sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE,
+            loop->ring_fd,
+            IORING_OFF_SQES
+        );
+    if (MAP_FAILED == sqes) {
+        return ERR;
+    }
+
+    loop->sq.head = (unsigned*)(sq_ring + params->sq_off.head);
+    loop->sq.tail = (unsigned*)(sq_ring + params->sq_off.tail);
+    loop->sq.mask = (unsigned*)(sq_ring + params->sq_off.ring_mask);
+    loop->sq.array = (unsigned*)(sq_ring + params->sq_off.array);
+    loop->sq.entries = params->sq_entries;
+    loop->sq.local_tail = *loop->sq.tail;
+    loop->sq.sqes = sqes;
+
+    loop->cq.head = (unsigned*)(cq_ring + params->cq_off.head);
+    loop->cq.tail = (unsigned*)(cq_ring + params->cq_off.tail);
+    loop->cq.mask = (unsigned*)(cq_ring + params->cq_off.ring_mask);
+    loop->cq.cqes = (struct io_uring_cqe*)(cq_ring + params->cq_off.cqes);
+
+    return OK;
+}
+
+static int uring_register_buf_ring(
+    struct UringEventLoop* loop)
+{
+    loop->buf_ring =
+        mmap(
+            NULL,
+            BUF_COUNT * sizeof(struct io_uring_buf),
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS,
+            ERR,
+            ZERO
+        );
+    if (MAP_FAILED == loop->buf_ring) {
+        return ERR;
+    }
+
+    loop->bufs =
+        mmap(
+            NULL,
+            (size_t)BUF_COUNT * BUF_SIZE,
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS,
+            ERR,
+            ZERO
+        );
+    if (MAP_FAILED == loop->bufs) {
+        return ERR;
+    }
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uint64_t)(uintptr_t)loop->buf_ring,
+        .ring_entries = BUF_COUNT,
+        .bgid = BUF_GROUP
+    };
+    if (OK !=
+        sys_io_uring_register(
+            loop->ring_fd,
+            IORING_REGISTER_PBUF_RING,
+            &reg,
+            1
+        )
+    ) {
+        return ERR;
+    }
+
+    loop->buf_ring_tail = ZERO;
+    for (uint16_t bid = 0; bid < BUF_COUNT; bid++) {
+        uring_provide_buf(loop, bid);
+    }
+
+    return OK;
+}
+
+static int uring_event_loop_construct(
+    struct UringEventLoop* loop)
+{
+    struct rlimit nofile = {0};
+    if (OK != getrlimit(RLIMIT_NOFILE, &nofile)) {
+        return ERR;
+    }
+    loop->fd_capacity =
+        RLIM_INFINITY == nofile.rlim_cur || nofile.rlim_cur > (1 << 24)
+        ? (1 << 24)
+        : nofile.rlim_cur;
+    loop->fds = calloc(loop->fd_capacity, sizeof(struct UringFdState));
+    loop->starved = calloc(loop->fd_capacity, sizeof(int));
+    loop->resumed = calloc(loop->fd_capacity, sizeof(int));
+    if (NULL == loop->fds || NULL == loop->starved || NULL == loop->resumed) {
+        return ERR;
+    }
+    for (size_t fd = 0; fd < loop->fd_capacity; fd++) {
+        fd_state_reset(&loop->fds[fd]);
+    }
+
+    struct io_uring_params params = {
+        .flags = IORING_SETUP_SINGLE_ISSUER
+            | IORING_SETUP_DEFER_TASKRUN
+            | IORING_SETUP_SUBMIT_ALL
+            | IORING_SETUP_CQSIZE,
+        .cq_entries = URING_ENTRIES * 4
+    };
+    loop->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    if (ERR == loop->ring_fd && EINVAL == errno) {
+        /* kernels before 6.1 */
+        const void* _ = memset(&params, ZERO, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = URING_ENTRIES * 4;
+        loop->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    }
+    if (ERR == loop->ring_fd) {
+        return ERR;
+    }
+
+    if (OK != uring_map_rings(loop, &params)) {
+        return ERR;
+    }
+
+    return uring_register_buf_ring(loop);
+}
+
+int uring_event_loop_run(
+    struct Socks5Server* socks5_server)
+{
+    /* one per shard, on the heap: the buffer states are too big for a thread stack */
+    struct UringEventLoop* loop =
+        calloc(
+            1,
+            sizeof(struct UringEventLoop)
+        );
+    if (NULL == loop) {
+        return ERR;
+    }
+    loop->socks5_server = socks5_server;
+    loop->timeout_deadline_ms = INT64_MAX;
+    socks5_server->data = loop;
+
+    if (OK != uring_event_loop_construct(loop)) {
+        return ERR;
+    }
+
+    if (OK !=
+        uring_arm_accept(
+            loop,
+            socks5_server->listener_socket_fd
+        )
+    ) {
+        return ERR;
+    }
+
+    for (;;) {
+        if (OK != uring_arm_timeout(loop)) {
+            return ERR;
+        }
+
+        if (OK != uring_submit(loop, 1)) {
+            return ERR;
+        }
+
+        unsigned head = *loop->cq.head;
+        const unsigned tail =
+            __atomic_load_n(loop->cq.tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const struct io_uring_cqe cqe =
+                loop->cq.cqes[head & *loop->cq.mask];
+            uring_proc_completion(loop, &cqe);
+        }
+        __atomic_store_n(loop->cq.head, head, __ATOMIC_RELEASE);
+
+        if (OK != socks5server_proc_timeouts(socks5_server)) {
+            return ERR;
+        }
+
+        uring_rearm_starved(loop);
+        uring_resume_held(loop);
+    }
+}
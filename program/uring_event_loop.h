@@ -0,0 +1,21 @@
+#ifndef _URING_EVENT_LOOP_H_
+#define _URING_EVENT_LOOP_H_
+
+#include "rfc1928socks5.h"
+
+/*
+    Completion based event source: multishot accept on the listener,
+    multishot recv into a provided buffer ring for every subscribed
+    socket, and relayed buffers sent straight out of that ring as linked
+    send SQEs.
+*/
+
+void uring_event_loop_fill_cfg(
+    struct Socks5ServerCfg* cfg
+);
+
+int uring_event_loop_run(
+    struct Socks5Server* socks5_server
+);
+
+#endif
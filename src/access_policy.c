@@ -0,0 +1,334 @@
+#define _GNU_SOURCE
+#include "access_policy.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+enum {OK=0,ERR=-1};
+enum {ZERO=0};
+
+/* eight bits a node: at most four nodes to an IPv4 decision, sixteen to an IPv6 one */
+enum {POLICY_STRIDE_BITS=8};
+enum {POLICY_STRIDE_FANOUT=1 << POLICY_STRIDE_BITS};
+
+enum {POLICY_FAMILY_IPV4=0,POLICY_FAMILY_IPV6=1,POLICY_FAMILY_COUNT=2};
+
+enum PolicyVerdict
+{
+    POLICY_VERDICT_NONE=0,
+    POLICY_VERDICT_ALLOW,
+    POLICY_VERDICT_DENY
+};
+
+/*
+    A prefix ending inside a stride is expanded over every entry it
+    holds; an entry keeps the verdict of the longest prefix expanded
+    over it, and a child node for the prefixes going further.
+*/
+struct PolicyTrieEntry
+{
+    int32_t child;
+    uint8_t verdict;
+    uint8_t prefix_len;
+};
+
+struct PolicyTrieNode
+{
+    struct PolicyTrieEntry entries[POLICY_STRIDE_FANOUT];
+};
+
+struct PolicyTrie
+{
+    /* ERR: no rule longer than /0 */
+    int32_t root;
+    /* the /0 rule's */
+    uint8_t verdict;
+};
+
+struct AccessPolicy
+{
+    struct PolicyTrieNode* nodes;
+    size_t node_count;
+    size_t node_capacity;
+    struct PolicyTrie tries[ACCESS_POLICY_DIRECTION_COUNT][POLICY_FAMILY_COUNT];
+};
+
+static int32_t policy_construct_node(
+    struct AccessPolicy* policy)
+{
+    if (policy->node_count == policy->node_capacity) {
+        const size_t capacity =
+            ZERO == policy->node_capacity ? 16 : 2 * policy->node_capacity;
+        if (capacity > INT32_MAX) {
+            return ERR;
+        }
+        struct PolicyTrieNode* nodes =
+            realloc(
+                policy->nodes,
+                capacity * sizeof(struct PolicyTrieNode)
+            );
+        if (NULL == nodes) {
+            return ERR;
+        }
+        policy->nodes = nodes;
+        policy->node_capacity = capacity;
+    }
+
+    struct PolicyTrieNode* node = &policy->nodes[policy->node_count];
+    for (ptrdiff_t i = 0; i < POLICY_STRIDE_FANOUT; i++) {
+        node->entries[i].child = ERR;
+        node->entries[i].verdict = POLICY_VERDICT_NONE;
+        node->entries[i].prefix_len = ZERO;
+    }
+    return policy->node_count++;
+}
+
+static int policy_insert(
+    struct AccessPolicy* policy,
+    struct PolicyTrie* trie,
+    const uint8_t address[],
+    const unsigned prefix_len,
+    const enum PolicyVerdict verdict)
+{
+    if (ZERO == prefix_len) {
+        if (POLICY_VERDICT_NONE == trie->verdict) {
+            trie->verdict = verdict;
+        }
+        return OK;
+    }
+
+    if (ERR == trie->root) {
+        trie->root = policy_construct_node(policy);
+        if (ERR == trie->root) {
+            return ERR;
+        }
+    }
+
+    /* the stride the prefix ends in */
+    const unsigned last = (prefix_len - 1) / POLICY_STRIDE_BITS;
+
+    int32_t node = trie->root;
+    for (unsigned i = 0; i < last; i++) {
+        if (ERR == policy->nodes[node].entries[address[i]].child) {
+            /* looked up again after: constructing may move the nodes */
+            const int32_t child = policy_construct_node(policy);
+            if (ERR == child) {
+                return ERR;
+            }
+            policy->nodes[node].entries[address[i]].child = child;
+        }
+        node = policy->nodes[node].entries[address[i]].child;
+    }
+
+    const unsigned bits = prefix_len - last * POLICY_STRIDE_BITS;
+    const unsigned span = 1u << (POLICY_STRIDE_BITS - bits);
+    const unsigned first = address[last] & ~(span - 1) & (POLICY_STRIDE_FANOUT - 1);
+    for (unsigned i = first; i < first + span; i++) {
+        struct PolicyTrieEntry* entry = &policy->nodes[node].entries[i];
+        /* the longer prefix decides; of two the same, the first stands */
+        if (POLICY_VERDICT_NONE == entry->verdict
+            || entry->prefix_len < prefix_len
+        ) {
+            entry->verdict = verdict;
+            entry->prefix_len = prefix_len;
+        }
+    }
+    return OK;
+}
+
+static enum PolicyVerdict policy_lookup(
+    const struct AccessPolicy* policy,
+    const struct PolicyTrie* trie,
+    const uint8_t address[],
+    const size_t address_len)
+{
+    enum PolicyVerdict verdict = trie->verdict;
+    int32_t node = trie->root;
+    for (size_t i = 0; ERR != node && i < address_len; i++) {
+        const struct PolicyTrieEntry* entry = &policy->nodes[node].entries[address[i]];
+        if (POLICY_VERDICT_NONE != entry->verdict) {
+            verdict = entry->verdict;
+        }
+        node = entry->child;
+    }
+    return verdict;
+}
+
+static int policy_parse_line(
+    struct AccessPolicy* policy,
+    const char* line)
+{
+    char action[8] = {0};
+    char direction[8] = {0};
+    char prefix[INET6_ADDRSTRLEN + 8] = {0};
+    if (3 != sscanf(line, "%7s %7s %53s", action, direction, prefix)) {
+        return ERR;
+    }
+
+    enum PolicyVerdict verdict = POLICY_VERDICT_NONE;
+    if (ZERO == strcmp(action, "allow")) {
+        verdict = POLICY_VERDICT_ALLOW;
+    } else if (ZERO == strcmp(action, "deny")) {
+        verdict = POLICY_VERDICT_DENY;
+    } else {
+        return ERR;
+    }
+
+    enum AccessPolicyDirection towards = ACCESS_POLICY_SOURCE;
+    if (ZERO == strcmp(direction, "src")) {
+        towards = ACCESS_POLICY_SOURCE;
+    } else if (ZERO == strcmp(direction, "dst")) {
+        towards = ACCESS_POLICY_DESTINATION;
+    } else {
+        return ERR;
+    }
+
+    char* slash = strchr(prefix, '/');
+    if (NULL != slash) {
+        *slash = '\0';
+    }
+
+    uint8_t address[SIXTEEN] = {0};
+    ptrdiff_t family = POLICY_FAMILY_IPV4;
+    unsigned max_len = 32;
+    if (1 == inet_pton(AF_INET, prefix, address)) {
+        family = POLICY_FAMILY_IPV4;
+        max_len = 32;
+    } else if (1 == inet_pton(AF_INET6, prefix, address)) {
+        family = POLICY_FAMILY_IPV6;
+        max_len = 128;
+    } else {
+        return ERR;
+    }
+
+    unsigned long prefix_len = max_len;
+    if (NULL != slash) {
+        char* end = NULL;
+        prefix_len = strtoul(slash + 1, &end, 10);
+        if (end == slash + 1 || '\0' != *end || prefix_len > max_len) {
+            return ERR;
+        }
+    }
+
+    return policy_insert(
+        policy,
+        &policy->tries[towards][family],
+        address,
+        prefix_len,
+        verdict
+    );
+}
+
+struct AccessPolicy* access_policy_load(
+    const char* path)
+{
+    FILE* file = fopen(path, "re");
+    if (NULL == file) {
+        return NULL;
+    }
+
+    struct AccessPolicy* policy = calloc(1, sizeof(struct AccessPolicy));
+    if (NULL != policy) {
+        for (ptrdiff_t d = 0; d < ACCESS_POLICY_DIRECTION_COUNT; d++) {
+            for (ptrdiff_t f = 0; f < POLICY_FAMILY_COUNT; f++) {
+                policy->tries[d][f].root = ERR;
+                policy->tries[d][f].verdict = POLICY_VERDICT_NONE;
+            }
+        }
+    }
+
+    char* line = NULL;
+    size_t line_capacity = ZERO;
+    ssize_t line_len = ZERO;
+    while (NULL != policy
+        && ERR != (line_len = getline(&line, &line_capacity, file))
+    ) {
+        const char* text = line + strspn(line, " \t");
+        if ('#' == text[0] || '\0' == text[strspn(text, " \t\r\n")]) {
+            continue;
+        }
+        if (OK != policy_parse_line(policy, text)) {
+            free(policy->nodes);
+            free(policy);
+            policy = NULL;
+        }
+    }
+
+    if (NULL != policy && ferror(file)) {
+        free(policy->nodes);
+        free(policy);
+        policy = NULL;
+    }
+
+    free(line);
+    const int _ignored = fclose(file);
+    return policy;
+}
+
+static bool verdict_admits(
+    const enum PolicyVerdict verdict)
+{
+    return POLICY_VERDICT_DENY != verdict;
+}
+
+bool access_policy_admits_in6(
+    const struct AccessPolicy* policy,
+    const enum AccessPolicyDirection direction,
+    const struct in6_addr* address)
+{
+    if (NULL == policy) {
+        return true;
+    }
+
+    if (IN6_IS_ADDR_V4MAPPED(address)) {
+        return verdict_admits(
+            policy_lookup(
+                policy,
+                &policy->tries[direction][POLICY_FAMILY_IPV4],
+                &address->s6_addr[SIXTEEN - FOUR],
+                FOUR
+            )
+        );
+    }
+
+    return verdict_admits(
+        policy_lookup(
+            policy,
+            &policy->tries[direction][POLICY_FAMILY_IPV6],
+            address->s6_addr,
+            SIXTEEN
+        )
+    );
+}
+
+bool access_policy_admits(
+    const struct AccessPolicy* policy,
+    const enum AccessPolicyDirection direction,
+    const struct sockaddr_storage* address)
+{
+    if (NULL == policy) {
+        return true;
+    }
+
+    switch (address->ss_family) {
+        case AF_INET:
+            return verdict_admits(
+                policy_lookup(
+                    policy,
+                    &policy->tries[direction][POLICY_FAMILY_IPV4],
+                    (const uint8_t*)&((const struct sockaddr_in*)address)->sin_addr,
+                    FOUR
+                )
+            );
+        case AF_INET6:
+            return access_policy_admits_in6(
+                policy,
+                direction,
+                &((const struct sockaddr_in6*)address)->sin6_addr
+            );
+        default:
+            return true;
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef _ACCESS_POLICY_H_
+#define _ACCESS_POLICY_H_
+
+#include "rfc1928socks5.h"
+
+/*
+    Allow and deny rules on client sources and request destinations,
+    compiled into one prefix trie per direction and family. The longest
+    prefix holding an address decides; an address no rule holds is
+    allowed. Loaded once and only read after: one policy may be shared
+    by every shard.
+*/
+
+enum AccessPolicyDirection
+{
+    ACCESS_POLICY_SOURCE=0,
+    ACCESS_POLICY_DESTINATION,
+    ACCESS_POLICY_DIRECTION_COUNT
+};
+
+/*
+    "allow|deny src|dst PREFIX[/LEN]" per line; blank lines and lines
+    starting with '#' are skipped. Of two rules on the same prefix, the
+    first stands.
+*/
+struct AccessPolicy* access_policy_load(
+    const char* path
+);
+
+/* IPv4-mapped IPv6 addresses are held to the IPv4 rules */
+bool access_policy_admits(
+    const struct AccessPolicy* policy,
+    const enum AccessPolicyDirection direction,
+    const struct sockaddr_storage* address
+);
+
+bool access_policy_admits_in6(
+    const struct AccessPolicy* policy,
+    const enum AccessPolicyDirection direction,
+    const struct in6_addr* address
+);
+
+#endif
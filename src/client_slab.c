@@ -0,0 +1,148 @@
+#define _GNU_SOURCE
+#include "client_slab.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+enum {OK=0,ERR=-1};
+enum {ZERO=0};
+
+enum {HUGE_PAGE_SIZE=2*1024*1024};
+
+static size_t round_up(
+    const size_t n,
+    const size_t multiple)
+{
+    return (n + multiple - 1) / multiple * multiple;
+}
+
+static void* map_slab_space(
+    const size_t size,
+    const unsigned flags)
+{
+    const int populate =
+        (flags & (SOCKS5_CLIENT_SLAB_PREFAULT | SOCKS5_CLIENT_SLAB_MLOCK))
+            ? MAP_POPULATE
+            : ZERO;
+
+    if (flags & SOCKS5_CLIENT_SLAB_HUGE_PAGES) {
+        /* reserved hugetlbfs pages first; fails unless vm.nr_hugepages is set */
+        void* space =
+            mmap(
+                NULL,
+                size,
+                PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | populate,
+                ERR,
+                ZERO
+            );
+        if (MAP_FAILED != space) {
+            return space;
+        }
+    }
+
+    void* space =
+        mmap(
+            NULL,
+            size,
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | populate,
+            ERR,
+            ZERO
+        );
+    if (MAP_FAILED == space) {
+        return NULL;
+    }
+
+    if (flags & SOCKS5_CLIENT_SLAB_HUGE_PAGES) {
+        /* transparent huge pages are only a hint */
+        const int _ignored = madvise(space, size, MADV_HUGEPAGE);
+    }
+
+    return space;
+}
+
+int client_slab_construct(
+    struct Socks5ClientSlab* slab,
+    const size_t capacity,
+    const unsigned flags)
+{
+    slab->clients = NULL;
+    slab->idle = NULL;
+    slab->idle_count = ZERO;
+    slab->capacity = ZERO;
+    slab->mapped_size = ZERO;
+
+    if (ZERO == capacity) {
+        return OK;
+    }
+
+    const size_t size =
+        round_up(
+            capacity * sizeof(struct Socks5Client),
+            (flags & SOCKS5_CLIENT_SLAB_HUGE_PAGES)
+                ? HUGE_PAGE_SIZE
+                : (size_t)sysconf(_SC_PAGESIZE)
+        );
+
+    slab->clients = map_slab_space(size, flags);
+    if (NULL == slab->clients) {
+        return ERR;
+    }
+    slab->mapped_size = size;
+
+    if ((flags & SOCKS5_CLIENT_SLAB_MLOCK)
+        && OK != mlock(slab->clients, size)
+    ) {
+        const int _ignored = munmap(slab->clients, size);
+        slab->clients = NULL;
+        return ERR;
+    }
+
+    slab->idle =
+        calloc(
+            capacity,
+            sizeof(struct Socks5Client*)
+        );
+    if (NULL == slab->idle) {
+        const int _ignored = munmap(slab->clients, size);
+        slab->clients = NULL;
+        return ERR;
+    }
+
+    /* lowest address on top, so a quiet server keeps touching the same few pages */
+    for (size_t i = ZERO; i < capacity; i++) {
+        slab->idle[i] = &slab->clients[capacity - 1 - i];
+    }
+    slab->idle_count = capacity;
+    slab->capacity = capacity;
+
+    return OK;
+}
+
+struct Socks5Client* client_slab_acquire(
+    struct Socks5ClientSlab* slab)
+{
+    if (ZERO == slab->idle_count) {
+        return NULL;
+    }
+
+    return slab->idle[--slab->idle_count];
+}
+
+bool client_slab_owns(
+    const struct Socks5ClientSlab* slab,
+    const struct Socks5Client* socks5_client)
+{
+    return slab->capacity > ZERO
+        && socks5_client >= slab->clients
+        && socks5_client < slab->clients + slab->capacity;
+}
+
+void client_slab_relinquish(
+    struct Socks5ClientSlab* slab,
+    struct Socks5Client* socks5_client)
+{
+    slab->idle[slab->idle_count++] = socks5_client;
+}
@@ -0,0 +1,26 @@
+#ifndef _CLIENT_SLAB_H_
+#define _CLIENT_SLAB_H_
+
+#include "rfc1928socks5.h"
+
+int client_slab_construct(
+    struct Socks5ClientSlab* slab,
+    const size_t capacity,
+    const unsigned flags
+);
+
+struct Socks5Client* client_slab_acquire(
+    struct Socks5ClientSlab* slab
+);
+
+bool client_slab_owns(
+    const struct Socks5ClientSlab* slab,
+    const struct Socks5Client* socks5_client
+);
+
+void client_slab_relinquish(
+    struct Socks5ClientSlab* slab,
+    struct Socks5Client* socks5_client
+);
+
+#endif
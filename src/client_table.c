@@ -0,0 +1,78 @@
+#include "client_table.h"
+
+#include <stdlib.h>
+#include <sys/resource.h>
+
+enum {OK=0,ERR=-1};
+enum {ZERO=0};
+
+/* fds are small, dense integers; a slot per possible fd beats hashing them */
+enum {MAX_TABLE_CAPACITY=1 << 24};
+
+int client_table_construct(
+    struct Socks5ClientTable* table)
+{
+    struct rlimit nofile = {0};
+    if (OK != getrlimit(RLIMIT_NOFILE, &nofile)) {
+        return ERR;
+    }
+
+    table->capacity =
+        RLIM_INFINITY == nofile.rlim_cur || nofile.rlim_cur > MAX_TABLE_CAPACITY
+            ? MAX_TABLE_CAPACITY
+            : nofile.rlim_cur;
+
+    table->clients =
+        calloc(
+            table->capacity,
+            sizeof(struct Socks5Client*)
+        );
+    if (NULL == table->clients) {
+        return ERR;
+    }
+
+    return OK;
+}
+
+int client_table_track(
+    struct Socks5ClientTable* table,
+    const int socket_fd,
+    struct Socks5Client* socks5_client)
+{
+    if (socket_fd < ZERO
+        || (size_t)socket_fd >= table->capacity
+        || NULL != table->clients[socket_fd]
+    ) {
+        return ERR;
+    }
+
+    table->clients[socket_fd] = socks5_client;
+    return OK;
+}
+
+int client_table_untrack(
+    struct Socks5ClientTable* table,
+    const int socket_fd,
+    const struct Socks5Client* socks5_client)
+{
+    if (socket_fd < ZERO
+        || (size_t)socket_fd >= table->capacity
+        || socks5_client != table->clients[socket_fd]
+    ) {
+        return ERR;
+    }
+
+    table->clients[socket_fd] = NULL;
+    return OK;
+}
+
+struct Socks5Client* client_table_lookup(
+    const struct Socks5ClientTable* table,
+    const int socket_fd)
+{
+    if (socket_fd < ZERO || (size_t)socket_fd >= table->capacity) {
+        return NULL;
+    }
+
+    return table->clients[socket_fd];
+}
@@ -0,0 +1,27 @@
+#ifndef _CLIENT_TABLE_H_
+#define _CLIENT_TABLE_H_
+
+#include "rfc1928socks5.h"
+
+int client_table_construct(
+    struct Socks5ClientTable* table
+);
+
+int client_table_track(
+    struct Socks5ClientTable* table,
+    const int socket_fd,
+    struct Socks5Client* socks5_client
+);
+
+int client_table_untrack(
+    struct Socks5ClientTable* table,
+    const int socket_fd,
+    const struct Socks5Client* socks5_client
+);
+
+struct Socks5Client* client_table_lookup(
+    const struct Socks5ClientTable* table,
+    const int socket_fd
+);
+
+#endif
@@ -0,0 +1,356 @@
+#define _GNU_SOURCE
+#include "credential_store.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <sys/random.h>
+
+enum {OK=0,ERR=-1};
+enum {ZERO=0};
+
+/* how long a failed name and source stay failed */
+enum {FAILED_AUTH_MS=1000};
+enum {FAILED_AUTH_SLOTS=4096};
+
+struct CredentialSlot
+{
+    uint64_t name_hash;
+    uint64_t password_hash;
+    uint32_t name_offset;
+    /* ZERO: the slot is empty */
+    uint8_t name_len;
+};
+
+struct CredentialStore
+{
+    struct CredentialSlot* slots;
+    size_t slot_mask;
+    char* names;
+    size_t names_len;
+    /* names, passwords and failures are each hashed under a key of their own */
+    uint64_t name_key[2];
+    uint64_t password_key[2];
+    uint64_t failure_key[2];
+};
+
+struct FailedAuth
+{
+    uint64_t key;
+    int64_t expires_ms;
+};
+
+/* direct mapped: a newer failure simply takes the slot */
+struct FailedAuthCache
+{
+    struct FailedAuth entries[FAILED_AUTH_SLOTS];
+};
+
+static uint64_t rotl64(
+    const uint64_t x,
+    const int b)
+{
+    return (x << b) | (x >> (64 - b));
+}
+
+static void sip_round(
+    uint64_t v[4])
+{
+    v[0] += v[1]; v[1] = rotl64(v[1], 13); v[1] ^= v[0]; v[0] = rotl64(v[0], 32);
+    v[2] += v[3]; v[3] = rotl64(v[3], 16); v[3] ^= v[2];
+    v[0] += v[3]; v[3] = rotl64(v[3], 21); v[3] ^= v[0];
+    v[2] += v[1]; v[1] = rotl64(v[1], 17); v[1] ^= v[2]; v[2] = rotl64(v[2], 32);
+}
+
+/* SipHash-2-4: keyed, so neither table nor verifier can be aimed at from outside */
+static uint64_t siphash(
+    const uint64_t key[2],
+    const void* data,
+    const size_t len)
+{
+    uint64_t v[4] = {
+        0x736f6d6570736575ULL ^ key[0],
+        0x646f72616e646f6dULL ^ key[1],
+        0x6c7967656e657261ULL ^ key[0],
+        0x7465646279746573ULL ^ key[1]
+    };
+
+    const uint8_t* in = data;
+    const size_t tail = len & 7;
+    for (const uint8_t* end = in + len - tail; in != end; in += 8) {
+        uint64_t m = 0;
+        const void* _ = memcpy(&m, in, sizeof(m));
+        m = le64toh(m);
+        v[3] ^= m;
+        sip_round(v);
+        sip_round(v);
+        v[0] ^= m;
+    }
+
+    uint64_t b = (uint64_t)len << 56;
+    for (size_t i = 0; i < tail; i++) {
+        b |= (uint64_t)in[i] << (8 * i);
+    }
+    v[3] ^= b;
+    sip_round(v);
+    sip_round(v);
+    v[0] ^= b;
+
+    v[2] ^= 0xFF;
+    for (int i = 0; i < 4; i++) {
+        sip_round(v);
+    }
+    return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+/* the slot holding name, or the empty slot it would go in */
+static struct CredentialSlot* store_slot_of(
+    const struct CredentialStore* store,
+    const char* name,
+    const uint8_t name_len,
+    const uint64_t name_hash)
+{
+    for (size_t i = name_hash;; i++) {
+        struct CredentialSlot* slot = &store->slots[i & store->slot_mask];
+        if (ZERO == slot->name_len
+            || (name_hash == slot->name_hash
+                && name_len == slot->name_len
+                && ZERO == memcmp(&store->names[slot->name_offset], name, name_len))
+        ) {
+            return slot;
+        }
+    }
+}
+
+static char* read_whole_file(
+    const char* path,
+    size_t* len)
+{
+    FILE* file = fopen(path, "re");
+    if (NULL == file) {
+        return NULL;
+    }
+
+    size_t capacity = 4096;
+    char* data = malloc(capacity);
+    *len = ZERO;
+    while (NULL != data) {
+        *len += fread(&data[*len], 1, capacity - *len, file);
+        if (*len < capacity) {
+            break;
+        }
+        capacity *= 2;
+        char* grown = realloc(data, capacity);
+        if (NULL == grown) {
+            free(data);
+        }
+        data = grown;
+    }
+
+    if (NULL != data && ferror(file)) {
+        free(data);
+        data = NULL;
+    }
+    const int _ignored = fclose(file);
+    return data;
+}
+
+static int store_insert(
+    struct CredentialStore* store,
+    const char* name,
+    const size_t name_len,
+    const char* password,
+    const size_t password_len)
+{
+    if (ZERO == name_len || name_len > UINT8_MAX
+        || ZERO == password_len || password_len > UINT8_MAX
+    ) {
+        return ERR;
+    }
+
+    const uint64_t name_hash = siphash(store->name_key, name, name_len);
+    struct CredentialSlot* slot =
+        store_slot_of(
+            store,
+            name,
+            name_len,
+            name_hash
+        );
+    /* the first of a name's lines stands */
+    if (ZERO != slot->name_len) {
+        return OK;
+    }
+
+    slot->name_hash = name_hash;
+    slot->password_hash = siphash(store->password_key, password, password_len);
+    slot->name_offset = store->names_len;
+    slot->name_len = name_len;
+    const void* _ = memcpy(&store->names[store->names_len], name, name_len);
+    store->names_len += name_len;
+    return OK;
+}
+
+/* calls insert, if given, with each line; returns how many lines there are, ERR if one is malformed */
+static ptrdiff_t store_parse_lines(
+    struct CredentialStore* store,
+    const char* data,
+    const size_t len)
+{
+    ptrdiff_t count = 0;
+    for (size_t i = 0; i < len;) {
+        const char* line = &data[i];
+        const char* newline = memchr(line, '\n', len - i);
+        size_t line_len = NULL == newline ? len - i : (size_t)(newline - line);
+        i += line_len + 1;
+
+        if (line_len > 0 && '\r' == line[line_len - 1]) {
+            line_len--;
+        }
+        if (ZERO == line_len || '#' == line[0]) {
+            continue;
+        }
+
+        const char* colon = memchr(line, ':', line_len);
+        if (NULL == colon) {
+            return ERR;
+        }
+
+        count++;
+        if (NULL != store
+            && OK !=
+            store_insert(
+                store,
+                line,
+                colon - line,
+                colon + 1,
+                line_len - (colon - line) - 1
+            )
+        ) {
+            return ERR;
+        }
+    }
+    return count;
+}
+
+struct CredentialStore* credential_store_load(
+    const char* path)
+{
+    size_t len = ZERO;
+    char* data = read_whole_file(path, &len);
+    if (NULL == data) {
+        return NULL;
+    }
+
+    struct CredentialStore* store = NULL;
+    const ptrdiff_t count = store_parse_lines(NULL, data, len);
+    if (ERR != count) {
+        store = calloc(1, sizeof(struct CredentialStore));
+    }
+
+    /* at most half full */
+    size_t slot_count = 2;
+    while (slot_count < 2 * (size_t)count) {
+        slot_count <<= 1;
+    }
+
+    if (NULL != store) {
+        store->slot_mask = slot_count - 1;
+        store->slots = calloc(slot_count, sizeof(struct CredentialSlot));
+        store->names = malloc(len + 1);
+    }
+
+    if (NULL == store
+        || NULL == store->slots
+        || NULL == store->names
+        || sizeof(store->name_key) != getrandom(store->name_key, sizeof(store->name_key), ZERO)
+        || sizeof(store->password_key) != getrandom(store->password_key, sizeof(store->password_key), ZERO)
+        || sizeof(store->failure_key) != getrandom(store->failure_key, sizeof(store->failure_key), ZERO)
+        || ERR == store_parse_lines(store, data, len)
+    ) {
+        if (NULL != store) {
+            free(store->slots);
+            free(store->names);
+            free(store);
+        }
+        store = NULL;
+    }
+
+    /* the passwords in the clear go no further */
+    explicit_bzero(data, len);
+    free(data);
+    return store;
+}
+
+struct FailedAuthCache* failed_auth_cache_construct(void)
+{
+    return calloc(1, sizeof(struct FailedAuthCache));
+}
+
+size_t credential_store_user_capacity(
+    const struct CredentialStore* store)
+{
+    return store->slot_mask + 1;
+}
+
+static uint64_t failure_key_of(
+    const struct CredentialStore* store,
+    const struct sockaddr_storage* source,
+    const char* name,
+    const uint8_t name_len)
+{
+    /* the host, not the port: a retry comes from a new connection */
+    char key[SIXTEEN + UINT8_MAX] = {0};
+    if (AF_INET6 == source->ss_family) {
+        const void* _ = memcpy(key, &((const struct sockaddr_in6*)source)->sin6_addr, SIXTEEN);
+    } else if (AF_INET == source->ss_family) {
+        const void* _ = memcpy(key, &((const struct sockaddr_in*)source)->sin_addr, FOUR);
+    }
+    const void* _ = memcpy(&key[SIXTEEN], name, name_len);
+
+    const uint64_t hash = siphash(store->failure_key, key, SIXTEEN + name_len);
+    return ZERO == hash ? 1 : hash;
+}
+
+bool credential_store_authenticate(
+    const struct CredentialStore* store,
+    struct FailedAuthCache* failures,
+    const struct sockaddr_storage* source,
+    const char* name,
+    const uint8_t name_len,
+    const char* password,
+    const uint8_t password_len,
+    const int64_t now_ms,
+    size_t* user)
+{
+    const uint64_t failure_key =
+        failure_key_of(
+            store,
+            source,
+            name,
+            name_len
+        );
+    struct FailedAuth* failed =
+        &failures->entries[failure_key & (FAILED_AUTH_SLOTS - 1)];
+    if (failure_key == failed->key && now_ms < failed->expires_ms) {
+        return false;
+    }
+
+    /* hashed whether or not the name is known, so timing doesn't tell */
+    const uint64_t password_hash = siphash(store->password_key, password, password_len);
+    const struct CredentialSlot* slot =
+        store_slot_of(
+            store,
+            name,
+            name_len,
+            siphash(store->name_key, name, name_len)
+        );
+    if (ZERO != slot->name_len && password_hash == slot->password_hash) {
+        *user = slot - store->slots;
+        return true;
+    }
+
+    failed->key = failure_key;
+    failed->expires_ms = now_ms + FAILED_AUTH_MS;
+    return false;
+}
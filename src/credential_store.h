@@ -0,0 +1,39 @@
+#ifndef _CREDENTIAL_STORE_H_
+#define _CREDENTIAL_STORE_H_
+
+#include "rfc1928socks5.h"
+
+/*
+    RFC 1929 users, loaded once and only read after: one store may be
+    shared by every shard. Names index an open-addressing table; each
+    holds a keyed hash of its password, never the password itself.
+    Failures are remembered per server, by source host and name, so
+    retrying them is turned away before any lookup.
+*/
+
+/* "name:password" per line; blank lines and lines starting with '#' are skipped */
+struct CredentialStore* credential_store_load(
+    const char* path
+);
+
+struct FailedAuthCache* failed_auth_cache_construct(void);
+
+/* users are numbered below this, for anything kept per user */
+size_t credential_store_user_capacity(
+    const struct CredentialStore* store
+);
+
+/* user: set to the user's number when authenticated */
+bool credential_store_authenticate(
+    const struct CredentialStore* store,
+    struct FailedAuthCache* failures,
+    const struct sockaddr_storage* source,
+    const char* name,
+    const uint8_t name_len,
+    const char* password,
+    const uint8_t password_len,
+    const int64_t now_ms,
+    size_t* user
+);
+
+#endif
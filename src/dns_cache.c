@@ -0,0 +1,337 @@
+#include "dns_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+enum {OK=0,ERR=-1};
+enum {ZERO=0};
+
+/* entries per set; a name can live in any way of the set its hash picks */
+enum {DNS_CACHE_WAYS=4};
+enum {DNS_CACHE_ADDRESSES=8};
+enum {DNS_CACHE_READ_TRIES=4};
+
+/* RFC 8767 4: a cap on TTLs; a day is what most resolvers settled on */
+enum {DNS_CACHE_MAX_TTL_S=86400};
+/* RFC 2308 5: negative answers last as long as the SOA says, bounded here */
+enum {DNS_CACHE_MAX_NEGATIVE_TTL_S=60};
+/* RFC 9520 3.2: resolution failures are cached at least 1 s */
+enum {DNS_CACHE_FAILURE_TTL_S=5};
+/* a hit within the last tenth of the TTL refreshes the entry, as unbound's prefetch does */
+enum {DNS_CACHE_PREFETCH_DIVISOR=10};
+
+struct DnsCacheAddress
+{
+    uint8_t family;
+    uint8_t bytes[16];
+};
+
+/* everything the sequence count guards; readers copy it out whole */
+struct DnsCacheRecord
+{
+    uint32_t name_hash;
+    uint32_t ttl_s;
+    int64_t expires_ms;
+    uint8_t status;
+    uint8_t address_count;
+    uint8_t name_len;
+    struct DnsCacheAddress addresses[DNS_CACHE_ADDRESSES];
+    char name[DNS_MAX_NAME + 1];
+};
+
+struct DnsCacheEntry
+{
+    /* odd while a writer is rewriting the record */
+    uint32_t sequence;
+    /* claimed by the one reader that is to refresh the record */
+    uint32_t prefetching;
+    struct DnsCacheRecord record;
+};
+
+struct DnsCache
+{
+    struct DnsCacheEntry* entries;
+    size_t set_mask;
+};
+
+struct DnsCache* dns_cache_construct(
+    const size_t capacity)
+{
+    size_t set_count = 1;
+    while (set_count * DNS_CACHE_WAYS < capacity) {
+        set_count <<= 1;
+    }
+
+    struct DnsCache* cache =
+        calloc(
+            1,
+            sizeof(struct DnsCache)
+        );
+    if (NULL == cache) {
+        return NULL;
+    }
+
+    cache->entries =
+        calloc(
+            set_count * DNS_CACHE_WAYS,
+            sizeof(struct DnsCacheEntry)
+        );
+    if (NULL == cache->entries) {
+        free(cache);
+        return NULL;
+    }
+
+    cache->set_mask = set_count - 1;
+    return cache;
+}
+
+static struct DnsCacheEntry* cache_set_of(
+    struct DnsCache* cache,
+    const uint32_t name_hash)
+{
+    return &cache->entries[(name_hash & cache->set_mask) * DNS_CACHE_WAYS];
+}
+
+/* false when every try raced a writer */
+static bool entry_read(
+    const struct DnsCacheEntry* entry,
+    struct DnsCacheRecord* record)
+{
+    for (int i = 0; i < DNS_CACHE_READ_TRIES; i++) {
+        const uint32_t before =
+            __atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            continue;
+        }
+
+        const void* _ = memcpy(record, &entry->record, sizeof(*record));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (before == __atomic_load_n(&entry->sequence, __ATOMIC_RELAXED)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* a cheap, possibly torn, peek that rules out most ways before a full read */
+static bool entry_may_hold(
+    const struct DnsCacheEntry* entry,
+    const uint32_t name_hash)
+{
+    return name_hash ==
+        __atomic_load_n(&entry->record.name_hash, __ATOMIC_RELAXED);
+}
+
+static bool record_holds(
+    const struct DnsCacheRecord* record,
+    const char* name,
+    const size_t name_len,
+    const uint32_t name_hash)
+{
+    return record->name_hash == name_hash
+        && record->name_len == name_len
+        && ZERO == memcmp(record->name, name, name_len);
+}
+
+enum DnsCacheLookup dns_cache_lookup(
+    struct DnsCache* cache,
+    const char* name,
+    const size_t name_len,
+    const uint32_t name_hash,
+    const int64_t now_ms,
+    struct DnsAnswer* answer)
+{
+    struct DnsCacheEntry* set = cache_set_of(cache, name_hash);
+
+    for (int way = 0; way < DNS_CACHE_WAYS; way++) {
+        struct DnsCacheEntry* entry = &set[way];
+        if (!entry_may_hold(entry, name_hash)) {
+            continue;
+        }
+
+        struct DnsCacheRecord record;
+        if (!entry_read(entry, &record)
+            || !record_holds(&record, name, name_len, name_hash)
+        ) {
+            continue;
+        }
+
+        if (now_ms >= record.expires_ms) {
+            return DNS_CACHE_MISS;
+        }
+
+        answer->status = record.status;
+        answer->ttl = (uint32_t)((record.expires_ms - now_ms) / 1000);
+        answer->address_count = record.address_count;
+        for (size_t i = 0; i < record.address_count; i++) {
+            struct sockaddr_storage* dst = &answer->addresses[i];
+            const void* _ = memset(dst, ZERO, sizeof(*dst));
+            if (AF_INET == record.addresses[i].family) {
+                struct sockaddr_in* in = (struct sockaddr_in*)dst;
+                in->sin_family = AF_INET;
+                _ = memcpy(&in->sin_addr, record.addresses[i].bytes, sizeof(in->sin_addr));
+            } else {
+                struct sockaddr_in6* in6 = (struct sockaddr_in6*)dst;
+                in6->sin6_family = AF_INET6;
+                _ = memcpy(&in6->sin6_addr, record.addresses[i].bytes, sizeof(in6->sin6_addr));
+            }
+        }
+
+        const int64_t prefetch_from_ms =
+            record.expires_ms
+            - (int64_t)record.ttl_s * 1000 / DNS_CACHE_PREFETCH_DIVISOR;
+        uint32_t unclaimed = ZERO;
+        if (DNS_ANSWER_OK == record.status
+            && now_ms >= prefetch_from_ms
+            && ZERO == __atomic_load_n(&entry->prefetching, __ATOMIC_RELAXED)
+            && __atomic_compare_exchange_n(
+                &entry->prefetching,
+                &unclaimed,
+                1,
+                false,
+                __ATOMIC_ACQ_REL,
+                __ATOMIC_RELAXED
+            )
+        ) {
+            return DNS_CACHE_HIT_PREFETCH;
+        }
+
+        return DNS_CACHE_HIT;
+    }
+
+    return DNS_CACHE_MISS;
+}
+
+static uint32_t cache_ttl_of_answer(
+    const struct DnsAnswer* answer)
+{
+    switch (answer->status) {
+        case DNS_ANSWER_OK:
+            return answer->ttl < DNS_CACHE_MAX_TTL_S
+                ? answer->ttl
+                : DNS_CACHE_MAX_TTL_S;
+        case DNS_ANSWER_NO_ADDRESS:
+            return answer->ttl < DNS_CACHE_MAX_NEGATIVE_TTL_S
+                ? answer->ttl
+                : DNS_CACHE_MAX_NEGATIVE_TTL_S;
+        case DNS_ANSWER_SERVER_FAILURE:
+        case DNS_ANSWER_TIMEOUT:
+        default:
+            return DNS_CACHE_FAILURE_TTL_S;
+    }
+}
+
+/*
+    The way to overwrite: the name's own, else an empty or expired one,
+    else the one closest to expiry. NULL when a live answer is in the
+    way of a failure: a refresh that failed keeps serving the old one.
+*/
+static struct DnsCacheEntry* cache_victim_of(
+    struct DnsCache* cache,
+    const char* name,
+    const size_t name_len,
+    const uint32_t name_hash,
+    const int64_t now_ms,
+    const enum DnsAnswerStatus status)
+{
+    struct DnsCacheEntry* set = cache_set_of(cache, name_hash);
+    struct DnsCacheEntry* victim = NULL;
+    int64_t victim_expires_ms = INT64_MAX;
+
+    for (int way = 0; way < DNS_CACHE_WAYS; way++) {
+        struct DnsCacheEntry* entry = &set[way];
+        struct DnsCacheRecord record;
+        if (!entry_read(entry, &record)) {
+            continue;
+        }
+
+        if (record_holds(&record, name, name_len, name_hash)) {
+            return DNS_ANSWER_OK != status
+                && DNS_ANSWER_OK == record.status
+                && now_ms < record.expires_ms
+                ? NULL
+                : entry;
+        }
+
+        const int64_t expires_ms =
+            now_ms >= record.expires_ms
+            ? INT64_MIN
+            : record.expires_ms;
+        if (expires_ms < victim_expires_ms) {
+            victim = entry;
+            victim_expires_ms = expires_ms;
+        }
+    }
+
+    return victim;
+}
+
+void dns_cache_store(
+    struct DnsCache* cache,
+    const char* name,
+    const size_t name_len,
+    const uint32_t name_hash,
+    const int64_t now_ms,
+    const struct DnsAnswer* answer)
+{
+    const uint32_t ttl_s = cache_ttl_of_answer(answer);
+    if (ZERO == ttl_s || name_len > DNS_MAX_NAME) {
+        return;
+    }
+
+    struct DnsCacheEntry* entry =
+        cache_victim_of(
+            cache,
+            name,
+            name_len,
+            name_hash,
+            now_ms,
+            answer->status
+        );
+    if (NULL == entry) {
+        return;
+    }
+
+    /* another shard is writing this entry; losing one store costs a lookup, not a wait */
+    uint32_t sequence =
+        __atomic_load_n(&entry->sequence, __ATOMIC_RELAXED);
+    if ((sequence & 1)
+        || !__atomic_compare_exchange_n(
+            &entry->sequence,
+            &sequence,
+            sequence + 1,
+            false,
+            __ATOMIC_ACQ_REL,
+            __ATOMIC_RELAXED
+        )
+    ) {
+        return;
+    }
+
+    struct DnsCacheRecord* record = &entry->record;
+    __atomic_store_n(&record->name_hash, name_hash, __ATOMIC_RELAXED);
+    record->ttl_s = ttl_s;
+    record->expires_ms = now_ms + (int64_t)ttl_s * 1000;
+    record->status = answer->status;
+    record->name_len = (uint8_t)name_len;
+    const void* _ = memcpy(record->name, name, name_len);
+
+    record->address_count = ZERO;
+    for (size_t i = 0;
+        i < answer->address_count && record->address_count < DNS_CACHE_ADDRESSES;
+        i++
+    ) {
+        const struct sockaddr_storage* src = &answer->addresses[i];
+        struct DnsCacheAddress* dst = &record->addresses[record->address_count++];
+        dst->family = (uint8_t)src->ss_family;
+        if (AF_INET == src->ss_family) {
+            _ = memcpy(dst->bytes, &((const struct sockaddr_in*)src)->sin_addr, 4);
+        } else {
+            _ = memcpy(dst->bytes, &((const struct sockaddr_in6*)src)->sin6_addr, 16);
+        }
+    }
+
+    __atomic_store_n(&entry->sequence, sequence + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&entry->prefetching, ZERO, __ATOMIC_RELEASE);
+}
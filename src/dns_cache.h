@@ -0,0 +1,43 @@
+#ifndef _DNS_CACHE_H_
+#define _DNS_CACHE_H_
+
+#include "dns_resolver.h"
+
+/*
+    Answers by name, shared by every shard. Readers take no lock: each
+    entry is guarded by a sequence count that writers make odd while
+    they rewrite it, and a read that raced a write is simply retried.
+*/
+
+enum DnsCacheLookup
+{
+    DNS_CACHE_MISS,
+    DNS_CACHE_HIT,
+    /* a hit in the last part of its TTL; the caller is to refresh it */
+    DNS_CACHE_HIT_PREFETCH
+};
+
+struct DnsCache* dns_cache_construct(
+    const size_t capacity
+);
+
+/* name as normalized by the resolver; fills answer on a hit */
+enum DnsCacheLookup dns_cache_lookup(
+    struct DnsCache* cache,
+    const char* name,
+    const size_t name_len,
+    const uint32_t name_hash,
+    const int64_t now_ms,
+    struct DnsAnswer* answer
+);
+
+void dns_cache_store(
+    struct DnsCache* cache,
+    const char* name,
+    const size_t name_len,
+    const uint32_t name_hash,
+    const int64_t now_ms,
+    const struct DnsAnswer* answer
+);
+
+#endif
@@ -0,0 +1,1541 @@
+#define _GNU_SOURCE
+#include "dns_resolver.h"
+#include "dns_cache.h"
+#include "socket_context.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/random.h>
+#include <assert.h>
+
+enum {OK=0,ERR=-1};
+enum {ZERO=0};
+
+/*
+    RFC 1035 4.1.1. Header section format
+
+                                    1  1  1  1  1  1
+      0  1  2  3  4  5  6  7  8  9  0  1  2  3  4  5
+    +--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+
+    |                      ID                       |
+    +--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+
+    |QR|   Opcode  |AA|TC|RD|RA|   Z    |   RCODE   |
+    +--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+
+    |                    QDCOUNT                    |
+    +--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+
+    |                    ANCOUNT                    |
+    +--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+
+    |                    NSCOUNT                    |
+    +--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+
+    |                    ARCOUNT                    |
+    +--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+
+*/
+enum {DNS_HEADER_SPACE=12};
+enum {DNS_FLAG_QR=0x8000, DNS_FLAG_TC=0x0200, DNS_FLAG_RD=0x0100};
+enum {DNS_OPCODE_MASK=0x7800, DNS_RCODE_MASK=0x000F};
+enum {DNS_RCODE_NOERROR=0, DNS_RCODE_NXDOMAIN=3};
+enum {DNS_TYPE_A=1, DNS_TYPE_SOA=6, DNS_TYPE_AAAA=28, DNS_TYPE_OPT=41, DNS_CLASS_IN=1};
+
+enum {DNS_PORT=53};
+enum {DNS_MAX_LABEL=63};
+/* RFC 6891 OPT pseudo-RR: root name, type, class (payload), ttl, rdlen */
+enum {DNS_OPT_RR_SPACE=1 + 2 + 2 + 4 + 2};
+/* the payload size DNS flag day 2020 settled on; large answers come over TCP */
+enum {DNS_EDNS_UDP_PAYLOAD=1232};
+enum {DNS_MAX_QUERY_SPACE=DNS_HEADER_SPACE + DNS_MAX_NAME + 2 + 4 + DNS_OPT_RR_SPACE};
+enum {DNS_MAX_DATAGRAM=4096};
+enum {DNS_TCP_LENGTH_SPACE=2};
+
+enum {DNS_UDP_TIMEOUT_MS=1500, DNS_UDP_ATTEMPTS=3, DNS_TCP_TIMEOUT_MS=5000};
+/* RFC 8305 3. Resolution Delay: once one family has answered, the other gets this long */
+enum {DNS_SIBLING_GRACE_MS=50};
+
+enum {DNS_LOOKUP_BUCKETS=1024};
+
+enum {DNS_QUERY_A, DNS_QUERY_AAAA, DNS_QUERY_COUNT};
+
+static_assert(
+    _Alignof(struct DnsSocket) > SOCKET_CONTEXT_ROLE_MASK,
+    "socket role is kept in the low bits of the socket pointer"
+);
+
+struct DnsLookup;
+struct DnsQuery;
+
+struct DnsTcpStream
+{
+    /* first, so the subscription context can point at the stream itself */
+    struct DnsSocket socket;
+    struct DnsQuery* query;
+    bool connected;
+    char out[DNS_TCP_LENGTH_SPACE + DNS_MAX_QUERY_SPACE];
+    size_t out_len;
+    size_t out_sent;
+    char* in;
+    size_t in_len;
+    struct DnsTcpStream* next;
+};
+
+struct DnsQuery
+{
+    /*
+        The current UDP attempt's socket, fd ERR between attempts; first,
+        so the subscription context can point at the query itself.
+    */
+    struct DnsSocket udp;
+    struct DnsQuery* next_udp;
+    struct DnsLookup* lookup;
+    uint16_t qtype;
+    uint16_t id;
+    bool done;
+    enum DnsAnswerStatus status;
+    unsigned attempts;
+    int64_t deadline_ms;
+    bool deadline_armed;
+    struct DnsQuery* prev_deadline;
+    struct DnsQuery* next_deadline;
+    struct DnsTcpStream* stream;
+};
+
+struct DnsLookup
+{
+    char name[DNS_MAX_NAME + 1];
+    size_t name_len;
+    uint32_t name_hash;
+    struct DnsQuery queries[DNS_QUERY_COUNT];
+    struct DnsAnswer* answer;
+    /* from the SOA of a negative answer; ZERO without one */
+    uint32_t negative_ttl;
+    struct DnsWaiter* waiters;
+    struct DnsLookup* next;
+};
+
+struct DnsResolver
+{
+    struct Socks5Server* server;
+    DnsResolvedCallback on_resolved;
+    /* NULL: every lookup goes to the nameserver */
+    struct DnsCache* cache;
+    struct sockaddr_storage nameserver;
+    socklen_t nameserver_len;
+    /* with a UDP attempt's socket open */
+    struct DnsQuery* udp_queries;
+    struct DnsLookup* lookups[DNS_LOOKUP_BUCKETS];
+    /* ascending deadline */
+    struct DnsQuery* deadlines_head;
+    struct DnsQuery* deadlines_tail;
+    struct DnsTcpStream* streams;
+    uint64_t rng_state;
+    char datagram_space[DNS_MAX_DATAGRAM];
+};
+
+static int64_t now_ms(void)
+{
+    struct timespec ts = {0};
+    const int _ignored = clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+    xorshift64*: IDs only need to be unpredictable off-path. With the
+    random source port of each attempt's socket, a spoofer off-path has
+    about 32 bits to guess rather than 16 (RFC 5452 9.2).
+*/
+static uint16_t next_random_id(
+    struct DnsResolver* resolver)
+{
+    uint64_t x = resolver->rng_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    resolver->rng_state = x;
+    return (uint16_t)((x * 0x2545F4914F6CDD1DULL) >> 48);
+}
+
+static uint32_t hash_of_name(
+    const char* name,
+    const size_t name_len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < name_len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static char ascii_lower(
+    const char c)
+{
+    return c >= 'A' && c <= 'Z'
+        ? c - 'A' + 'a'
+        : c;
+}
+
+/* lower cased, trailing dot dropped; ERR unless every label is 1..63 octets */
+static int normalize_name(
+    const char* name,
+    size_t name_len,
+    char normalized[DNS_MAX_NAME + 1],
+    size_t* normalized_len)
+{
+    if (name_len > ZERO && '.' == name[name_len - 1]) {
+        name_len--;
+    }
+    if (ZERO == name_len || name_len > DNS_MAX_NAME) {
+        return ERR;
+    }
+
+    size_t label_len = ZERO;
+    for (size_t i = 0; i < name_len; i++) {
+        if ('.' == name[i]) {
+            if (ZERO == label_len) {
+                return ERR;
+            }
+            label_len = ZERO;
+        } else if (++label_len > DNS_MAX_LABEL) {
+            return ERR;
+        }
+        normalized[i] = ascii_lower(name[i]);
+    }
+    if (ZERO == label_len) {
+        return ERR;
+    }
+
+    normalized[name_len] = '\0';
+    *normalized_len = name_len;
+    return OK;
+}
+
+static struct DnsAnswer* construct_answer(void)
+{
+    struct DnsAnswer* answer =
+        calloc(
+            1,
+            sizeof(struct DnsAnswer)
+        );
+    if (NULL == answer) {
+        return NULL;
+    }
+    answer->refs = 1;
+    answer->ttl = UINT32_MAX;
+    return answer;
+}
+
+void dns_answer_release(
+    struct DnsAnswer* answer)
+{
+    if (NULL != answer && ZERO == --answer->refs) {
+        free(answer);
+    }
+}
+
+static void answer_add_address(
+    struct DnsAnswer* answer,
+    const int family,
+    const void* address)
+{
+    if (answer->address_count >= DNS_MAX_ADDRESSES) {
+        return;
+    }
+
+    struct sockaddr_storage* dst =
+        &answer->addresses[answer->address_count++];
+    const void* _ = memset(dst, ZERO, sizeof(*dst));
+
+    if (AF_INET == family) {
+        struct sockaddr_in* in = (struct sockaddr_in*)dst;
+        in->sin_family = AF_INET;
+        _ = memcpy(&in->sin_addr, address, sizeof(in->sin_addr));
+    } else {
+        struct sockaddr_in6* in6 = (struct sockaddr_in6*)dst;
+        in6->sin6_family = AF_INET6;
+        _ = memcpy(&in6->sin6_addr, address, sizeof(in6->sin6_addr));
+    }
+}
+
+/* an address literal sent as a DOMAINNAME needs no query */
+static struct DnsAnswer* answer_of_literal(
+    const char* name)
+{
+    struct in_addr in = {0};
+    struct in6_addr in6 = {0};
+    int family = AF_UNSPEC;
+    if (1 == inet_pton(AF_INET, name, &in)) {
+        family = AF_INET;
+    } else if (1 == inet_pton(AF_INET6, name, &in6)) {
+        family = AF_INET6;
+    } else {
+        return NULL;
+    }
+
+    struct DnsAnswer* answer = construct_answer();
+    if (NULL == answer) {
+        return NULL;
+    }
+    answer_add_address(
+        answer,
+        family,
+        AF_INET == family ? (const void*)&in : (const void*)&in6
+    );
+    answer->ttl = ZERO;
+    return answer;
+}
+
+static int sockaddr_of_nameserver_line(
+    const char* line,
+    struct sockaddr_storage* address,
+    socklen_t* address_len)
+{
+    char host[INET6_ADDRSTRLEN] = {0};
+    if (1 != sscanf(line, " nameserver %45s", host)) {
+        return ERR;
+    }
+
+    const void* _ = memset(address, ZERO, sizeof(*address));
+
+    struct sockaddr_in* in = (struct sockaddr_in*)address;
+    if (1 == inet_pton(AF_INET, host, &in->sin_addr)) {
+        in->sin_family = AF_INET;
+        in->sin_port = htons(DNS_PORT);
+        *address_len = sizeof(*in);
+        return OK;
+    }
+
+    struct sockaddr_in6* in6 = (struct sockaddr_in6*)address;
+    if (1 == inet_pton(AF_INET6, host, &in6->sin6_addr)) {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(DNS_PORT);
+        *address_len = sizeof(*in6);
+        return OK;
+    }
+
+    return ERR;
+}
+
+/* first nameserver of /etc/resolv.conf, else 127.0.0.1 */
+static void default_nameserver(
+    struct sockaddr_storage* address,
+    socklen_t* address_len)
+{
+    FILE* resolv_conf = fopen("/etc/resolv.conf", "re");
+    if (NULL != resolv_conf) {
+        char line[256];
+        while (NULL != fgets(line, sizeof(line), resolv_conf)) {
+            if (OK ==
+                sockaddr_of_nameserver_line(
+                    line,
+                    address,
+                    address_len
+                )
+            ) {
+                const int _ignored = fclose(resolv_conf);
+                return;
+            }
+        }
+        const int _ignored = fclose(resolv_conf);
+    }
+
+    const void* _ = memset(address, ZERO, sizeof(*address));
+    struct sockaddr_in* in = (struct sockaddr_in*)address;
+    in->sin_family = AF_INET;
+    in->sin_port = htons(DNS_PORT);
+    in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    *address_len = sizeof(*in);
+}
+
+struct DnsResolver* dns_resolver_construct(
+    struct Socks5Server* server,
+    DnsResolvedCallback on_resolved)
+{
+    struct DnsResolver* resolver =
+        calloc(
+            1,
+            sizeof(struct DnsResolver)
+        );
+    if (NULL == resolver) {
+        return NULL;
+    }
+
+    resolver->server = server;
+    resolver->on_resolved = on_resolved;
+    resolver->cache = server->cfg.dns_cache;
+    resolver->udp_queries = NULL;
+
+    if (server->cfg.dns_nameserver_len > ZERO) {
+        resolver->nameserver = server->cfg.dns_nameserver;
+        resolver->nameserver_len = server->cfg.dns_nameserver_len;
+    } else {
+        default_nameserver(
+            &resolver->nameserver,
+            &resolver->nameserver_len
+        );
+    }
+
+    if (sizeof(resolver->rng_state) !=
+        getrandom(
+            &resolver->rng_state,
+            sizeof(resolver->rng_state),
+            GRND_NONBLOCK
+        )
+    ) {
+        resolver->rng_state = (uint64_t)now_ms() ^ ((uint64_t)getpid() << 32);
+    }
+    resolver->rng_state |= 1;
+
+    return resolver;
+}
+
+static void* context_of_socket(
+    struct DnsSocket* socket)
+{
+    return socket_context_of(socket, SOCKET_CONTEXT_RESOLVER);
+}
+
+static void query_close_udp(
+    struct DnsResolver* resolver,
+    struct DnsQuery* query)
+{
+    if (ERR == query->udp.fd) {
+        return;
+    }
+
+    struct DnsQuery** link = &resolver->udp_queries;
+    while (NULL != *link && query != *link) {
+        link = &(*link)->next_udp;
+    }
+    if (NULL != *link) {
+        *link = query->next_udp;
+    }
+    query->next_udp = NULL;
+
+    const int _ignored =
+        resolver->server->cfg.unsubscribe_socket(
+            resolver->server,
+            query->udp.fd
+        );
+    const int _ignored_too = close(query->udp.fd);
+    query->udp.fd = ERR;
+}
+
+/*
+    A socket per attempt, never bound: the kernel gives each a random
+    ephemeral port as it connects (RFC 5452 9.2). Connected, it only
+    hears back from the nameserver's address and port.
+*/
+static int query_open_udp(
+    struct DnsResolver* resolver,
+    struct DnsQuery* query)
+{
+    query_close_udp(resolver, query);
+
+    const int socket_fd =
+        socket(
+            resolver->nameserver.ss_family,
+            SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            ZERO
+        );
+    if (ERR == socket_fd) {
+        return ERR;
+    }
+
+    if (OK !=
+        connect(
+            socket_fd,
+            (const struct sockaddr*)&resolver->nameserver,
+            resolver->nameserver_len
+        )
+    ) {
+        const int _ignored = close(socket_fd);
+        return ERR;
+    }
+
+    if (OK !=
+        resolver->server->cfg.subscribe_socket(
+            resolver->server,
+            socket_fd,
+            FDIOEVENT_READABLE,
+            context_of_socket(&query->udp)
+        )
+    ) {
+        const int _ignored = close(socket_fd);
+        return ERR;
+    }
+
+    query->udp.fd = socket_fd;
+    query->next_udp = resolver->udp_queries;
+    resolver->udp_queries = query;
+    return OK;
+}
+
+static void query_unarm_deadline(
+    struct DnsResolver* resolver,
+    struct DnsQuery* query)
+{
+    if (!query->deadline_armed) {
+        return;
+    }
+
+    if (NULL != query->prev_deadline) {
+        query->prev_deadline->next_deadline = query->next_deadline;
+    } else {
+        resolver->deadlines_head = query->next_deadline;
+    }
+    if (NULL != query->next_deadline) {
+        query->next_deadline->prev_deadline = query->prev_deadline;
+    } else {
+        resolver->deadlines_tail = query->prev_deadline;
+    }
+
+    query->prev_deadline = NULL;
+    query->next_deadline = NULL;
+    query->deadline_armed = false;
+}
+
+/* deadlines are mostly "now + constant", so the insertion point is almost always the tail */
+static void query_arm_deadline(
+    struct DnsResolver* resolver,
+    struct DnsQuery* query,
+    const int64_t deadline_ms)
+{
+    query_unarm_deadline(resolver, query);
+
+    query->deadline_ms = deadline_ms;
+    query->deadline_armed = true;
+
+    struct DnsQuery* before = resolver->deadlines_tail;
+    while (NULL != before && before->deadline_ms > deadline_ms) {
+        before = before->prev_deadline;
+    }
+
+    query->prev_deadline = before;
+    query->next_deadline =
+        NULL == before
+        ? resolver->deadlines_head
+        : before->next_deadline;
+
+    if (NULL != query->next_deadline) {
+        query->next_deadline->prev_deadline = query;
+    } else {
+        resolver->deadlines_tail = query;
+    }
+    if (NULL != before) {
+        before->next_deadline = query;
+    } else {
+        resolver->deadlines_head = query;
+    }
+}
+
+static void write_u16(
+    char* space,
+    const uint16_t value)
+{
+    space[0] = (char)(value >> 8);
+    space[1] = (char)(value & 0xFF);
+}
+
+static uint16_t read_u16(
+    const char* space)
+{
+    return (uint16_t)(((uint8_t)space[0] << 8) | (uint8_t)space[1]);
+}
+
+static uint32_t read_u32(
+    const char* space)
+{
+    return ((uint32_t)read_u16(space) << 16) | read_u16(&space[2]);
+}
+
+/*
+    RFC 1035 4.1.2. Question section format: QNAME as length prefixed
+    labels, QTYPE, QCLASS; then an RFC 6891 OPT record advertising
+    DNS_EDNS_UDP_PAYLOAD.
+*/
+static size_t encode_query(
+    char space[DNS_MAX_QUERY_SPACE],
+    const struct DnsQuery* query)
+{
+    const struct DnsLookup* lookup = query->lookup;
+
+    write_u16(&space[0], query->id);
+    write_u16(&space[2], DNS_FLAG_RD);
+    write_u16(&space[4], 1);
+    write_u16(&space[6], ZERO);
+    write_u16(&space[8], ZERO);
+    write_u16(&space[10], 1);
+
+    size_t i = DNS_HEADER_SPACE;
+    size_t label_start = ZERO;
+    for (size_t j = 0; j <= lookup->name_len; j++) {
+        if (j == lookup->name_len || '.' == lookup->name[j]) {
+            const size_t label_len = j - label_start;
+            space[i++] = (char)label_len;
+            const void* _ =
+                memcpy(
+                    &space[i],
+                    &lookup->name[label_start],
+                    label_len
+                );
+            i += label_len;
+            label_start = j + 1;
+        }
+    }
+    space[i++] = ZERO;
+
+    write_u16(&space[i], query->qtype);
+    write_u16(&space[i + 2], DNS_CLASS_IN);
+    i += 4;
+
+    space[i++] = ZERO;
+    write_u16(&space[i], DNS_TYPE_OPT);
+    write_u16(&space[i + 2], DNS_EDNS_UDP_PAYLOAD);
+    write_u16(&space[i + 4], ZERO);
+    write_u16(&space[i + 6], ZERO);
+    write_u16(&space[i + 8], ZERO);
+    i += 10;
+
+    return i;
+}
+
+static void stream_close(
+    struct DnsResolver* resolver,
+    struct DnsTcpStream* stream)
+{
+    struct DnsTcpStream** link = &resolver->streams;
+    while (NULL != *link && stream != *link) {
+        link = &(*link)->next;
+    }
+    if (NULL != *link) {
+        *link = stream->next;
+    }
+
+    const int _ignored =
+        resolver->server->cfg.unsubscribe_socket(
+            resolver->server,
+            stream->socket.fd
+        );
+    const int _ignored_too = close(stream->socket.fd);
+
+    if (NULL != stream->query) {
+        stream->query->stream = NULL;
+    }
+    free(stream->in);
+    free(stream);
+}
+
+static void lookup_complete(
+    struct DnsResolver* resolver,
+    struct DnsLookup* lookup);
+
+static void query_finish(
+    struct DnsResolver* resolver,
+    struct DnsQuery* query,
+    const enum DnsAnswerStatus status)
+{
+    if (query->done) {
+        return;
+    }
+
+    query_close_udp(resolver, query);
+    query_unarm_deadline(resolver, query);
+    if (NULL != query->stream) {
+        stream_close(resolver, query->stream);
+    }
+
+    query->done = true;
+    query->status = status;
+
+    struct DnsLookup* lookup = query->lookup;
+    bool all_done = true;
+    for (int i = 0; i < DNS_QUERY_COUNT; i++) {
+        struct DnsQuery* sibling = &lookup->queries[i];
+        if (sibling->done) {
+            continue;
+        }
+        all_done = false;
+
+        if (DNS_ANSWER_OK == status && sibling->deadline_armed) {
+            const int64_t grace_deadline = now_ms() + DNS_SIBLING_GRACE_MS;
+            sibling->attempts = DNS_UDP_ATTEMPTS;
+            if (grace_deadline < sibling->deadline_ms) {
+                query_arm_deadline(resolver, sibling, grace_deadline);
+            }
+        }
+    }
+
+    if (all_done) {
+        lookup_complete(resolver, lookup);
+    }
+}
+
+static void query_send_udp(
+    struct DnsResolver* resolver,
+    struct DnsQuery* query)
+{
+    query->attempts++;
+    query_arm_deadline(
+        resolver,
+        query,
+        now_ms() + DNS_UDP_TIMEOUT_MS
+    );
+
+    /* a fresh socket and ID per attempt: a late answer to an earlier one finds neither */
+    if (OK != query_open_udp(resolver, query)) {
+        return;
+    }
+    query->id = next_random_id(resolver);
+
+    char space[DNS_MAX_QUERY_SPACE];
+    const size_t len = encode_query(space, query);
+
+    /* a lost or refused datagram is retried from the deadline */
+    const ssize_t _ignored =
+        send(
+            query->udp.fd,
+            space,
+            len,
+            MSG_NOSIGNAL
+        );
+}
+
+static int stream_flush(
+    struct DnsResolver* resolver,
+    struct DnsTcpStream* stream)
+{
+    while (stream->out_sent < stream->out_len) {
+        const ssize_t sent =
+            send(
+                stream->socket.fd,
+                &stream->out[stream->out_sent],
+                stream->out_len - stream->out_sent,
+                MSG_NOSIGNAL
+            );
+        if (ERR == sent && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+            return OK;
+        } else if (ERR == sent && EINTR == errno) {
+            continue;
+        } else if (ERR == sent) {
+            return ERR;
+        }
+        stream->out_sent += sent;
+    }
+
+    return resolver->server->cfg.modify_socket_interest(
+        resolver->server,
+        stream->socket.fd,
+        FDIOEVENT_READABLE,
+        context_of_socket(&stream->socket)
+    );
+}
+
+/* RFC 7766: a truncated UDP answer is asked for again over TCP */
+static void query_send_tcp(
+    struct DnsResolver* resolver,
+    struct DnsQuery* query)
+{
+    query_arm_deadline(
+        resolver,
+        query,
+        now_ms() + DNS_TCP_TIMEOUT_MS
+    );
+
+    struct DnsTcpStream* stream =
+        calloc(
+            1,
+            sizeof(struct DnsTcpStream)
+        );
+    if (NULL == stream) {
+        return query_finish(resolver, query, DNS_ANSWER_SERVER_FAILURE);
+    }
+
+    stream->socket.tcp = true;
+    stream->socket.fd =
+        socket(
+            resolver->nameserver.ss_family,
+            SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            ZERO
+        );
+    if (ERR == stream->socket.fd) {
+        free(stream);
+        return query_finish(resolver, query, DNS_ANSWER_SERVER_FAILURE);
+    }
+
+    if (OK !=
+        connect(
+            stream->socket.fd,
+            (const struct sockaddr*)&resolver->nameserver,
+            resolver->nameserver_len
+        )
+        && EINPROGRESS != errno
+    ) {
+        const int _ignored = close(stream->socket.fd);
+        free(stream);
+        return query_finish(resolver, query, DNS_ANSWER_SERVER_FAILURE);
+    }
+
+    if (OK !=
+        resolver->server->cfg.subscribe_socket(
+            resolver->server,
+            stream->socket.fd,
+            FDIOEVENT_READABLE | FDIOEVENT_WRITABLE,
+            context_of_socket(&stream->socket)
+        )
+    ) {
+        const int _ignored = close(stream->socket.fd);
+        free(stream);
+        return query_finish(resolver, query, DNS_ANSWER_SERVER_FAILURE);
+    }
+
+    const size_t len =
+        encode_query(
+            &stream->out[DNS_TCP_LENGTH_SPACE],
+            query
+        );
+    write_u16(&stream->out[0], (uint16_t)len);
+    stream->out_len = DNS_TCP_LENGTH_SPACE + len;
+
+    stream->query = query;
+    query->stream = stream;
+    stream->next = resolver->streams;
+    resolver->streams = stream;
+}
+
+/* advances *i past a possibly compressed name; ERR when it runs off the message */
+static int skip_name(
+    const char* message,
+    const size_t len,
+    size_t* i)
+{
+    while (*i < len) {
+        const uint8_t label_len = (uint8_t)message[*i];
+        if (ZERO == label_len) {
+            *i += 1;
+            return OK;
+        }
+        if ((label_len & 0xC0) == 0xC0) {
+            *i += 2;
+            return *i <= len ? OK : ERR;
+        }
+        *i += 1 + label_len;
+    }
+    return ERR;
+}
+
+/* the question must echo ours; anything else is a stray or spoofed answer */
+static int match_question(
+    const char* message,
+    const size_t len,
+    const struct DnsQuery* query,
+    size_t* i)
+{
+    const struct DnsLookup* lookup = query->lookup;
+
+    size_t name_i = ZERO;
+    while (*i < len) {
+        const uint8_t label_len = (uint8_t)message[(*i)++];
+        if (ZERO == label_len) {
+            break;
+        }
+        if (label_len > DNS_MAX_LABEL || *i + label_len > len) {
+            return ERR;
+        }
+        if (ZERO != name_i) {
+            if (name_i >= lookup->name_len || '.' != lookup->name[name_i]) {
+                return ERR;
+            }
+            name_i++;
+        }
+        for (size_t j = 0; j < label_len; j++, name_i++) {
+            if (name_i >= lookup->name_len
+                || ascii_lower(message[*i + j]) != lookup->name[name_i]
+            ) {
+                return ERR;
+            }
+        }
+        *i += label_len;
+    }
+
+    if (name_i != lookup->name_len || *i + 4 > len) {
+        return ERR;
+    }
+
+    const uint16_t qtype = read_u16(&message[*i]);
+    const uint16_t qclass = read_u16(&message[*i + 2]);
+    *i += 4;
+
+    return qtype == query->qtype && DNS_CLASS_IN == qclass
+        ? OK
+        : ERR;
+}
+
+/*
+    RFC 2308 5: a negative answer lives for the smaller of the SOA
+    record's TTL and its MINIMUM field. i is just past the question.
+*/
+static uint32_t negative_ttl_of_message(
+    const char* message,
+    const size_t len,
+    size_t i)
+{
+    const uint16_t ancount = read_u16(&message[6]);
+    const uint16_t nscount = read_u16(&message[8]);
+
+    for (uint32_t record = 0; record < (uint32_t)ancount + nscount; record++) {
+        if (OK != skip_name(message, len, &i) || i + 10 > len) {
+            return ZERO;
+        }
+        const uint16_t type = read_u16(&message[i]);
+        const uint32_t ttl = read_u32(&message[i + 4]);
+        const uint16_t rdlength = read_u16(&message[i + 8]);
+        i += 10;
+        const size_t rdata_end = i + rdlength;
+        if (rdata_end > len) {
+            return ZERO;
+        }
+
+        if (record >= ancount && DNS_TYPE_SOA == type) {
+            /* MNAME, RNAME, then SERIAL REFRESH RETRY EXPIRE MINIMUM */
+            if (OK != skip_name(message, rdata_end, &i)
+                || OK != skip_name(message, rdata_end, &i)
+                || i + 20 > rdata_end
+            ) {
+                return ZERO;
+            }
+            const uint32_t minimum = read_u32(&message[i + 16]);
+            return minimum < ttl ? minimum : ttl;
+        }
+        i = rdata_end;
+    }
+
+    return ZERO;
+}
+
+/*
+    OK when the message settled query, or sent it on to TCP; ERR when it
+    was not the answer: another ID or another question.
+*/
+static int resolver_proc_message(
+    struct DnsResolver* resolver,
+    struct DnsQuery* query,
+    const char* message,
+    const size_t len,
+    const struct DnsTcpStream* stream)
+{
+    if (len < DNS_HEADER_SPACE
+        || query->done
+        || query->stream != stream
+        || read_u16(&message[0]) != query->id
+    ) {
+        return ERR;
+    }
+
+    const uint16_t flags = read_u16(&message[2]);
+    const uint16_t qdcount = read_u16(&message[4]);
+    const uint16_t ancount = read_u16(&message[6]);
+    if (!(flags & DNS_FLAG_QR) || (flags & DNS_OPCODE_MASK) || 1 != qdcount) {
+        return ERR;
+    }
+
+    size_t i = DNS_HEADER_SPACE;
+    if (OK != match_question(message, len, query, &i)) {
+        return ERR;
+    }
+
+    if ((flags & DNS_FLAG_TC) && NULL == stream) {
+        query_close_udp(resolver, query);
+        query->id = next_random_id(resolver);
+        query_send_tcp(resolver, query);
+        return OK;
+    }
+
+    switch (flags & DNS_RCODE_MASK) {
+        case DNS_RCODE_NOERROR:
+            break;
+        case DNS_RCODE_NXDOMAIN:
+            query->lookup->negative_ttl =
+                negative_ttl_of_message(message, len, i);
+            query_finish(resolver, query, DNS_ANSWER_NO_ADDRESS);
+            return OK;
+        default:
+            query_finish(resolver, query, DNS_ANSWER_SERVER_FAILURE);
+            return OK;
+    }
+
+    /*
+        RFC 1035 4.1.3. Resource record format: NAME, TYPE, CLASS, TTL,
+        RDLENGTH, RDATA. Records of the asked type are taken whatever
+        their owner, which covers the targets of CNAME chains.
+    */
+    struct DnsAnswer* answer = query->lookup->answer;
+    const size_t address_count_before = answer->address_count;
+    const size_t question_end = i;
+    const size_t address_space = DNS_TYPE_A == query->qtype ? 4 : 16;
+    for (uint16_t record = 0; record < ancount; record++) {
+        if (OK != skip_name(message, len, &i) || i + 10 > len) {
+            break;
+        }
+        const uint16_t type = read_u16(&message[i]);
+        const uint16_t class = read_u16(&message[i + 2]);
+        const uint32_t ttl = read_u32(&message[i + 4]);
+        const uint16_t rdlength = read_u16(&message[i + 8]);
+        i += 10;
+        if (i + rdlength > len) {
+            break;
+        }
+
+        if (type == query->qtype
+            && DNS_CLASS_IN == class
+            && rdlength == address_space
+        ) {
+            answer_add_address(
+                answer,
+                DNS_TYPE_A == type ? AF_INET : AF_INET6,
+                &message[i]
+            );
+            if (ttl < answer->ttl) {
+                answer->ttl = ttl;
+            }
+        }
+        i += rdlength;
+    }
+
+    if (answer->address_count == address_count_before) {
+        query->lookup->negative_ttl =
+            negative_ttl_of_message(message, len, question_end);
+        query_finish(resolver, query, DNS_ANSWER_NO_ADDRESS);
+        return OK;
+    }
+
+    query_finish(resolver, query, DNS_ANSWER_OK);
+    return OK;
+}
+
+static void lookup_unlink(
+    struct DnsResolver* resolver,
+    struct DnsLookup* lookup)
+{
+    struct DnsLookup** link =
+        &resolver->lookups[lookup->name_hash % DNS_LOOKUP_BUCKETS];
+    while (NULL != *link && lookup != *link) {
+        link = &(*link)->next;
+    }
+    if (NULL != *link) {
+        *link = lookup->next;
+    }
+}
+
+static void lookup_complete(
+    struct DnsResolver* resolver,
+    struct DnsLookup* lookup)
+{
+    lookup_unlink(resolver, lookup);
+
+    struct DnsAnswer* answer = lookup->answer;
+    if (answer->address_count > ZERO) {
+        answer->status = DNS_ANSWER_OK;
+    } else {
+        answer->status = DNS_ANSWER_TIMEOUT;
+        for (int i = 0; i < DNS_QUERY_COUNT; i++) {
+            const enum DnsAnswerStatus status = lookup->queries[i].status;
+            if (DNS_ANSWER_NO_ADDRESS == status
+                || (DNS_ANSWER_SERVER_FAILURE == status
+                    && DNS_ANSWER_NO_ADDRESS != answer->status)
+            ) {
+                answer->status = status;
+            }
+        }
+        answer->ttl =
+            DNS_ANSWER_NO_ADDRESS == answer->status
+            ? lookup->negative_ttl
+            : ZERO;
+    }
+
+    if (NULL != resolver->cache) {
+        dns_cache_store(
+            resolver->cache,
+            lookup->name,
+            lookup->name_len,
+            lookup->name_hash,
+            now_ms(),
+            answer
+        );
+    }
+
+    struct DnsWaiter* waiter = lookup->waiters;
+    lookup->waiters = NULL;
+    while (NULL != waiter) {
+        struct DnsWaiter* next = waiter->next;
+        waiter->next = NULL;
+        waiter->lookup = NULL;
+        answer->refs++;
+        resolver->on_resolved(
+            resolver->server,
+            waiter,
+            answer
+        );
+        waiter = next;
+    }
+
+    dns_answer_release(answer);
+    free(lookup);
+}
+
+static struct DnsLookup* resolver_find_lookup(
+    struct DnsResolver* resolver,
+    const char* name,
+    const size_t name_len,
+    const uint32_t name_hash)
+{
+    struct DnsLookup* lookup =
+        resolver->lookups[name_hash % DNS_LOOKUP_BUCKETS];
+    for (; NULL != lookup; lookup = lookup->next) {
+        if (lookup->name_hash == name_hash
+            && lookup->name_len == name_len
+            && ZERO == memcmp(lookup->name, name, name_len)
+        ) {
+            return lookup;
+        }
+    }
+    return NULL;
+}
+
+static struct DnsLookup* resolver_start_lookup(
+    struct DnsResolver* resolver,
+    const char* name,
+    const size_t name_len,
+    const uint32_t name_hash)
+{
+    struct DnsLookup* lookup =
+        calloc(
+            1,
+            sizeof(struct DnsLookup)
+        );
+    if (NULL == lookup) {
+        return NULL;
+    }
+    lookup->answer = construct_answer();
+    if (NULL == lookup->answer) {
+        free(lookup);
+        return NULL;
+    }
+
+    const void* _ = memcpy(lookup->name, name, name_len);
+    lookup->name[name_len] = '\0';
+    lookup->name_len = name_len;
+    lookup->name_hash = name_hash;
+    lookup->queries[DNS_QUERY_A].qtype = DNS_TYPE_A;
+    lookup->queries[DNS_QUERY_AAAA].qtype = DNS_TYPE_AAAA;
+    for (int i = 0; i < DNS_QUERY_COUNT; i++) {
+        lookup->queries[i].udp.fd = ERR;
+        lookup->queries[i].udp.tcp = false;
+        lookup->queries[i].lookup = lookup;
+    }
+
+    struct DnsLookup** bucket =
+        &resolver->lookups[name_hash % DNS_LOOKUP_BUCKETS];
+    lookup->next = *bucket;
+    *bucket = lookup;
+
+    for (int i = 0; i < DNS_QUERY_COUNT; i++) {
+        query_send_udp(resolver, &lookup->queries[i]);
+    }
+
+    return lookup;
+}
+
+enum DnsResolveConsequence dns_resolver_resolve(
+    struct DnsResolver* resolver,
+    const char* name,
+    const size_t name_len,
+    struct DnsWaiter* waiter,
+    struct DnsAnswer** answer)
+{
+    char normalized[DNS_MAX_NAME + 1];
+    size_t normalized_len = ZERO;
+    if (OK !=
+        normalize_name(
+            name,
+            name_len,
+            normalized,
+            &normalized_len
+        )
+    ) {
+        return DNS_RESOLVE_ERR;
+    }
+
+    *answer = answer_of_literal(normalized);
+    if (NULL != *answer) {
+        return DNS_RESOLVE_DONE;
+    }
+
+    const uint32_t name_hash = hash_of_name(normalized, normalized_len);
+
+    struct DnsLookup* lookup =
+        resolver_find_lookup(
+            resolver,
+            normalized,
+            normalized_len,
+            name_hash
+        );
+
+    if (NULL != resolver->cache) {
+        struct DnsAnswer* cached = construct_answer();
+        if (NULL == cached) {
+            return DNS_RESOLVE_ERR;
+        }
+
+        switch (
+            dns_cache_lookup(
+                resolver->cache,
+                normalized,
+                normalized_len,
+                name_hash,
+                now_ms(),
+                cached
+            )
+        ) {
+            case DNS_CACHE_HIT_PREFETCH:
+                /* a refresh without waiters; if it fails the entry just runs out */
+                if (NULL == lookup) {
+                    const struct DnsLookup* _ignored =
+                        resolver_start_lookup(
+                            resolver,
+                            normalized,
+                            normalized_len,
+                            name_hash
+                        );
+                }
+                *answer = cached;
+                return DNS_RESOLVE_DONE;
+            case DNS_CACHE_HIT:
+                *answer = cached;
+                return DNS_RESOLVE_DONE;
+            case DNS_CACHE_MISS: default:
+                dns_answer_release(cached);
+                break;
+        }
+    }
+
+    if (NULL == lookup) {
+        lookup =
+            resolver_start_lookup(
+                resolver,
+                normalized,
+                normalized_len,
+                name_hash
+            );
+        if (NULL == lookup) {
+            return DNS_RESOLVE_ERR;
+        }
+    }
+
+    waiter->lookup = lookup;
+    waiter->next = lookup->waiters;
+    lookup->waiters = waiter;
+    return DNS_RESOLVE_PENDING;
+}
+
+void dns_resolver_cancel(
+    struct DnsResolver* resolver,
+    struct DnsWaiter* waiter)
+{
+    struct DnsLookup* lookup = waiter->lookup;
+    if (NULL == lookup) {
+        return;
+    }
+
+    /* the lookup itself carries on; nothing else is waiting on a restart */
+    struct DnsWaiter** link = &lookup->waiters;
+    while (NULL != *link && waiter != *link) {
+        link = &(*link)->next;
+    }
+    if (NULL != *link) {
+        *link = waiter->next;
+    }
+    waiter->next = NULL;
+    waiter->lookup = NULL;
+}
+
+struct DnsSocket* dns_resolver_socket_of_fd(
+    struct DnsResolver* resolver,
+    const int socket_fd)
+{
+    if (NULL == resolver || ERR == socket_fd) {
+        return NULL;
+    }
+    for (struct DnsQuery* query = resolver->udp_queries;
+        NULL != query;
+        query = query->next_udp
+    ) {
+        if (socket_fd == query->udp.fd) {
+            return &query->udp;
+        }
+    }
+    for (struct DnsTcpStream* stream = resolver->streams;
+        NULL != stream;
+        stream = stream->next
+    ) {
+        if (socket_fd == stream->socket.fd) {
+            return &stream->socket;
+        }
+    }
+    return NULL;
+}
+
+/* the stream_proc_* return ERR once the stream has been closed (and freed) */
+static int stream_fail(
+    struct DnsResolver* resolver,
+    struct DnsTcpStream* stream)
+{
+    query_finish(resolver, stream->query, DNS_ANSWER_SERVER_FAILURE);
+    return ERR;
+}
+
+static int stream_proc_bytes(
+    struct DnsResolver* resolver,
+    struct DnsTcpStream* stream,
+    const char data[],
+    const size_t len)
+{
+    if (ZERO == len) {
+        return stream_fail(resolver, stream);
+    }
+
+    enum {MAX_FRAME=DNS_TCP_LENGTH_SPACE + UINT16_MAX};
+    if (NULL == stream->in) {
+        stream->in = malloc(MAX_FRAME);
+        if (NULL == stream->in) {
+            return stream_fail(resolver, stream);
+        }
+    }
+
+    const size_t taken =
+        len < MAX_FRAME - stream->in_len
+        ? len
+        : MAX_FRAME - stream->in_len;
+    const void* _ = memcpy(&stream->in[stream->in_len], data, taken);
+    stream->in_len += taken;
+
+    if (stream->in_len < DNS_TCP_LENGTH_SPACE) {
+        return OK;
+    }
+    const size_t message_len = read_u16(stream->in);
+    if (stream->in_len < DNS_TCP_LENGTH_SPACE + message_len) {
+        return OK;
+    }
+
+    if (OK !=
+        resolver_proc_message(
+            resolver,
+            stream->query,
+            &stream->in[DNS_TCP_LENGTH_SPACE],
+            message_len,
+            stream
+        )
+    ) {
+        return stream_fail(resolver, stream);
+    }
+    return ERR;
+}
+
+static int stream_proc_writable(
+    struct DnsResolver* resolver,
+    struct DnsTcpStream* stream)
+{
+    if (!stream->connected) {
+        int err = ZERO;
+        socklen_t err_len = sizeof(err);
+        if (OK !=
+            getsockopt(
+                stream->socket.fd,
+                SOL_SOCKET,
+                SO_ERROR,
+                &err,
+                &err_len
+            )
+            || ZERO != err
+        ) {
+            return stream_fail(resolver, stream);
+        }
+        stream->connected = true;
+    }
+
+    if (OK != stream_flush(resolver, stream)) {
+        return stream_fail(resolver, stream);
+    }
+    return OK;
+}
+
+static int stream_proc_readable(
+    struct DnsResolver* resolver,
+    struct DnsTcpStream* stream)
+{
+    for (;;) {
+        const ssize_t read =
+            recv(
+                stream->socket.fd,
+                resolver->datagram_space,
+                sizeof(resolver->datagram_space),
+                ZERO
+            );
+        if (ERR == read && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+            return OK;
+        } else if (ERR == read && EINTR == errno) {
+            continue;
+        } else if (ERR == read) {
+            return stream_fail(resolver, stream);
+        }
+
+        if (OK !=
+            stream_proc_bytes(
+                resolver,
+                stream,
+                resolver->datagram_space,
+                read
+            )
+        ) {
+            return ERR;
+        }
+    }
+}
+
+static void udp_proc_readable(
+    struct DnsResolver* resolver,
+    struct DnsQuery* query)
+{
+    while (ERR != query->udp.fd) {
+        const ssize_t read =
+            recv(
+                query->udp.fd,
+                resolver->datagram_space,
+                sizeof(resolver->datagram_space),
+                ZERO
+            );
+        if (ERR == read && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+            return;
+        } else if (ERR == read && (EINTR == errno || ECONNREFUSED == errno)) {
+            continue;
+        } else if (ERR == read) {
+            return;
+        }
+
+        /* settled, its socket is closed and its lookup may be gone */
+        if (OK ==
+            resolver_proc_message(
+                resolver,
+                query,
+                resolver->datagram_space,
+                read,
+                NULL
+            )
+        ) {
+            return;
+        }
+    }
+}
+
+int dns_resolver_proc_io_event(
+    struct DnsResolver* resolver,
+    struct DnsSocket* socket,
+    const bool readable,
+    const bool writable)
+{
+    if (!socket->tcp) {
+        if (readable) {
+            udp_proc_readable(resolver, (struct DnsQuery*)socket);
+        }
+        return OK;
+    }
+
+    struct DnsTcpStream* stream = (struct DnsTcpStream*)socket;
+
+    if (writable && OK != stream_proc_writable(resolver, stream)) {
+        return OK;
+    }
+
+    if (readable
+        && SOCKS5_EVENT_MODEL_READINESS == resolver->server->cfg.event_model
+    ) {
+        const int _ignored = stream_proc_readable(resolver, stream);
+    }
+
+    return OK;
+}
+
+int dns_resolver_proc_recvd(
+    struct DnsResolver* resolver,
+    struct DnsSocket* socket,
+    const char data[],
+    const size_t len)
+{
+    if (!socket->tcp) {
+        const int _ignored =
+            resolver_proc_message(resolver, (struct DnsQuery*)socket, data, len, NULL);
+        return OK;
+    }
+
+    const int _ignored =
+        stream_proc_bytes(
+            resolver,
+            (struct DnsTcpStream*)socket,
+            data,
+            len
+        );
+    return OK;
+}
+
+void dns_resolver_proc_socket_failure(
+    struct DnsResolver* resolver,
+    struct DnsSocket* socket)
+{
+    if (!socket->tcp) {
+        /* the query retries from its deadline, on a socket of its own again */
+        return query_close_udp(resolver, (struct DnsQuery*)socket);
+    }
+
+    const int _ignored =
+        stream_fail(
+            resolver,
+            (struct DnsTcpStream*)socket
+        );
+}
+
+int dns_resolver_next_timeout_ms(
+    const struct DnsResolver* resolver)
+{
+    if (NULL == resolver || NULL == resolver->deadlines_head) {
+        return ERR;
+    }
+
+    const int64_t remaining = resolver->deadlines_head->deadline_ms - now_ms();
+    return remaining > ZERO
+        ? (int)remaining
+        : ZERO;
+}
+
+void dns_resolver_proc_timeouts(
+    struct DnsResolver* resolver)
+{
+    if (NULL == resolver) {
+        return;
+    }
+
+    const int64_t now = now_ms();
+    while (NULL != resolver->deadlines_head
+        && resolver->deadlines_head->deadline_ms <= now
+    ) {
+        struct DnsQuery* query = resolver->deadlines_head;
+        query_unarm_deadline(resolver, query);
+
+        if (NULL == query->stream && query->attempts < DNS_UDP_ATTEMPTS) {
+            query_send_udp(resolver, query);
+        } else {
+            query_finish(resolver, query, DNS_ANSWER_TIMEOUT);
+        }
+    }
+}
@@ -0,0 +1,121 @@
+#ifndef _DNS_RESOLVER_H_
+#define _DNS_RESOLVER_H_
+
+#include "rfc1928socks5.h"
+
+/*
+    Non-blocking stub resolver driven by the server's own event source.
+    A and AAAA are asked for in parallel over one connected UDP socket,
+    falling back to TCP for truncated answers; concurrent lookups of
+    the same name share their queries. With cfg.dns_cache set, answers
+    are served from and stored to that cache.
+*/
+
+enum {DNS_MAX_ADDRESSES=16};
+/* presentation form, without the trailing dot */
+enum {DNS_MAX_NAME=253};
+
+enum DnsAnswerStatus
+{
+    DNS_ANSWER_OK,
+    /* NXDOMAIN, or a name without A/AAAA records */
+    DNS_ANSWER_NO_ADDRESS,
+    DNS_ANSWER_SERVER_FAILURE,
+    DNS_ANSWER_TIMEOUT
+};
+
+/* shared by every waiter of a lookup; released through dns_answer_release */
+struct DnsAnswer
+{
+    unsigned refs;
+    enum DnsAnswerStatus status;
+    /* smallest TTL of the records used, or the negative TTL (RFC 2308), seconds */
+    uint32_t ttl;
+    size_t address_count;
+    /* ports left zero */
+    struct sockaddr_storage addresses[DNS_MAX_ADDRESSES];
+};
+
+/* a resolver socket; the resolver's subscription context points at one */
+struct DnsSocket
+{
+    int fd;
+    bool tcp;
+};
+
+typedef void (*DnsResolvedCallback)(
+    struct Socks5Server* server,
+    struct DnsWaiter* waiter,
+    struct DnsAnswer* answer
+);
+
+enum DnsResolveConsequence
+{
+    DNS_RESOLVE_DONE,
+    DNS_RESOLVE_PENDING,
+    DNS_RESOLVE_ERR = -1
+};
+
+struct DnsResolver* dns_resolver_construct(
+    struct Socks5Server* server,
+    DnsResolvedCallback on_resolved
+);
+
+/*
+    DONE: *answer is set right away (an address literal, or from the
+    cache, possibly negative) and owned by the caller. PENDING: on_resolved is called with waiter later, from
+    within the server's event processing.
+*/
+enum DnsResolveConsequence dns_resolver_resolve(
+    struct DnsResolver* resolver,
+    const char* name,
+    const size_t name_len,
+    struct DnsWaiter* waiter,
+    struct DnsAnswer** answer
+);
+
+void dns_resolver_cancel(
+    struct DnsResolver* resolver,
+    struct DnsWaiter* waiter
+);
+
+struct DnsSocket* dns_resolver_socket_of_fd(
+    struct DnsResolver* resolver,
+    const int socket_fd
+);
+
+/* readiness model: the resolver does its own reads and writes */
+int dns_resolver_proc_io_event(
+    struct DnsResolver* resolver,
+    struct DnsSocket* socket,
+    const bool readable,
+    const bool writable
+);
+
+/* completion model: bytes the event source read off a resolver socket */
+int dns_resolver_proc_recvd(
+    struct DnsResolver* resolver,
+    struct DnsSocket* socket,
+    const char data[],
+    const size_t len
+);
+
+void dns_resolver_proc_socket_failure(
+    struct DnsResolver* resolver,
+    struct DnsSocket* socket
+);
+
+/* milliseconds until the earliest query deadline, or -1 without any */
+int dns_resolver_next_timeout_ms(
+    const struct DnsResolver* resolver
+);
+
+void dns_resolver_proc_timeouts(
+    struct DnsResolver* resolver
+);
+
+void dns_answer_release(
+    struct DnsAnswer* answer
+);
+
+#endif
@@ -0,0 +1,697 @@
+#define _GNU_SOURCE
+#include "domain_index.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+enum {OK=0,ERR=-1};
+enum {ZERO=0};
+
+enum {MAX_SUFFIX_LEN=UINT8_MAX};
+
+/* high bit of a node's first edge: a suffix ends at the node */
+#define DOMAIN_INDEX_TERMINAL 0x80000000u
+#define DOMAIN_INDEX_EDGE_MASK 0x7FFFFFFFu
+#define DOMAIN_INDEX_BYTE_ORDER 0x01020304u
+
+static const char DOMAIN_INDEX_MAGIC[8] = {'S', '5', 'D', 'O', 'M', 'I', 'X', 1};
+
+/*
+    The file, in host byte order:
+
+        header
+        uint32_t node_edges[node_count + 1]  first edge of each node, and TERMINAL
+        uint32_t targets[edge_count]
+        uint8_t labels[edge_count]           ascending within a node
+*/
+struct DomainIndexHeader
+{
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t node_count;
+    uint32_t edge_count;
+    uint32_t root;
+};
+
+struct DomainIndex
+{
+    void* map;
+    size_t map_len;
+    const uint32_t* node_edges;
+    const uint32_t* targets;
+    const uint8_t* labels;
+    uint32_t node_count;
+    uint32_t edge_count;
+    uint32_t root;
+};
+
+static uint8_t ascii_lower(
+    const uint8_t c)
+{
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+struct BuildEdge
+{
+    uint32_t target;
+    uint8_t label;
+};
+
+struct BuildNode
+{
+    struct BuildEdge* edges;
+    uint32_t edge_count;
+    uint32_t edge_capacity;
+    bool terminal;
+};
+
+/*
+    Daciuk et al.'s incremental construction from sorted input: only
+    the path of the suffix inserted last can still change; whatever
+    leaves it is replaced by an equivalent node already registered, or
+    registered itself.
+*/
+struct DomainIndexBuilder
+{
+    struct BuildNode* nodes;
+    size_t node_count;
+    size_t node_capacity;
+    /* node ids + 1; ZERO: empty */
+    uint32_t* register_slots;
+    size_t register_mask;
+    size_t registered;
+    uint32_t path[MAX_SUFFIX_LEN + 1];
+    const uint8_t* prev;
+    size_t prev_len;
+};
+
+struct SuffixSpan
+{
+    size_t offset;
+    size_t len;
+};
+
+static ptrdiff_t builder_construct_node(
+    struct DomainIndexBuilder* builder)
+{
+    if (builder->node_count == builder->node_capacity) {
+        const size_t capacity =
+            ZERO == builder->node_capacity ? 1024 : 2 * builder->node_capacity;
+        if (capacity > DOMAIN_INDEX_EDGE_MASK) {
+            return ERR;
+        }
+        struct BuildNode* nodes =
+            realloc(
+                builder->nodes,
+                capacity * sizeof(struct BuildNode)
+            );
+        if (NULL == nodes) {
+            return ERR;
+        }
+        builder->nodes = nodes;
+        builder->node_capacity = capacity;
+    }
+
+    struct BuildNode* node = &builder->nodes[builder->node_count];
+    node->edges = NULL;
+    node->edge_count = ZERO;
+    node->edge_capacity = ZERO;
+    node->terminal = false;
+    return builder->node_count++;
+}
+
+static int node_append_edge(
+    struct BuildNode* node,
+    const uint8_t label,
+    const uint32_t target)
+{
+    if (node->edge_count == node->edge_capacity) {
+        const uint32_t capacity =
+            ZERO == node->edge_capacity ? 2 : 2 * node->edge_capacity;
+        struct BuildEdge* edges =
+            realloc(
+                node->edges,
+                capacity * sizeof(struct BuildEdge)
+            );
+        if (NULL == edges) {
+            return ERR;
+        }
+        node->edges = edges;
+        node->edge_capacity = capacity;
+    }
+
+    node->edges[node->edge_count].label = label;
+    node->edges[node->edge_count].target = target;
+    node->edge_count++;
+    return OK;
+}
+
+/* children are registered before their parents: equivalence is one level deep */
+static uint64_t node_hash(
+    const struct BuildNode* node)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL ^ node->terminal;
+    for (uint32_t i = 0; i < node->edge_count; i++) {
+        hash = (hash ^ node->edges[i].label) * 0x100000001b3ULL;
+        hash = (hash ^ node->edges[i].target) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static bool nodes_equivalent(
+    const struct BuildNode* a,
+    const struct BuildNode* b)
+{
+    if (a->terminal != b->terminal || a->edge_count != b->edge_count) {
+        return false;
+    }
+    for (uint32_t i = 0; i < a->edge_count; i++) {
+        if (a->edges[i].label != b->edges[i].label
+            || a->edges[i].target != b->edges[i].target
+        ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int builder_grow_register(
+    struct DomainIndexBuilder* builder)
+{
+    const size_t capacity =
+        NULL == builder->register_slots ? 1024 : 2 * (builder->register_mask + 1);
+    uint32_t* slots = calloc(capacity, sizeof(uint32_t));
+    if (NULL == slots) {
+        return ERR;
+    }
+
+    for (size_t i = 0; NULL != builder->register_slots && i <= builder->register_mask; i++) {
+        const uint32_t id = builder->register_slots[i];
+        if (ZERO == id) {
+            continue;
+        }
+        for (size_t k = node_hash(&builder->nodes[id - 1]);; k++) {
+            if (ZERO == slots[k & (capacity - 1)]) {
+                slots[k & (capacity - 1)] = id;
+                break;
+            }
+        }
+    }
+
+    free(builder->register_slots);
+    builder->register_slots = slots;
+    builder->register_mask = capacity - 1;
+    return OK;
+}
+
+/* the registered node equivalent to id: id itself if there was none; ERR if it can't be registered */
+static ptrdiff_t builder_register(
+    struct DomainIndexBuilder* builder,
+    const uint32_t id)
+{
+    if (NULL == builder->register_slots
+        || 2 * (builder->registered + 1) > builder->register_mask + 1
+    ) {
+        if (OK != builder_grow_register(builder)) {
+            return ERR;
+        }
+    }
+
+    const struct BuildNode* node = &builder->nodes[id];
+    for (size_t k = node_hash(node);; k++) {
+        uint32_t* slot = &builder->register_slots[k & builder->register_mask];
+        if (ZERO == *slot) {
+            *slot = id + 1;
+            builder->registered++;
+            return id;
+        }
+        if (nodes_equivalent(&builder->nodes[*slot - 1], node)) {
+            return *slot - 1;
+        }
+    }
+}
+
+/* every node of the last path past depth is replaced or registered */
+static int builder_minimize(
+    struct DomainIndexBuilder* builder,
+    const size_t depth)
+{
+    for (size_t i = builder->prev_len; i > depth; i--) {
+        const uint32_t child = builder->path[i];
+        const ptrdiff_t canonical = builder_register(builder, child);
+        if (ERR == canonical) {
+            return ERR;
+        }
+        if ((uint32_t)canonical == child) {
+            continue;
+        }
+
+        struct BuildNode* parent = &builder->nodes[builder->path[i - 1]];
+        parent->edges[parent->edge_count - 1].target = canonical;
+
+        struct BuildNode* replaced = &builder->nodes[child];
+        free(replaced->edges);
+        replaced->edges = NULL;
+        replaced->edge_count = ZERO;
+    }
+    builder->prev_len = depth;
+    return OK;
+}
+
+static const struct BuildEdge* build_node_edge(
+    const struct BuildNode* node,
+    const uint8_t label)
+{
+    for (uint32_t i = 0; i < node->edge_count; i++) {
+        if (label == node->edges[i].label) {
+            return &node->edges[i];
+        }
+    }
+    return NULL;
+}
+
+/* whether a shorter suffix already holds the (reversed) suffix */
+static bool builder_holds(
+    const struct DomainIndexBuilder* builder,
+    const uint8_t reversed[],
+    const size_t len)
+{
+    uint32_t node = builder->path[0];
+    for (size_t i = 0; i < len; i++) {
+        if (builder->nodes[node].terminal && '.' == reversed[i]) {
+            return true;
+        }
+        const struct BuildEdge* edge =
+            build_node_edge(
+                &builder->nodes[node],
+                reversed[i]
+            );
+        if (NULL == edge) {
+            return false;
+        }
+        node = edge->target;
+    }
+    return builder->nodes[node].terminal;
+}
+
+static int builder_insert(
+    struct DomainIndexBuilder* builder,
+    const uint8_t reversed[],
+    const size_t len)
+{
+    if (builder_holds(builder, reversed, len)) {
+        return OK;
+    }
+
+    size_t common = ZERO;
+    while (common < len
+        && common < builder->prev_len
+        && reversed[common] == builder->prev[common]
+    ) {
+        common++;
+    }
+
+    if (OK != builder_minimize(builder, common)) {
+        return ERR;
+    }
+
+    for (size_t i = common; i < len; i++) {
+        const ptrdiff_t node = builder_construct_node(builder);
+        if (ERR == node
+            || OK !=
+            node_append_edge(
+                &builder->nodes[builder->path[i]],
+                reversed[i],
+                node
+            )
+        ) {
+            return ERR;
+        }
+        builder->path[i + 1] = node;
+    }
+
+    builder->nodes[builder->path[len]].terminal = true;
+    builder->prev = reversed;
+    builder->prev_len = len;
+    return OK;
+}
+
+static int compare_suffixes(
+    const void* a,
+    const void* b,
+    void* arg)
+{
+    const uint8_t* suffixes = arg;
+    const struct SuffixSpan* x = a;
+    const struct SuffixSpan* y = b;
+    const size_t len = x->len < y->len ? x->len : y->len;
+    const int cmp = memcmp(&suffixes[x->offset], &suffixes[y->offset], len);
+    if (ZERO != cmp) {
+        return cmp;
+    }
+    return x->len < y->len ? -1 : x->len > y->len ? 1 : ZERO;
+}
+
+/* each suffix lower-cased and reversed, one after another */
+static int read_suffixes(
+    const char* list_path,
+    uint8_t** suffixes,
+    struct SuffixSpan** spans,
+    size_t* span_count)
+{
+    FILE* file = fopen(list_path, "re");
+    if (NULL == file) {
+        return ERR;
+    }
+
+    size_t suffixes_len = ZERO;
+    size_t suffixes_capacity = ZERO;
+    size_t spans_capacity = ZERO;
+    *suffixes = NULL;
+    *spans = NULL;
+    *span_count = ZERO;
+
+    int ret = OK;
+    char* line = NULL;
+    size_t line_capacity = ZERO;
+    ssize_t line_len = ZERO;
+    while (OK == ret
+        && ERR != (line_len = getline(&line, &line_capacity, file))
+    ) {
+        const char* text = line + strspn(line, " \t");
+        size_t len = strcspn(text, " \t\r\n#");
+        if (ZERO == strncmp(text, "*.", 2)) {
+            text += 2;
+            len = len < 2 ? ZERO : len - 2;
+        } else if ('.' == text[0]) {
+            text++;
+            len--;
+        }
+        while (len > ZERO && '.' == text[len - 1]) {
+            len--;
+        }
+        if (ZERO == len) {
+            continue;
+        }
+        if (len > MAX_SUFFIX_LEN) {
+            ret = ERR;
+            break;
+        }
+
+        if (suffixes_len + len > suffixes_capacity) {
+            const size_t capacity = 2 * (suffixes_len + len) + 4096;
+            uint8_t* grown = realloc(*suffixes, capacity);
+            if (NULL == grown) {
+                ret = ERR;
+                break;
+            }
+            *suffixes = grown;
+            suffixes_capacity = capacity;
+        }
+        if (*span_count == spans_capacity) {
+            const size_t capacity = ZERO == spans_capacity ? 1024 : 2 * spans_capacity;
+            struct SuffixSpan* grown = realloc(*spans, capacity * sizeof(struct SuffixSpan));
+            if (NULL == grown) {
+                ret = ERR;
+                break;
+            }
+            *spans = grown;
+            spans_capacity = capacity;
+        }
+
+        for (size_t i = 0; i < len; i++) {
+            (*suffixes)[suffixes_len + i] = ascii_lower(text[len - 1 - i]);
+        }
+        (*spans)[*span_count].offset = suffixes_len;
+        (*spans)[*span_count].len = len;
+        (*span_count)++;
+        suffixes_len += len;
+    }
+
+    if (ferror(file)) {
+        ret = ERR;
+    }
+    free(line);
+    const int _ignored = fclose(file);
+
+    if (OK != ret) {
+        free(*suffixes);
+        free(*spans);
+        *suffixes = NULL;
+        *spans = NULL;
+    }
+    return ret;
+}
+
+/* the reachable nodes, renumbered breadth first, written out */
+static int builder_write(
+    const struct DomainIndexBuilder* builder,
+    const char* index_path)
+{
+    uint32_t* renumbered = malloc(builder->node_count * sizeof(uint32_t));
+    uint32_t* order = malloc(builder->node_count * sizeof(uint32_t));
+    if (NULL == renumbered || NULL == order) {
+        free(renumbered);
+        free(order);
+        return ERR;
+    }
+    const void* _ = memset(renumbered, 0xFF, builder->node_count * sizeof(uint32_t));
+
+    /* order doubles as the queue: what is in it is numbered, what is past next is yet to be expanded */
+    uint32_t node_count = ZERO;
+    uint32_t edge_count = ZERO;
+    renumbered[builder->path[0]] = node_count;
+    order[node_count++] = builder->path[0];
+    for (uint32_t next = 0; next < node_count; next++) {
+        const struct BuildNode* node = &builder->nodes[order[next]];
+        edge_count += node->edge_count;
+        for (uint32_t i = 0; i < node->edge_count; i++) {
+            const uint32_t target = node->edges[i].target;
+            if (UINT32_MAX == renumbered[target]) {
+                renumbered[target] = node_count;
+                order[node_count++] = target;
+            }
+        }
+    }
+
+    struct DomainIndexHeader header = {
+        .byte_order = DOMAIN_INDEX_BYTE_ORDER,
+        .node_count = node_count,
+        .edge_count = edge_count,
+        .root = ZERO
+    };
+    _ = memcpy(header.magic, DOMAIN_INDEX_MAGIC, sizeof(header.magic));
+
+    FILE* file = fopen(index_path, "we");
+    bool written =
+        NULL != file
+        && 1 == fwrite(&header, sizeof(header), 1, file);
+
+    uint32_t first_edge = ZERO;
+    for (uint32_t i = 0; written && i < node_count; i++) {
+        const struct BuildNode* node = &builder->nodes[order[i]];
+        const uint32_t entry = first_edge | (node->terminal ? DOMAIN_INDEX_TERMINAL : ZERO);
+        written = 1 == fwrite(&entry, sizeof(entry), 1, file);
+        first_edge += node->edge_count;
+    }
+    written = written && 1 == fwrite(&first_edge, sizeof(first_edge), 1, file);
+
+    for (uint32_t i = 0; written && i < node_count; i++) {
+        const struct BuildNode* node = &builder->nodes[order[i]];
+        for (uint32_t k = 0; written && k < node->edge_count; k++) {
+            const uint32_t target = renumbered[node->edges[k].target];
+            written = 1 == fwrite(&target, sizeof(target), 1, file);
+        }
+    }
+    for (uint32_t i = 0; written && i < node_count; i++) {
+        const struct BuildNode* node = &builder->nodes[order[i]];
+        for (uint32_t k = 0; written && k < node->edge_count; k++) {
+            written = EOF != fputc(node->edges[k].label, file);
+        }
+    }
+
+    if (NULL != file && OK != fclose(file)) {
+        written = false;
+    }
+    free(renumbered);
+    free(order);
+    return written ? OK : ERR;
+}
+
+int domain_index_compile(
+    const char* list_path,
+    const char* index_path)
+{
+    uint8_t* suffixes = NULL;
+    struct SuffixSpan* spans = NULL;
+    size_t span_count = ZERO;
+    if (OK !=
+        read_suffixes(
+            list_path,
+            &suffixes,
+            &spans,
+            &span_count
+        )
+    ) {
+        return ERR;
+    }
+
+    /* sorted, a suffix is inserted after every suffix of it: those it is held by are known by then */
+    qsort_r(
+        spans,
+        span_count,
+        sizeof(struct SuffixSpan),
+        compare_suffixes,
+        suffixes
+    );
+
+    struct DomainIndexBuilder builder = {0};
+    int ret = ERR == builder_construct_node(&builder) ? ERR : OK;
+    builder.path[0] = ZERO;
+
+    for (size_t i = 0; OK == ret && i < span_count; i++) {
+        ret =
+            builder_insert(
+                &builder,
+                &suffixes[spans[i].offset],
+                spans[i].len
+            );
+    }
+    if (OK == ret) {
+        ret = builder_minimize(&builder, ZERO);
+    }
+    if (OK == ret) {
+        ret = builder_write(&builder, index_path);
+    }
+
+    for (size_t i = 0; i < builder.node_count; i++) {
+        free(builder.nodes[i].edges);
+    }
+    free(builder.nodes);
+    free(builder.register_slots);
+    free(suffixes);
+    free(spans);
+    return ret;
+}
+
+struct DomainIndex* domain_index_map(
+    const char* index_path)
+{
+    const int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+    if (ERR == fd) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (OK != fstat(fd, &st)
+        || (size_t)st.st_size < sizeof(struct DomainIndexHeader)
+    ) {
+        const int _ignored = close(fd);
+        return NULL;
+    }
+
+    void* map =
+        mmap(
+            NULL,
+            st.st_size,
+            PROT_READ,
+            MAP_SHARED,
+            fd,
+            ZERO
+        );
+    const int _ignored = close(fd);
+    if (MAP_FAILED == map) {
+        return NULL;
+    }
+
+    /* only the header is checked here; each step of a lookup is bounds checked as it is taken */
+    const struct DomainIndexHeader* header = map;
+    const size_t expected_len =
+        sizeof(struct DomainIndexHeader)
+        + ((size_t)header->node_count + 1) * sizeof(uint32_t)
+        + (size_t)header->edge_count * sizeof(uint32_t)
+        + (size_t)header->edge_count;
+
+    struct DomainIndex* index = NULL;
+    if (ZERO == memcmp(header->magic, DOMAIN_INDEX_MAGIC, sizeof(DOMAIN_INDEX_MAGIC))
+        && DOMAIN_INDEX_BYTE_ORDER == header->byte_order
+        && header->root < header->node_count
+        && header->edge_count <= DOMAIN_INDEX_EDGE_MASK
+        && expected_len == (size_t)st.st_size
+    ) {
+        index = malloc(sizeof(struct DomainIndex));
+    }
+    if (NULL == index) {
+        const int _ignored_too = munmap(map, st.st_size);
+        return NULL;
+    }
+
+    index->map = map;
+    index->map_len = st.st_size;
+    index->node_count = header->node_count;
+    index->edge_count = header->edge_count;
+    index->root = header->root;
+    index->node_edges = (const uint32_t*)(header + 1);
+    index->targets = index->node_edges + index->node_count + 1;
+    index->labels = (const uint8_t*)(index->targets + index->edge_count);
+    return index;
+}
+
+bool domain_index_holds(
+    const struct DomainIndex* index,
+    const char* name,
+    const size_t name_len)
+{
+    if (NULL == index) {
+        return false;
+    }
+
+    size_t left = name_len;
+    while (left > ZERO && '.' == name[left - 1]) {
+        left--;
+    }
+
+    uint32_t node = index->root;
+    for (;;) {
+        const uint32_t entry = index->node_edges[node];
+        /* a suffix ends here, and so does a label of the name */
+        if ((entry & DOMAIN_INDEX_TERMINAL)
+            && (ZERO == left || '.' == name[left - 1])
+        ) {
+            return true;
+        }
+        if (ZERO == left) {
+            return false;
+        }
+
+        const uint8_t label = ascii_lower(name[--left]);
+        size_t lo = entry & DOMAIN_INDEX_EDGE_MASK;
+        size_t hi = index->node_edges[node + 1] & DOMAIN_INDEX_EDGE_MASK;
+        if (hi > index->edge_count || lo > hi) {
+            return false;
+        }
+        while (lo < hi) {
+            const size_t mid = lo + (hi - lo) / 2;
+            if (index->labels[mid] < label) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo == (index->node_edges[node + 1] & DOMAIN_INDEX_EDGE_MASK)
+            || label != index->labels[lo]
+        ) {
+            return false;
+        }
+
+        node = index->targets[lo];
+        if (node >= index->node_count) {
+            return false;
+        }
+    }
+}
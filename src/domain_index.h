@@ -0,0 +1,37 @@
+#ifndef _DOMAIN_INDEX_H_
+#define _DOMAIN_INDEX_H_
+
+#include "rfc1928socks5.h"
+
+/*
+    Domain suffixes, as a minimal automaton (DAFSA) over their reversed
+    bytes: a name is looked up in one pass from its last byte to its
+    first. Compiled ahead of time into a file that is mapped, not
+    parsed: loading costs a validation of the header, and every shard
+    maps the same pages.
+
+    A suffix holds itself and every name under it: "example.com" holds
+    "example.com" and "www.example.com", not "badexample.com".
+    Comparisons ignore ASCII case and a trailing '.'.
+*/
+
+/*
+    list: one suffix per line; a leading "*." or '.' is dropped, blank
+    lines and lines starting with '#' are skipped.
+*/
+int domain_index_compile(
+    const char* list_path,
+    const char* index_path
+);
+
+struct DomainIndex* domain_index_map(
+    const char* index_path
+);
+
+bool domain_index_holds(
+    const struct DomainIndex* index,
+    const char* name,
+    const size_t name_len
+);
+
+#endif
@@ -0,0 +1,88 @@
+#include "io_buffer_pool.h"
+
+#include <stdlib.h>
+
+enum {OK=0,ERR=-1};
+enum {ZERO=0};
+
+static const size_t class_capacities[IO_BUFFER_CLASS_COUNT] = {
+    256,
+    1024,
+    4096,
+    16384,
+    65536
+};
+
+/* idle buffers are linked through their own first bytes */
+struct IdleIOBuffer
+{
+    struct IdleIOBuffer* next;
+};
+
+void io_buffer_pool_construct(
+    struct IOBufferPool* pool,
+    const size_t idle_capacity)
+{
+    for (ptrdiff_t i = 0; i < IO_BUFFER_CLASS_COUNT; i++) {
+        pool->classes[i].idle = NULL;
+        pool->classes[i].idle_count = ZERO;
+    }
+    pool->idle_capacity = idle_capacity;
+}
+
+static ptrdiff_t class_of_capacity(
+    const size_t least)
+{
+    for (ptrdiff_t i = 0; i < IO_BUFFER_CLASS_COUNT; i++) {
+        if (least <= class_capacities[i]) {
+            return i;
+        }
+    }
+    return ERR;
+}
+
+char* io_buffer_pool_acquire(
+    struct IOBufferPool* pool,
+    const size_t least,
+    size_t* capacity)
+{
+    const ptrdiff_t i = class_of_capacity(least);
+    if (ERR == i) {
+        return NULL;
+    }
+
+    struct IOBufferClass* size_class = &pool->classes[i];
+    *capacity = class_capacities[i];
+
+    if (NULL != size_class->idle) {
+        struct IdleIOBuffer* buffer = size_class->idle;
+        size_class->idle = buffer->next;
+        size_class->idle_count--;
+        return (char*)buffer;
+    }
+
+    return malloc(class_capacities[i]);
+}
+
+void io_buffer_pool_relinquish(
+    struct IOBufferPool* pool,
+    char* space,
+    const size_t capacity)
+{
+    if (NULL == space) {
+        return;
+    }
+
+    const ptrdiff_t i = class_of_capacity(capacity);
+    struct IOBufferClass* size_class = &pool->classes[i];
+
+    if (size_class->idle_count >= pool->idle_capacity) {
+        free(space);
+        return;
+    }
+
+    struct IdleIOBuffer* buffer = (struct IdleIOBuffer*)space;
+    buffer->next = size_class->idle;
+    size_class->idle = buffer;
+    size_class->idle_count++;
+}
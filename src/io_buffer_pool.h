@@ -0,0 +1,24 @@
+#ifndef _IO_BUFFER_POOL_H_
+#define _IO_BUFFER_POOL_H_
+
+#include "rfc1928socks5.h"
+
+void io_buffer_pool_construct(
+    struct IOBufferPool* pool,
+    const size_t idle_capacity
+);
+
+/* smallest class holding at least `least` bytes, or NULL when none does */
+char* io_buffer_pool_acquire(
+    struct IOBufferPool* pool,
+    const size_t least,
+    size_t* capacity
+);
+
+void io_buffer_pool_relinquish(
+    struct IOBufferPool* pool,
+    char* space,
+    const size_t capacity
+);
+
+#endif
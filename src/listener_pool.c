@@ -0,0 +1,153 @@
+#define _GNU_SOURCE
+#include "listener_pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+enum {OK=0,ERR=-1};
+enum {ZERO=0};
+
+/* a BIND waits for one connection; the rest is room for strays */
+enum {LISTENER_BACKLOG=8};
+
+static int construct_listener(
+    const struct ListenerPool* pool)
+{
+    const int socket_fd =
+        socket(
+            pool->address.ss_family,
+            SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            ZERO
+        );
+    if (ERR == socket_fd) {
+        return ERR;
+    }
+
+    if (OK !=
+        bind(
+            socket_fd,
+            (const struct sockaddr*)&pool->address,
+            pool->address_len
+        )
+        || OK !=
+        listen(
+            socket_fd,
+            LISTENER_BACKLOG
+        )
+    ) {
+        const int _ignored = close(socket_fd);
+        return ERR;
+    }
+
+    return socket_fd;
+}
+
+/*
+    Connections nobody asked for: made to an idle listener, or left
+    over from the BIND it served. ERR when the listener can't be kept.
+*/
+static int drain_listener(
+    const int socket_fd)
+{
+    for (;;) {
+        const int stray =
+            accept4(
+                socket_fd,
+                NULL,
+                NULL,
+                SOCK_CLOEXEC
+            );
+        if (ERR != stray) {
+            const int _ignored = close(stray);
+            continue;
+        }
+
+        switch (errno) {
+            case EAGAIN:
+                return OK;
+            case EINTR:
+            case ECONNABORTED:
+            case EPROTO:
+                continue;
+            default:
+                return ERR;
+        }
+    }
+}
+
+int listener_pool_construct(
+    struct ListenerPool* pool,
+    const struct addrinfo* address,
+    const size_t capacity)
+{
+    pool->idle_count = ZERO;
+    pool->capacity = capacity;
+    pool->idle = NULL;
+
+    const void* _ = memset(&pool->address, ZERO, sizeof(pool->address));
+    _ = memcpy(&pool->address, address->ai_addr, address->ai_addrlen);
+    pool->address_len = address->ai_addrlen;
+    if (AF_INET6 == pool->address.ss_family) {
+        ((struct sockaddr_in6*)&pool->address)->sin6_port = ZERO;
+    } else {
+        ((struct sockaddr_in*)&pool->address)->sin_port = ZERO;
+    }
+
+    if (ZERO == capacity) {
+        return OK;
+    }
+
+    pool->idle =
+        calloc(
+            capacity,
+            sizeof(int)
+        );
+    if (NULL == pool->idle) {
+        return ERR;
+    }
+
+    /* bound and listening ahead of time: a BIND costs no socket(), bind() or listen() */
+    while (pool->idle_count < capacity) {
+        const int socket_fd = construct_listener(pool);
+        if (ERR == socket_fd) {
+            break;
+        }
+        pool->idle[pool->idle_count++] = socket_fd;
+    }
+
+    return OK;
+}
+
+int listener_pool_acquire(
+    struct ListenerPool* pool)
+{
+    while (pool->idle_count > ZERO) {
+        const int socket_fd = pool->idle[--pool->idle_count];
+        if (OK == drain_listener(socket_fd)) {
+            return socket_fd;
+        }
+        const int _ignored = close(socket_fd);
+    }
+
+    return construct_listener(pool);
+}
+
+void listener_pool_relinquish(
+    struct ListenerPool* pool,
+    const int socket_fd)
+{
+    if (ERR == socket_fd) {
+        return;
+    }
+
+    if (pool->idle_count < pool->capacity
+        && OK == drain_listener(socket_fd)
+    ) {
+        pool->idle[pool->idle_count++] = socket_fd;
+        return;
+    }
+
+    const int _ignored = close(socket_fd);
+}
@@ -0,0 +1,23 @@
+#ifndef _LISTENER_POOL_H_
+#define _LISTENER_POOL_H_
+
+#include "rfc1928socks5.h"
+
+/* listeners are bound where address is, on ports of their own */
+int listener_pool_construct(
+    struct ListenerPool* pool,
+    const struct addrinfo* address,
+    const size_t capacity
+);
+
+/* a non-blocking listener, or ERR */
+int listener_pool_acquire(
+    struct ListenerPool* pool
+);
+
+void listener_pool_relinquish(
+    struct ListenerPool* pool,
+    const int socket_fd
+);
+
+#endif
@@ -0,0 +1,112 @@
+#define _GNU_SOURCE
+#include "pipe_pool.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+enum {OK=0,ERR=-1};
+enum {ZERO=0};
+
+static int construct_pipe_pair(
+    struct PipePair* pair)
+{
+    int fds[2];
+    if (OK !=
+        pipe2(
+            fds,
+            O_NONBLOCK | O_CLOEXEC
+        )
+    ) {
+        return ERR;
+    }
+
+    pair->read_fd = fds[0];
+    pair->write_fd = fds[1];
+    pair->in_pipe = ZERO;
+    return OK;
+}
+
+static void destruct_pipe_pair(
+    struct PipePair* pair)
+{
+    if (ERR != pair->read_fd) {
+        const int _ignored = close(pair->read_fd);
+    }
+    if (ERR != pair->write_fd) {
+        const int _ignored = close(pair->write_fd);
+    }
+    pair->read_fd = ERR;
+    pair->write_fd = ERR;
+    pair->in_pipe = ZERO;
+}
+
+int pipe_pool_construct(
+    struct PipePairPool* pool,
+    const size_t capacity)
+{
+    pool->idle_count = ZERO;
+    pool->capacity = capacity;
+    pool->idle = NULL;
+
+    if (ZERO == capacity) {
+        return OK;
+    }
+
+    pool->idle =
+        calloc(
+            capacity,
+            sizeof(struct PipePair)
+        );
+    if (NULL == pool->idle) {
+        return ERR;
+    }
+
+    /* pre-create so the first tunnels don't pay for pipe2() either */
+    while (pool->idle_count < capacity) {
+        if (OK !=
+            construct_pipe_pair(
+                &pool->idle[pool->idle_count]
+            )
+        ) {
+            break;
+        }
+        pool->idle_count++;
+    }
+
+    return OK;
+}
+
+int pipe_pool_acquire(
+    struct PipePairPool* pool,
+    struct PipePair* pair)
+{
+    if (pool->idle_count > ZERO) {
+        *pair = pool->idle[--pool->idle_count];
+        return OK;
+    }
+
+    return construct_pipe_pair(pair);
+}
+
+void pipe_pool_relinquish(
+    struct PipePairPool* pool,
+    struct PipePair* pair)
+{
+    if (ERR == pair->read_fd) {
+        return;
+    }
+
+    /* a pipe still holding bytes of a dead tunnel can't be handed out */
+    if (ZERO == pair->in_pipe
+        && pool->idle_count < pool->capacity
+    ) {
+        pool->idle[pool->idle_count++] = *pair;
+        pair->read_fd = ERR;
+        pair->write_fd = ERR;
+        return;
+    }
+
+    destruct_pipe_pair(pair);
+}
@@ -0,0 +1,21 @@
+#ifndef _PIPE_POOL_H_
+#define _PIPE_POOL_H_
+
+#include "rfc1928socks5.h"
+
+int pipe_pool_construct(
+    struct PipePairPool* pool,
+    const size_t capacity
+);
+
+int pipe_pool_acquire(
+    struct PipePairPool* pool,
+    struct PipePair* pair
+);
+
+void pipe_pool_relinquish(
+    struct PipePairPool* pool,
+    struct PipePair* pair
+);
+
+#endif
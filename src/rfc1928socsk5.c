@@ -1,4 +1,21 @@
+#define _GNU_SOURCE
 #include "rfc1928socks5.h"
+#include "pipe_pool.h"
+#include "listener_pool.h"
+#include "client_slab.h"
+#include "io_buffer_pool.h"
+#include "client_table.h"
+#include "dns_resolver.h"
+#include "dns_cache.h"
+#include "credential_store.h"
+#include "access_policy.h"
+#include "domain_index.h"
+#include "socket_context.h"
+#include "udp_association.h"
+#include "timer_wheel.h"
+#include "token_bucket.h"
+#include "zerocopy.h"
+#include "tls_session.h"
 
 #include <stdlib.h>
 #include <stdint.h>
@@ -11,6 +28,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdbool.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
 
 #define SOCKS_PORT_CSTR "1080"
 
@@ -21,6 +41,12 @@ enum {ZERO=0};
 enum {OK=0,ERR=-1};
 enum {MAX_CONNECTIONS=UINT8_MAX};
 enum {CLIENT_VERSION_CHOICE_LENGTH=2};
+/*
+    SOCKS5_EVENT_MODEL_COMPLETION: bytes buffered from the client past
+    which its reads are withdrawn; what the event source hands over in
+    one go has to fit above it in the pool's largest buffer.
+*/
+enum {COMPLETION_RECV_HIGH_WATER=32 * 1024};
 
 
 enum AdvancePhaseConsequence
@@ -40,10 +66,11 @@ enum TryParseConsequence
 static enum TryParseConsequence try_parse_client_request(
     const char data[],
     const size_t space,
-    struct ClientRequest* req)
+    struct ClientRequest* req,
+    size_t* consumed)
 {
-    enum {MIN_SPACE=9};
-    if (space < MIN_SPACE) {
+    enum {HEADER_SPACE=4, PORT_SPACE=2};
+    if (space < HEADER_SPACE + 1) {
         return TRY_PARSE_UNEXPECTED_END_OF_INPUT;
     }
 
@@ -54,32 +81,78 @@ static enum TryParseConsequence try_parse_client_request(
         return TRY_PARSE_ERR;
     }
 
-    const enum Socks5RequestCmd cmd = data[1];
+    const enum Socks5RequestCmd cmd = (uint8_t)data[1];
 
-    if (SOCKS5_REQUEST_CMD_CONNECT != cmd) {
-        return TRY_PARSE_ERR;
+    switch (cmd) {
+        case SOCKS5_REQUEST_CMD_CONNECT:
+        case SOCKS5_REQUEST_CMD_BIND:
+        case SOCKS5_REQUEST_CMD_UDPASSOSICATE:
+            break;
+
+        default: return TRY_PARSE_ERR;
     }
 
-    const enum Socks5AddrType addr_type = data[3];
+    const enum Socks5AddrType addr_type = (uint8_t)data[3];
 
+    size_t addr_offset = HEADER_SPACE;
+    size_t addr_len = 0;
     switch (addr_type) {
         case SOCKS5_ADDR_TYPE_IPV4:
+            addr_len = FOUR;
             break;
         case SOCKS5_ADDR_TYPE_DOMAINNAME:
+            addr_len = (uint8_t)data[HEADER_SPACE];
+            addr_offset += 1;
+            if (ZERO == addr_len) {
+                return TRY_PARSE_ERR;
+            }
             break;
         case SOCKS5_ADDR_TYPE_IPV6:
+            addr_len = SIXTEEN;
             break;
 
         default: return TRY_PARSE_ERR;
     }
 
+    const size_t total = addr_offset + addr_len + PORT_SPACE;
+    if (space < total) {
+        return TRY_PARSE_UNEXPECTED_END_OF_INPUT;
+    }
+
+    if (NULL != req) {
+        req->version = ver;
+        req->cmd = cmd;
+        req->_reserved = data[2];
+        req->addr_type = addr_type;
+        req->dst_addr_len = addr_len;
+        const void* _ =
+            memmove(
+                &req->dst_addr,
+                &data[addr_offset],
+                addr_len
+            );
+        if (SOCKS5_ADDR_TYPE_DOMAINNAME == addr_type) {
+            req->dst_addr.domain_name[addr_len] = '\0';
+        }
+        memcpy(
+            &req->dst_port,
+            &data[addr_offset + addr_len],
+            PORT_SPACE
+        );
+    }
+
+    if (NULL != consumed) {
+        *consumed = total;
+    }
+
     return TRY_PARSE_OK;    
 }
 
 static enum TryParseConsequence try_parse_client_hello(
     const char data[],
     const size_t space,
-    struct ClientHello* client_hello)
+    struct ClientHello* client_hello,
+    size_t* consumed)
 {
     enum {MIN_SPACE=3};
     if (space < MIN_SPACE) {
@@ -114,6 +187,63 @@ static enum TryParseConsequence try_parse_client_hello(
         client_hello->method_count = method_count;
     }
     
+    *consumed = 2 + method_count;
+    return TRY_PARSE_OK;
+}
+
+/*
+   RFC 1929 2. Once the SOCKS V5 server has started, and the client has
+   selected the Username/Password Authentication protocol, the
+   Username/Password subnegotiation begins.
+
+           +----+------+----------+------+----------+
+           |VER | ULEN |  UNAME   | PLEN |  PASSWD  |
+           +----+------+----------+------+----------+
+           | 1  |  1   | 1 to 255 |  1   | 1 to 255 |
+           +----+------+----------+------+----------+
+*/
+struct UsernamePassword
+{
+    const char* name;
+    uint8_t name_len;
+    const char* password;
+    uint8_t password_len;
+};
+
+/* auth points into data */
+static enum TryParseConsequence try_parse_client_auth(
+    const char data[],
+    const size_t space,
+    struct UsernamePassword* auth,
+    size_t* consumed)
+{
+    enum {ONE=1};
+    if (space < 2) {
+        return TRY_PARSE_UNEXPECTED_END_OF_INPUT;
+    }
+    if (ONE != data[0]) {
+        return TRY_PARSE_ERR;
+    }
+
+    auth->name_len = data[1];
+    if (ZERO == auth->name_len) {
+        return TRY_PARSE_ERR;
+    }
+    if (space < 2 + (size_t)auth->name_len + 1) {
+        return TRY_PARSE_UNEXPECTED_END_OF_INPUT;
+    }
+    auth->name = &data[2];
+
+    auth->password_len = data[2 + auth->name_len];
+    if (ZERO == auth->password_len) {
+        return TRY_PARSE_ERR;
+    }
+    if (space < 2 + (size_t)auth->name_len + 1 + auth->password_len) {
+        return TRY_PARSE_UNEXPECTED_END_OF_INPUT;
+    }
+    auth->password = &data[2 + auth->name_len + 1];
+    *consumed = 2 + (size_t)auth->name_len + 1 + auth->password_len;
+
     return TRY_PARSE_OK;
 }
 
@@ -169,18 +299,10 @@ static int destruct_client_socket(
     return ret;
 }
 
-static int try_destruct_client_socket_ret_arg(
-    struct Socks5Client* socks5_client,
-    const int ret)
-{
-    return try_close_socket_then_ret_arg(
-        socks5_client->inbound_socket_fd,
-        ret
-    );
-}
-
 static int construct_socks5_listener_socket(
-    const struct addrinfo* server_info)
+    const struct addrinfo* server_info,
+    const bool reuse_port,
+    const uint32_t fast_open_backlog)
 {
     const int socket_fd =
         socket(
@@ -209,6 +331,35 @@ static int construct_socks5_listener_socket(
         );
     };
 
+    if (reuse_port
+        && OK !=
+        setsockopt(
+            socket_fd,
+            SOL_SOCKET,
+            SO_REUSEPORT,
+            &yes,
+            sizeof(yes)
+        )
+    ) {
+        return try_close_socket_then_ret_arg(
+            socket_fd,
+            ERR
+        );
+    }
+
+    /* a kernel without server side Fast Open still listens, just without it */
+    if (ZERO != fast_open_backlog) {
+        const int backlog = fast_open_backlog;
+        const int _ignored =
+            setsockopt(
+                socket_fd,
+                IPPROTO_TCP,
+                TCP_FASTOPEN,
+                &backlog,
+                sizeof(backlog)
+            );
+    }
+
     if (OK != set_socket_nonblocking(socket_fd)) {
         return try_close_socket_then_ret_arg(
             socket_fd,
@@ -248,37 +399,153 @@ int socks5server_begin_listening(
     return OK;
 }
 
+
+static int set_socket_nodelay(
+    const int socket_fd)
+{
+    static const int yes = 1;
+    return setsockopt(
+        socket_fd,
+        IPPROTO_TCP,
+        TCP_NODELAY,
+        &yes,
+        sizeof(yes)
+    );
+}
+
+/* defined with the phases it times out */
+static void client_proc_deadline(
+    struct Socks5Server* socks5_server,
+    struct TimerWheelEntry* entry
+);
+
+/* defined after shift_phase, which it calls */
+static void client_proc_attempt_delay(
+    struct Socks5Server* socks5_server,
+    struct TimerWheelEntry* entry
+);
+
+/* defined with the relay it resumes */
+static void client_proc_shaping_refilled(
+    struct Socks5Server* socks5_server,
+    struct TimerWheelEntry* entry
+);
+
+/* defined with the relay legs whose pins it keeps */
+static void client_bury_zerocopy(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client
+);
+
+/* a client's zerocopy legs share one pooled buffer, indexed by these */
+enum {UPSTREAM_ZEROCOPY_LEG=0,DOWNSTREAM_ZEROCOPY_LEG=1};
+enum {ZEROCOPY_LEGS_SIZE=2 * sizeof(struct ZerocopyLeg)};
+
 static int init_client(
     struct Socks5Server* socks5_server,
     struct Socks5Client* socks5_client,
     const int client_socket_fd,
-    struct sockaddr* client_address,
+    struct sockaddr_storage* client_address,
     const socklen_t addr_len)
 {
+    socks5_client->inbound_socket_fd = client_socket_fd;
+    socks5_client->outbound_socket_fd = ERR;
+    socks5_client->upstream_pipe.read_fd = ERR;
+    socks5_client->upstream_pipe.write_fd = ERR;
+    socks5_client->downstream_pipe.read_fd = ERR;
+    socks5_client->downstream_pipe.write_fd = ERR;
+    socks5_client->destination_waiter.next = NULL;
+    socks5_client->destination_waiter.lookup = NULL;
+    socks5_client->destination_answer = NULL;
+    for (int i = 0; i < MAX_OUTBOUND_ATTEMPTS; i++) {
+        socks5_client->outbound_attempts[i].socket_fd = ERR;
+        socks5_client->outbound_attempts[i].subscribed = false;
+        socks5_client->outbound_attempts[i].client = socks5_client;
+        socks5_client->outbound_attempts[i].early_sent = ZERO;
+    }
+    socks5_client->bind_listener.socket_fd = ERR;
+    socks5_client->bind_listener.subscribed = false;
+    socks5_client->bind_listener.client = socks5_client;
+    timer_wheel_entry_construct(
+        &socks5_client->attempt_timer,
+        client_proc_attempt_delay
+    );
+    socks5_client->udp_association = NULL;
+    socks5_client->held_reply_count = ZERO;
+    socks5_client->zerocopy_legs = NULL;
+    timer_wheel_entry_construct(
+        &socks5_client->deadline_timer,
+        client_proc_deadline
+    );
+    socks5_client->deadline = SOCKS5_CLIENT_DEADLINE_NONE;
+    socks5_client->last_active_ms = ZERO;
+    token_bucket_construct(
+        &socks5_client->shaping_bucket,
+        &socks5_server->cfg.client_shaping,
+        socks5_server->now_ms
+    );
+    socks5_client->user_bucket = NULL;
+    timer_wheel_entry_construct(
+        &socks5_client->shaping_timer,
+        client_proc_shaping_refilled
+    );
+    socks5_client->relay_budget = ZERO;
+    socks5_client->relay_weight = 1;
+    socks5_client->runnable = false;
+    socks5_client->prev_runnable = NULL;
+    socks5_client->next_runnable = NULL;
+
     if (OK != set_socket_nonblocking(client_socket_fd)) {
-        return try_destruct_client_socket_ret_arg(
-            socks5_client,
-            ERR
-        );
+        return ERR;
+    }
+
+    const int _ignored = set_socket_nodelay(client_socket_fd);
+
+    if (NULL != client_address) {
+        socks5_client->address = *client_address;
+        socks5_client->addr_len = addr_len;
+    } else {
+        /* accepted without it (multishot accept): source rules and the like still need it */
+        socks5_client->addr_len = sizeof(socks5_client->address);
+        if (OK !=
+            getpeername(
+                client_socket_fd,
+                (struct sockaddr*)&socks5_client->address,
+                &socks5_client->addr_len
+            )
+        ) {
+            const void* _ = memset(&socks5_client->address, ZERO, sizeof(socks5_client->address));
+            socks5_client->addr_len = ZERO;
+        }
     }
-        
-    socks5_client->inbound_socket_fd = client_socket_fd;
-    socks5_client->address = *client_address;
-    socks5_client->addr_len = addr_len;
     socks5_client->status = RECVING_SOCKS5_REQUEST;
     socks5_client->phase = SOCKS5_CLIENT_PHASE_BEGIN_RECVING_CLIENT_VERSION_CHOICE_METHODS_ARRAY_REQ;
+
+    socks5_client->inbound_reads_held = false;
+    socks5_client->tls_handshake = NULL;
+    if (NULL != socks5_server->cfg.tls) {
+        socks5_client->phase = SOCKS5_CLIENT_PHASE_TLS_HANDSHAKE;
+        socks5_client->tls_handshake =
+            tls_handshake_construct(
+                socks5_server->cfg.tls,
+                client_socket_fd
+            );
+        if (NULL == socks5_client->tls_handshake) {
+            return ERR;
+        }
+    }
     return OK;
 }
 
 static int accept_awaiting_connection(
     struct Socks5Server* socks5_server,
-    struct sockaddr* client_address,
+    struct sockaddr_storage* client_address,
     socklen_t* addr_len)
 {
     const int client_socket_fd =
         accept(
             socks5_server->listener_socket_fd,
-            client_address,
+            (struct sockaddr*)client_address,
             addr_len
         );
 
@@ -289,6 +556,18 @@ static int accept_awaiting_connection(
 struct Socks5Client* socks5_server_acquire_client_resources(
     struct Socks5Server* socks5_server)
 {
+    struct Socks5Client* socks5_client =
+        client_slab_acquire(
+            &socks5_server->client_slab
+        );
+    if (NULL != socks5_client) {
+        return socks5_client;
+    }
+
+    if (NULL == socks5_server->cfg.acquire_client_resources) {
+        return NULL;
+    }
+
     return socks5_server->cfg.acquire_client_resources();
 }
 
@@ -296,603 +575,4763 @@ static void socks5_server_relinquish_client_resources(
     struct Socks5Server* socks5_server,
     struct Socks5Client* socks5s_client)
 {
+    if (client_slab_owns(&socks5_server->client_slab, socks5s_client)) {
+        return client_slab_relinquish(
+            &socks5_server->client_slab,
+            socks5s_client
+        );
+    }
+
     return socks5_server->cfg.relenquish_client_resources(socks5s_client);
 }
 
-static int client_destruct(
+static int server_track_client_socket(
     struct Socks5Server* socks5_server,
-    struct Socks5Client* socks5_client)
+    struct Socks5Client* socks5_client,
+    const int* socket_fd)
 {
-    int ret = OK;
-    const void* hash_value =
-        hash_add(
-            &socks5_server->clients,
-            (const char*)&socks5_client->inbound_socket_fd,
-            sizeof(socks5_client->inbound_socket_fd),
-            NULL
-        );
-    if (socks5_client != 
-        hash_value
-    ) {
-        ret = ERR;
-    }
-
-    if (OK != 
-        socks5_server->cfg.unsub_all_socket_events(
-            socks5_server,
-            socks5_client->inbound_socket_fd
-        )
-    ) {
-        ret = ERR;
-    } 
-
-    if (OK != destruct_client_socket(socks5_client) && ret != ERR) {
-        ret = ERR;
-    }
-
-    socks5_client->inbound_socket_fd = ZERO;
-
-    socks5_server_relinquish_client_resources(
-        socks5_server,
+    return client_table_track(
+        &socks5_server->clients,
+        *socket_fd,
         socks5_client
     );
-
-    return ret;
 }
 
-static enum AdvancePhaseConsequence destruct_client_ret_phase_err(
+static int server_untrack_client_socket(
     struct Socks5Server* socks5_server,
-    struct Socks5Client* socks5_client)
+    struct Socks5Client* socks5_client,
+    const int* socket_fd)
 {
-    const int _ignored = 
-        client_destruct(
-            socks5_server,
-            socks5_client
-        );
-    
-    return ADVANCE_PHASE_ERR;
+    return client_table_untrack(
+        &socks5_server->clients,
+        *socket_fd,
+        socks5_client
+    );
 }
 
-static enum AdvancePhaseConsequence proc_new_connection_event(
-    struct Socks5Server* socks5_server)
+/* an event handed back with a client's socket context needs no fd lookup */
+static_assert(
+    _Alignof(struct Socks5Client) > SOCKET_CONTEXT_ROLE_MASK,
+    "socket role is kept in the low bits of the client pointer"
+);
+
+static void* client_socket_context(
+    struct Socks5Client* socks5_client,
+    const int socket_fd)
 {
+    return socket_context_of(
+        socks5_client,
+        socket_fd == socks5_client->outbound_socket_fd
+        ? SOCKET_CONTEXT_OUTBOUND
+        : SOCKET_CONTEXT_INBOUND
+    );
+}
 
-    struct sockaddr client_addr = {0};
-    socklen_t addr_len = 0;
-    const int client_socket_fd =
-        accept_awaiting_connection(
-            socks5_server,
-            &client_addr,
-            &addr_len
-        );
-    if (ERR == 
-        client_socket_fd
-    ) {
-        if (EAGAIN == errno) {
-            return ADVANCE_PHASE_IOBLOCKED_AGAIN;
-        }
+static_assert(
+    _Alignof(struct ClientSocket) > SOCKET_CONTEXT_ROLE_MASK,
+    "socket role is kept in the low bits of the client socket pointer"
+);
 
-        return ADVANCE_PHASE_ERR;
+static struct Socks5Client* client_of_socket_context(
+    void* context,
+    int* socket_fd)
+{
+    if (SOCKET_CONTEXT_CLIENT_SOCKET == socket_context_role(context)) {
+        const struct ClientSocket* client_socket =
+            socket_context_owner(context);
+        *socket_fd = client_socket->socket_fd;
+        return client_socket->client;
     }
 
     struct Socks5Client* socks5_client =
-        socks5_server_acquire_client_resources(
-            socks5_server);
+        socket_context_owner(context);
 
-    assert(NULL != socks5_client);
+    *socket_fd =
+        SOCKET_CONTEXT_OUTBOUND == socket_context_role(context)
+        ? socks5_client->outbound_socket_fd
+        : socks5_client->inbound_socket_fd;
 
-    const void* _ = 
-        memset(
-            socks5_client,
-            ZERO,
-            sizeof(struct Socks5Client)
-        );
+    return socks5_client;
+}
 
-    if (OK !=
-        init_client(
-            socks5_server,
+static struct SocketInterest* client_socket_interest(
+    struct Socks5Client* socks5_client,
+    const int socket_fd)
+{
+    return socket_fd == socks5_client->outbound_socket_fd
+        ? &socks5_client->outbound_interest
+        : &socks5_client->inbound_interest;
+}
+
+/*
+    Only records the change; the event source hears about it when the
+    server's interest queue is flushed, once per batch.
+*/
+static void client_want_events(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    const int socket_fd,
+    const enum FDIOEvent events,
+    const bool wanted)
+{
+    struct SocketInterest* interest =
+        client_socket_interest(
             socks5_client,
-            client_socket_fd,
-            &client_addr,
-            addr_len
-        )
-    ) {
-        return destruct_client_ret_phase_err(
-            socks5_server,
-            socks5_client
+            socket_fd
         );
-    }
 
-    if (NULL != 
-        hash_add(
-            &socks5_server->clients,
-            (const char*)&socks5_client->inbound_socket_fd,
-            sizeof(socks5_client->inbound_socket_fd),
-            socks5_client
-        )
+    interest->wanted =
+        wanted
+        ? interest->wanted | events
+        : interest->wanted & ~events;
+
+    if (interest->wanted == interest->registered
+        || socks5_client->interest_queued
     ) {
-        return destruct_client_ret_phase_err(
-            socks5_server,
-            socks5_client
-        );
+        return;
     }
 
-    return socks5_server->cfg.sub_to_socket_read_activity_event(
-            socks5_server,
-            socks5_client->inbound_socket_fd
-    ) 
-    == OK 
-    ? ADVANCE_PHASE_OK 
-    : ADVANCE_PHASE_ERR;
+    socks5_client->interest_queued = true;
+    socks5_client->next_interest_queued = socks5_server->interest_queue;
+    socks5_server->interest_queue = socks5_client;
 }
 
-static int send_what_may(
-    const int socket_fd,
-    const void* space,
-    const size_t zero_point,
-    const size_t time,
-    bool *blocked_eagain) 
+static int client_sub_write_activity_of(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    const int socket_fd)
 {
-    assert(zero_point < time);
+    client_want_events(
+        socks5_server,
+        socks5_client,
+        socket_fd,
+        FDIOEVENT_WRITABLE,
+        true
+    );
+    return OK;
+}
 
-    const ptrdiff_t last_i = time - 1;
-    
-    ptrdiff_t i = zero_point;
-    const ptrdiff_t total_amount_of_space_to_send = time - i;
-    
-    int total_sent = 0;
+static int client_unsub_write_activity_of(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    const int socket_fd)
+{
+    client_want_events(
+        socks5_server,
+        socks5_client,
+        socket_fd,
+        FDIOEVENT_WRITABLE,
+        false
+    );
+    return OK;
+}
 
-    for (;;) {
-        if (total_sent >= total_amount_of_space_to_send) {
-            return total_sent;
-        }
+static int client_sub_read_activity_of(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    const int socket_fd)
+{
+    client_want_events(
+        socks5_server,
+        socks5_client,
+        socket_fd,
+        FDIOEVENT_READABLE,
+        true
+    );
+    return OK;
+}
 
-        const size_t remaining_time = time - i;
-        const int sent =
-            send(
-                socket_fd,
-                &space[i],
-                remaining_time,
-                ZERO
-            );
-        if (sent == ZERO) {
-            return total_sent;
-        }
-        if (sent == ERR && errno == EAGAIN) {
-            if (NULL != blocked_eagain) {
-                *blocked_eagain = true;
-            }
-            return total_sent;
-        } else if (sent == ERR) {
-            return ERR;
-        }
-
-        i += sent;
-        total_sent += sent;
-    }
-}
-
-static bool client_write_blocked_and_need_noti_on_writable(
-    const struct Socks5Client* socks5_client)
+static int client_unsub_read_activity_of(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    const int socket_fd)
 {
-    return socks5_client->inbound_write_subscribed_socket_fd > 0
-        && socks5_client->io.to_send > 0;
+    client_want_events(
+        socks5_server,
+        socks5_client,
+        socket_fd,
+        FDIOEVENT_READABLE,
+        false
+    );
+    return OK;
 }
 
-static int client_send_whatmayof_iobuf(
+static int client_flush_socket_interest(
     struct Socks5Server* socks5_server,
-    struct Socks5Client* socks5_client)
+    struct Socks5Client* socks5_client,
+    const int socket_fd)
 {
-    const int max = socks5_client->io.to_send;
-    enum {SIZE_OF_SEND_SPACE=sizeof(socks5_client->io.send_space)};
+    if (ERR == socket_fd) {
+        return OK;
+    }
 
-    bool blocked_eagain = false;
-    const int sent = 
-        send_what_may(
-            socks5_client->inbound_socket_fd,
-            socks5_client->io.send_space,
-            socks5_client->io.sent,
-            socks5_client->io.to_send,
-            &blocked_eagain
+    struct SocketInterest* interest =
+        client_socket_interest(
+            socks5_client,
+            socket_fd
         );
-    if (ERR == sent) {
+    if (interest->wanted == interest->registered) {
+        return OK;
+    }
+
+    void* context =
+        client_socket_context(
+            socks5_client,
+            socket_fd
+        );
+    const int applied =
+        interest->subscribed
+        ? socks5_server->cfg.modify_socket_interest(
+            socks5_server,
+            socket_fd,
+            interest->wanted,
+            context
+        )
+        : socks5_server->cfg.subscribe_socket(
+            socks5_server,
+            socket_fd,
+            interest->wanted,
+            context
+        );
+    if (OK != applied) {
         return ERR;
     }
 
-    socks5_client->io.sent += sent;
-    socks5_client->io.to_send -= sent;
+    interest->subscribed = true;
+    interest->registered = interest->wanted;
+    return OK;
+}
 
-    if (blocked_eagain) {
+static int client_unsubscribe_socket(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    const int socket_fd)
+{
+    struct SocketInterest* interest =
+        client_socket_interest(
+            socks5_client,
+            socket_fd
+        );
 
-        if (client_write_blocked_and_need_noti_on_writable(socks5_client)) {
-            const int duplicated = dup(socks5_client->inbound_socket_fd);
-            if (ERR == duplicated) {
-                return ERR;
-            }
-            if (OK !=
-                socks5_server->cfg.sub_to_socket_write_activity_event(
-                    socks5_server,
-                    duplicated
-                )
-            ) {
-                const int _ = close_socket(duplicated);
-                return ERR;
-            }
-            socks5_client->inbound_write_subscribed_socket_fd = duplicated;
-        } else if (ZERO == socks5_client->io.to_send) {
-            if (OK !=
-                socks5_server->cfg.unsub_to_socket_write_activity_event(
-                    socks5_server,
-                    socks5_client->inbound_socket_fd
-                )
-            ) {
-                return ERR;
-            }
-            socks5_client->io.sent = ZERO;
-            
-            if (socks5_client->inbound_write_subscribed_socket_fd > 0) {
-                if (OK != close_socket(socks5_client->inbound_write_subscribed_socket_fd)) {
-                    return ERR;
-                }
-                socks5_client->inbound_write_subscribed_socket_fd = ERR;
-            }
-        }
+    const bool subscribed = interest->subscribed;
+    interest->wanted = ZERO;
+    interest->registered = ZERO;
+    interest->subscribed = false;
 
+    if (!subscribed) {
+        return OK;
     }
 
-    return OK;
+    return socks5_server->cfg.unsubscribe_socket(
+        socks5_server,
+        socket_fd
+    );
 }
 
-static int recv_what_may(
-    const int socket_fd,
-    void* space,
-    const size_t zero_point,
-    const size_t time,
-    bool* end_of_stream)
+static int client_destruct_outbound(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
 {
-    assert(zero_point < time);
+    if (ERR == socks5_client->outbound_socket_fd) {
+        return OK;
+    }
 
-    const ptrdiff_t last_i = time - 1;
-    
-    ptrdiff_t i = zero_point;
-    const size_t total_amount_of_space_to_recv = time - i;
+    int ret = OK;
 
-    int total_read = 0;
+    if (OK !=
+        server_untrack_client_socket(
+            socks5_server,
+            socks5_client,
+            &socks5_client->outbound_socket_fd
+        )
+    ) {
+        ret = ERR;
+    }
 
-    for (;;) {
-        if (total_read >= total_amount_of_space_to_recv) {
-            return total_read;
-        }
+    if (OK !=
+        client_unsubscribe_socket(
+            socks5_server,
+            socks5_client,
+            socks5_client->outbound_socket_fd
+        )
+    ) {
+        ret = ERR;
+    }
 
-        const size_t remaining_time = time - i;
-        const int read =
-            recv(
-                socket_fd,
-                &space[i],
-                remaining_time,
-                ZERO
-            );
-        if (ZERO == read) {
-            if (NULL != end_of_stream) {
-                *end_of_stream = true;
-            }
-            return total_read;
-        }
+    if (OK != close_socket(socks5_client->outbound_socket_fd)) {
+        ret = ERR;
+    }
 
-        if (ERR == read && errno == EAGAIN) {
-            return total_read;
-        } else if (ERR == read) {
-            return ERR;
-        }
+    socks5_client->outbound_socket_fd = ERR;
 
-        i += read;
-        total_read += read;
-    }
+    return ret;
 }
 
-static int client_recv_whatmayof_iobuff(
-    struct Socks5Client* socks5_client)
-{    
-    enum {RECV_TEMP_SPACE_LASTI=sizeof(socks5_client->io.recv_space) - 1};
-    enum {B=sizeof(socks5_client->io.recv_space)};
+/* RFC 8305 5: the recommended Connection Attempt Delay */
+enum {CONNECTION_ATTEMPT_DELAY_MS=250};
 
-    ptrdiff_t index = socks5_client->io.recvd;
+static int64_t monotonic_ms(void)
+{
+    struct timespec ts = {0};
+    const int _ignored = clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    if (index > RECV_TEMP_SPACE_LASTI) {
-        return ERR;
+static void server_unqueue_runnable(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
+{
+    if (!socks5_client->runnable) {
+        return;
     }
 
-    ptrdiff_t space_remaining =
-        &socks5_client->io.recv_space[RECV_TEMP_SPACE_LASTI] - &socks5_client->io.recv_space[index];
-
-    if (space_remaining <= 0) {
-        return ERR;
+    if (NULL != socks5_client->prev_runnable) {
+        socks5_client->prev_runnable->next_runnable =
+            socks5_client->next_runnable;
+    } else {
+        socks5_server->run_queue_head = socks5_client->next_runnable;
     }
-
-    bool end_of_stream = false;
-    const int read =
-        recv_what_may(
-            socks5_client->inbound_socket_fd,
-            socks5_client->io.recv_space,
-            socks5_client->io.recvd,
-            sizeof(socks5_client->io.recv_space),
-            &end_of_stream
-        );
-
-    if (ERR == read || end_of_stream) {
-        return ERR;
+    if (NULL != socks5_client->next_runnable) {
+        socks5_client->next_runnable->prev_runnable =
+            socks5_client->prev_runnable;
+    } else {
+        socks5_server->run_queue_tail = socks5_client->prev_runnable;
     }
 
-    socks5_client->io.recvd += read;
-
-    return OK;
+    socks5_client->prev_runnable = NULL;
+    socks5_client->next_runnable = NULL;
+    socks5_client->runnable = false;
+    socks5_server->runnable_count--;
 }
 
-static int server_choose_auth_method(
-    const struct ClientHello* client_hello,
-    int* choice)
+static void server_queue_runnable(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
 {
-    for (ptrdiff_t i = 0; i < client_hello->method_count; i++) {
-        const uint8_t method =
-            client_hello->methods[i];
-        if (ZERO == method) {
-            *choice = ZERO;
-            return OK;
-        }
+    if (socks5_client->runnable) {
+        return;
     }
-    return ERR;
-}
 
+    socks5_client->runnable = true;
+    socks5_client->prev_runnable = socks5_server->run_queue_tail;
+    socks5_client->next_runnable = NULL;
 
-static int client_set_sendiobuf(
+    if (NULL != socks5_server->run_queue_tail) {
+        socks5_server->run_queue_tail->next_runnable = socks5_client;
+    } else {
+        socks5_server->run_queue_head = socks5_client;
+    }
+    socks5_server->run_queue_tail = socks5_client;
+    socks5_server->runnable_count++;
+}
+
+static int client_close_outbound_attempt(
+    struct Socks5Server* socks5_server,
     struct Socks5Client* socks5_client,
-    const char* space,
-    const size_t time)
+    struct ClientSocket* attempt)
 {
-    enum {MAX_TIME=sizeof(socks5_client->io.send_space)};
-
-    if (time >= MAX_TIME) {
-        return ERR;
+    if (ERR == attempt->socket_fd) {
+        return OK;
     }
-    const void* _ =
-        memmove(
-            socks5_client->io.send_space,
-            space,
-            time
+
+    int ret =
+        server_untrack_client_socket(
+            socks5_server,
+            socks5_client,
+            &attempt->socket_fd
         );
 
-    socks5_client->io.sent = ZERO;
-    socks5_client->io.to_send = time;
+    if (attempt->subscribed
+        && OK !=
+        socks5_server->cfg.unsubscribe_socket(
+            socks5_server,
+            attempt->socket_fd
+        )
+    ) {
+        ret = ERR;
+    }
+
+    if (OK != close_socket(attempt->socket_fd)) {
+        ret = ERR;
+    }
 
-    return OK;
+    attempt->socket_fd = ERR;
+    attempt->subscribed = false;
+    attempt->early_sent = ZERO;
+    return ret;
 }
 
-static enum AdvancePhaseConsequence
-phase_shift_server_choose_auth_method_and_send(
+static int client_close_outbound_attempts(
     struct Socks5Server* socks5_server,
     struct Socks5Client* socks5_client)
 {
-    struct ClientHello* client_hello =
-        &socks5_client->current_request.client_hello;
-    
-    int choice = 0;
-    if (OK !=
-        server_choose_auth_method(
-            client_hello,
-            &choice
-        )
-    ) {
-        return ERR;
+    int ret = OK;
+    for (int i = 0; i < MAX_OUTBOUND_ATTEMPTS; i++) {
+        if (OK !=
+            client_close_outbound_attempt(
+                socks5_server,
+                socks5_client,
+                &socks5_client->outbound_attempts[i]
+            )
+        ) {
+            ret = ERR;
+        }
     }
 
-/*
-   The server selects from one of the methods given in METHODS, and
-   sends a METHOD selection message:
+    timer_wheel_unarm(
+        &socks5_server->timers,
+        &socks5_client->attempt_timer
+    );
+    return ret;
+}
 
-                         +----+--------+
-                         |VER | METHOD |
-                         +----+--------+
-                         | 1  |   1    |
-                         +----+--------+
-*/
-    enum {TWO=2};
-    char tmp[TWO] = {0x05, choice};
+/* back to the pool, whatever it has queued for accepting dropped */
+static int client_close_bind_listener(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
+{
+    struct ClientSocket* listener = &socks5_client->bind_listener;
+    if (ERR == listener->socket_fd) {
+        return OK;
+    }
 
-    if (OK !=
-        client_set_sendiobuf(
+    int ret =
+        server_untrack_client_socket(
+            socks5_server,
             socks5_client,
-            tmp,
-            TWO
+            &listener->socket_fd
+        );
+
+    if (listener->subscribed
+        && OK !=
+        socks5_server->cfg.unsubscribe_socket(
+            socks5_server,
+            listener->socket_fd
         )
     ) {
-        return ERR;
+        ret = ERR;
     }
 
-    return client_send_whatmayof_iobuf(
-        socks5_server,
-        socks5_client
-    )
-    != OK
-    ? ADVANCE_PHASE_ERR
-    : ADVANCE_PHASE_OK;
+    listener_pool_relinquish(
+        &socks5_server->bind_listeners,
+        listener->socket_fd
+    );
+
+    listener->socket_fd = ERR;
+    listener->subscribed = false;
+    return ret;
 }
 
-static enum AdvancePhaseConsequence phase_tryshift_tryparse_client_recvbuff_for_req(
+static void client_release_destination(
     struct Socks5Server* socks5_server,
     struct Socks5Client* socks5_client)
 {
-    if (socks5_client->io.recvd < 9) {
-        return ADVANCE_PHASE_IOBLOCKED_AGAIN;
-    }
+    dns_resolver_cancel(
+        socks5_server->resolver,
+        &socks5_client->destination_waiter
+    );
+    dns_answer_release(socks5_client->destination_answer);
+    socks5_client->destination_answer = NULL;
+}
 
-    const char* recv_space =
-        socks5_client->io.recv_space;
-    
-    switch (
-        try_parse_client_request(
-            socks5_client->io.recv_space,
-            socks5_client->io.recvd,
-            &socks5_client->current_request.client_request
-        )
+static int client_destruct(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
+{
+    client_bury_zerocopy(
+        socks5_server,
+        socks5_client
+    );
+    io_buffer_pool_relinquish(
+        &socks5_server->io_buffers,
+        (char*)socks5_client->zerocopy_legs,
+        ZEROCOPY_LEGS_SIZE
+    );
+    socks5_client->zerocopy_legs = NULL;
+
+    timer_wheel_unarm(
+        &socks5_server->timers,
+        &socks5_client->deadline_timer
+    );
+    timer_wheel_unarm(
+        &socks5_server->timers,
+        &socks5_client->shaping_timer
+    );
+    server_unqueue_runnable(
+        socks5_server,
+        socks5_client
+    );
+
+    int ret =
+        client_destruct_outbound(
+            socks5_server,
+            socks5_client
+        );
+
+    if (OK !=
+        client_close_outbound_attempts(
+            socks5_server,
+            socks5_client
+        )
+    ) {
+        ret = ERR;
+    }
+
+    if (OK !=
+        client_close_bind_listener(
+            socks5_server,
+            socks5_client
+        )
+    ) {
+        ret = ERR;
+    }
+
+    if (NULL != socks5_client->udp_association
+        && OK !=
+        udp_association_destruct(
+            socks5_server,
+            socks5_client->udp_association
+        )
+    ) {
+        ret = ERR;
+    }
+    socks5_client->udp_association = NULL;
+
+    if (NULL != socks5_client->tls_handshake) {
+        tls_handshake_destruct(socks5_client->tls_handshake);
+        socks5_client->tls_handshake = NULL;
+    }
+
+    if (OK !=
+        server_untrack_client_socket(
+            socks5_server,
+            socks5_client,
+            &socks5_client->inbound_socket_fd
+        )
+    ) {
+        ret = ERR;
+    }
+
+    if (OK !=
+        client_unsubscribe_socket(
+            socks5_server,
+            socks5_client,
+            socks5_client->inbound_socket_fd
+        )
+    ) {
+        ret = ERR;
+    }
+
+    if (OK != destruct_client_socket(socks5_client) && ret != ERR) {
+        ret = ERR;
+    }
+
+    socks5_client->inbound_socket_fd = ZERO;
+
+    io_buffer_pool_relinquish(
+        &socks5_server->io_buffers,
+        socks5_client->io.recv_space,
+        socks5_client->io.recv_capacity
+    );
+    io_buffer_pool_relinquish(
+        &socks5_server->io_buffers,
+        socks5_client->io.send_space,
+        socks5_client->io.send_capacity
+    );
+    socks5_client->io.recv_space = NULL;
+    socks5_client->io.send_space = NULL;
+
+    pipe_pool_relinquish(
+        &socks5_server->pipes,
+        &socks5_client->upstream_pipe
+    );
+    pipe_pool_relinquish(
+        &socks5_server->pipes,
+        &socks5_client->downstream_pipe
+    );
+
+    client_release_destination(
+        socks5_server,
+        socks5_client
+    );
+
+    socks5_client->destructed = true;
+    if (socks5_server->batch_depth > ZERO) {
+        socks5_client->next_destructed = socks5_server->destructed_clients;
+        socks5_server->destructed_clients = socks5_client;
+        return ret;
+    }
+
+    socks5_server_relinquish_client_resources(
+        socks5_server,
+        socks5_client
+    );
+
+    return ret;
+}
+
+static enum AdvancePhaseConsequence destruct_client_ret_phase_err(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
+{
+    const int _ignored =
+        client_destruct(
+            socks5_server,
+            socks5_client
+        );
+
+    return ADVANCE_PHASE_ERR;
+}
+
+static enum Socks5ClientDeadline deadline_of_phase(
+    const enum Socks5ClientPhase phase)
+{
+    switch (phase) {
+        case SOCKS5_CLIENT_PHASE_TLS_HANDSHAKE:
+        case SOCKS5_CLIENT_PHASE_BEGIN_RECVING_CLIENT_VERSION_CHOICE_METHODS_ARRAY_REQ:
+        case SOCKS5_CLIENT_PHASE_AWAITING_EVENT_RECVD_CLIENT_VERSION_CHOICE_METHODS_ARRAY_REQ:
+        case SOCKS5_CLIENT_PHASE_BEGIN_SENDING_AUTH_METHOD_CHOICE_RESP:
+        case SOCKS5_CLIENT_PHASE_AWAITING_EVENT_SENT_AUTH_METHOD_CHOICE_RESP:
+        case SOCKS5_CLIENT_PHASE_RECV_REQUEST:
+            return SOCKS5_CLIENT_DEADLINE_HANDSHAKE;
+        case SOCKS5_CLIENT_PHASE_RECV_USERNAME_PASSWORD_AUTH:
+            return SOCKS5_CLIENT_DEADLINE_AUTH;
+        case SOCKS5_CLIENT_PHASE_BEGIN_RESOLVING_DESTINATION:
+        case SOCKS5_CLIENT_PHASE_AWAITING_EVENT_DESTINATION_RESOLVED:
+        case SOCKS5_CLIENT_PHASE_BEGIN_CONNECTING_OUTBOUND:
+        case SOCKS5_CLIENT_PHASE_AWAITING_EVENT_OUTBOUND_CONNECTED:
+        case SOCKS5_CLIENT_PHASE_BEGIN_BINDING:
+        case SOCKS5_CLIENT_PHASE_AWAITING_EVENT_BIND_ACCEPTED:
+        case SOCKS5_CLIENT_PHASE_BEGIN_ASSOCIATING_UDP:
+        case SOCKS5_CLIENT_PHASE_BEGIN_SENDING_REQUEST_REPLY:
+            return SOCKS5_CLIENT_DEADLINE_CONNECT;
+        case SOCKS5_CLIENT_PHASE_RELAYING:
+        case SOCKS5_CLIENT_PHASE_RELAYING_DATAGRAMS:
+            return SOCKS5_CLIENT_DEADLINE_IDLE;
+        default:
+            return SOCKS5_CLIENT_DEADLINE_NONE;
+    }
+}
+
+static uint32_t timeout_ms_of_deadline(
+    const struct Socks5ServerCfg* cfg,
+    const enum Socks5ClientDeadline deadline)
+{
+    switch (deadline) {
+        case SOCKS5_CLIENT_DEADLINE_HANDSHAKE:
+            return cfg->handshake_timeout_ms;
+        case SOCKS5_CLIENT_DEADLINE_AUTH:
+            return cfg->auth_timeout_ms;
+        case SOCKS5_CLIENT_DEADLINE_CONNECT:
+            return cfg->connect_timeout_ms;
+        case SOCKS5_CLIENT_DEADLINE_IDLE:
+            return cfg->idle_timeout_ms;
+        case SOCKS5_CLIENT_DEADLINE_NONE: default:
+            return ZERO;
+    }
+}
+
+/* the deadline is armed afresh only when the phase is held to a different one */
+static void client_track_deadline(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
+{
+    const enum Socks5ClientDeadline deadline =
+        deadline_of_phase(socks5_client->phase);
+    if (deadline == socks5_client->deadline) {
+        return;
+    }
+
+    socks5_client->deadline = deadline;
+    socks5_client->last_active_ms = socks5_server->now_ms;
+
+    const uint32_t timeout_ms =
+        timeout_ms_of_deadline(
+            &socks5_server->cfg,
+            deadline
+        );
+    if (ZERO == timeout_ms) {
+        timer_wheel_unarm(
+            &socks5_server->timers,
+            &socks5_client->deadline_timer
+        );
+        return;
+    }
+
+    timer_wheel_arm(
+        &socks5_server->timers,
+        &socks5_client->deadline_timer,
+        socks5_server->now_ms + timeout_ms
+    );
+}
+
+static enum AdvancePhaseConsequence server_adopt_connection(
+    struct Socks5Server* socks5_server,
+    const int client_socket_fd,
+    struct sockaddr_storage* client_addr,
+    const socklen_t addr_len)
+{
+    struct Socks5Client* socks5_client =
+        socks5_server_acquire_client_resources(
+            socks5_server);
+
+    if (NULL == socks5_client) {
+        const int _ignored = close_socket(client_socket_fd);
+        return ADVANCE_PHASE_OK;
+    }
+
+    const void* _ =
+        memset(
+            socks5_client,
+            ZERO,
+            sizeof(struct Socks5Client)
+        );
+
+    if (OK !=
+        init_client(
+            socks5_server,
+            socks5_client,
+            client_socket_fd,
+            client_addr,
+            addr_len
+        )
+    ) {
+        const int _ignored = close_socket(client_socket_fd);
+        socks5_server_relinquish_client_resources(
+            socks5_server,
+            socks5_client
+        );
+        return ADVANCE_PHASE_OK;
+    }
+
+    if (OK !=
+        server_track_client_socket(
+            socks5_server,
+            socks5_client,
+            &socks5_client->inbound_socket_fd
+        )
+    ) {
+        return destruct_client_ret_phase_err(
+            socks5_server,
+            socks5_client
+        );
+    }
+
+    const int _ignored =
+        client_sub_read_activity_of(
+            socks5_server,
+            socks5_client,
+            socks5_client->inbound_socket_fd
+        );
+
+    /* a client that never sends a byte is timed out all the same */
+    client_track_deadline(
+        socks5_server,
+        socks5_client
+    );
+
+    return ADVANCE_PHASE_OK;
+}
+
+static enum AdvancePhaseConsequence proc_new_connection_event(
+    struct Socks5Server* socks5_server)
+{
+
+    struct sockaddr_storage client_addr = {0};
+    socklen_t addr_len = sizeof(client_addr);
+    const int client_socket_fd =
+        accept_awaiting_connection(
+            socks5_server,
+            &client_addr,
+            &addr_len
+        );
+    if (ERR ==
+        client_socket_fd
+    ) {
+        if (EAGAIN == errno || EWOULDBLOCK == errno) {
+            return ADVANCE_PHASE_IOBLOCKED_AGAIN;
+        }
+
+        return ADVANCE_PHASE_ERR;
+    }
+
+    return server_adopt_connection(
+        socks5_server,
+        client_socket_fd,
+        &client_addr,
+        addr_len
+    );
+}
+
+static int send_what_may(
+    const int socket_fd,
+    const void* space,
+    const size_t zero_point,
+    const size_t time,
+    bool *blocked_eagain)
+{
+    assert(zero_point < time);
+
+    const ptrdiff_t last_i = time - 1;
+
+    ptrdiff_t i = zero_point;
+    const ptrdiff_t total_amount_of_space_to_send = time - i;
+
+    int total_sent = 0;
+
+    for (;;) {
+        if (total_sent >= total_amount_of_space_to_send) {
+            return total_sent;
+        }
+
+        const size_t remaining_time = time - i;
+        const int sent =
+            send(
+                socket_fd,
+                &space[i],
+                remaining_time,
+                MSG_NOSIGNAL
+            );
+        if (sent == ZERO) {
+            return total_sent;
+        }
+        if (sent == ERR && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (NULL != blocked_eagain) {
+                *blocked_eagain = true;
+            }
+            return total_sent;
+        } else if (sent == ERR && errno == EINTR) {
+            continue;
+        } else if (sent == ERR) {
+            return ERR;
+        }
+
+        i += sent;
+        total_sent += sent;
+    }
+}
+
+/*
+    One direction of a tunnel. (*space)[*start, *end) is what is still
+    owed to dst from the buffered path; pipe is only used once spliced.
+    During the handshake the same legs describe the request and reply
+    buffers.
+*/
+struct RelayLeg
+{
+    int src_socket_fd;
+    int dst_socket_fd;
+    char** space;
+    size_t* capacity;
+    ptrdiff_t* start;
+    ptrdiff_t* end;
+    bool* src_end_of_stream;
+    bool* dst_shut_wr;
+    struct PipePair* pipe;
+    /* NULL: the client sends no zerocopy */
+    struct ZerocopyLeg* zerocopy;
+};
+
+static struct ZerocopyLeg* client_zerocopy_leg(
+    struct Socks5Client* socks5_client,
+    const ptrdiff_t which)
+{
+    return NULL == socks5_client->zerocopy_legs
+        ? NULL
+        : &socks5_client->zerocopy_legs[which];
+}
+
+static struct RelayLeg client_upstream_leg(
+    struct Socks5Client* socks5_client)
+{
+    return (struct RelayLeg) {
+        .src_socket_fd = socks5_client->inbound_socket_fd,
+        .dst_socket_fd = socks5_client->outbound_socket_fd,
+        .space = &socks5_client->io.recv_space,
+        .capacity = &socks5_client->io.recv_capacity,
+        .start = &socks5_client->io.forwarded,
+        .end = &socks5_client->io.recvd,
+        .src_end_of_stream = &socks5_client->inbound_end_of_stream,
+        .dst_shut_wr = &socks5_client->outbound_shut_wr,
+        .pipe = &socks5_client->upstream_pipe,
+        .zerocopy = client_zerocopy_leg(socks5_client, UPSTREAM_ZEROCOPY_LEG)
+    };
+}
+
+static struct RelayLeg client_downstream_leg(
+    struct Socks5Client* socks5_client)
+{
+    return (struct RelayLeg) {
+        .src_socket_fd = socks5_client->outbound_socket_fd,
+        .dst_socket_fd = socks5_client->inbound_socket_fd,
+        .space = &socks5_client->io.send_space,
+        .capacity = &socks5_client->io.send_capacity,
+        .start = &socks5_client->io.sent,
+        .end = &socks5_client->io.to_send,
+        .src_end_of_stream = &socks5_client->outbound_end_of_stream,
+        .dst_shut_wr = &socks5_client->inbound_shut_wr,
+        .pipe = &socks5_client->downstream_pipe,
+        .zerocopy = client_zerocopy_leg(socks5_client, DOWNSTREAM_ZEROCOPY_LEG)
+    };
+}
+
+/* pins released once every zerocopy send from them is done; all: regardless */
+static void server_release_zerocopy_pins(
+    struct Socks5Server* socks5_server,
+    struct ZerocopyLeg* zerocopy,
+    const bool all)
+{
+    uint8_t kept = ZERO;
+    for (ptrdiff_t i = 0; i < zerocopy->pin_count; i++) {
+        const struct ZerocopyPin pin = zerocopy->pins[i];
+        if (!all && !zerocopy_done(zerocopy, pin.sends_through)) {
+            zerocopy->pins[kept++] = pin;
+            continue;
+        }
+        io_buffer_pool_relinquish(
+            &socks5_server->io_buffers,
+            pin.space,
+            pin.capacity
+        );
+    }
+    zerocopy->pin_count = kept;
+}
+
+/* back to the pool, or pinned while zerocopy sends from it are in flight */
+static void leg_let_go_of_space(
+    struct Socks5Server* socks5_server,
+    const struct RelayLeg* leg,
+    char* space,
+    const size_t capacity)
+{
+    struct ZerocopyLeg* zerocopy = leg->zerocopy;
+    const bool pinned =
+        NULL != zerocopy
+        && zerocopy->space_sent
+        && !zerocopy_done(zerocopy, zerocopy->space_sends_through);
+    if (NULL != zerocopy) {
+        zerocopy->space_sent = false;
+    }
+
+    if (!pinned) {
+        io_buffer_pool_relinquish(
+            &socks5_server->io_buffers,
+            space,
+            capacity
+        );
+        return;
+    }
+
+    /* a leg only sends zerocopy from a buffer it has a pin left for */
+    assert(zerocopy->pin_count < MAX_ZEROCOPY_PINS);
+    zerocopy->pins[zerocopy->pin_count++] =
+        (struct ZerocopyPin) {
+            .space = space,
+            .capacity = capacity,
+            .sends_through = zerocopy->space_sends_through
+        };
+}
+
+static void leg_relinquish_space(
+    struct Socks5Server* socks5_server,
+    const struct RelayLeg* leg)
+{
+    leg_let_go_of_space(
+        socks5_server,
+        leg,
+        *leg->space,
+        *leg->capacity
+    );
+    *leg->space = NULL;
+    *leg->capacity = ZERO;
+    *leg->start = ZERO;
+    *leg->end = ZERO;
+}
+
+/*
+    Makes room for `more` bytes past *end, moving what is pending into a
+    buffer of the next size class when the held one is too small.
+*/
+static int leg_reserve_space(
+    struct Socks5Server* socks5_server,
+    const struct RelayLeg* leg,
+    const size_t more)
+{
+    if (NULL != *leg->space && *leg->end + more <= *leg->capacity) {
+        return OK;
+    }
+
+    const size_t pending = *leg->end - *leg->start;
+    size_t capacity = ZERO;
+    char* space =
+        io_buffer_pool_acquire(
+            &socks5_server->io_buffers,
+            pending + more,
+            &capacity
+        );
+    if (NULL == space) {
+        return ERR;
+    }
+
+    if (pending > ZERO) {
+        const void* _ =
+            memcpy(
+                space,
+                &(*leg->space)[*leg->start],
+                pending
+            );
+    }
+
+    leg_let_go_of_space(
+        socks5_server,
+        leg,
+        *leg->space,
+        *leg->capacity
+    );
+    *leg->space = space;
+    *leg->capacity = capacity;
+    *leg->start = ZERO;
+    *leg->end = pending;
+
+    return OK;
+}
+
+static int leg_append(
+    struct Socks5Server* socks5_server,
+    const struct RelayLeg* leg,
+    const char* data,
+    const size_t len)
+{
+    if (ZERO == len) {
+        return OK;
+    }
+
+    if (OK !=
+        leg_reserve_space(
+            socks5_server,
+            leg,
+            len
+        )
+    ) {
+        return ERR;
+    }
+
+    const void* _ =
+        memcpy(
+            &(*leg->space)[*leg->end],
+            data,
+            len
+        );
+    *leg->end += len;
+
+    return OK;
+}
+
+static void client_discard_recvd(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
+{
+    const struct RelayLeg leg =
+        client_upstream_leg(socks5_client);
+    leg_relinquish_space(
+        socks5_server,
+        &leg
+    );
+}
+
+/* past a parsed message; what the client pipelined behind it stays */
+static void client_consume_recvd(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    const size_t consumed)
+{
+    socks5_client->io.forwarded += consumed;
+    if (socks5_client->io.forwarded >= socks5_client->io.recvd) {
+        client_discard_recvd(
+            socks5_server,
+            socks5_client
+        );
+    }
+}
+
+static bool client_pipelined(
+    const struct Socks5Client* socks5_client)
+{
+    return socks5_client->io.forwarded < socks5_client->io.recvd;
+}
+
+static int client_send_whatmayof_iobuf(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
+{
+    if (socks5_client->io.sent >= socks5_client->io.to_send) {
+        return OK;
+    }
+
+    bool blocked_eagain = false;
+    const int sent =
+        send_what_may(
+            socks5_client->inbound_socket_fd,
+            socks5_client->io.send_space,
+            socks5_client->io.sent,
+            socks5_client->io.to_send,
+            &blocked_eagain
+        );
+    if (ERR == sent) {
+        return ERR;
+    }
+
+    socks5_client->io.sent += sent;
+
+    if (socks5_client->io.sent < socks5_client->io.to_send) {
+        return client_sub_write_activity_of(
+            socks5_server,
+            socks5_client,
+            socks5_client->inbound_socket_fd
+        );
+    }
+
+    const struct RelayLeg leg =
+        client_downstream_leg(socks5_client);
+    leg_relinquish_space(
+        socks5_server,
+        &leg
+    );
+
+    return client_unsub_write_activity_of(
+        socks5_server,
+        socks5_client,
+        socks5_client->inbound_socket_fd
+    );
+}
+
+static int recv_what_may(
+    const int socket_fd,
+    void* space,
+    const size_t zero_point,
+    const size_t time,
+    bool* end_of_stream)
+{
+    assert(zero_point < time);
+
+    const ptrdiff_t last_i = time - 1;
+
+    ptrdiff_t i = zero_point;
+    const size_t total_amount_of_space_to_recv = time - i;
+
+    int total_read = 0;
+
+    for (;;) {
+        if (total_read >= total_amount_of_space_to_recv) {
+            return total_read;
+        }
+
+        const size_t remaining_time = time - i;
+        const int read =
+            recv(
+                socket_fd,
+                &space[i],
+                remaining_time,
+                ZERO
+            );
+        if (ZERO == read) {
+            if (NULL != end_of_stream) {
+                *end_of_stream = true;
+            }
+            return total_read;
+        }
+
+        if (ERR == read && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return total_read;
+        } else if (ERR == read && errno == EINTR) {
+            continue;
+        } else if (ERR == read) {
+            return ERR;
+        }
+
+        i += read;
+        total_read += read;
+    }
+}
+
+static int client_recv_whatmayof_iobuff(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
+{
+    enum {B=CLIENT_TEMP_SPACE};
+
+    if (socks5_client->io.recvd >= B
+        || socks5_client->inbound_end_of_stream) {
+        return OK;
+    }
+
+    const int read =
+        recv_what_may(
+            socks5_client->inbound_socket_fd,
+            socks5_server->scratch_space,
+            ZERO,
+            B - socks5_client->io.recvd,
+            &socks5_client->inbound_end_of_stream
+        );
+
+    if (ERR == read) {
+        return ERR;
+    }
+    if (ZERO == read) {
+        return OK;
+    }
+
+    const struct RelayLeg leg =
+        client_upstream_leg(socks5_client);
+    return leg_append(
+        socks5_server,
+        &leg,
+        socks5_server->scratch_space,
+        read
+    );
+}
+
+/* with credentials only username/password will do, without them only no authentication */
+static int server_choose_auth_method(
+    const struct Socks5Server* socks5_server,
+    const struct ClientHello* client_hello,
+    enum Socks5AuthMethod* choice)
+{
+    const enum Socks5AuthMethod required =
+        NULL != socks5_server->cfg.credentials
+        ? SOCKS5_AUTH_METHOD_USERNAME_PASSWORD
+        : SOCKS5_AUTH_METHOD_NO_AUTHENTICATION_REQUIRED;
+
+    for (ptrdiff_t i = 0; i < client_hello->method_count; i++) {
+        const uint8_t method =
+            client_hello->methods[i];
+        if (required == method) {
+            *choice = required;
+            return OK;
+        }
+    }
+
+    *choice = SOCKS5_AUTH_METHOD_NO_ACCEPTABLE_METHODS;
+    return ERR;
+}
+
+
+/* held replies go first: the client reads them in the order they were decided */
+static int client_set_sendiobuf(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    const char* space,
+    const size_t time)
+{
+    const struct RelayLeg leg =
+        client_downstream_leg(socks5_client);
+
+    for (ptrdiff_t i = 0; i < socks5_client->held_reply_count; i++) {
+        if (OK !=
+            leg_append(
+                socks5_server,
+                &leg,
+                socks5_client->held_replies[i].iov_base,
+                socks5_client->held_replies[i].iov_len
+            )
+        ) {
+            return ERR;
+        }
+    }
+    socks5_client->held_reply_count = ZERO;
+
+    return leg_append(
+        socks5_server,
+        &leg,
+        space,
+        time
+    );
+}
+
+/* reply is static: only its address is kept */
+static void client_hold_reply(
+    struct Socks5Client* socks5_client,
+    const char* reply,
+    const size_t len)
+{
+    assert(socks5_client->held_reply_count < MAX_HELD_REPLIES);
+    socks5_client->held_replies[socks5_client->held_reply_count++] =
+        (struct iovec) {
+            .iov_base = (void*)reply,
+            .iov_len = len
+        };
+}
+
+/*
+    The held replies, then reply, in one sendmsg. What the socket won't
+    take, and everything when bytes are already waiting to go, is
+    buffered and sent as the socket drains.
+*/
+static int client_send_reply(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    const char* reply,
+    const size_t len)
+{
+    if (socks5_client->io.sent < socks5_client->io.to_send) {
+        return OK ==
+            client_set_sendiobuf(
+                socks5_server,
+                socks5_client,
+                reply,
+                len
+            )
+            ? client_send_whatmayof_iobuf(
+                socks5_server,
+                socks5_client
+            )
+            : ERR;
+    }
+
+    struct iovec iov[MAX_HELD_REPLIES + 1];
+    size_t iov_count = ZERO;
+    for (ptrdiff_t i = 0; i < socks5_client->held_reply_count; i++) {
+        iov[iov_count++] = socks5_client->held_replies[i];
+    }
+    socks5_client->held_reply_count = ZERO;
+    if (ZERO != len) {
+        iov[iov_count++] =
+            (struct iovec) {
+                .iov_base = (void*)reply,
+                .iov_len = len
+            };
+    }
+    if (ZERO == iov_count) {
+        return OK;
+    }
+
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = iov_count
+    };
+    ssize_t sent = ERR;
+    do {
+        sent =
+            sendmsg(
+                socks5_client->inbound_socket_fd,
+                &msg,
+                MSG_NOSIGNAL
+            );
+    } while (ERR == sent && EINTR == errno);
+    if (ERR == sent && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+        sent = ZERO;
+    } else if (ERR == sent) {
+        return ERR;
+    }
+
+    const struct RelayLeg leg =
+        client_downstream_leg(socks5_client);
+    bool unsent = false;
+    for (size_t i = 0; i < iov_count; i++) {
+        const size_t skipped =
+            (size_t)sent < iov[i].iov_len
+            ? (size_t)sent
+            : iov[i].iov_len;
+        sent -= skipped;
+        if (skipped == iov[i].iov_len) {
+            continue;
+        }
+
+        unsent = true;
+        if (OK !=
+            leg_append(
+                socks5_server,
+                &leg,
+                (const char*)iov[i].iov_base + skipped,
+                iov[i].iov_len - skipped
+            )
+        ) {
+            return ERR;
+        }
+    }
+
+    return unsent
+        ? client_sub_write_activity_of(
+            socks5_server,
+            socks5_client,
+            socks5_client->inbound_socket_fd
+        )
+        : OK;
+}
+
+/*
+   The server selects from one of the methods given in METHODS, and
+   sends a METHOD selection message:
+
+                         +----+--------+
+                         |VER | METHOD |
+                         +----+--------+
+                         | 1  |   1    |
+                         +----+--------+
+*/
+enum {METHOD_SELECTION_REPLY_SPACE=2};
+
+static const char NO_AUTHENTICATION_REQUIRED_REPLY[METHOD_SELECTION_REPLY_SPACE] =
+    {0x05, SOCKS5_AUTH_METHOD_NO_AUTHENTICATION_REQUIRED};
+static const char USERNAME_PASSWORD_REPLY[METHOD_SELECTION_REPLY_SPACE] =
+    {0x05, SOCKS5_AUTH_METHOD_USERNAME_PASSWORD};
+static const char NO_ACCEPTABLE_METHODS_REPLY[METHOD_SELECTION_REPLY_SPACE] =
+    {0x05, (char)SOCKS5_AUTH_METHOD_NO_ACCEPTABLE_METHODS};
+
+static const char* method_selection_reply(
+    const enum Socks5AuthMethod method)
+{
+    switch (method) {
+        case SOCKS5_AUTH_METHOD_NO_AUTHENTICATION_REQUIRED:
+            return NO_AUTHENTICATION_REQUIRED_REPLY;
+        case SOCKS5_AUTH_METHOD_USERNAME_PASSWORD:
+            return USERNAME_PASSWORD_REPLY;
+        case SOCKS5_AUTH_METHOD_NO_ACCEPTABLE_METHODS: default:
+            return NO_ACCEPTABLE_METHODS_REPLY;
+    }
+}
+
+static enum AdvancePhaseConsequence
+phase_shift_server_choose_auth_method_and_send(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
+{
+    struct ClientHello* client_hello =
+        &socks5_client->current_request.client_hello;
+
+    const int chosen =
+        server_choose_auth_method(
+            socks5_server,
+            client_hello,
+            &socks5_client->auth_method
+        );
+    const char* reply =
+        method_selection_reply(socks5_client->auth_method);
+
+    /*
+       If the selected METHOD is X'FF', none of the methods listed by the
+       client are acceptable, and the client MUST close the connection.
+    */
+    if (OK != chosen) {
+        const int _ignored =
+            client_send_reply(
+                socks5_server,
+                socks5_client,
+                reply,
+                METHOD_SELECTION_REPLY_SPACE
+            );
+        return ADVANCE_PHASE_ERR;
+    }
+
+    /* the client went on without waiting for it: it waits for the next reply */
+    if (client_pipelined(socks5_client)) {
+        client_hold_reply(
+            socks5_client,
+            reply,
+            METHOD_SELECTION_REPLY_SPACE
+        );
+        return ADVANCE_PHASE_OK;
+    }
+
+    if (OK !=
+        client_send_reply(
+            socks5_server,
+            socks5_client,
+            reply,
+            METHOD_SELECTION_REPLY_SPACE
+        )
+    ) {
+        return ADVANCE_PHASE_ERR;
+    }
+
+    return ZERO == socks5_client->io.to_send
+        ? ADVANCE_PHASE_OK
+        : ADVANCE_PHASE_IOBLOCKED_AGAIN;
+}
+
+/*
+   The server verifies the supplied UNAME and PASSWD, and sends the
+   following response:
+
+                        +----+--------+
+                        |VER | STATUS |
+                        +----+--------+
+                        | 1  |   1    |
+                        +----+--------+
+
+   A STATUS field of X'00' indicates success. If the server returns a
+   `failure' (STATUS value other than X'00') status, it MUST close the
+   connection.
+*/
+enum {AUTH_STATUS_REPLY_SPACE=2};
+
+static const char AUTH_STATUS_REPLIES[2][AUTH_STATUS_REPLY_SPACE] = {
+    {0x01, 0x00},
+    {0x01, 0x01}
+};
+
+static enum AdvancePhaseConsequence phase_tryshift_authenticate_username_password(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
+{
+    struct UsernamePassword auth;
+    size_t consumed = ZERO;
+    switch (
+        try_parse_client_auth(
+            &socks5_client->io.recv_space[socks5_client->io.forwarded],
+            socks5_client->io.recvd - socks5_client->io.forwarded,
+            &auth,
+            &consumed
+        )
+    ) {
+        case TRY_PARSE_OK:
+            break;
+        case TRY_PARSE_UNEXPECTED_END_OF_INPUT:
+            return ADVANCE_PHASE_IOBLOCKED_AGAIN;
+        case TRY_PARSE_ERR: default:
+            return ADVANCE_PHASE_ERR;
+    }
+
+    size_t user = ZERO;
+    const bool authenticated =
+        credential_store_authenticate(
+            socks5_server->cfg.credentials,
+            socks5_server->failed_auths,
+            &socks5_client->address,
+            auth.name,
+            auth.name_len,
+            auth.password,
+            auth.password_len,
+            monotonic_ms(),
+            &user
+        );
+
+    if (authenticated && NULL != socks5_server->shaping_buckets->users) {
+        socks5_client->user_bucket = &socks5_server->shaping_buckets->users[user];
+    }
+
+    /* the buffer goes back to the pool; the password doesn't go with it */
+    explicit_bzero(
+        &socks5_client->io.recv_space[socks5_client->io.forwarded],
+        consumed
+    );
+    client_consume_recvd(
+        socks5_server,
+        socks5_client,
+        consumed
+    );
+
+    const char* reply = AUTH_STATUS_REPLIES[authenticated ? ZERO : 1];
+    if (!authenticated) {
+        const int _ignored =
+            client_send_reply(
+                socks5_server,
+                socks5_client,
+                reply,
+                AUTH_STATUS_REPLY_SPACE
+            );
+        return ADVANCE_PHASE_ERR;
+    }
+
+    if (client_pipelined(socks5_client)) {
+        client_hold_reply(
+            socks5_client,
+            reply,
+            AUTH_STATUS_REPLY_SPACE
+        );
+        return ADVANCE_PHASE_OK;
+    }
+
+    return OK ==
+        client_send_reply(
+            socks5_server,
+            socks5_client,
+            reply,
+            AUTH_STATUS_REPLY_SPACE
+        )
+        ? ADVANCE_PHASE_OK
+        : ADVANCE_PHASE_ERR;
+}
+
+/* the request, or first the sub-negotiation of the method chosen */
+static enum Socks5ClientPhase phase_after_auth_method_choice(
+    const struct Socks5Client* socks5_client)
+{
+    return SOCKS5_AUTH_METHOD_USERNAME_PASSWORD == socks5_client->auth_method
+        ? SOCKS5_CLIENT_PHASE_RECV_USERNAME_PASSWORD_AUTH
+        : SOCKS5_CLIENT_PHASE_RECV_REQUEST;
+}
+
+static enum AdvancePhaseConsequence phase_tryshift_tryparse_client_recvbuff_for_req(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
+{
+    size_t consumed = 0;
+    switch (
+        try_parse_client_request(
+            &socks5_client->io.recv_space[socks5_client->io.forwarded],
+            socks5_client->io.recvd - socks5_client->io.forwarded,
+            &socks5_client->current_request.client_request,
+            &consumed
+        )
+    ) {
+        case TRY_PARSE_OK:
+            /* anything past the request is early data for the remote */
+            client_consume_recvd(
+                socks5_server,
+                socks5_client,
+                consumed
+            );
+            return ADVANCE_PHASE_OK;
+        case TRY_PARSE_UNEXPECTED_END_OF_INPUT:
+            return ADVANCE_PHASE_IOBLOCKED_AGAIN;
+        case TRY_PARSE_ERR: default:
+            return ADVANCE_PHASE_ERR;
+    }
+}
+
+/*
+    OpenSSL reads and writes the socket itself until the handshake is
+    done; then the kernel holds the keys, and what the client sent
+    after its Finished is read as plaintext like any other request.
+*/
+static enum AdvancePhaseConsequence phase_tryshift_tls_handshake(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
+{
+    switch (tls_handshake_advance(socks5_client->tls_handshake)) {
+        case TLS_HANDSHAKE_DONE:
+            break;
+        case TLS_HANDSHAKE_WANTS_READ: {
+            const int _ignored =
+                client_unsub_write_activity_of(
+                    socks5_server,
+                    socks5_client,
+                    socks5_client->inbound_socket_fd
+                );
+            return ADVANCE_PHASE_IOBLOCKED_AGAIN;
+        }
+        case TLS_HANDSHAKE_WANTS_WRITE: {
+            const int _ignored =
+                client_sub_write_activity_of(
+                    socks5_server,
+                    socks5_client,
+                    socks5_client->inbound_socket_fd
+                );
+            return ADVANCE_PHASE_IOBLOCKED_AGAIN;
+        }
+        case TLS_HANDSHAKE_FAILED: default:
+            return ADVANCE_PHASE_ERR;
+    }
+
+    const int offloaded =
+        tls_handshake_offload(
+            socks5_client->tls_handshake,
+            socks5_client->inbound_socket_fd
+        );
+    tls_handshake_destruct(socks5_client->tls_handshake);
+    socks5_client->tls_handshake = NULL;
+    if (OK != offloaded) {
+        return ADVANCE_PHASE_ERR;
+    }
+
+    const int _ignored =
+        client_unsub_write_activity_of(
+            socks5_server,
+            socks5_client,
+            socks5_client->inbound_socket_fd
+        );
+
+    /* edge triggered: no event is coming for what is already waiting */
+    if (OK !=
+        client_recv_whatmayof_iobuff(
+            socks5_server,
+            socks5_client
+        )
+    ) {
+        return ADVANCE_PHASE_ERR;
+    }
+    return ADVANCE_PHASE_OK;
+}
+
+static enum AdvancePhaseConsequence
+phase_tryshift_tryparse_client_recvbuff_for_hello(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
+{
+    size_t consumed = ZERO;
+    switch (
+        try_parse_client_hello(
+            &socks5_client->io.recv_space[socks5_client->io.forwarded],
+            socks5_client->io.recvd - socks5_client->io.forwarded,
+            &socks5_client->current_request.client_hello,
+            &consumed
+        )
+    ) {
+        case TRY_PARSE_OK:
+            client_consume_recvd(
+                socks5_server,
+                socks5_client,
+                consumed
+            );
+            return ADVANCE_PHASE_OK;
+        case TRY_PARSE_UNEXPECTED_END_OF_INPUT:
+            return ADVANCE_PHASE_IOBLOCKED_AGAIN;
+        default:
+        case TRY_PARSE_ERR:
+            return ADVANCE_PHASE_ERR;
+    }
+}
+
+static const struct sockaddr_storage* nth_address_of_family(
+    const struct DnsAnswer* answer,
+    const sa_family_t family,
+    size_t n)
+{
+    for (size_t i = 0; i < answer->address_count; i++) {
+        if (family == answer->addresses[i].ss_family && ZERO == n--) {
+            return &answer->addresses[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+    RFC 8305 4. Sorting of Resolved Destination Addresses: families
+    alternate, IPv6 first, so a broken family costs at most every
+    other attempt.
+*/
+static const struct sockaddr_storage* interleaved_address_of_answer(
+    const struct DnsAnswer* answer,
+    const size_t index)
+{
+    if (NULL == answer || index >= answer->address_count) {
+        return NULL;
+    }
+
+    size_t v6_count = ZERO;
+    for (size_t i = 0; i < answer->address_count; i++) {
+        if (AF_INET6 == answer->addresses[i].ss_family) {
+            v6_count++;
+        }
+    }
+    const size_t v4_count = answer->address_count - v6_count;
+
+    size_t v6_taken = ZERO;
+    size_t v4_taken = ZERO;
+    const struct sockaddr_storage* address = NULL;
+    for (size_t k = 0; k <= index; k++) {
+        const bool v6_turn =
+            (ZERO == k % 2 && v6_taken < v6_count)
+            || v4_taken == v4_count;
+        address =
+            v6_turn
+            ? nth_address_of_family(answer, AF_INET6, v6_taken++)
+            : nth_address_of_family(answer, AF_INET, v4_taken++);
+    }
+    return address;
+}
+
+static size_t destination_count_of_request(
+    const struct ClientRequest* req,
+    const struct DnsAnswer* answer)
+{
+    switch (req->addr_type) {
+        case SOCKS5_ADDR_TYPE_IPV4:
+        case SOCKS5_ADDR_TYPE_IPV6:
+            return 1;
+        case SOCKS5_ADDR_TYPE_DOMAINNAME:
+            return NULL == answer ? ZERO : answer->address_count;
+        default:
+            return ZERO;
+    }
+}
+
+static int destination_sockaddr_of_request(
+    const struct ClientRequest* req,
+    const struct DnsAnswer* answer,
+    const size_t index,
+    struct sockaddr_storage* dst,
+    socklen_t* dst_len)
+{
+    const void* _ = memset(dst, ZERO, sizeof(*dst));
+
+    switch (req->addr_type) {
+        case SOCKS5_ADDR_TYPE_IPV4: {
+            struct sockaddr_in* in = (struct sockaddr_in*)dst;
+            in->sin_family = AF_INET;
+            in->sin_port = req->dst_port;
+            memcpy(&in->sin_addr, req->dst_addr.ipv4, FOUR);
+            *dst_len = sizeof(*in);
+            return OK;
+        }
+        case SOCKS5_ADDR_TYPE_IPV6: {
+            struct sockaddr_in6* in6 = (struct sockaddr_in6*)dst;
+            in6->sin6_family = AF_INET6;
+            in6->sin6_port = req->dst_port;
+            memcpy(&in6->sin6_addr, req->dst_addr.ipv6, SIXTEEN);
+            *dst_len = sizeof(*in6);
+            return OK;
+        }
+        case SOCKS5_ADDR_TYPE_DOMAINNAME: {
+            const struct sockaddr_storage* resolved =
+                interleaved_address_of_answer(answer, index);
+            if (NULL == resolved) {
+                return ERR;
+            }
+            *dst = *resolved;
+            if (AF_INET == dst->ss_family) {
+                ((struct sockaddr_in*)dst)->sin_port = req->dst_port;
+                *dst_len = sizeof(struct sockaddr_in);
+            } else {
+                ((struct sockaddr_in6*)dst)->sin6_port = req->dst_port;
+                *dst_len = sizeof(struct sockaddr_in6);
+            }
+            return OK;
+        }
+        default:
+            return ERR;
+    }
+}
+
+static enum Socks5RequestReply reply_of_connect_errno(
+    const int err)
+{
+    switch (err) {
+        case ENETUNREACH:
+        case ENETDOWN:
+            return SOCKS5_ERROR_NETWORK_UNREACHABLE;
+        case EHOSTUNREACH:
+        case EHOSTDOWN:
+            return SOCKS5_ERROR_HOST_UNREACHABLE;
+        case ECONNREFUSED:
+            return SOCKS5_ERROR_CONNECTION_REFUSED;
+        case ETIMEDOUT:
+            return SOCKS5_ERROR_TTL_EXPIRED;
+        case EACCES:
+        case EPERM:
+            return SOCKS5_ERROR_CONNECTION_TO_REMOTE_HOST_FORBIDDEN;
+        case EAFNOSUPPORT:
+            return SOCKS5_ERROR_ADDR_TYPE_NOT_SUPPORTED;
+        default:
+            return SOCKS5_ERROR;
+    }
+}
+
+/*
+        +----+-----+-------+------+----------+----------+
+        |VER | REP |  RSV  | ATYP | BND.ADDR | BND.PORT |
+        +----+-----+-------+------+----------+----------+
+        | 1  |  1  | X'00' |  1   | Variable |    2     |
+        +----+-----+-------+------+----------+----------+
+*/
+static size_t build_request_reply(
+    char space[],
+    const enum Socks5RequestReply reply,
+    const struct sockaddr_storage* bnd_address)
+{
+    enum {FIVE=5};
+    size_t i = 0;
+    space[i++] = FIVE;
+    space[i++] = reply;
+    space[i++] = ZERO;
+
+    if (NULL != bnd_address && AF_INET6 == bnd_address->ss_family) {
+        const struct sockaddr_in6* in6 =
+            (const struct sockaddr_in6*)bnd_address;
+        space[i++] = SOCKS5_ADDR_TYPE_IPV6;
+        memcpy(&space[i], &in6->sin6_addr, SIXTEEN);
+        i += SIXTEEN;
+        memcpy(&space[i], &in6->sin6_port, sizeof(in6->sin6_port));
+        i += sizeof(in6->sin6_port);
+        return i;
+    }
+
+    space[i++] = SOCKS5_ADDR_TYPE_IPV4;
+    if (NULL != bnd_address && AF_INET == bnd_address->ss_family) {
+        const struct sockaddr_in* in =
+            (const struct sockaddr_in*)bnd_address;
+        memcpy(&space[i], &in->sin_addr, FOUR);
+        i += FOUR;
+        memcpy(&space[i], &in->sin_port, sizeof(in->sin_port));
+        i += sizeof(in->sin_port);
+        return i;
+    }
+
+    const void* _ = memset(&space[i], ZERO, FOUR + sizeof(in_port_t));
+    return i + FOUR + sizeof(in_port_t);
+}
+
+enum {MAX_REQUEST_REPLY_SPACE=4 + 16 + 2};
+
+/*
+   When a reply (REP value other than X'00') indicates a failure, the
+   SOCKS server MUST terminate the TCP connection shortly after sending
+   the reply.
+*/
+enum {FAILURE_REPLY_SPACE=4 + 4 + 2};
+
+#define FAILURE_REPLY(rep) \
+    [rep] = {0x05, rep, 0x00, SOCKS5_ADDR_TYPE_IPV4, 0, 0, 0, 0, 0, 0}
+
+/* with no bound address: BND.ADDR and BND.PORT zeroed */
+static const char FAILURE_REPLIES[][FAILURE_REPLY_SPACE] = {
+    FAILURE_REPLY(SOCKS5_ERROR),
+    FAILURE_REPLY(SOCKS5_ERROR_CONNECTION_TO_REMOTE_HOST_FORBIDDEN),
+    FAILURE_REPLY(SOCKS5_ERROR_NETWORK_UNREACHABLE),
+    FAILURE_REPLY(SOCKS5_ERROR_HOST_UNREACHABLE),
+    FAILURE_REPLY(SOCKS5_ERROR_CONNECTION_REFUSED),
+    FAILURE_REPLY(SOCKS5_ERROR_TTL_EXPIRED),
+    FAILURE_REPLY(SOCKS5_ERROR_CMD_NOT_SUPPORTED),
+    FAILURE_REPLY(SOCKS5_ERROR_ADDR_TYPE_NOT_SUPPORTED)
+};
+
+#undef FAILURE_REPLY
+
+static int client_send_failure_reply(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    const enum Socks5RequestReply reply)
+{
+    assert(SOCKS5_OK != reply);
+    const int _ignored =
+        client_send_reply(
+            socks5_server,
+            socks5_client,
+            FAILURE_REPLIES[reply],
+            FAILURE_REPLY_SPACE
+        );
+
+    return ERR;
+}
+
+static void client_proc_deadline(
+    struct Socks5Server* socks5_server,
+    struct TimerWheelEntry* entry)
+{
+    struct Socks5Client* socks5_client =
+        (struct Socks5Client*)(
+            (char*)entry - offsetof(struct Socks5Client, deadline_timer)
+        );
+
+    if (SOCKS5_CLIENT_DEADLINE_IDLE == socks5_client->deadline) {
+        const int64_t idle_until_ms =
+            socks5_client->last_active_ms + socks5_server->cfg.idle_timeout_ms;
+        if (idle_until_ms > socks5_server->now_ms) {
+            timer_wheel_arm(
+                &socks5_server->timers,
+                entry,
+                idle_until_ms
+            );
+            return;
+        }
+    }
+
+    /* X'06' TTL expired, unless the reply has begun to go out */
+    if (SOCKS5_CLIENT_DEADLINE_CONNECT == socks5_client->deadline
+        && SOCKS5_CLIENT_PHASE_BEGIN_SENDING_REQUEST_REPLY != socks5_client->phase
+    ) {
+        const int _ignored =
+            client_send_failure_reply(
+                socks5_server,
+                socks5_client,
+                SOCKS5_ERROR_TTL_EXPIRED
+            );
+    }
+
+    const int _ignored =
+        client_destruct(
+            socks5_server,
+            socks5_client
+        );
+}
+
+static enum AdvancePhaseConsequence phase_tryshift_destination_resolved(
+    struct Socks5Client* socks5_client,
+    enum Socks5RequestReply* reply)
+{
+    const struct DnsAnswer* answer =
+        socks5_client->destination_answer;
+
+    if (NULL == answer) {
+        return ADVANCE_PHASE_IOBLOCKED_AGAIN;
+    }
+
+    if (DNS_ANSWER_OK != answer->status) {
+        *reply = SOCKS5_ERROR_HOST_UNREACHABLE;
+        return ADVANCE_PHASE_ERR;
+    }
+
+    return ADVANCE_PHASE_OK;
+}
+
+static enum AdvancePhaseConsequence phase_shift_resolve_destination(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    enum Socks5RequestReply* reply)
+{
+    const struct ClientRequest* req =
+        &socks5_client->current_request.client_request;
+
+    switch (
+        dns_resolver_resolve(
+            socks5_server->resolver,
+            req->dst_addr.domain_name,
+            req->dst_addr_len,
+            &socks5_client->destination_waiter,
+            &socks5_client->destination_answer
+        )
+    ) {
+        case DNS_RESOLVE_DONE:
+            return phase_tryshift_destination_resolved(
+                socks5_client,
+                reply
+            );
+        case DNS_RESOLVE_PENDING:
+            return ADVANCE_PHASE_IOBLOCKED_AGAIN;
+        case DNS_RESOLVE_ERR: default:
+            *reply = SOCKS5_ERROR_HOST_UNREACHABLE;
+            return ADVANCE_PHASE_ERR;
+    }
+}
+
+/*
+    The winner becomes the outbound socket, keeping its registration:
+    the next interest flush hands the event source the outbound
+    socket's context in place of the attempt's.
+*/
+static enum AdvancePhaseConsequence client_adopt_outbound_attempt(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    struct ClientSocket* winner)
+{
+    const int socket_fd = winner->socket_fd;
+    const bool subscribed = winner->subscribed;
+    /* what its SYN carried is not sent again */
+    socks5_client->io.forwarded += winner->early_sent;
+    winner->socket_fd = ERR;
+    winner->subscribed = false;
+    winner->early_sent = ZERO;
+
+    const int _ignored =
+        client_close_outbound_attempts(
+            socks5_server,
+            socks5_client
+        );
+
+    socks5_client->outbound_socket_fd = socket_fd;
+    socks5_client->outbound_interest.subscribed = subscribed;
+    socks5_client->outbound_interest.registered =
+        subscribed ? FDIOEVENT_WRITABLE : ZERO;
+    socks5_client->outbound_interest.wanted =
+        socks5_client->outbound_interest.registered;
+
+    const int _ignored_too =
+        client_unsub_write_activity_of(
+            socks5_server,
+            socks5_client,
+            socket_fd
+        );
+
+    return ADVANCE_PHASE_OK;
+}
+
+static struct ClientSocket* client_idle_outbound_attempt(
+    struct Socks5Client* socks5_client)
+{
+    for (int i = 0; i < MAX_OUTBOUND_ATTEMPTS; i++) {
+        if (ERR == socks5_client->outbound_attempts[i].socket_fd) {
+            return &socks5_client->outbound_attempts[i];
+        }
+    }
+    return NULL;
+}
+
+static bool client_outbound_attempts_in_flight(
+    const struct Socks5Client* socks5_client)
+{
+    for (int i = 0; i < MAX_OUTBOUND_ATTEMPTS; i++) {
+        if (ERR != socks5_client->outbound_attempts[i].socket_fd) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* OK: connected at once; IOBLOCKED_AGAIN: in flight; ERR: last_connect_errno says why */
+/*
+    connect(), with early data in the SYN (MSG_FASTOPEN). Data the
+    kernel took is counted in *early_sent and, like connect(), the
+    result is ERR with errno EINPROGRESS. Without a cookie for dst the
+    SYN asks for one and carries nothing; without client side Fast Open
+    this is a plain connect.
+*/
+static int connect_with_early_data(
+    const int socket_fd,
+    const struct sockaddr_storage* dst,
+    const socklen_t dst_len,
+    const char* early,
+    const size_t early_len,
+    size_t* early_sent)
+{
+    *early_sent = ZERO;
+    if (ZERO == early_len) {
+        return connect(
+            socket_fd,
+            (const struct sockaddr*)dst,
+            dst_len
+        );
+    }
+
+    const ssize_t sent =
+        sendto(
+            socket_fd,
+            early,
+            early_len,
+            MSG_FASTOPEN | MSG_NOSIGNAL,
+            (const struct sockaddr*)dst,
+            dst_len
+        );
+    if (sent >= ZERO) {
+        *early_sent = sent;
+        errno = EINPROGRESS;
+        return ERR;
+    }
+    if (EOPNOTSUPP == errno) {
+        return connect(
+            socket_fd,
+            (const struct sockaddr*)dst,
+            dst_len
+        );
+    }
+    return ERR;
+}
+
+static enum AdvancePhaseConsequence client_begin_outbound_attempt(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    struct ClientSocket* attempt,
+    const struct sockaddr_storage* dst,
+    const socklen_t dst_len,
+    const bool last_destination)
+{
+    /*
+        Only an attempt that nothing can race carries early data, the
+        last destination with no other in flight: of two in flight, the
+        one dropped may already have delivered it, and the winner would
+        deliver it again.
+    */
+    const size_t early_len =
+        socks5_server->cfg.tcp_fast_open_connect
+        && last_destination
+        && !client_outbound_attempts_in_flight(socks5_client)
+        ? socks5_client->io.recvd - socks5_client->io.forwarded
+        : ZERO;
+
+    const int socket_fd =
+        socket(
+            dst->ss_family,
+            SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            ZERO
+        );
+    if (ERR == socket_fd) {
+        socks5_client->last_connect_errno = errno;
+        return ADVANCE_PHASE_ERR;
+    }
+
+    const int _ignored = set_socket_nodelay(socket_fd);
+
+    attempt->socket_fd = socket_fd;
+    attempt->subscribed = false;
+
+    if (OK !=
+        server_track_client_socket(
+            socks5_server,
+            socks5_client,
+            &attempt->socket_fd
+        )
+    ) {
+        socks5_client->last_connect_errno = errno;
+        attempt->socket_fd = ERR;
+        return try_close_socket_then_ret_arg(
+            socket_fd,
+            ADVANCE_PHASE_ERR
+        );
+    }
+
+    if (OK ==
+        connect_with_early_data(
+            socket_fd,
+            dst,
+            dst_len,
+            &socks5_client->io.recv_space[socks5_client->io.forwarded],
+            early_len,
+            &attempt->early_sent
+        )
+    ) {
+        return ADVANCE_PHASE_OK;
+    }
+
+    if (EINPROGRESS != errno
+        || OK !=
+        socks5_server->cfg.subscribe_socket(
+            socks5_server,
+            socket_fd,
+            FDIOEVENT_WRITABLE,
+            socket_context_of(attempt, SOCKET_CONTEXT_CLIENT_SOCKET)
+        )
+    ) {
+        socks5_client->last_connect_errno = errno;
+        const int _ignored_too =
+            client_close_outbound_attempt(
+                socks5_server,
+                socks5_client,
+                attempt
+            );
+        return ADVANCE_PHASE_ERR;
+    }
+
+    attempt->subscribed = true;
+    return ADVANCE_PHASE_IOBLOCKED_AGAIN;
+}
+
+/*
+    Starts on the next destination address that gets as far as an
+    attempt in flight; the one after it is due a Connection Attempt
+    Delay later, or as soon as an attempt fails.
+*/
+static enum AdvancePhaseConsequence client_begin_next_outbound_attempt(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    enum Socks5RequestReply* reply)
+{
+    const struct ClientRequest* req =
+        &socks5_client->current_request.client_request;
+    const size_t destination_count =
+        destination_count_of_request(
+            req,
+            socks5_client->destination_answer
+        );
+
+    socks5_client->attempt_due = false;
+
+    while (socks5_client->next_destination < destination_count) {
+        struct ClientSocket* attempt =
+            client_idle_outbound_attempt(socks5_client);
+        if (NULL == attempt) {
+            break;
+        }
+
+        struct sockaddr_storage dst = {0};
+        socklen_t dst_len = 0;
+        if (OK !=
+            destination_sockaddr_of_request(
+                req,
+                socks5_client->destination_answer,
+                socks5_client->next_destination++,
+                &dst,
+                &dst_len
+            )
+        ) {
+            continue;
+        }
+
+        /* a denied address counts as a failed attempt: the next may yet be allowed */
+        if (!access_policy_admits(
+                socks5_server->cfg.access_policy,
+                ACCESS_POLICY_DESTINATION,
+                &dst
+            )
+        ) {
+            socks5_client->last_connect_errno = EACCES;
+            continue;
+        }
+
+        switch (
+            client_begin_outbound_attempt(
+                socks5_server,
+                socks5_client,
+                attempt,
+                &dst,
+                dst_len,
+                socks5_client->next_destination >= destination_count
+            )
+        ) {
+            case ADVANCE_PHASE_OK:
+                return client_adopt_outbound_attempt(
+                    socks5_server,
+                    socks5_client,
+                    attempt
+                );
+            case ADVANCE_PHASE_IOBLOCKED_AGAIN:
+                if (socks5_client->next_destination < destination_count) {
+                    timer_wheel_arm(
+                        &socks5_server->timers,
+                        &socks5_client->attempt_timer,
+                        socks5_server->now_ms + CONNECTION_ATTEMPT_DELAY_MS
+                    );
+                }
+                return ADVANCE_PHASE_IOBLOCKED_AGAIN;
+            case ADVANCE_PHASE_ERR: default:
+                continue;
+        }
+    }
+
+    if (client_outbound_attempts_in_flight(socks5_client)) {
+        return ADVANCE_PHASE_IOBLOCKED_AGAIN;
+    }
+
+    *reply = reply_of_connect_errno(socks5_client->last_connect_errno);
+    return ADVANCE_PHASE_ERR;
+}
+
+static enum AdvancePhaseConsequence phase_shift_connect_outbound(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    enum Socks5RequestReply* reply)
+{
+    const struct ClientRequest* req =
+        &socks5_client->current_request.client_request;
+
+    if (SOCKS5_REQUEST_CMD_CONNECT != req->cmd) {
+        *reply = SOCKS5_ERROR_CMD_NOT_SUPPORTED;
+        return ADVANCE_PHASE_ERR;
+    }
+
+    if (ZERO ==
+        destination_count_of_request(
+            req,
+            socks5_client->destination_answer
+        )
+    ) {
+        *reply = SOCKS5_ERROR_ADDR_TYPE_NOT_SUPPORTED;
+        return ADVANCE_PHASE_ERR;
+    }
+
+    socks5_client->next_destination = ZERO;
+    socks5_client->last_connect_errno = ZERO;
+
+    return client_begin_next_outbound_attempt(
+        socks5_server,
+        socks5_client,
+        reply
+    );
+}
+
+/* 0 once connected, EINPROGRESS while the handshake is in flight, else why it failed */
+static int outbound_attempt_status(
+    const struct ClientSocket* attempt)
+{
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    if (OK !=
+        getsockopt(
+            attempt->socket_fd,
+            SOL_SOCKET,
+            SO_ERROR,
+            &err,
+            &err_len
+        )
+    ) {
+        return errno;
+    }
+
+    if (EALREADY == err) {
+        return EINPROGRESS;
+    }
+    if (ZERO != err) {
+        return err;
+    }
+
+    /* SO_ERROR is also 0 while the handshake is still in flight */
+    struct sockaddr_storage peer = {0};
+    socklen_t peer_len = sizeof(peer);
+    if (OK !=
+        getpeername(
+            attempt->socket_fd,
+            (struct sockaddr*)&peer,
+            &peer_len
+        )
+    ) {
+        return ENOTCONN == errno ? EINPROGRESS : errno;
+    }
+
+    return ZERO;
+}
+
+/* the first attempt to connect wins; the losers are closed */
+static enum AdvancePhaseConsequence phase_tryshift_outbound_connected(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    enum Socks5RequestReply* reply)
+{
+    for (int i = 0; i < MAX_OUTBOUND_ATTEMPTS; i++) {
+        struct ClientSocket* attempt =
+            &socks5_client->outbound_attempts[i];
+        if (ERR == attempt->socket_fd) {
+            continue;
+        }
+
+        const int status = outbound_attempt_status(attempt);
+        if (ZERO == status) {
+            return client_adopt_outbound_attempt(
+                socks5_server,
+                socks5_client,
+                attempt
+            );
+        }
+        if (EINPROGRESS == status) {
+            continue;
+        }
+
+        socks5_client->last_connect_errno = status;
+        socks5_client->attempt_due = true;
+        const int _ignored =
+            client_close_outbound_attempt(
+                socks5_server,
+                socks5_client,
+                attempt
+            );
+    }
+
+    if (!socks5_client->attempt_due) {
+        return ADVANCE_PHASE_IOBLOCKED_AGAIN;
+    }
+
+    return client_begin_next_outbound_attempt(
+        socks5_server,
+        socks5_client,
+        reply
+    );
+}
+
+static void set_sockaddr_port(
+    struct sockaddr_storage* address,
+    const in_port_t port)
+{
+    if (AF_INET6 == address->ss_family) {
+        ((struct sockaddr_in6*)address)->sin6_port = port;
+    } else {
+        ((struct sockaddr_in*)address)->sin_port = port;
+    }
+}
+
+static in_port_t port_of_sockaddr(
+    const struct sockaddr_storage* address)
+{
+    return AF_INET6 == address->ss_family
+        ? ((const struct sockaddr_in6*)address)->sin6_port
+        : ((const struct sockaddr_in*)address)->sin_port;
+}
+
+/* IPv4 addresses v4-mapped, so either family compares with either */
+static void mapped_address_of_sockaddr(
+    const struct sockaddr_storage* address,
+    struct in6_addr* mapped)
+{
+    if (AF_INET6 == address->ss_family) {
+        *mapped = ((const struct sockaddr_in6*)address)->sin6_addr;
+        return;
+    }
+
+    const void* _ = memset(mapped, ZERO, sizeof(*mapped));
+    mapped->s6_addr[10] = 0xFF;
+    mapped->s6_addr[11] = 0xFF;
+    _ = memcpy(
+        &mapped->s6_addr[12],
+        &((const struct sockaddr_in*)address)->sin_addr,
+        FOUR
+    );
+}
+
+/*
+    DST.ADDR of a BIND is the host the connection is to come from,
+    whatever its port; an unspecified one admits any host.
+*/
+static bool client_bind_admits_peer(
+    const struct Socks5Client* socks5_client,
+    const struct sockaddr_storage* peer)
+{
+    static const struct in6_addr v4_unspecified = {
+        .s6_addr = {[10] = 0xFF, [11] = 0xFF}
+    };
+
+    const struct ClientRequest* req =
+        &socks5_client->current_request.client_request;
+
+    struct in6_addr peer_addr;
+    mapped_address_of_sockaddr(peer, &peer_addr);
+
+    const size_t count =
+        destination_count_of_request(
+            req,
+            socks5_client->destination_answer
+        );
+    for (size_t i = 0; i < count; i++) {
+        struct sockaddr_storage dst;
+        socklen_t dst_len = ZERO;
+        if (OK !=
+            destination_sockaddr_of_request(
+                req,
+                socks5_client->destination_answer,
+                i,
+                &dst,
+                &dst_len
+            )
+        ) {
+            continue;
+        }
+
+        struct in6_addr dst_addr;
+        mapped_address_of_sockaddr(&dst, &dst_addr);
+        if (IN6_IS_ADDR_UNSPECIFIED(&dst_addr)
+            || IN6_ARE_ADDR_EQUAL(&dst_addr, &v4_unspecified)
+            || IN6_ARE_ADDR_EQUAL(&dst_addr, &peer_addr)
+        ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+   Two replies are sent from the SOCKS server to the client during a
+   BIND operation.  The first is sent after the server creates and binds
+   a new socket.  The BND.PORT field contains the port number that the
+   SOCKS server assigned to listen for an incoming connection.  The
+   BND.ADDR field contains the associated IP address.
+*/
+static enum AdvancePhaseConsequence phase_shift_bind(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    enum Socks5RequestReply* reply)
+{
+    struct ClientSocket* listener = &socks5_client->bind_listener;
+    *reply = SOCKS5_ERROR;
+
+    const int socket_fd =
+        listener_pool_acquire(
+            &socks5_server->bind_listeners
+        );
+    if (ERR == socket_fd) {
+        return ADVANCE_PHASE_ERR;
+    }
+
+    if (OK !=
+        server_track_client_socket(
+            socks5_server,
+            socks5_client,
+            &socket_fd
+        )
+    ) {
+        listener_pool_relinquish(
+            &socks5_server->bind_listeners,
+            socket_fd
+        );
+        return ADVANCE_PHASE_ERR;
+    }
+    listener->socket_fd = socket_fd;
+
+    /* the remote is to reach the listener where the client reached the server */
+    struct sockaddr_storage bnd = {0};
+    socklen_t bnd_len = sizeof(bnd);
+    struct sockaddr_storage listening = {0};
+    socklen_t listening_len = sizeof(listening);
+    if (OK !=
+        getsockname(
+            socks5_client->inbound_socket_fd,
+            (struct sockaddr*)&bnd,
+            &bnd_len
+        )
+        || OK !=
+        getsockname(
+            socket_fd,
+            (struct sockaddr*)&listening,
+            &listening_len
+        )
+        || OK !=
+        socks5_server->cfg.subscribe_socket(
+            socks5_server,
+            socket_fd,
+            FDIOEVENT_POLL_READABLE,
+            socket_context_of(listener, SOCKET_CONTEXT_CLIENT_SOCKET)
+        )
+    ) {
+        return ADVANCE_PHASE_ERR;
+    }
+    listener->subscribed = true;
+    set_sockaddr_port(&bnd, port_of_sockaddr(&listening));
+
+    char tmp[MAX_REQUEST_REPLY_SPACE];
+    const size_t time =
+        build_request_reply(
+            tmp,
+            SOCKS5_OK,
+            &bnd
+        );
+
+    if (OK !=
+        client_send_reply(
+            socks5_server,
+            socks5_client,
+            tmp,
+            time
+        )
+    ) {
+        return ADVANCE_PHASE_ERR;
+    }
+
+    return ADVANCE_PHASE_OK;
+}
+
+/*
+   The second reply occurs only after the anticipated incoming
+   connection succeeds or fails.
+   The accepted connection becomes the outbound socket; the listener
+   goes back to the pool.
+*/
+static enum AdvancePhaseConsequence phase_tryshift_bind_accepted(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    enum Socks5RequestReply* reply)
+{
+    for (;;) {
+        struct sockaddr_storage peer = {0};
+        socklen_t peer_len = sizeof(peer);
+        const int socket_fd =
+            accept4(
+                socks5_client->bind_listener.socket_fd,
+                (struct sockaddr*)&peer,
+                &peer_len,
+                SOCK_NONBLOCK | SOCK_CLOEXEC
+            );
+        if (ERR == socket_fd) {
+            switch (errno) {
+                case EAGAIN:
+                    return ADVANCE_PHASE_IOBLOCKED_AGAIN;
+                case EINTR:
+                case ECONNABORTED:
+                case EPROTO:
+                    continue;
+                default:
+                    *reply = SOCKS5_ERROR;
+                    return ADVANCE_PHASE_ERR;
+            }
+        }
+
+        if (!client_bind_admits_peer(socks5_client, &peer)
+            || !access_policy_admits(
+                socks5_server->cfg.access_policy,
+                ACCESS_POLICY_DESTINATION,
+                &peer
+            )
+        ) {
+            const int _ignored = close_socket(socket_fd);
+            continue;
+        }
+
+        const int _ignored = set_socket_nodelay(socket_fd);
+
+        if (OK !=
+            server_track_client_socket(
+                socks5_server,
+                socks5_client,
+                &socket_fd
+            )
+        ) {
+            *reply = SOCKS5_ERROR;
+            return try_close_socket_then_ret_arg(
+                socket_fd,
+                ADVANCE_PHASE_ERR
+            );
+        }
+        socks5_client->outbound_socket_fd = socket_fd;
+
+        const int _ignored_too =
+            client_close_bind_listener(
+                socks5_server,
+                socks5_client
+            );
+        return ADVANCE_PHASE_OK;
+    }
+}
+
+/*
+   In the reply to a CONNECT, BND.PORT contains the port number that the
+   server assigned to connect to the target host, while BND.ADDR
+   contains the associated IP address.
+*/
+/*
+   In the reply to a UDP ASSOCIATE request, the BND.PORT and BND.ADDR
+   fields indicate the port number/address where the client MUST send
+   UDP request messages to be relayed.
+*/
+static enum AdvancePhaseConsequence phase_shift_associate_udp(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    enum Socks5RequestReply* reply)
+{
+    socks5_client->udp_association =
+        udp_association_construct(
+            socks5_server,
+            socks5_client,
+            &socks5_client->current_request.client_request
+        );
+    if (NULL == socks5_client->udp_association) {
+        *reply = SOCKS5_ERROR;
+        return ADVANCE_PHASE_ERR;
+    }
+
+    return ADVANCE_PHASE_OK;
+}
+
+static enum AdvancePhaseConsequence phase_shift_send_request_reply(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
+{
+    struct sockaddr_storage bnd = {0};
+    socklen_t bnd_len = sizeof(bnd);
+    /*
+       In the second reply to a BIND, the BND.PORT and BND.ADDR fields
+       contain the address and port number of the connecting host.
+    */
+    const bool bound =
+        SOCKS5_REQUEST_CMD_BIND == socks5_client->current_request.client_request.cmd;
+    if (OK !=
+        (NULL != socks5_client->udp_association
+            ? udp_association_local_address(
+                socks5_client->udp_association,
+                &bnd,
+                &bnd_len
+            )
+            : bound
+            ? getpeername(
+                socks5_client->outbound_socket_fd,
+                (struct sockaddr*)&bnd,
+                &bnd_len
+            )
+            : getsockname(
+                socks5_client->outbound_socket_fd,
+                (struct sockaddr*)&bnd,
+                &bnd_len
+            )
+        )
+    ) {
+        return ADVANCE_PHASE_ERR;
+    }
+
+    char tmp[MAX_REQUEST_REPLY_SPACE];
+    const size_t time =
+        build_request_reply(
+            tmp,
+            SOCKS5_OK,
+            &bnd
+        );
+
+    if (OK !=
+        client_send_reply(
+            socks5_server,
+            socks5_client,
+            tmp,
+            time
+        )
+    ) {
+        return ADVANCE_PHASE_ERR;
+    }
+
+    if (NULL != socks5_client->udp_association) {
+        return ADVANCE_PHASE_OK;
+    }
+
+    /*
+        Only now is the remote read from: anything it sent early has to
+        queue up behind the reply.
+    */
+    return client_sub_read_activity_of(
+        socks5_server,
+        socks5_client,
+        socks5_client->outbound_socket_fd
+    )
+    != OK
+    ? ADVANCE_PHASE_ERR
+    : ADVANCE_PHASE_OK;
+}
+
+static bool server_shapes(
+    const struct Socks5Server* socks5_server)
+{
+    return ZERO != socks5_server->cfg.client_shaping.bytes_per_s
+        || ZERO != socks5_server->cfg.user_shaping.bytes_per_s
+        || ZERO != socks5_server->cfg.server_shaping.bytes_per_s;
+}
+
+/* the least of what the client's, its user's and the server's buckets hold */
+static uint64_t client_shaping_allowance(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
+{
+    uint64_t allowance =
+        token_bucket_available(
+            &socks5_client->shaping_bucket,
+            &socks5_server->cfg.client_shaping,
+            socks5_server->now_ms
+        );
+
+    if (NULL != socks5_client->user_bucket) {
+        const uint64_t user_allowance =
+            token_bucket_available(
+                socks5_client->user_bucket,
+                &socks5_server->cfg.user_shaping,
+                socks5_server->now_ms
+            );
+        if (user_allowance < allowance) {
+            allowance = user_allowance;
+        }
+    }
+
+    const uint64_t server_allowance =
+        token_bucket_available(
+            &socks5_server->shaping_buckets->server,
+            &socks5_server->cfg.server_shaping,
+            socks5_server->now_ms
+        );
+    return server_allowance < allowance
+        ? server_allowance
+        : allowance;
+}
+
+static void client_shaping_draw(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    const uint64_t bytes)
+{
+    token_bucket_draw(
+        &socks5_client->shaping_bucket,
+        &socks5_server->cfg.client_shaping,
+        bytes
+    );
+    if (NULL != socks5_client->user_bucket) {
+        token_bucket_draw(
+            socks5_client->user_bucket,
+            &socks5_server->cfg.user_shaping,
+            bytes
+        );
+    }
+    token_bucket_draw(
+        &socks5_server->shaping_buckets->server,
+        &socks5_server->cfg.server_shaping,
+        bytes
+    );
+}
+
+/*
+    Nothing to read with: the relay stops reading until the emptiest
+    bucket has refilled some. The wheel wakes every client parked on
+    the same tick in one pass, so a drained server bucket costs one
+    wake per tick, not a syscall per client per byte.
+*/
+static void client_park_shaped(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
+{
+    int64_t wait_ms =
+        token_bucket_refill_ms(
+            &socks5_client->shaping_bucket,
+            &socks5_server->cfg.client_shaping
+        );
+
+    if (NULL != socks5_client->user_bucket) {
+        const int64_t user_wait_ms =
+            token_bucket_refill_ms(
+                socks5_client->user_bucket,
+                &socks5_server->cfg.user_shaping
+            );
+        if (user_wait_ms > wait_ms) {
+            wait_ms = user_wait_ms;
+        }
+    }
+
+    const int64_t server_wait_ms =
+        token_bucket_refill_ms(
+            &socks5_server->shaping_buckets->server,
+            &socks5_server->cfg.server_shaping
+        );
+    if (server_wait_ms > wait_ms) {
+        wait_ms = server_wait_ms;
+    }
+
+    timer_wheel_arm(
+        &socks5_server->timers,
+        &socks5_client->shaping_timer,
+        socks5_server->now_ms + wait_ms
+    );
+}
+
+static int64_t client_relay_turn_bytes(
+    const struct Socks5Server* socks5_server,
+    const struct Socks5Client* socks5_client)
+{
+    return (int64_t)socks5_server->cfg.relay_turn_bytes
+        * socks5_client->relay_weight;
+}
+
+/*
+    Of want, what the relay may read now. Zero: it is to wait, either
+    queued for its next turn or parked until its buckets refill.
+*/
+static size_t client_relay_allowance(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    const size_t want)
+{
+    size_t allowance = want;
+
+    if (ZERO != socks5_server->cfg.relay_turn_bytes) {
+        if (socks5_client->relay_budget <= ZERO) {
+            server_queue_runnable(socks5_server, socks5_client);
+            return ZERO;
+        }
+        if ((uint64_t)socks5_client->relay_budget < allowance) {
+            allowance = socks5_client->relay_budget;
+        }
+    }
+
+    if (server_shapes(socks5_server)) {
+        const uint64_t shaping_allowance =
+            client_shaping_allowance(
+                socks5_server,
+                socks5_client
+            );
+        if (ZERO == shaping_allowance) {
+            client_park_shaped(socks5_server, socks5_client);
+            return ZERO;
+        }
+        if (shaping_allowance < allowance) {
+            allowance = shaping_allowance;
+        }
+    }
+
+    return allowance;
+}
+
+static void client_relay_drew(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    const size_t bytes)
+{
+    socks5_client->relay_budget -= bytes;
+    client_shaping_draw(
+        socks5_server,
+        socks5_client,
+        bytes
+    );
+}
+
+/* a relay that empties its socket within its turn starts the next one afresh */
+static void client_relay_drained(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
+{
+    if (!socks5_client->runnable) {
+        socks5_client->relay_budget =
+            client_relay_turn_bytes(
+                socks5_server,
+                socks5_client
+            );
+    }
+}
+
+static int leg_reap_zerocopy(
+    struct Socks5Server* socks5_server,
+    const struct RelayLeg* leg)
+{
+    if (OK !=
+        zerocopy_reap(
+            leg->zerocopy,
+            leg->dst_socket_fd
+        )
+    ) {
+        return ERR;
+    }
+    server_release_zerocopy_pins(
+        socks5_server,
+        leg->zerocopy,
+        false
+    );
+    return OK;
+}
+
+/*
+    Pins that outlive their client: the socket is kept open, through a
+    dup, until the kernel is done with them; it is only shut for writing.
+*/
+struct ZerocopyGrave
+{
+    struct TimerWheelEntry timer;
+    int socket_fd;
+    int64_t buried_ms;
+    struct ZerocopyLeg zerocopy;
+};
+
+enum {ZEROCOPY_GRAVE_POLL_MS=16};
+/* a peer that won't take the rest for this long has its connection reset */
+enum {ZEROCOPY_GRAVE_TIMEOUT_MS=60000};
+
+/* a reset: the kernel drops what it still holds to send, pages and all, as the socket closes */
+static void abandon_zerocopy_socket(
+    const int socket_fd)
+{
+    const struct linger linger = {
+        .l_onoff = 1,
+        .l_linger = ZERO
+    };
+    const int _ignored =
+        setsockopt(
+            socket_fd,
+            SOL_SOCKET,
+            SO_LINGER,
+            &linger,
+            sizeof(linger)
+        );
+}
+
+static void server_proc_zerocopy_grave(
+    struct Socks5Server* socks5_server,
+    struct TimerWheelEntry* entry)
+{
+    struct ZerocopyGrave* grave =
+        (struct ZerocopyGrave*)(
+            (char*)entry - offsetof(struct ZerocopyGrave, timer)
+        );
+
+    const bool reaped =
+        OK ==
+        zerocopy_reap(
+            &grave->zerocopy,
+            grave->socket_fd
+        );
+    server_release_zerocopy_pins(
+        socks5_server,
+        &grave->zerocopy,
+        false
+    );
+
+    if (ZERO != grave->zerocopy.pin_count
+        && reaped
+        && socks5_server->now_ms - grave->buried_ms < ZEROCOPY_GRAVE_TIMEOUT_MS
+    ) {
+        timer_wheel_arm(
+            &socks5_server->timers,
+            &grave->timer,
+            socks5_server->now_ms + ZEROCOPY_GRAVE_POLL_MS
+        );
+        return;
+    }
+
+    if (ZERO != grave->zerocopy.pin_count) {
+        abandon_zerocopy_socket(grave->socket_fd);
+    }
+    const int _ignored = close_socket(grave->socket_fd);
+    server_release_zerocopy_pins(
+        socks5_server,
+        &grave->zerocopy,
+        true
+    );
+    free(grave);
+}
+
+static void leg_bury_zerocopy(
+    struct Socks5Server* socks5_server,
+    const struct RelayLeg* leg)
+{
+    struct ZerocopyLeg* zerocopy = leg->zerocopy;
+    if (NULL == zerocopy
+        || ERR == leg->dst_socket_fd
+        || zerocopy_done(zerocopy, zerocopy->sends)
+    ) {
+        return;
+    }
+
+    /* the buffer joins the pins */
+    leg_relinquish_space(
+        socks5_server,
+        leg
+    );
+    if (OK ==
+        leg_reap_zerocopy(
+            socks5_server,
+            leg
+        )
+        && ZERO == zerocopy->pin_count
+    ) {
+        return;
+    }
+
+    struct ZerocopyGrave* grave = malloc(sizeof(struct ZerocopyGrave));
+    const int socket_fd =
+        NULL == grave
+        ? ERR
+        : fcntl(leg->dst_socket_fd, F_DUPFD_CLOEXEC, ZERO);
+    if (ERR == socket_fd) {
+        free(grave);
+        /* nothing is acquired from the pool before the socket is closed */
+        abandon_zerocopy_socket(leg->dst_socket_fd);
+        server_release_zerocopy_pins(
+            socks5_server,
+            zerocopy,
+            true
+        );
+        return;
+    }
+
+    if (!*leg->dst_shut_wr) {
+        const int _ignored = shutdown(socket_fd, SHUT_WR);
+    }
+    grave->socket_fd = socket_fd;
+    grave->buried_ms = socks5_server->now_ms;
+    grave->zerocopy = *zerocopy;
+    zerocopy->pin_count = ZERO;
+    timer_wheel_entry_construct(
+        &grave->timer,
+        server_proc_zerocopy_grave
+    );
+    timer_wheel_arm(
+        &socks5_server->timers,
+        &grave->timer,
+        socks5_server->now_ms + ZEROCOPY_GRAVE_POLL_MS
+    );
+}
+
+/* before the client's sockets are closed */
+static void client_bury_zerocopy(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
+{
+    const struct RelayLeg upstream_leg =
+        client_upstream_leg(socks5_client);
+    const struct RelayLeg downstream_leg =
+        client_downstream_leg(socks5_client);
+    leg_bury_zerocopy(socks5_server, &upstream_leg);
+    leg_bury_zerocopy(socks5_server, &downstream_leg);
+}
+
+/*
+    space[*start, *end) to dst: zerocopy with the leg on, at least
+    cfg.zerocopy_threshold bytes of it, and a pin to hold the buffer
+    with once let go of.
+*/
+static int leg_send_what_may(
+    struct Socks5Server* socks5_server,
+    const struct RelayLeg* leg,
+    bool* blocked_eagain)
+{
+    struct ZerocopyLeg* zerocopy = leg->zerocopy;
+    if (NULL != zerocopy
+        && zerocopy->enabled
+        && (size_t)(*leg->end - *leg->start) >= socks5_server->cfg.zerocopy_threshold
+    ) {
+        if (!zerocopy->space_sent
+            && MAX_ZEROCOPY_PINS == zerocopy->pin_count
+            && OK !=
+            leg_reap_zerocopy(
+                socks5_server,
+                leg
+            )
+        ) {
+            return ERR;
+        }
+
+        if (zerocopy->enabled
+            && (zerocopy->space_sent || zerocopy->pin_count < MAX_ZEROCOPY_PINS)
+        ) {
+            return zerocopy_send_what_may(
+                zerocopy,
+                leg->dst_socket_fd,
+                *leg->space,
+                *leg->start,
+                *leg->end,
+                blocked_eagain
+            );
+        }
+    }
+
+    return send_what_may(
+        leg->dst_socket_fd,
+        *leg->space,
+        *leg->start,
+        *leg->end,
+        blocked_eagain
+    );
+}
+
+/*
+    Sends space[*start, *end) to dst. *flushed is false when dst would
+    block, in which case write activity of dst is subscribed to.
+*/
+static int relay_flush(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    const struct RelayLeg* leg,
+    bool* flushed)
+{
+    *flushed = false;
+
+    if (*leg->start < *leg->end) {
+        bool blocked_eagain = false;
+        const int sent =
+            leg_send_what_may(
+                socks5_server,
+                leg,
+                &blocked_eagain
+            );
+        if (ERR == sent) {
+            return ERR;
+        }
+
+        *leg->start += sent;
+
+        if (*leg->start < *leg->end) {
+            return client_sub_write_activity_of(
+                socks5_server,
+                socks5_client,
+                leg->dst_socket_fd
+            );
+        }
+    }
+
+    leg_relinquish_space(
+        socks5_server,
+        leg
+    );
+    *flushed = true;
+
+    return client_unsub_write_activity_of(
+        socks5_server,
+        socks5_client,
+        leg->dst_socket_fd
+    );
+}
+
+static int relay_shut_wr_dst(
+    const struct RelayLeg* leg)
+{
+    if (*leg->dst_shut_wr) {
+        return OK;
+    }
+
+    *leg->dst_shut_wr = true;
+    if (OK != shutdown(leg->dst_socket_fd, SHUT_WR) && ENOTCONN != errno) {
+        return ERR;
+    }
+    return OK;
+}
+
+/* the largest pooled buffer: zerocopy pays off with larger sends */
+enum {ZEROCOPY_READ_SPACE=65536};
+
+/*
+    Moves bytes src -> scratch space -> dst until src would block or dst
+    would block. Reads only happen once the leg has been fully drained so
+    one recv batch becomes one send batch instead of a syscall per
+    segment; only what dst would not take is copied into the leg's own
+    buffer. A zerocopy leg reads into its own buffer instead: scratch is
+    read into again before the kernel is done with its pages.
+*/
+static int relay_pump(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    const struct RelayLeg* leg)
+{
+    enum {B=sizeof(socks5_server->scratch_space)};
+    char* scratch = socks5_server->scratch_space;
+
+    bool src_drained = false;
+    for (;;) {
+        bool flushed = false;
+        if (OK !=
+            relay_flush(
+                socks5_server,
+                socks5_client,
+                leg,
+                &flushed
+            )
+        ) {
+            return ERR;
+        }
+        if (!flushed) {
+            return OK;
+        }
+
+        if (*leg->src_end_of_stream) {
+            return relay_shut_wr_dst(leg);
+        }
+
+        if (src_drained) {
+            client_relay_drained(socks5_server, socks5_client);
+            return OK;
+        }
+
+        const bool zerocopy = NULL != leg->zerocopy && leg->zerocopy->enabled;
+        const size_t want =
+            client_relay_allowance(
+                socks5_server,
+                socks5_client,
+                zerocopy ? ZEROCOPY_READ_SPACE : B
+            );
+        if (ZERO == want) {
+            return OK;
+        }
+
+        if (zerocopy) {
+            if (OK !=
+                leg_reserve_space(
+                    socks5_server,
+                    leg,
+                    want
+                )
+            ) {
+                return ERR;
+            }
+
+            const int read =
+                recv_what_may(
+                    leg->src_socket_fd,
+                    *leg->space,
+                    *leg->end,
+                    *leg->end + want,
+                    leg->src_end_of_stream
+                );
+            if (ERR == read) {
+                return ERR;
+            }
+            src_drained = read < (int)want;
+
+            client_relay_drew(
+                socks5_server,
+                socks5_client,
+                read
+            );
+            *leg->end += read;
+            continue;
+        }
+
+        const int read =
+            recv_what_may(
+                leg->src_socket_fd,
+                scratch,
+                ZERO,
+                want,
+                leg->src_end_of_stream
+            );
+        if (ERR == read) {
+            return ERR;
+        }
+        src_drained = read < (int)want;
+
+        client_relay_drew(
+            socks5_server,
+            socks5_client,
+            read
+        );
+
+        if (ZERO == read) {
+            continue;
+        }
+
+        bool blocked_eagain = false;
+        const int sent =
+            send_what_may(
+                leg->dst_socket_fd,
+                scratch,
+                ZERO,
+                read,
+                &blocked_eagain
+            );
+        if (ERR == sent) {
+            return ERR;
+        }
+
+        if (sent < read
+            && OK !=
+            leg_append(
+                socks5_server,
+                leg,
+                &scratch[sent],
+                read - sent
+            )
+        ) {
+            return ERR;
+        }
+    }
+}
+
+enum SplicePumpConsequence
+{
+    SPLICE_PUMP_OK,
+    SPLICE_PUMP_UNSUPPORTED,
+    SPLICE_PUMP_ERR = -1
+};
+
+enum {SPLICE_CHUNK=1 << 16};
+
+/*
+    Same contract as relay_pump, but bytes go src -> pipe -> dst without
+    being copied into user space.
+*/
+static enum SplicePumpConsequence relay_splice_pump(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    const struct RelayLeg* leg)
+{
+    struct PipePair* pipe = leg->pipe;
+
+    bool src_drained = false;
+    for (;;) {
+        while (pipe->in_pipe > ZERO) {
+            const ssize_t moved =
+                splice(
+                    pipe->read_fd,
+                    NULL,
+                    leg->dst_socket_fd,
+                    NULL,
+                    pipe->in_pipe,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK
+                );
+            if (ERR == moved && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+                return client_sub_write_activity_of(
+                    socks5_server,
+                    socks5_client,
+                    leg->dst_socket_fd
+                ) == OK
+                ? SPLICE_PUMP_OK
+                : SPLICE_PUMP_ERR;
+            } else if (ERR == moved && EINTR == errno) {
+                continue;
+            } else if (ERR == moved || ZERO == moved) {
+                return SPLICE_PUMP_ERR;
+            }
+            pipe->in_pipe -= moved;
+        }
+
+        if (OK !=
+            client_unsub_write_activity_of(
+                socks5_server,
+                socks5_client,
+                leg->dst_socket_fd
+            )
+        ) {
+            return SPLICE_PUMP_ERR;
+        }
+
+        if (*leg->src_end_of_stream) {
+            return relay_shut_wr_dst(leg) == OK
+                ? SPLICE_PUMP_OK
+                : SPLICE_PUMP_ERR;
+        }
+
+        if (src_drained) {
+            client_relay_drained(socks5_server, socks5_client);
+            return SPLICE_PUMP_OK;
+        }
+
+        while (pipe->in_pipe < SPLICE_CHUNK) {
+            const size_t want =
+                client_relay_allowance(
+                    socks5_server,
+                    socks5_client,
+                    SPLICE_CHUNK - pipe->in_pipe
+                );
+            /* what the pipe holds goes out first */
+            if (ZERO == want && ZERO == pipe->in_pipe) {
+                return SPLICE_PUMP_OK;
+            }
+            if (ZERO == want) {
+                break;
+            }
+
+            const ssize_t moved =
+                splice(
+                    leg->src_socket_fd,
+                    NULL,
+                    pipe->write_fd,
+                    NULL,
+                    want,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK
+                );
+            if (ZERO == moved) {
+                *leg->src_end_of_stream = true;
+                break;
+            }
+            if (ERR == moved && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+                src_drained = true;
+                break;
+            } else if (ERR == moved && EINTR == errno) {
+                continue;
+            } else if (ERR == moved && (EINVAL == errno || ENOSYS == errno)
+                && ZERO == pipe->in_pipe
+            ) {
+                return SPLICE_PUMP_UNSUPPORTED;
+            } else if (ERR == moved) {
+                return SPLICE_PUMP_ERR;
+            }
+            pipe->in_pipe += moved;
+            client_relay_drew(
+                socks5_server,
+                socks5_client,
+                moved
+            );
+        }
+    }
+}
+
+static void client_unsplice(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
+{
+    pipe_pool_relinquish(
+        &socks5_server->pipes,
+        &socks5_client->upstream_pipe
+    );
+    pipe_pool_relinquish(
+        &socks5_server->pipes,
+        &socks5_client->downstream_pipe
+    );
+    socks5_client->relay_spliced = false;
+}
+
+static void client_try_splice(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
+{
+    if (SOCKS5_RELAY_MODE_SPLICE != socks5_server->cfg.relay_mode
+        || SOCKS5_EVENT_MODEL_COMPLETION == socks5_server->cfg.event_model) {
+        return;
+    }
+
+    if (OK !=
+        pipe_pool_acquire(
+            &socks5_server->pipes,
+            &socks5_client->upstream_pipe
+        )
+    ) {
+        return;
+    }
+
+    if (OK !=
+        pipe_pool_acquire(
+            &socks5_server->pipes,
+            &socks5_client->downstream_pipe
+        )
+    ) {
+        client_unsplice(socks5_server, socks5_client);
+        return;
+    }
+
+    socks5_client->relay_spliced = true;
+}
+
+/*
+    SOCKS5_EVENT_MODEL_COMPLETION: the event source reads the client
+    ahead of the handshake and of a slow remote, and can't be made to
+    leave bytes in the socket. Past the high water the client's reads
+    are withdrawn, the event source holding on to whatever it still
+    receives, until the relay has flushed the upstream leg.
+*/
+static void client_hold_back_inbound_reads(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
+{
+    if (socks5_client->inbound_reads_held
+        || socks5_client->io.recvd - socks5_client->io.forwarded < COMPLETION_RECV_HIGH_WATER
+    ) {
+        return;
+    }
+
+    socks5_client->inbound_reads_held = true;
+    const int _ignored =
+        client_unsub_read_activity_of(
+            socks5_server,
+            socks5_client,
+            socks5_client->inbound_socket_fd
+        );
+}
+
+static void client_release_inbound_reads(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
+{
+    if (!socks5_client->inbound_reads_held) {
+        return;
+    }
+
+    socks5_client->inbound_reads_held = false;
+    const int _ignored =
+        client_sub_read_activity_of(
+            socks5_server,
+            socks5_client,
+            socks5_client->inbound_socket_fd
+        );
+}
+
+static int client_relay_leg(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    const struct RelayLeg* leg)
+{
+    socks5_client->last_active_ms = socks5_server->now_ms;
+
+    if (SOCKS5_EVENT_MODEL_COMPLETION == socks5_server->cfg.event_model) {
+        /* the event source reads; only what got buffered is ours to send */
+        bool flushed = false;
+        if (OK !=
+            relay_flush(
+                socks5_server,
+                socks5_client,
+                leg,
+                &flushed
+            )
+        ) {
+            return ERR;
+        }
+        if (flushed && leg->src_socket_fd == socks5_client->inbound_socket_fd) {
+            client_release_inbound_reads(
+                socks5_server,
+                socks5_client
+            );
+        }
+        return flushed && *leg->src_end_of_stream
+            ? relay_shut_wr_dst(leg)
+            : OK;
+    }
+
+    if (!socks5_client->relay_spliced) {
+        return relay_pump(
+            socks5_server,
+            socks5_client,
+            leg
+        );
+    }
+
+    /* bytes buffered during the handshake go out before any spliced ones */
+    bool flushed = false;
+    if (OK !=
+        relay_flush(
+            socks5_server,
+            socks5_client,
+            leg,
+            &flushed
+        )
+    ) {
+        return ERR;
+    }
+    if (!flushed) {
+        return OK;
+    }
+
+    switch (
+        relay_splice_pump(
+            socks5_server,
+            socks5_client,
+            leg
+        )
+    ) {
+        case SPLICE_PUMP_OK:
+            return OK;
+        case SPLICE_PUMP_UNSUPPORTED:
+            client_unsplice(socks5_server, socks5_client);
+            return relay_pump(
+                socks5_server,
+                socks5_client,
+                leg
+            );
+        case SPLICE_PUMP_ERR: default:
+            return ERR;
+    }
+}
+
+static void client_weigh_relay(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
+{
+    socks5_client->relay_weight =
+        NULL == socks5_server->cfg.weigh_relay
+        ? 1
+        : socks5_server->cfg.weigh_relay(socks5_server, socks5_client);
+    if (ZERO == socks5_client->relay_weight) {
+        socks5_client->relay_weight = 1;
+    }
+    socks5_client->relay_budget =
+        client_relay_turn_bytes(
+            socks5_server,
+            socks5_client
+        );
+}
+
+static void client_enable_zerocopy(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
+{
+    if (ZERO == socks5_server->cfg.zerocopy_threshold) {
+        return;
+    }
+
+    /* without it the client relays by copy, as with zerocopy off */
+    size_t capacity = ZERO;
+    struct ZerocopyLeg* legs =
+        (struct ZerocopyLeg*)io_buffer_pool_acquire(
+            &socks5_server->io_buffers,
+            ZEROCOPY_LEGS_SIZE,
+            &capacity
+        );
+    if (NULL == legs) {
+        return;
+    }
+    zerocopy_leg_construct(&legs[UPSTREAM_ZEROCOPY_LEG]);
+    zerocopy_leg_construct(&legs[DOWNSTREAM_ZEROCOPY_LEG]);
+    socks5_client->zerocopy_legs = legs;
+
+    zerocopy_enable(
+        &legs[UPSTREAM_ZEROCOPY_LEG],
+        socks5_client->outbound_socket_fd
+    );
+    /* the kernel's TLS sends take no MSG_ZEROCOPY */
+    if (NULL != socks5_server->cfg.tls) {
+        return;
+    }
+    zerocopy_enable(
+        &legs[DOWNSTREAM_ZEROCOPY_LEG],
+        socks5_client->inbound_socket_fd
+    );
+}
+
+static int client_relay_upstream(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
+{
+    const struct RelayLeg leg =
+        client_upstream_leg(socks5_client);
+    return client_relay_leg(
+        socks5_server,
+        socks5_client,
+        &leg
+    );
+}
+
+static int client_relay_downstream(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
+{
+    const struct RelayLeg leg =
+        client_downstream_leg(socks5_client);
+    return client_relay_leg(
+        socks5_server,
+        socks5_client,
+        &leg
+    );
+}
+
+static bool client_relay_finished(
+    const struct Socks5Client* socks5_client)
+{
+    return socks5_client->inbound_shut_wr
+        && socks5_client->outbound_shut_wr;
+}
+
+/*
+    The rest of a pipelined message is to come: whatever is held goes
+    out now, as the client may be waiting on it before it sends more.
+*/
+static int client_await_pipelined(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
+{
+    if (OK !=
+        client_send_reply(
+            socks5_server,
+            socks5_client,
+            NULL,
+            ZERO
+        )
+    ) {
+        return ERR;
+    }
+    return socks5_client->inbound_end_of_stream ? ERR : OK;
+}
+
+/* where a request goes once its destination is known */
+static enum Socks5ClientPhase phase_of_destined_request(
+    const struct Socks5Client* socks5_client)
+{
+    return SOCKS5_REQUEST_CMD_BIND == socks5_client->current_request.client_request.cmd
+        ? SOCKS5_CLIENT_PHASE_BEGIN_BINDING
+        : SOCKS5_CLIENT_PHASE_BEGIN_CONNECTING_OUTBOUND;
+}
+
+static int shift_phase(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
+{
+    enum Socks5RequestReply reply = SOCKS5_ERROR;
+
+phase_change:
+    client_track_deadline(
+        socks5_server,
+        socks5_client
+    );
+
+    switch (socks5_client->phase) {
+        case SOCKS5_CLIENT_PHASE_TLS_HANDSHAKE:
+            switch (
+                phase_tryshift_tls_handshake(
+                    socks5_server,
+                    socks5_client
+                )
+            ) {
+                case ADVANCE_PHASE_OK:
+                    socks5_client->phase = SOCKS5_CLIENT_PHASE_BEGIN_RECVING_CLIENT_VERSION_CHOICE_METHODS_ARRAY_REQ;
+                    goto phase_change;
+                case ADVANCE_PHASE_IOBLOCKED_AGAIN:
+                    return OK;
+                case ADVANCE_PHASE_ERR: default:
+                    return ERR;
+            }
+/*
+    The client connects to the server, and sends a version
+    identifier/method selection message:
+
+            +----+----------+----------+
+            |VER | NMETHODS | METHODS  |
+            +----+----------+----------+
+            | 1  |    1     | 1 to 255 |
+            +----+----------+----------+
+*/
+        case SOCKS5_CLIENT_PHASE_BEGIN_RECVING_CLIENT_VERSION_CHOICE_METHODS_ARRAY_REQ:
+        case SOCKS5_CLIENT_PHASE_AWAITING_EVENT_RECVD_CLIENT_VERSION_CHOICE_METHODS_ARRAY_REQ:
+            switch (
+                phase_tryshift_tryparse_client_recvbuff_for_hello(
+                    socks5_server,
+                    socks5_client
+                )
+            ) {
+                case ADVANCE_PHASE_OK:
+                    socks5_client->status = SENDING_SOCKS5_RESPONSE;
+                    socks5_client->phase = SOCKS5_CLIENT_PHASE_BEGIN_SENDING_AUTH_METHOD_CHOICE_RESP;
+                    goto phase_change;
+                case ADVANCE_PHASE_IOBLOCKED_AGAIN:
+                    socks5_client->phase = SOCKS5_CLIENT_PHASE_AWAITING_EVENT_RECVD_CLIENT_VERSION_CHOICE_METHODS_ARRAY_REQ;
+                    return socks5_client->inbound_end_of_stream ? ERR : OK;
+                case ADVANCE_PHASE_ERR: default:
+                    return ERR;
+            }
+/*
+   The server selects from one of the methods given in METHODS, and
+   sends a METHOD selection message:
+
+                         +----+--------+
+                         |VER | METHOD |
+                         +----+--------+
+                         | 1  |   1    |
+                         +----+--------+
+*/
+        case SOCKS5_CLIENT_PHASE_BEGIN_SENDING_AUTH_METHOD_CHOICE_RESP:
+            switch (
+                phase_shift_server_choose_auth_method_and_send(
+                    socks5_server,
+                    socks5_client
+                )
+            ) {
+                case ADVANCE_PHASE_OK:
+                    socks5_client->status = RECVING_SOCKS5_REQUEST;
+                    socks5_client->phase = phase_after_auth_method_choice(socks5_client);
+                    goto phase_change;
+                case ADVANCE_PHASE_IOBLOCKED_AGAIN:
+                    socks5_client->phase = SOCKS5_CLIENT_PHASE_AWAITING_EVENT_SENT_AUTH_METHOD_CHOICE_RESP;
+                    return OK;
+                case ADVANCE_PHASE_ERR: default:
+                    return ERR;
+            }
+
+        case SOCKS5_CLIENT_PHASE_AWAITING_EVENT_SENT_AUTH_METHOD_CHOICE_RESP:
+            if (ZERO == socks5_client->io.to_send) {
+                socks5_client->status = RECVING_SOCKS5_REQUEST;
+                socks5_client->phase = phase_after_auth_method_choice(socks5_client);
+                goto phase_change;
+            }
+            return OK;
+
+        case SOCKS5_CLIENT_PHASE_RECV_USERNAME_PASSWORD_AUTH:
+            switch (
+                phase_tryshift_authenticate_username_password(
+                    socks5_server,
+                    socks5_client
+                )
+            ) {
+                case ADVANCE_PHASE_OK:
+                    socks5_client->phase = SOCKS5_CLIENT_PHASE_RECV_REQUEST;
+                    goto phase_change;
+                case ADVANCE_PHASE_IOBLOCKED_AGAIN:
+                    return client_await_pipelined(
+                        socks5_server,
+                        socks5_client
+                    );
+                case ADVANCE_PHASE_ERR: default:
+                    return ERR;
+            }
+/*
+   The SOCKS request is formed as follows:
+
+        +----+-----+-------+------+----------+----------+
+        |VER | CMD |  RSV  | ATYP | DST.ADDR | DST.PORT |
+        +----+-----+-------+------+----------+----------+
+        | 1  |  1  | X'00' |  1   | Variable |    2     |
+        +----+-----+-------+------+----------+----------+
+
+     Where:
+
+          o  VER    protocol version: X'05'
+          o  CMD
+             o  CONNECT X'01'
+             o  BIND X'02'
+             o  UDP ASSOCIATE X'03'
+          o  RSV    RESERVED
+          o  ATYP   address type of following address
+             o  IP V4 address: X'01'
+             o  DOMAINNAME: X'03'
+             o  IP V6 address: X'04'
+          o  DST.ADDR       desired destination address
+          o  DST.PORT desired destination port in network octet
+             order
+
+   The SOCKS server will typically evaluate the request based on source
+   and destination addresses, and return one or more reply messages, as
+   appropriate for the request type.
+
+*/
+        case SOCKS5_CLIENT_PHASE_RECV_REQUEST:
+            switch (
+                phase_tryshift_tryparse_client_recvbuff_for_req(
+                    socks5_server,
+                    socks5_client
+                )
+            ) {
+                case ADVANCE_PHASE_OK:
+                    socks5_client->status = SENDING_SOCKS5_RESPONSE;
+                    if (!access_policy_admits(
+                            socks5_server->cfg.access_policy,
+                            ACCESS_POLICY_SOURCE,
+                            &socks5_client->address
+                        )
+                        || (SOCKS5_ADDR_TYPE_DOMAINNAME == socks5_client->current_request.client_request.addr_type
+                            && domain_index_holds(
+                                socks5_server->cfg.domain_blocklist,
+                                socks5_client->current_request.client_request.dst_addr.domain_name,
+                                socks5_client->current_request.client_request.dst_addr_len
+                            ))
+                    ) {
+                        return client_send_failure_reply(
+                            socks5_server,
+                            socks5_client,
+                            SOCKS5_ERROR_CONNECTION_TO_REMOTE_HOST_FORBIDDEN
+                        );
+                    }
+                    socks5_client->phase =
+                        SOCKS5_REQUEST_CMD_UDPASSOSICATE == socks5_client->current_request.client_request.cmd
+                        ? SOCKS5_CLIENT_PHASE_BEGIN_ASSOCIATING_UDP
+                        : SOCKS5_ADDR_TYPE_DOMAINNAME == socks5_client->current_request.client_request.addr_type
+                        ? SOCKS5_CLIENT_PHASE_BEGIN_RESOLVING_DESTINATION
+                        : phase_of_destined_request(socks5_client);
+                    goto phase_change;
+                case ADVANCE_PHASE_IOBLOCKED_AGAIN:
+                    return client_await_pipelined(
+                        socks5_server,
+                        socks5_client
+                    );
+                case ADVANCE_PHASE_ERR: default:
+                    return ERR;
+            }
+
+        case SOCKS5_CLIENT_PHASE_BEGIN_RESOLVING_DESTINATION:
+            switch (
+                phase_shift_resolve_destination(
+                    socks5_server,
+                    socks5_client,
+                    &reply
+                )
+            ) {
+                case ADVANCE_PHASE_OK:
+                    socks5_client->phase = phase_of_destined_request(socks5_client);
+                    goto phase_change;
+                case ADVANCE_PHASE_IOBLOCKED_AGAIN:
+                    socks5_client->phase = SOCKS5_CLIENT_PHASE_AWAITING_EVENT_DESTINATION_RESOLVED;
+                    return OK;
+                case ADVANCE_PHASE_ERR: default:
+                    return client_send_failure_reply(
+                        socks5_server,
+                        socks5_client,
+                        reply
+                    );
+            }
+
+        case SOCKS5_CLIENT_PHASE_AWAITING_EVENT_DESTINATION_RESOLVED:
+            switch (
+                phase_tryshift_destination_resolved(
+                    socks5_client,
+                    &reply
+                )
+            ) {
+                case ADVANCE_PHASE_OK:
+                    socks5_client->phase = phase_of_destined_request(socks5_client);
+                    goto phase_change;
+                case ADVANCE_PHASE_IOBLOCKED_AGAIN:
+                    return OK;
+                case ADVANCE_PHASE_ERR: default:
+                    return client_send_failure_reply(
+                        socks5_server,
+                        socks5_client,
+                        reply
+                    );
+            }
+
+        case SOCKS5_CLIENT_PHASE_BEGIN_CONNECTING_OUTBOUND:
+            switch (
+                phase_shift_connect_outbound(
+                    socks5_server,
+                    socks5_client,
+                    &reply
+                )
+            ) {
+                case ADVANCE_PHASE_OK:
+                    socks5_client->phase = SOCKS5_CLIENT_PHASE_BEGIN_SENDING_REQUEST_REPLY;
+                    goto phase_change;
+                case ADVANCE_PHASE_IOBLOCKED_AGAIN:
+                    socks5_client->phase = SOCKS5_CLIENT_PHASE_AWAITING_EVENT_OUTBOUND_CONNECTED;
+                    return OK;
+                case ADVANCE_PHASE_ERR: default:
+                    return client_send_failure_reply(
+                        socks5_server,
+                        socks5_client,
+                        reply
+                    );
+            }
+
+        case SOCKS5_CLIENT_PHASE_AWAITING_EVENT_OUTBOUND_CONNECTED:
+            switch (
+                phase_tryshift_outbound_connected(
+                    socks5_server,
+                    socks5_client,
+                    &reply
+                )
+            ) {
+                case ADVANCE_PHASE_OK:
+                    socks5_client->phase = SOCKS5_CLIENT_PHASE_BEGIN_SENDING_REQUEST_REPLY;
+                    goto phase_change;
+                case ADVANCE_PHASE_IOBLOCKED_AGAIN:
+                    return OK;
+                case ADVANCE_PHASE_ERR: default:
+                    return client_send_failure_reply(
+                        socks5_server,
+                        socks5_client,
+                        reply
+                    );
+            }
+
+/*
+   The BIND request is used in protocols which require the client to
+   accept connections from the server.
+*/
+        case SOCKS5_CLIENT_PHASE_BEGIN_BINDING:
+            switch (
+                phase_shift_bind(
+                    socks5_server,
+                    socks5_client,
+                    &reply
+                )
+            ) {
+                case ADVANCE_PHASE_OK:
+                    socks5_client->phase = SOCKS5_CLIENT_PHASE_AWAITING_EVENT_BIND_ACCEPTED;
+                    goto phase_change;
+                case ADVANCE_PHASE_ERR: default:
+                    return client_send_failure_reply(
+                        socks5_server,
+                        socks5_client,
+                        reply
+                    );
+            }
+
+        case SOCKS5_CLIENT_PHASE_AWAITING_EVENT_BIND_ACCEPTED:
+            switch (
+                phase_tryshift_bind_accepted(
+                    socks5_server,
+                    socks5_client,
+                    &reply
+                )
+            ) {
+                case ADVANCE_PHASE_OK:
+                    socks5_client->phase = SOCKS5_CLIENT_PHASE_BEGIN_SENDING_REQUEST_REPLY;
+                    goto phase_change;
+                case ADVANCE_PHASE_IOBLOCKED_AGAIN:
+                    return socks5_client->inbound_end_of_stream ? ERR : OK;
+                case ADVANCE_PHASE_ERR: default:
+                    return client_send_failure_reply(
+                        socks5_server,
+                        socks5_client,
+                        reply
+                    );
+            }
+
+        case SOCKS5_CLIENT_PHASE_BEGIN_ASSOCIATING_UDP:
+            switch (
+                phase_shift_associate_udp(
+                    socks5_server,
+                    socks5_client,
+                    &reply
+                )
+            ) {
+                case ADVANCE_PHASE_OK:
+                    socks5_client->phase = SOCKS5_CLIENT_PHASE_BEGIN_SENDING_REQUEST_REPLY;
+                    goto phase_change;
+                case ADVANCE_PHASE_ERR: default:
+                    return client_send_failure_reply(
+                        socks5_server,
+                        socks5_client,
+                        reply
+                    );
+            }
+
+/*
+   If the reply code (REP value of X'00') indicates a success, and the
+   request was either a BIND or a CONNECT, the client may now start
+   passing data.
+*/
+        case SOCKS5_CLIENT_PHASE_BEGIN_SENDING_REQUEST_REPLY:
+            switch (
+                phase_shift_send_request_reply(
+                    socks5_server,
+                    socks5_client
+                )
+            ) {
+                case ADVANCE_PHASE_OK:
+                    if (NULL != socks5_client->udp_association) {
+                        socks5_client->status = RECVING_SOCKS5_REQUEST;
+                        socks5_client->phase = SOCKS5_CLIENT_PHASE_RELAYING_DATAGRAMS;
+                        goto phase_change;
+                    }
+                    client_release_destination(socks5_server, socks5_client);
+                    client_try_splice(socks5_server, socks5_client);
+                    client_weigh_relay(socks5_server, socks5_client);
+                    client_enable_zerocopy(socks5_server, socks5_client);
+                    socks5_client->status = RECVING_SOCKS5_REQUEST;
+                    socks5_client->phase = SOCKS5_CLIENT_PHASE_RELAYING;
+                    goto phase_change;
+                case ADVANCE_PHASE_ERR: default:
+                    return ERR;
+            }
+
+        case SOCKS5_CLIENT_PHASE_RELAYING:
+            if (OK != client_relay_upstream(socks5_server, socks5_client)) {
+                return ERR;
+            }
+            if (OK != client_relay_downstream(socks5_server, socks5_client)) {
+                return ERR;
+            }
+            return client_relay_finished(socks5_client) ? ERR : OK;
+
+/*
+   A UDP association terminates when the TCP connection that the UDP
+   ASSOCIATE request arrived on terminates.
+*/
+        case SOCKS5_CLIENT_PHASE_RELAYING_DATAGRAMS:
+            client_discard_recvd(
+                socks5_server,
+                socks5_client
+            );
+            return socks5_client->inbound_end_of_stream ? ERR : OK;
+
+        default:
+            return ERR;
+    }
+}
+
+static void client_proc_shaping_refilled(
+    struct Socks5Server* socks5_server,
+    struct TimerWheelEntry* entry)
+{
+    struct Socks5Client* socks5_client =
+        (struct Socks5Client*)(
+            (char*)entry - offsetof(struct Socks5Client, shaping_timer)
+        );
+
+    /* both legs: edge triggered, what was left unread raises no new event */
+    if (OK !=
+        shift_phase(
+            socks5_server,
+            socks5_client
+        )
+    ) {
+        const int _ignored =
+            client_destruct(
+                socks5_server,
+                socks5_client
+            );
+    }
+}
+
+/* the next destination address may be tried, alongside the attempts in flight */
+static void client_proc_attempt_delay(
+    struct Socks5Server* socks5_server,
+    struct TimerWheelEntry* entry)
+{
+    struct Socks5Client* socks5_client =
+        (struct Socks5Client*)(
+            (char*)entry - offsetof(struct Socks5Client, attempt_timer)
+        );
+
+    socks5_client->attempt_due = true;
+    if (OK !=
+        shift_phase(
+            socks5_server,
+            socks5_client
+        )
+    ) {
+        const int _ignored =
+            client_destruct(
+                socks5_server,
+                socks5_client
+            );
+    }
+}
+
+static int client_recv_data_advance_phase(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client)
+{
+    const int consequence =
+        client_recv_whatmayof_iobuff(socks5_server, socks5_client);
+    if (ERR == consequence) {
+        return ERR;
+    }
+
+    return shift_phase(
+        socks5_server,
+        socks5_client
+    );
+}
+
+static int proc_listener_pending_connections(
+    struct Socks5Server* socks5_server)
+{
+    enum AdvancePhaseConsequence conseq = {0};
+    do {
+        conseq = proc_new_connection_event(
+            socks5_server
+        );
+        if (ADVANCE_PHASE_ERR == conseq
+            && (ECONNABORTED == errno || EINTR == errno || EPROTO == errno)) {
+            conseq = ADVANCE_PHASE_OK;
+        }
+    } while (conseq == ADVANCE_PHASE_OK);
+
+    switch (conseq) {
+        case ADVANCE_PHASE_OK:
+        case ADVANCE_PHASE_IOBLOCKED_AGAIN:
+            return OK;
+        default:
+        case ADVANCE_PHASE_ERR:
+            return ERR;
+    }
+}
+
+static int client_proc_writable_event(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    const int socket_fd)
+{
+    if (SOCKS5_CLIENT_PHASE_RELAYING == socks5_client->phase) {
+        const int relayed =
+            socket_fd == socks5_client->outbound_socket_fd
+            ? client_relay_upstream(socks5_server, socks5_client)
+            : client_relay_downstream(socks5_server, socks5_client);
+        if (OK != relayed) {
+            return ERR;
+        }
+        return client_relay_finished(socks5_client) ? ERR : OK;
+    }
+
+    if (socket_fd == socks5_client->inbound_socket_fd) {
+        const int sent =
+            client_send_whatmayof_iobuf(
+                socks5_server,
+                socks5_client
+            );
+        if (ERR == sent) {
+            return ERR;
+        }
+    }
+
+    return shift_phase(
+        socks5_server,
+        socks5_client
+    );
+}
+
+static int client_proc_readable_event(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    const int socket_fd)
+{
+    if (SOCKS5_CLIENT_PHASE_RELAYING == socks5_client->phase) {
+        const int relayed =
+            socket_fd == socks5_client->outbound_socket_fd
+            ? client_relay_downstream(socks5_server, socks5_client)
+            : client_relay_upstream(socks5_server, socks5_client);
+        if (OK != relayed) {
+            return ERR;
+        }
+        return client_relay_finished(socks5_client) ? ERR : OK;
+    }
+
+    if (SOCKS5_CLIENT_PHASE_RELAYING_DATAGRAMS == socks5_client->phase
+        && socket_fd != socks5_client->inbound_socket_fd
+    ) {
+        socks5_client->last_active_ms = socks5_server->now_ms;
+        return udp_association_proc_readable(
+            socks5_server,
+            socks5_client->udp_association,
+            socket_fd
+        );
+    }
+
+    /* the outbound socket, a connection attempt that failed, or the BIND listener; or OpenSSL reads */
+    if (socket_fd != socks5_client->inbound_socket_fd
+        || SOCKS5_CLIENT_PHASE_TLS_HANDSHAKE == socks5_client->phase
+    ) {
+        return shift_phase(
+            socks5_server,
+            socks5_client
+        );
+    }
+
+    return client_recv_data_advance_phase(
+        socks5_server,
+        socks5_client
+    );
+}
+
+/* completions of the zerocopy sends of whichever leg writes to socket_fd */
+static int client_proc_error_queue_event(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    const int socket_fd)
+{
+    const struct RelayLeg legs[] = {
+        client_upstream_leg(socks5_client),
+        client_downstream_leg(socks5_client)
+    };
+    for (ptrdiff_t i = 0; i < (ptrdiff_t)(sizeof(legs) / sizeof(legs[0])); i++) {
+        const struct RelayLeg* leg = &legs[i];
+        if (socket_fd != leg->dst_socket_fd
+            || NULL == leg->zerocopy
+            || zerocopy_done(leg->zerocopy, leg->zerocopy->sends)
+        ) {
+            continue;
+        }
+        if (OK !=
+            leg_reap_zerocopy(
+                socks5_server,
+                leg
+            )
+        ) {
+            return ERR;
+        }
+    }
+    return OK;
+}
+
+static int proc_socket_error_queue_event(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    const int socket_fd)
+{
+    if (OK !=
+        client_proc_error_queue_event(
+            socks5_server,
+            socks5_client,
+            socket_fd
+        )
     ) {
-        case TRY_PARSE_OK:
-            return ADVANCE_PHASE_OK;
-        case TRY_PARSE_UNEXPECTED_END_OF_INPUT:
-            return ADVANCE_PHASE_IOBLOCKED_AGAIN;
-        case TRY_PARSE_ERR: default:
-            return ADVANCE_PHASE_ERR;
+        const int _ignored =
+            client_destruct(
+                socks5_server,
+                socks5_client
+            );
     }
+
+    return OK;
 }
 
-static enum AdvancePhaseConsequence
-phase_tryshift_tryparse_client_recvbuff_for_hello(
+static int proc_socket_writable_event(
     struct Socks5Server* socks5_server,
-    struct Socks5Client* socks5_client)
-{    
-    switch (
-        try_parse_client_hello(
-            socks5_client->io.recv_space,
-            socks5_client->io.recvd,
-            &socks5_client->current_request.client_hello
+    struct Socks5Client* socks5_client,
+    const int socket_fd)
+{
+    if (OK !=
+        client_proc_writable_event(
+            socks5_server,
+            socks5_client,
+            socket_fd
         )
     ) {
-        case TRY_PARSE_OK:
-            return ADVANCE_PHASE_OK;
-        case TRY_PARSE_UNEXPECTED_END_OF_INPUT:
-            return ADVANCE_PHASE_IOBLOCKED_AGAIN;
-        default:
-        case TRY_PARSE_ERR:
-            return ADVANCE_PHASE_ERR;
+        const int _ignored =
+            client_destruct(
+                socks5_server,
+                socks5_client
+            );
     }
+
+    return OK;
 }
 
+static int proc_socket_readable_event(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    const int socket_fd)
+{
+    if (OK !=
+        client_proc_readable_event(
+            socks5_server,
+            socks5_client,
+            socket_fd
+        )
+    ) {
+        const int _ignored =
+            client_destruct(
+                socks5_server,
+                socks5_client
+            );
+    }
 
-static int shift_phase(
+    return OK;
+}
+
+static int proc_io_event(
     struct Socks5Server* socks5_server,
-    struct Socks5Client* socks5_client)
+    const struct FdEventNotification* noti)
 {
+    const bool readable = (noti->events_of_occurrence & FDIOEVENT_READABLE) > 0;
+    const bool writable = (noti->events_of_occurrence & FDIOEVENT_WRITABLE) > 0;
+    const bool error_queued = (noti->events_of_occurrence & FDIOEVENT_ERROR_QUEUE) > 0;
 
-phase_change:
-    switch (socks5_client->phase) {
-/*
-    The client connects to the server, and sends a version 
-    identifier/method selection message:
+    if (NULL == noti->context
+        && socks5_server->listener_socket_fd == noti->fd_of_interest
+    ) {
+        return readable
+            ? proc_listener_pending_connections(socks5_server)
+            : OK;
+    }
 
-            +----+----------+----------+
-            |VER | NMETHODS | METHODS  |
-            +----+----------+----------+
-            | 1  |    1     | 1 to 255 |
-            +----+----------+----------+
-*/
-        case SOCKS5_CLIENT_PHASE_BEGIN_RECVING_CLIENT_VERSION_CHOICE_METHODS_ARRAY_REQ:
-        case SOCKS5_CLIENT_PHASE_AWAITING_EVENT_RECVD_CLIENT_VERSION_CHOICE_METHODS_ARRAY_REQ:
-            switch (
-                phase_tryshift_tryparse_client_recvbuff_for_hello(
-                    socks5_server,
-                    socks5_client
-                )
-            ) {
-                case ADVANCE_PHASE_OK:
-                    socks5_client->io.recvd = 0;
-                    socks5_client->status = SENDING_SOCKS5_RESPONSE;
-                    socks5_client->phase = SOCKS5_CLIENT_PHASE_BEGIN_SENDING_AUTH_METHOD_CHOICE_RESP;
-                    goto phase_change;
-                case ADVANCE_PHASE_IOBLOCKED_AGAIN:
-                    socks5_client->phase = SOCKS5_CLIENT_PHASE_AWAITING_EVENT_RECVD_CLIENT_VERSION_CHOICE_METHODS_ARRAY_REQ;
-                    return OK;
-                case ADVANCE_PHASE_ERR: default:
-                    return ERR;
-            } 
-/*
-   The server selects from one of the methods given in METHODS, and
-   sends a METHOD selection message:
+    if (NULL != noti->context
+        && SOCKET_CONTEXT_RESOLVER == socket_context_role(noti->context)
+    ) {
+        return dns_resolver_proc_io_event(
+            socks5_server->resolver,
+            socket_context_owner(noti->context),
+            readable,
+            writable
+        );
+    }
 
-                         +----+--------+
-                         |VER | METHOD |
-                         +----+--------+
-                         | 1  |   1    |
-                         +----+--------+
-*/
-        case SOCKS5_CLIENT_PHASE_BEGIN_SENDING_AUTH_METHOD_CHOICE_RESP:
-            switch (
-                phase_shift_server_choose_auth_method_and_send(
+    int socket_fd = noti->fd_of_interest;
+    struct Socks5Client* socks5_client =
+        NULL == noti->context
+        ? client_table_lookup(&socks5_server->clients, socket_fd)
+        : client_of_socket_context(noti->context, &socket_fd);
+
+    if (NULL == socks5_client && NULL == noti->context) {
+        struct DnsSocket* dns_socket =
+            dns_resolver_socket_of_fd(
+                socks5_server->resolver,
+                socket_fd
+            );
+        if (NULL != dns_socket) {
+            return dns_resolver_proc_io_event(
+                socks5_server->resolver,
+                dns_socket,
+                readable,
+                writable
+            );
+        }
+    }
+
+    if (error_queued
+        && NULL != socks5_client
+        && !socks5_client->destructed
+        && ERR != socket_fd
+    ) {
+        if (OK !=
+            proc_socket_error_queue_event(
+                socks5_server,
+                socks5_client,
+                socket_fd
+            )
+        ) {
+            return ERR;
+        }
+    }
+
+    if (readable
+        && NULL != socks5_client
+        && !socks5_client->destructed
+        && ERR != socket_fd
+    ) {
+        if (OK !=
+            proc_socket_readable_event(
+                socks5_server,
+                socks5_client,
+                socket_fd
+            )
+        ) {
+            return ERR;
+        }
+    }
+
+    /* either may have been closed by the readable event */
+    if (NULL != noti->context) {
+        socks5_client = client_of_socket_context(noti->context, &socket_fd);
+    }
+
+    if (writable
+        && NULL != socks5_client
+        && !socks5_client->destructed
+        && ERR != socket_fd
+    ) {
+        if (OK !=
+            proc_socket_writable_event(
+                socks5_server,
+                socks5_client,
+                socket_fd
+            )
+        ) {
+            return ERR;
+        }
+    }
+
+    return OK;
+}
+
+static void server_flush_interest_queue(
+    struct Socks5Server* socks5_server)
+{
+    while (NULL != socks5_server->interest_queue) {
+        struct Socks5Client* socks5_client =
+            socks5_server->interest_queue;
+        socks5_server->interest_queue = socks5_client->next_interest_queued;
+        socks5_client->interest_queued = false;
+
+        if (socks5_client->destructed) {
+            continue;
+        }
+
+        if (OK !=
+            client_flush_socket_interest(
+                socks5_server,
+                socks5_client,
+                socks5_client->inbound_socket_fd
+            )
+            || OK !=
+            client_flush_socket_interest(
+                socks5_server,
+                socks5_client,
+                socks5_client->outbound_socket_fd
+            )
+        ) {
+            const int _ignored =
+                client_destruct(
                     socks5_server,
                     socks5_client
-                )
-            ) {
-                case ADVANCE_PHASE_OK:
-                    socks5_client->status = RECVING_SOCKS5_REQUEST;
-                    socks5_client->phase = SOCKS5_CLIENT_PHASE_RECV_REQUEST;
-                    return OK;
-                case ADVANCE_PHASE_IOBLOCKED_AGAIN:
-                    socks5_client->phase = SOCKS5_CLIENT_PHASE_AWAITING_EVENT_SENT_AUTH_METHOD_CHOICE_RESP;
-                    return OK;
-                case ADVANCE_PHASE_ERR: default:
-                    return ERR;
-            }
-        
-        case SOCKS5_CLIENT_PHASE_AWAITING_EVENT_SENT_AUTH_METHOD_CHOICE_RESP:
-            if (ZERO == socks5_client->io.to_send) {
-                socks5_client->status = RECVING_SOCKS5_REQUEST;
-                socks5_client->phase = SOCKS5_CLIENT_PHASE_RECV_REQUEST;
-                return OK;
-            }
-            return OK;
+                );
+        }
+    }
+}
+
+static void server_begin_batch(
+    struct Socks5Server* socks5_server)
+{
+    if (ZERO == socks5_server->batch_depth) {
+        socks5_server->now_ms = monotonic_ms();
+    }
+    socks5_server->batch_depth++;
+}
+
 /*
-   The SOCKS request is formed as follows:
+    Interest changes go out once, coalesced; clients destructed in the
+    batch are relinquished only now because a later event in it may
+    still carry their context.
+*/
+static void server_end_batch(
+    struct Socks5Server* socks5_server)
+{
+    if (socks5_server->batch_depth > 1) {
+        socks5_server->batch_depth--;
+        return;
+    }
 
-        +----+-----+-------+------+----------+----------+
-        |VER | CMD |  RSV  | ATYP | DST.ADDR | DST.PORT |
-        +----+-----+-------+------+----------+----------+
-        | 1  |  1  | X'00' |  1   | Variable |    2     |
-        +----+-----+-------+------+----------+----------+
+    server_flush_interest_queue(socks5_server);
 
-     Where:
+    socks5_server->batch_depth = ZERO;
 
-          o  VER    protocol version: X'05'
-          o  CMD
-             o  CONNECT X'01'
-             o  BIND X'02'
-             o  UDP ASSOCIATE X'03'
-          o  RSV    RESERVED
-          o  ATYP   address type of following address
-             o  IP V4 address: X'01'
-             o  DOMAINNAME: X'03'
-             o  IP V6 address: X'04'
-          o  DST.ADDR       desired destination address
-          o  DST.PORT desired destination port in network octet
-             order
+    while (NULL != socks5_server->destructed_clients) {
+        struct Socks5Client* socks5_client =
+            socks5_server->destructed_clients;
+        socks5_server->destructed_clients = socks5_client->next_destructed;
+        socks5_server_relinquish_client_resources(
+            socks5_server,
+            socks5_client
+        );
+    }
+}
 
-   The SOCKS server will typically evaluate the request based on source
-   and destination addresses, and return one or more reply messages, as
-   appropriate for the request type.
+int socks5server_proc_io_events(
+    struct Socks5Server* socks5_server,
+    struct FdEventNotification event_notis[],
+    const size_t event_noti_count)
+{
+    int ret = OK;
 
-*/
-        case SOCKS5_CLIENT_PHASE_RECV_REQUEST:
-            switch (
-                phase_tryshift_tryparse_client_recvbuff_for_req(
-                    socks5_server,
-                    socks5_client
-                )
-            ) {
+    server_begin_batch(socks5_server);
+
+    for (ptrdiff_t i = 0; i < event_noti_count; i++) {
+        if (OK !=
+            proc_io_event(
+                socks5_server,
+                &event_notis[i]
+            )
+        ) {
+            ret = ERR;
+            break;
+        }
+    }
+
+    server_end_batch(socks5_server);
+
+    return ret;
+}
+
+
+static struct Socks5Client* server_lookup_client(
+    struct Socks5Server* socks5_server,
+    const int socket_fd)
+{
+    return client_table_lookup(
+        &socks5_server->clients,
+        socket_fd
+    );
+}
+
+static int server_proc_accepted_connection(
+    struct Socks5Server* socks5_server,
+    const int socket_fd,
+    struct sockaddr_storage* address,
+    const socklen_t addr_len)
+{
+    return server_adopt_connection(
+        socks5_server,
+        socket_fd,
+        address,
+        addr_len
+    )
+    == ADVANCE_PHASE_ERR
+    ? ERR
+    : OK;
+}
+
+int socks5server_proc_accepted_connection(
+    struct Socks5Server* socks5_server,
+    const int socket_fd,
+    struct sockaddr_storage* address,
+    const socklen_t addr_len)
+{
+    server_begin_batch(socks5_server);
+    const int ret =
+        server_proc_accepted_connection(
+            socks5_server,
+            socket_fd,
+            address,
+            addr_len
+        );
+    server_end_batch(socks5_server);
+    return ret;
+}
+
+static int client_proc_recvd(
+    struct Socks5Server* socks5_server,
+    struct Socks5Client* socks5_client,
+    const int socket_fd,
+    const char data[],
+    const size_t len,
+    int* forward_to_fd)
+{
+    if (SOCKS5_CLIENT_PHASE_RELAYING == socks5_client->phase) {
+        const struct RelayLeg leg =
+            socket_fd == socks5_client->outbound_socket_fd
+            ? client_downstream_leg(socks5_client)
+            : client_upstream_leg(socks5_client);
+
+        socks5_client->last_active_ms = socks5_server->now_ms;
 
-            }
-            return ERR;
+        if (ZERO == len) {
+            *leg.src_end_of_stream = true;
+        }
 
-        default:
+        /* an empty leg lets the event source send its own buffer as is */
+        if (*leg.start >= *leg.end) {
+            *forward_to_fd = leg.dst_socket_fd;
+            return OK;
+        }
+
+        if (OK !=
+            leg_append(
+                socks5_server,
+                &leg,
+                data,
+                len
+            )
+        ) {
             return ERR;
+        }
+        if (socket_fd == socks5_client->inbound_socket_fd) {
+            client_hold_back_inbound_reads(
+                socks5_server,
+                socks5_client
+            );
+        }
+        return OK;
     }
-}
 
-static int client_recv_data_advance_phase(
-    struct Socks5Server* socks5_server,
-    struct Socks5Client* socks5_client)
-{
-    const int consequence =
-        client_recv_whatmayof_iobuff(socks5_client);
-    if (ERR == consequence) {
+    if (socket_fd != socks5_client->inbound_socket_fd) {
+        return ERR;
+    }
+
+    if (ZERO == len) {
+        socks5_client->inbound_end_of_stream = true;
+    }
+
+    /* what the client pipelined waits here for the relay, however much the event source read */
+    const struct RelayLeg leg =
+        client_upstream_leg(socks5_client);
+    if (OK !=
+        leg_append(
+            socks5_server,
+            &leg,
+            data,
+            len
+        )
+    ) {
         return ERR;
     }
+    client_hold_back_inbound_reads(
+        socks5_server,
+        socks5_client
+    );
 
     return shift_phase(
         socks5_server,
@@ -900,139 +5339,362 @@ static int client_recv_data_advance_phase(
     );
 }
 
-static int proc_listener_pending_connections(
-    struct Socks5Server* socks5_server)
+static int server_proc_recvd(
+    struct Socks5Server* socks5_server,
+    const int socket_fd,
+    const char data[],
+    const size_t len,
+    int* forward_to_fd)
 {
-    enum AdvancePhaseConsequence conseq = {0};
-    int accepted = 0;
-    do {
-        conseq = proc_new_connection_event(
-            socks5_server
-        );
-        if (ADVANCE_PHASE_OK == conseq) {
-            accepted++;
-        }
-    } while (conseq == ADVANCE_PHASE_OK);
+    *forward_to_fd = ERR;
 
-    switch (conseq) {
-        case ADVANCE_PHASE_OK:
-        case ADVANCE_PHASE_IOBLOCKED_AGAIN:
-            if (ZERO == accepted) {
-                return ERR;
-            }
+    struct Socks5Client* socks5_client =
+        server_lookup_client(
+            socks5_server,
+            socket_fd
+        );
+    if (NULL == socks5_client) {
+        struct DnsSocket* dns_socket =
+            dns_resolver_socket_of_fd(
+                socks5_server->resolver,
+                socket_fd
+            );
+        return NULL == dns_socket
+            ? OK
+            : dns_resolver_proc_recvd(
+                socks5_server->resolver,
+                dns_socket,
+                data,
+                len
+            );
+    }
 
-            return OK;
-        default:
-        case ADVANCE_PHASE_ERR:
-            return ERR;
+    if (OK !=
+        client_proc_recvd(
+            socks5_server,
+            socks5_client,
+            socket_fd,
+            data,
+            len,
+            forward_to_fd
+        )
+    ) {
+        *forward_to_fd = ERR;
+        const int _ignored =
+            client_destruct(
+                socks5_server,
+                socks5_client
+            );
     }
 
+    return OK;
+}
 
+int socks5server_proc_recvd(
+    struct Socks5Server* socks5_server,
+    const int socket_fd,
+    const char data[],
+    const size_t len,
+    int* forward_to_fd)
+{
+    server_begin_batch(socks5_server);
+    const int ret =
+        server_proc_recvd(
+            socks5_server,
+            socket_fd,
+            data,
+            len,
+            forward_to_fd
+        );
+    server_end_batch(socks5_server);
+    return ret;
 }
 
-static int proc_socket_writable_event(
+static int server_proc_forwarded_end_of_stream(
     struct Socks5Server* socks5_server,
     const int socket_fd)
 {
     struct Socks5Client* socks5_client =
-        hash_lookup(
-            &socks5_server->clients,
-            (const char*)&socket_fd,
-            sizeof(socket_fd)
+        server_lookup_client(
+            socks5_server,
+            socket_fd
         );
     if (NULL == socks5_client) {
-        return ERR;
+        return OK;
     }
 
-    const int sent =
-        client_send_whatmayof_iobuf(
-            socks5_server,
-            socks5_client
-        );
-    if (ERR == sent) {
-        return ERR;
+    if (socket_fd == socks5_client->outbound_socket_fd) {
+        socks5_client->outbound_shut_wr = true;
+    } else {
+        socks5_client->inbound_shut_wr = true;
     }
 
-    return shift_phase(
-        socks5_server,
-        socks5_client
-    );
+    if (client_relay_finished(socks5_client)) {
+        const int _ignored =
+            client_destruct(
+                socks5_server,
+                socks5_client
+            );
+    }
+
+    return OK;
 }
 
-static int proc_socket_readable_event(
+int socks5server_proc_forwarded_end_of_stream(
     struct Socks5Server* socks5_server,
     const int socket_fd)
 {
-    if (socks5_server->listener_socket_fd == socket_fd) {
-        return proc_listener_pending_connections(socks5_server);
-    } 
+    server_begin_batch(socks5_server);
+    const int ret =
+        server_proc_forwarded_end_of_stream(
+            socks5_server,
+            socket_fd
+        );
+    server_end_batch(socks5_server);
+    return ret;
+}
 
+static int server_proc_socket_failure(
+    struct Socks5Server* socks5_server,
+    const int socket_fd)
+{
     struct Socks5Client* socks5_client =
-        hash_lookup(
-            &socks5_server->clients,
-            (const char*)&socket_fd,
-            sizeof(socket_fd)
+        server_lookup_client(
+            socks5_server,
+            socket_fd
         );
     if (NULL == socks5_client) {
-        return ERR;
+        struct DnsSocket* dns_socket =
+            dns_resolver_socket_of_fd(
+                socks5_server->resolver,
+                socket_fd
+            );
+        if (NULL != dns_socket) {
+            dns_resolver_proc_socket_failure(
+                socks5_server->resolver,
+                dns_socket
+            );
+        }
+        return OK;
     }
 
-    return client_recv_data_advance_phase(
-        socks5_server,
-        socks5_client
+    /* a failed connection attempt leaves the others, and the next address, to try */
+    if (socket_fd != socks5_client->inbound_socket_fd
+        && socket_fd != socks5_client->outbound_socket_fd
+        && OK ==
+        shift_phase(
+            socks5_server,
+            socks5_client
+        )
+    ) {
+        return OK;
+    }
+
+    const int _ignored =
+        client_destruct(
+            socks5_server,
+            socks5_client
+        );
+
+    return OK;
+}
+
+int socks5server_proc_socket_failure(
+    struct Socks5Server* socks5_server,
+    const int socket_fd)
+{
+    server_begin_batch(socks5_server);
+    const int ret =
+        server_proc_socket_failure(
+            socks5_server,
+            socket_fd
+        );
+    server_end_batch(socks5_server);
+    return ret;
+}
+
+struct DnsCache* socks5server_construct_dns_cache(
+    const size_t capacity)
+{
+    return dns_cache_construct(capacity);
+}
+
+struct ShapingBuckets* socks5server_construct_shaping_buckets(
+    const struct CredentialStore* credentials,
+    const struct ShapingRate* user_shaping,
+    const struct ShapingRate* server_shaping)
+{
+    const size_t user_count =
+        NULL == credentials || ZERO == user_shaping->bytes_per_s
+        ? ZERO
+        : credential_store_user_capacity(credentials);
+    return shaping_buckets_construct(
+        user_count,
+        user_shaping,
+        server_shaping,
+        monotonic_ms()
     );
 }
 
+struct CredentialStore* socks5server_load_credentials(
+    const char* path)
+{
+    return credential_store_load(path);
+}
 
-int socks5server_proc_io_events(
-    struct Socks5Server* socks5_server,
-    struct FdEventNotification event_notis[],
-    const size_t event_noti_count)
+struct AccessPolicy* socks5server_load_access_policy(
+    const char* path)
 {
+    return access_policy_load(path);
+}
 
-    static int err_sock_fds[64];
-    size_t err_i = 0;
-    for (ptrdiff_t i = 0; i < event_noti_count; i++) {
-        const struct FdEventNotification* noti =
-            &event_notis[i];
+struct TlsContext* socks5server_load_tls(
+    const char* cert_path,
+    const char* key_path)
+{
+    return tls_context_load(cert_path, key_path);
+}
 
-        const bool readable = (noti->events_of_occurrence & FDIOEVENT_READABLE) > 0;
-        const bool writable = (noti->events_of_occurrence & FDIOEVENT_WRITABLE) > 0;
+int socks5server_compile_domain_blocklist(
+    const char* list_path,
+    const char* index_path)
+{
+    return domain_index_compile(list_path, index_path);
+}
 
-        if (readable) {
-            if (OK !=
-                proc_socket_readable_event(
-                    socks5_server,
-                    noti->fd_of_interest
-                )
-            ) {
-                err_sock_fds[i++] = err_i;
-            }
-        }
+struct DomainIndex* socks5server_map_domain_blocklist(
+    const char* index_path)
+{
+    return domain_index_map(index_path);
+}
 
-        if (writable) {
-            if (OK !=
-                proc_socket_writable_event(
-                    socks5_server,
-                    noti->fd_of_interest
-                )
-            ) {
-                err_sock_fds[i++] = err_i;
-            }
-        }
+/* the sooner of two timeouts, either -1 for none */
+static int sooner_timeout_ms(
+    const int a_ms,
+    const int b_ms)
+{
+    return ERR == a_ms || (ERR != b_ms && b_ms < a_ms)
+        ? b_ms
+        : a_ms;
+}
 
-        if (ZERO == err_i) {
-            continue;
+int socks5server_next_timeout_ms(
+    const struct Socks5Server* socks5_server)
+{
+    if (NULL != socks5_server->run_queue_head) {
+        return ZERO;
+    }
+
+    return sooner_timeout_ms(
+        dns_resolver_next_timeout_ms(
+            socks5_server->resolver
+        ),
+        timer_wheel_next_timeout_ms(
+            &socks5_server->timers,
+            monotonic_ms()
+        )
+    );
+}
+
+static void server_proc_timer_wheel(
+    struct Socks5Server* socks5_server)
+{
+    const int64_t now_ms = monotonic_ms();
+
+    for (;;) {
+        struct TimerWheelEntry* entry =
+            timer_wheel_pop_expired(
+                &socks5_server->timers,
+                now_ms
+            );
+        if (NULL == entry) {
+            return;
         }
+        entry->expire(socks5_server, entry);
+    }
+}
 
-        return ERR;
+/*
+    A turn for each relay queued as the pass begins, oldest first; one
+    that runs out again goes back to the end, behind those queued
+    meanwhile, for the next pass.
+*/
+static void server_proc_run_queue(
+    struct Socks5Server* socks5_server)
+{
+    for (size_t turns = socks5_server->runnable_count;
+        turns > ZERO && NULL != socks5_server->run_queue_head;
+        turns--
+    ) {
+        struct Socks5Client* socks5_client =
+            socks5_server->run_queue_head;
+        server_unqueue_runnable(socks5_server, socks5_client);
+        socks5_client->relay_budget =
+            client_relay_turn_bytes(
+                socks5_server,
+                socks5_client
+            );
 
+        if (OK !=
+            shift_phase(
+                socks5_server,
+                socks5_client
+            )
+        ) {
+            const int _ignored =
+                client_destruct(
+                    socks5_server,
+                    socks5_client
+                );
+        }
     }
-    
+}
 
+int socks5server_proc_timeouts(
+    struct Socks5Server* socks5_server)
+{
+    server_begin_batch(socks5_server);
+    dns_resolver_proc_timeouts(socks5_server->resolver);
+    server_proc_timer_wheel(socks5_server);
+    server_proc_run_queue(socks5_server);
+    server_end_batch(socks5_server);
     return OK;
 }
 
+/* waiter is a client's destination_waiter; answer is the client's to release */
+static void client_proc_destination_resolved(
+    struct Socks5Server* socks5_server,
+    struct DnsWaiter* waiter,
+    struct DnsAnswer* answer)
+{
+    struct Socks5Client* socks5_client =
+        (struct Socks5Client*)(
+            (char*)waiter - offsetof(struct Socks5Client, destination_waiter)
+        );
+
+    if (NULL != socks5_client->udp_association) {
+        udp_association_proc_resolved(
+            socks5_client->udp_association,
+            answer
+        );
+        return;
+    }
+
+    socks5_client->destination_answer = answer;
+
+    if (OK !=
+        shift_phase(
+            socks5_server,
+            socks5_client
+        )
+    ) {
+        const int _ignored =
+            client_destruct(
+                socks5_server,
+                socks5_client
+            );
+    }
+}
 
 int socks5server_construct(
     struct Socks5Server* socks5_server,
@@ -1044,16 +5706,106 @@ int socks5server_construct(
 
     const int listener_socket_fd =
         construct_socks5_listener_socket(
-            &socks5_server->cfg.listener_address
+            &socks5_server->cfg.listener_address,
+            socks5_server->cfg.reuse_port,
+            socks5_server->cfg.tcp_fast_open_backlog
         );
 
     if (ERR == listener_socket_fd) {
         return ERR;
     }
-    
+
     socks5_server->listener_socket_fd = listener_socket_fd;
 
-    hash_init(&socks5_server->clients);
+    if (OK != client_table_construct(&socks5_server->clients)) {
+        return ERR;
+    }
+    socks5_server->batch_depth = ZERO;
+    socks5_server->interest_queue = NULL;
+    socks5_server->destructed_clients = NULL;
+    socks5_server->run_queue_head = NULL;
+    socks5_server->run_queue_tail = NULL;
+    socks5_server->runnable_count = ZERO;
+    socks5_server->udp_batch = NULL;
+    socks5_server->udp_reassembly_space = ZERO;
+    socks5_server->failed_auths = NULL;
+
+    if (NULL != socks5_server->cfg.credentials) {
+        socks5_server->failed_auths = failed_auth_cache_construct();
+        if (NULL == socks5_server->failed_auths) {
+            return ERR;
+        }
+    }
+    socks5_server->now_ms = monotonic_ms();
+    timer_wheel_construct(
+        &socks5_server->timers,
+        socks5_server->now_ms
+    );
+
+    if ((server_shapes(socks5_server)
+            || ZERO != socks5_server->cfg.zerocopy_threshold
+            || NULL != socks5_server->cfg.tls)
+        && SOCKS5_EVENT_MODEL_COMPLETION == socks5_server->cfg.event_model
+    ) {
+        errno = EINVAL;
+        return ERR;
+    }
+    socks5_server->shaping_buckets = socks5_server->cfg.shaping_buckets;
+    if (NULL == socks5_server->shaping_buckets) {
+        socks5_server->shaping_buckets =
+            socks5server_construct_shaping_buckets(
+                socks5_server->cfg.credentials,
+                &socks5_server->cfg.user_shaping,
+                &socks5_server->cfg.server_shaping
+            );
+        if (NULL == socks5_server->shaping_buckets) {
+            return ERR;
+        }
+    }
+
+    io_buffer_pool_construct(
+        &socks5_server->io_buffers,
+        socks5_server->cfg.io_buffer_pool_idle_capacity
+    );
+
+    if (OK !=
+        client_slab_construct(
+            &socks5_server->client_slab,
+            socks5_server->cfg.client_slab_capacity,
+            socks5_server->cfg.client_slab_flags
+        )
+    ) {
+        return ERR;
+    }
+
+    if (OK !=
+        listener_pool_construct(
+            &socks5_server->bind_listeners,
+            &socks5_server->cfg.listener_address,
+            socks5_server->cfg.bind_listener_pool_capacity
+        )
+    ) {
+        return ERR;
+    }
+
+    if (SOCKS5_RELAY_MODE_SPLICE == socks5_server->cfg.relay_mode
+        && OK !=
+        pipe_pool_construct(
+            &socks5_server->pipes,
+            socks5_server->cfg.pipe_pool_capacity
+        )
+    ) {
+        return ERR;
+    }
+
+    socks5_server->resolver =
+        dns_resolver_construct(
+            socks5_server,
+            client_proc_destination_resolved
+        );
+    if (NULL == socks5_server->resolver) {
+        return ERR;
+    }
 
     return OK;
-}
\ No newline at end of file
+}
@@ -0,0 +1,40 @@
+#ifndef _SOCKET_CONTEXT_H_
+#define _SOCKET_CONTEXT_H_
+
+#include <stdint.h>
+
+/*
+    What the library hands an event source as subscription context: the
+    owner of the socket (a client, one of its further sockets, or one
+    of the resolver's sockets) with the socket's role in the pointer's
+    two low bits.
+*/
+enum SocketContextRole
+{
+    SOCKET_CONTEXT_INBOUND,
+    SOCKET_CONTEXT_OUTBOUND,
+    SOCKET_CONTEXT_RESOLVER,
+    SOCKET_CONTEXT_CLIENT_SOCKET,
+    SOCKET_CONTEXT_ROLE_MASK = 3
+};
+
+static inline void* socket_context_of(
+    void* owner,
+    const enum SocketContextRole role)
+{
+    return (void*)((uintptr_t)owner | role);
+}
+
+static inline void* socket_context_owner(
+    void* context)
+{
+    return (void*)((uintptr_t)context & ~(uintptr_t)SOCKET_CONTEXT_ROLE_MASK);
+}
+
+static inline enum SocketContextRole socket_context_role(
+    void* context)
+{
+    return (enum SocketContextRole)((uintptr_t)context & SOCKET_CONTEXT_ROLE_MASK);
+}
+
+#endif
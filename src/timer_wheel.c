@@ -0,0 +1,277 @@
+#include "timer_wheel.h"
+
+#include <limits.h>
+
+enum {OK=0,ERR=-1};
+enum {ZERO=0};
+
+enum {TIMER_WHEEL_TICK_MS=16};
+/* the slot of entries found expired */
+enum {TIMER_WHEEL_EXPIRED=TIMER_WHEEL_SLOTS};
+enum {TIMER_WHEEL_SLOT_MASK=TIMER_WHEEL_LEVEL_SLOTS - 1};
+/* ticks spanned by the whole wheel: a deadline further out waits at its far end */
+enum {TIMER_WHEEL_SPAN_BITS=TIMER_WHEEL_LEVELS * TIMER_WHEEL_LEVEL_BITS};
+
+void timer_wheel_construct(
+    struct TimerWheel* wheel,
+    const int64_t now_ms)
+{
+    for (ptrdiff_t i = 0; i <= TIMER_WHEEL_EXPIRED; i++) {
+        wheel->slots[i] = NULL;
+    }
+    for (ptrdiff_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        wheel->level_counts[level] = ZERO;
+    }
+    wheel->cursor_tick = now_ms / TIMER_WHEEL_TICK_MS;
+    wheel->armed_count = ZERO;
+}
+
+void timer_wheel_entry_construct(
+    struct TimerWheelEntry* entry,
+    const TimerWheelExpire expire)
+{
+    entry->prev = NULL;
+    entry->next = NULL;
+    entry->expire = expire;
+    entry->tick = ZERO;
+    entry->slot = ERR;
+}
+
+bool timer_wheel_entry_armed(
+    const struct TimerWheelEntry* entry)
+{
+    return ERR != entry->slot;
+}
+
+static void wheel_link(
+    struct TimerWheel* wheel,
+    struct TimerWheelEntry* entry,
+    const ptrdiff_t slot)
+{
+    entry->slot = slot;
+    entry->prev = NULL;
+    entry->next = wheel->slots[slot];
+    if (NULL != entry->next) {
+        entry->next->prev = entry;
+    }
+    wheel->slots[slot] = entry;
+    if (TIMER_WHEEL_EXPIRED != slot) {
+        wheel->level_counts[slot / TIMER_WHEEL_LEVEL_SLOTS]++;
+    }
+}
+
+static void wheel_unlink(
+    struct TimerWheel* wheel,
+    struct TimerWheelEntry* entry)
+{
+    if (NULL != entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        wheel->slots[entry->slot] = entry->next;
+    }
+    if (NULL != entry->next) {
+        entry->next->prev = entry->prev;
+    }
+    entry->prev = NULL;
+    entry->next = NULL;
+    if (TIMER_WHEEL_EXPIRED != entry->slot) {
+        wheel->level_counts[entry->slot / TIMER_WHEEL_LEVEL_SLOTS]--;
+    }
+}
+
+/*
+    The lowest level whose span from the cursor reaches tick, in the
+    slot of tick's block there: the slot is moved down a level when
+    the cursor reaches the start of that block.
+*/
+static ptrdiff_t wheel_slot_of(
+    const struct TimerWheel* wheel,
+    const int64_t tick)
+{
+    if (tick < wheel->cursor_tick) {
+        return TIMER_WHEEL_EXPIRED;
+    }
+
+    const int64_t span = (int64_t)1 << TIMER_WHEEL_SPAN_BITS;
+    const int64_t placed =
+        tick - wheel->cursor_tick < span
+        ? tick
+        : wheel->cursor_tick + span - 1;
+    const int64_t delta = placed - wheel->cursor_tick;
+
+    ptrdiff_t level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1
+        && delta >= (int64_t)1 << (TIMER_WHEEL_LEVEL_BITS * (level + 1))
+    ) {
+        level++;
+    }
+
+    return level * TIMER_WHEEL_LEVEL_SLOTS
+        + ((placed >> (TIMER_WHEEL_LEVEL_BITS * level)) & TIMER_WHEEL_SLOT_MASK);
+}
+
+void timer_wheel_arm(
+    struct TimerWheel* wheel,
+    struct TimerWheelEntry* entry,
+    const int64_t deadline_ms)
+{
+    timer_wheel_unarm(wheel, entry);
+
+    /* rounded up: an entry expires in the first tick not before its deadline */
+    entry->tick = (deadline_ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+    wheel_link(wheel, entry, wheel_slot_of(wheel, entry->tick));
+    wheel->armed_count++;
+}
+
+void timer_wheel_unarm(
+    struct TimerWheel* wheel,
+    struct TimerWheelEntry* entry)
+{
+    if (!timer_wheel_entry_armed(entry)) {
+        return;
+    }
+
+    wheel_unlink(wheel, entry);
+    entry->slot = ERR;
+    wheel->armed_count--;
+}
+
+/*
+    A lower bound, never later than the soonest deadline: for level 0
+    the first tick with an entry, above it the first block with one,
+    when it is moved down.
+*/
+int timer_wheel_next_timeout_ms(
+    const struct TimerWheel* wheel,
+    const int64_t now_ms)
+{
+    if (NULL != wheel->slots[TIMER_WHEEL_EXPIRED]) {
+        return ZERO;
+    }
+    if (ZERO == wheel->armed_count) {
+        return ERR;
+    }
+
+    int64_t soonest = INT64_MAX;
+    for (ptrdiff_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        if (ZERO == wheel->level_counts[level]) {
+            continue;
+        }
+
+        const int shift = TIMER_WHEEL_LEVEL_BITS * level;
+        for (int64_t k = 0; k <= TIMER_WHEEL_LEVEL_SLOTS; k++) {
+            const int64_t block = (wheel->cursor_tick >> shift) + k;
+            const int64_t tick = block << shift;
+            if (tick < wheel->cursor_tick && ZERO != level) {
+                continue;
+            }
+            const ptrdiff_t slot =
+                level * TIMER_WHEEL_LEVEL_SLOTS + (block & TIMER_WHEEL_SLOT_MASK);
+            if (NULL != wheel->slots[slot]) {
+                if (tick < soonest) {
+                    soonest = tick;
+                }
+                break;
+            }
+        }
+    }
+
+    const int64_t until_ms = soonest * TIMER_WHEEL_TICK_MS - now_ms;
+    return until_ms <= ZERO
+        ? ZERO
+        : (int)(until_ms < INT_MAX ? until_ms : INT_MAX);
+}
+
+/* each entry of a slot above level 0 moves down to where it now belongs */
+static void wheel_cascade(
+    struct TimerWheel* wheel,
+    const ptrdiff_t level,
+    const int64_t block)
+{
+    const ptrdiff_t slot =
+        level * TIMER_WHEEL_LEVEL_SLOTS + (block & TIMER_WHEEL_SLOT_MASK);
+
+    struct TimerWheelEntry* entry = wheel->slots[slot];
+    while (NULL != entry) {
+        struct TimerWheelEntry* next = entry->next;
+        wheel_unlink(wheel, entry);
+        wheel_link(wheel, entry, wheel_slot_of(wheel, entry->tick));
+        entry = next;
+    }
+}
+
+/* the cursor's tick: blocks starting at it are moved down first, then its level 0 slot is due */
+static void wheel_collect_tick(
+    struct TimerWheel* wheel)
+{
+    const int64_t tick = wheel->cursor_tick;
+    for (ptrdiff_t level = 1;
+        level < TIMER_WHEEL_LEVELS
+        && ZERO == ((tick >> (TIMER_WHEEL_LEVEL_BITS * (level - 1))) & TIMER_WHEEL_SLOT_MASK);
+        level++
+    ) {
+        wheel_cascade(
+            wheel,
+            level,
+            tick >> (TIMER_WHEEL_LEVEL_BITS * level)
+        );
+    }
+
+    struct TimerWheelEntry* entry = wheel->slots[tick & TIMER_WHEEL_SLOT_MASK];
+    while (NULL != entry) {
+        struct TimerWheelEntry* next = entry->next;
+        wheel_unlink(wheel, entry);
+        wheel_link(wheel, entry, TIMER_WHEEL_EXPIRED);
+        entry = next;
+    }
+
+    wheel->cursor_tick++;
+}
+
+static void wheel_collect_expired(
+    struct TimerWheel* wheel,
+    const int64_t now_tick)
+{
+    while (wheel->cursor_tick <= now_tick) {
+        ptrdiff_t level = 0;
+        while (level < TIMER_WHEEL_LEVELS && ZERO == wheel->level_counts[level]) {
+            level++;
+        }
+        if (TIMER_WHEEL_LEVELS == level) {
+            wheel->cursor_tick = now_tick + 1;
+            return;
+        }
+
+        /* nothing below level: straight to the start of its next block */
+        if (ZERO != level) {
+            const int64_t block_ticks = (int64_t)1 << (TIMER_WHEEL_LEVEL_BITS * level);
+            const int64_t block_start =
+                (wheel->cursor_tick + block_ticks - 1) & ~(block_ticks - 1);
+            if (block_start > now_tick) {
+                wheel->cursor_tick = now_tick + 1;
+                return;
+            }
+            wheel->cursor_tick = block_start;
+        }
+
+        wheel_collect_tick(wheel);
+    }
+}
+
+struct TimerWheelEntry* timer_wheel_pop_expired(
+    struct TimerWheel* wheel,
+    const int64_t now_ms)
+{
+    if (NULL == wheel->slots[TIMER_WHEEL_EXPIRED]) {
+        wheel_collect_expired(
+            wheel,
+            now_ms / TIMER_WHEEL_TICK_MS
+        );
+    }
+
+    struct TimerWheelEntry* entry = wheel->slots[TIMER_WHEEL_EXPIRED];
+    if (NULL != entry) {
+        timer_wheel_unarm(wheel, entry);
+    }
+    return entry;
+}
@@ -0,0 +1,44 @@
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+#include "rfc1928socks5.h"
+
+void timer_wheel_construct(
+    struct TimerWheel* wheel,
+    const int64_t now_ms
+);
+
+void timer_wheel_entry_construct(
+    struct TimerWheelEntry* entry,
+    const TimerWheelExpire expire
+);
+
+bool timer_wheel_entry_armed(
+    const struct TimerWheelEntry* entry
+);
+
+/* an armed entry is moved; it never expires before deadline_ms */
+void timer_wheel_arm(
+    struct TimerWheel* wheel,
+    struct TimerWheelEntry* entry,
+    const int64_t deadline_ms
+);
+
+void timer_wheel_unarm(
+    struct TimerWheel* wheel,
+    struct TimerWheelEntry* entry
+);
+
+/* -1 when nothing is armed */
+int timer_wheel_next_timeout_ms(
+    const struct TimerWheel* wheel,
+    const int64_t now_ms
+);
+
+/* an expired entry, unarmed, or NULL once there are no more */
+struct TimerWheelEntry* timer_wheel_pop_expired(
+    struct TimerWheel* wheel,
+    const int64_t now_ms
+);
+
+#endif
@@ -0,0 +1,426 @@
+#include "tls_session.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/core_names.h>
+
+enum {OK=0,ERR=-1};
+enum {ZERO=0};
+
+/* TLS 1.3 cipher suites, by their code point (RFC 8446 B.4) */
+enum {
+    TLS_AES_128_GCM_SHA256=0x1301,
+    TLS_AES_256_GCM_SHA384=0x1302,
+    TLS_CHACHA20_POLY1305_SHA256=0x1303
+};
+enum {TLS13_IV_SIZE=12};
+enum {MAX_TRAFFIC_SECRET_SIZE=EVP_MAX_MD_SIZE};
+
+static const char ULP[] = "tls";
+
+struct TlsContext
+{
+    SSL_CTX* ssl_ctx;
+};
+
+struct TrafficSecret
+{
+    unsigned char secret[MAX_TRAFFIC_SECRET_SIZE];
+    size_t len;
+};
+
+struct TlsHandshake
+{
+    SSL* ssl;
+    /* application traffic secrets, as the key log reports them */
+    struct TrafficSecret client_secret;
+    struct TrafficSecret server_secret;
+};
+
+union KernelCryptoInfo
+{
+    struct tls_crypto_info info;
+    struct tls12_crypto_info_aes_gcm_128 aes_gcm_128;
+    struct tls12_crypto_info_aes_gcm_256 aes_gcm_256;
+    struct tls12_crypto_info_chacha20_poly1305 chacha20_poly1305;
+};
+
+static int hex_digit(
+    const char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return ERR;
+}
+
+static int parse_traffic_secret(
+    const char* hex,
+    struct TrafficSecret* secret)
+{
+    size_t len = ZERO;
+    while ('\0' != hex[0] && '\0' != hex[1]) {
+        const int hi = hex_digit(hex[0]);
+        const int lo = hex_digit(hex[1]);
+        if (ERR == hi || ERR == lo || len >= sizeof(secret->secret)) {
+            return ERR;
+        }
+        secret->secret[len++] = (unsigned char)(hi << 4 | lo);
+        hex += 2;
+    }
+    secret->len = len;
+    return OK;
+}
+
+/*
+    NSS key log lines, "LABEL <client_random> <secret>": the only way
+    OpenSSL gives out the traffic secrets. Only the first application
+    ones are kept; the handshake ones stay with OpenSSL.
+*/
+static void tls_handshake_log_key(
+    const SSL* ssl,
+    const char* line)
+{
+    struct TlsHandshake* handshake = SSL_get_app_data(ssl);
+    if (NULL == handshake) {
+        return;
+    }
+
+    static const char CLIENT_LABEL[] = "CLIENT_TRAFFIC_SECRET_0 ";
+    static const char SERVER_LABEL[] = "SERVER_TRAFFIC_SECRET_0 ";
+    struct TrafficSecret* secret = NULL;
+    if (ZERO == strncmp(line, CLIENT_LABEL, sizeof(CLIENT_LABEL) - 1)) {
+        secret = &handshake->client_secret;
+    } else if (ZERO == strncmp(line, SERVER_LABEL, sizeof(SERVER_LABEL) - 1)) {
+        secret = &handshake->server_secret;
+    } else {
+        return;
+    }
+
+    const char* hex = strrchr(line, ' ');
+    if (NULL == hex
+        || OK != parse_traffic_secret(hex + 1, secret)
+    ) {
+        secret->len = ZERO;
+    }
+}
+
+/*
+    Whether the kernel has the tls ULP, loading its module if need be.
+    The ULP is looked up before the socket's state is checked: a socket
+    never connected gets ENOENT without it, ENOTCONN with it.
+*/
+static int tls_kernel_probe(void)
+{
+    const int socket_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (socket_fd < ZERO) {
+        return ERR;
+    }
+
+    const int set = setsockopt(socket_fd, IPPROTO_TCP, TCP_ULP, ULP, sizeof(ULP));
+    const int set_errno = errno;
+    const int _ignored = close(socket_fd);
+
+    if (OK == set || ENOTCONN == set_errno) {
+        return OK;
+    }
+    errno = ENOENT == set_errno ? ENOPROTOOPT : set_errno;
+    return ERR;
+}
+
+struct TlsContext* tls_context_load(
+    const char* cert_path,
+    const char* key_path)
+{
+    if (OK != tls_kernel_probe()) {
+        return NULL;
+    }
+
+    struct TlsContext* context = malloc(sizeof(struct TlsContext));
+    if (NULL == context) {
+        return NULL;
+    }
+
+    context->ssl_ctx = SSL_CTX_new(TLS_server_method());
+    if (NULL == context->ssl_ctx) {
+        free(context);
+        return NULL;
+    }
+
+    SSL_CTX* ssl_ctx = context->ssl_ctx;
+    /* the kernel is handed records numbered from zero: nothing may be sent after the handshake */
+    if (1 != SSL_CTX_set_min_proto_version(ssl_ctx, TLS1_3_VERSION)
+        || 1 != SSL_CTX_set_num_tickets(ssl_ctx, ZERO)
+        || 1 != SSL_CTX_use_certificate_chain_file(ssl_ctx, cert_path)
+        || 1 != SSL_CTX_use_PrivateKey_file(ssl_ctx, key_path, SSL_FILETYPE_PEM)
+        || 1 != SSL_CTX_check_private_key(ssl_ctx)
+    ) {
+        SSL_CTX_free(ssl_ctx);
+        free(context);
+        errno = EINVAL;
+        return NULL;
+    }
+    SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_keylog_callback(ssl_ctx, tls_handshake_log_key);
+
+    return context;
+}
+
+struct TlsHandshake* tls_handshake_construct(
+    const struct TlsContext* context,
+    const int socket_fd)
+{
+    struct TlsHandshake* handshake = calloc(1, sizeof(struct TlsHandshake));
+    if (NULL == handshake) {
+        return NULL;
+    }
+
+    handshake->ssl = SSL_new(context->ssl_ctx);
+    if (NULL == handshake->ssl
+        || 1 != SSL_set_fd(handshake->ssl, socket_fd)
+    ) {
+        tls_handshake_destruct(handshake);
+        return NULL;
+    }
+    SSL_set_app_data(handshake->ssl, handshake);
+    SSL_set_accept_state(handshake->ssl);
+
+    return handshake;
+}
+
+void tls_handshake_destruct(
+    struct TlsHandshake* handshake)
+{
+    /* the socket BIO doesn't own the socket: it stays open */
+    SSL_free(handshake->ssl);
+    OPENSSL_cleanse(handshake, sizeof(struct TlsHandshake));
+    free(handshake);
+}
+
+enum TlsHandshakeProgress tls_handshake_advance(
+    struct TlsHandshake* handshake)
+{
+    ERR_clear_error();
+    const int accepted = SSL_do_handshake(handshake->ssl);
+    if (1 == accepted) {
+        return TLS_HANDSHAKE_DONE;
+    }
+
+    switch (SSL_get_error(handshake->ssl, accepted)) {
+        case SSL_ERROR_WANT_READ:
+            return TLS_HANDSHAKE_WANTS_READ;
+        case SSL_ERROR_WANT_WRITE:
+            return TLS_HANDSHAKE_WANTS_WRITE;
+        default:
+            ERR_clear_error();
+            return TLS_HANDSHAKE_FAILED;
+    }
+}
+
+/* HKDF-Expand-Label(secret, label, "", len) (RFC 8446 7.1) */
+static int hkdf_expand_label(
+    const EVP_MD* md,
+    const struct TrafficSecret* secret,
+    const char* label,
+    unsigned char* out,
+    const size_t len)
+{
+    static const char PREFIX[] = "tls13 ";
+    const size_t label_len = sizeof(PREFIX) - 1 + strlen(label);
+
+    unsigned char info[2 + 1 + UINT8_MAX + 1];
+    size_t info_len = ZERO;
+    info[info_len++] = (unsigned char)(len >> 8);
+    info[info_len++] = (unsigned char)len;
+    info[info_len++] = (unsigned char)label_len;
+    const void* _ = memcpy(&info[info_len], PREFIX, sizeof(PREFIX) - 1);
+    info_len += sizeof(PREFIX) - 1;
+    _ = memcpy(&info[info_len], label, strlen(label));
+    info_len += strlen(label);
+    info[info_len++] = ZERO;
+
+    EVP_KDF* kdf = EVP_KDF_fetch(NULL, OSSL_KDF_NAME_HKDF, NULL);
+    EVP_KDF_CTX* kdf_ctx = NULL != kdf ? EVP_KDF_CTX_new(kdf) : NULL;
+    EVP_KDF_free(kdf);
+    if (NULL == kdf_ctx) {
+        return ERR;
+    }
+
+    int mode = EVP_KDF_HKDF_MODE_EXPAND_ONLY;
+    const OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_int(OSSL_KDF_PARAM_MODE, &mode),
+        OSSL_PARAM_construct_utf8_string(OSSL_KDF_PARAM_DIGEST, (char*)EVP_MD_get0_name(md), ZERO),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_KEY, (void*)secret->secret, secret->len),
+        OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_INFO, info, info_len),
+        OSSL_PARAM_construct_end()
+    };
+    const int derived = EVP_KDF_derive(kdf_ctx, out, len, params);
+    EVP_KDF_CTX_free(kdf_ctx);
+
+    return 1 == derived ? OK : ERR;
+}
+
+/*
+    The record nonce is the write IV XOR'd with the sequence number;
+    for AES-GCM the kernel takes the IV's first 4 bytes as the salt and
+    the other 8 as the IV. The sequence number stays zero.
+*/
+static int kernel_crypto_info_of(
+    const uint16_t cipher_suite,
+    const EVP_MD* md,
+    const struct TrafficSecret* secret,
+    union KernelCryptoInfo* crypto_info,
+    socklen_t* crypto_info_len)
+{
+    unsigned char key[32] = {0};
+    unsigned char iv[TLS13_IV_SIZE] = {0};
+
+    size_t key_len = ZERO;
+    switch (cipher_suite) {
+        case TLS_AES_128_GCM_SHA256:
+            key_len = TLS_CIPHER_AES_GCM_128_KEY_SIZE;
+            break;
+        case TLS_AES_256_GCM_SHA384:
+            key_len = TLS_CIPHER_AES_GCM_256_KEY_SIZE;
+            break;
+        case TLS_CHACHA20_POLY1305_SHA256:
+            key_len = TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE;
+            break;
+        default:
+            errno = EPROTONOSUPPORT;
+            return ERR;
+    }
+
+    if (OK != hkdf_expand_label(md, secret, "key", key, key_len)
+        || OK != hkdf_expand_label(md, secret, "iv", iv, sizeof(iv))
+    ) {
+        errno = EPROTO;
+        return ERR;
+    }
+
+    const void* _ = memset(crypto_info, ZERO, sizeof(*crypto_info));
+    crypto_info->info.version = TLS_1_3_VERSION;
+    switch (cipher_suite) {
+        case TLS_AES_128_GCM_SHA256: {
+            struct tls12_crypto_info_aes_gcm_128* info = &crypto_info->aes_gcm_128;
+            info->info.cipher_type = TLS_CIPHER_AES_GCM_128;
+            _ = memcpy(info->key, key, sizeof(info->key));
+            _ = memcpy(info->salt, iv, sizeof(info->salt));
+            _ = memcpy(info->iv, &iv[sizeof(info->salt)], sizeof(info->iv));
+            *crypto_info_len = sizeof(*info);
+            break;
+        }
+        case TLS_AES_256_GCM_SHA384: {
+            struct tls12_crypto_info_aes_gcm_256* info = &crypto_info->aes_gcm_256;
+            info->info.cipher_type = TLS_CIPHER_AES_GCM_256;
+            _ = memcpy(info->key, key, sizeof(info->key));
+            _ = memcpy(info->salt, iv, sizeof(info->salt));
+            _ = memcpy(info->iv, &iv[sizeof(info->salt)], sizeof(info->iv));
+            *crypto_info_len = sizeof(*info);
+            break;
+        }
+        case TLS_CHACHA20_POLY1305_SHA256: default: {
+            struct tls12_crypto_info_chacha20_poly1305* info = &crypto_info->chacha20_poly1305;
+            info->info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+            _ = memcpy(info->key, key, sizeof(info->key));
+            _ = memcpy(info->iv, iv, sizeof(info->iv));
+            *crypto_info_len = sizeof(*info);
+            break;
+        }
+    }
+
+    OPENSSL_cleanse(key, sizeof(key));
+    OPENSSL_cleanse(iv, sizeof(iv));
+    return OK;
+}
+
+int tls_handshake_offload(
+    const struct TlsHandshake* handshake,
+    const int socket_fd)
+{
+    /* a record OpenSSL read ahead would never reach the kernel */
+    if (SSL_has_pending(handshake->ssl)
+        || ZERO == handshake->client_secret.len
+        || ZERO == handshake->server_secret.len
+    ) {
+        errno = EPROTO;
+        return ERR;
+    }
+
+    const SSL_CIPHER* cipher = SSL_get_current_cipher(handshake->ssl);
+    const EVP_MD* md = NULL != cipher ? SSL_CIPHER_get_handshake_digest(cipher) : NULL;
+    if (NULL == md) {
+        errno = EPROTO;
+        return ERR;
+    }
+    const uint16_t cipher_suite = SSL_CIPHER_get_protocol_id(cipher);
+
+    /* OpenSSL built with kTLS attaches the ULP itself, keyless, as the socket BIO is made */
+    if (OK !=
+        setsockopt(
+            socket_fd,
+            IPPROTO_TCP,
+            TCP_ULP,
+            ULP,
+            sizeof(ULP)
+        )
+        && EEXIST != errno
+    ) {
+        return ERR;
+    }
+
+    /* we send with the server's keys and receive with the client's */
+    const struct {
+        int direction;
+        const struct TrafficSecret* secret;
+    } halves[] = {
+        {TLS_TX, &handshake->server_secret},
+        {TLS_RX, &handshake->client_secret}
+    };
+    for (ptrdiff_t i = 0; i < (ptrdiff_t)(sizeof(halves) / sizeof(halves[0])); i++) {
+        union KernelCryptoInfo crypto_info;
+        socklen_t crypto_info_len = ZERO;
+        if (OK !=
+            kernel_crypto_info_of(
+                cipher_suite,
+                md,
+                halves[i].secret,
+                &crypto_info,
+                &crypto_info_len
+            )
+        ) {
+            return ERR;
+        }
+
+        const int set =
+            setsockopt(
+                socket_fd,
+                SOL_TLS,
+                halves[i].direction,
+                &crypto_info,
+                crypto_info_len
+            );
+        OPENSSL_cleanse(&crypto_info, sizeof(crypto_info));
+        if (OK != set) {
+            return ERR;
+        }
+    }
+
+    return OK;
+}
@@ -0,0 +1,60 @@
+#ifndef _TLS_SESSION_H_
+#define _TLS_SESSION_H_
+
+#include "rfc1928socks5.h"
+
+/*
+    TLS 1.3 on the client's socket, with the record layer in the kernel
+    (Documentation/networking/tls.rst): the handshake is done here, in
+    user space, then the session's traffic keys are handed to the socket
+    with TCP_ULP "tls". No session tickets are issued, so both sequence
+    numbers are still zero when the keys are handed over. Records other
+    than application data, a close_notify among them, then fail reads
+    with EIO: the connection ends as if reset.
+*/
+
+enum TlsHandshakeProgress
+{
+    TLS_HANDSHAKE_DONE=0,
+    TLS_HANDSHAKE_WANTS_READ,
+    TLS_HANDSHAKE_WANTS_WRITE,
+    TLS_HANDSHAKE_FAILED=-1
+};
+
+/*
+    certificate chain and private key, PEM; one context may be shared by
+    every server. NULL, errno ENOPROTOOPT, if the kernel has no tls ULP;
+    EINVAL if the certificate or key won't load.
+*/
+struct TlsContext* tls_context_load(
+    const char* cert_path,
+    const char* key_path
+);
+
+/* the server's side of a handshake over socket_fd; NULL if out of memory */
+struct TlsHandshake* tls_handshake_construct(
+    const struct TlsContext* context,
+    const int socket_fd
+);
+
+void tls_handshake_destruct(
+    struct TlsHandshake* handshake
+);
+
+/* as far as the socket allows, without blocking */
+enum TlsHandshakeProgress tls_handshake_advance(
+    struct TlsHandshake* handshake
+);
+
+/*
+    Once done: the socket's records are sealed and opened by the kernel
+    from here on, both ways. ERR, errno set, if the kernel won't take
+    them (no tls module, a cipher it lacks) or bytes past the handshake
+    were already read.
+*/
+int tls_handshake_offload(
+    const struct TlsHandshake* handshake,
+    const int socket_fd
+);
+
+#endif
@@ -0,0 +1,175 @@
+#include <stdlib.h>
+
+#include "token_bucket.h"
+
+enum {OK=0,ERR=-1};
+enum {ZERO=0};
+
+enum {MILLIBYTES_PER_BYTE=1000};
+/* no wait is armed for less than this share of a second's tokens */
+enum {TOKEN_BUCKET_WAKE_DIVISOR=64};
+/*
+    A parked relay may sleep a wheel tick past its wait: a burst under
+    two ticks' worth would overflow meanwhile, and the rate fall short.
+*/
+enum {TOKEN_BUCKET_BURST_FLOOR_DIVISOR=32};
+
+static int64_t bucket_burst_millibytes(
+    const struct ShapingRate* rate)
+{
+    uint64_t burst = rate->burst;
+    if (ZERO == burst) {
+        burst = rate->bytes_per_s / 8;
+    }
+    if (burst < rate->bytes_per_s / TOKEN_BUCKET_BURST_FLOOR_DIVISOR) {
+        burst = rate->bytes_per_s / TOKEN_BUCKET_BURST_FLOOR_DIVISOR;
+    }
+    if (ZERO == burst) {
+        burst = 1;
+    }
+    return (int64_t)burst * MILLIBYTES_PER_BYTE;
+}
+
+void token_bucket_construct(
+    struct TokenBucket* bucket,
+    const struct ShapingRate* rate,
+    const int64_t now_ms)
+{
+    bucket->millibytes =
+        ZERO == rate->bytes_per_s
+        ? ZERO
+        : bucket_burst_millibytes(rate);
+    bucket->refilled_ms = now_ms;
+}
+
+struct ShapingBuckets* shaping_buckets_construct(
+    const size_t user_count,
+    const struct ShapingRate* user_rate,
+    const struct ShapingRate* server_rate,
+    const int64_t now_ms)
+{
+    struct ShapingBuckets* buckets = malloc(sizeof(struct ShapingBuckets));
+    if (NULL == buckets) {
+        return NULL;
+    }
+    token_bucket_construct(&buckets->server, server_rate, now_ms);
+    buckets->users = NULL;
+    if (ZERO == user_count) {
+        return buckets;
+    }
+
+    buckets->users = calloc(user_count, sizeof(struct TokenBucket));
+    if (NULL == buckets->users) {
+        free(buckets);
+        return NULL;
+    }
+    for (size_t i = 0; i < user_count; i++) {
+        token_bucket_construct(&buckets->users[i], user_rate, now_ms);
+    }
+    return buckets;
+}
+
+/*
+    A byte a second is a millibyte a millisecond. Whoever moves
+    refilled_ms forward owns the stretch it covers and adds its tokens;
+    the others see none left to add.
+*/
+static void bucket_refill(
+    struct TokenBucket* bucket,
+    const struct ShapingRate* rate,
+    const int64_t now_ms)
+{
+    int64_t refilled_ms = __atomic_load_n(&bucket->refilled_ms, __ATOMIC_RELAXED);
+    do {
+        if (now_ms <= refilled_ms) {
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(
+        &bucket->refilled_ms,
+        &refilled_ms,
+        now_ms,
+        true,
+        __ATOMIC_RELAXED,
+        __ATOMIC_RELAXED
+    ));
+    const int64_t elapsed_ms = now_ms - refilled_ms;
+
+    const int64_t burst = bucket_burst_millibytes(rate);
+    const int64_t per_ms = (int64_t)rate->bytes_per_s;
+    int64_t millibytes = __atomic_load_n(&bucket->millibytes, __ATOMIC_RELAXED);
+    int64_t refilled;
+    do {
+        const int64_t deficit = burst - millibytes;
+        /* compared before multiplying: a long idle stretch would overflow */
+        refilled =
+            elapsed_ms > deficit / per_ms
+            ? burst
+            : millibytes + elapsed_ms * per_ms;
+    } while (!__atomic_compare_exchange_n(
+        &bucket->millibytes,
+        &millibytes,
+        refilled,
+        true,
+        __ATOMIC_RELAXED,
+        __ATOMIC_RELAXED
+    ));
+}
+
+uint64_t token_bucket_available(
+    struct TokenBucket* bucket,
+    const struct ShapingRate* rate,
+    const int64_t now_ms)
+{
+    if (ZERO == rate->bytes_per_s) {
+        return UINT64_MAX;
+    }
+
+    bucket_refill(bucket, rate, now_ms);
+    const int64_t millibytes = __atomic_load_n(&bucket->millibytes, __ATOMIC_RELAXED);
+    return millibytes <= ZERO
+        ? ZERO
+        : (uint64_t)(millibytes / MILLIBYTES_PER_BYTE);
+}
+
+void token_bucket_draw(
+    struct TokenBucket* bucket,
+    const struct ShapingRate* rate,
+    const uint64_t bytes)
+{
+    if (ZERO == rate->bytes_per_s) {
+        return;
+    }
+
+    const int64_t _ignored =
+        __atomic_sub_fetch(
+            &bucket->millibytes,
+            (int64_t)bytes * MILLIBYTES_PER_BYTE,
+            __ATOMIC_RELAXED
+        );
+}
+
+int64_t token_bucket_refill_ms(
+    const struct TokenBucket* bucket,
+    const struct ShapingRate* rate)
+{
+    if (ZERO == rate->bytes_per_s) {
+        return ZERO;
+    }
+
+    const int64_t burst = bucket_burst_millibytes(rate);
+    int64_t wanted =
+        (int64_t)(rate->bytes_per_s / TOKEN_BUCKET_WAKE_DIVISOR) * MILLIBYTES_PER_BYTE;
+    if (wanted > burst) {
+        wanted = burst;
+    }
+    if (wanted < MILLIBYTES_PER_BYTE) {
+        wanted = MILLIBYTES_PER_BYTE;
+    }
+
+    const int64_t deficit = wanted - __atomic_load_n(&bucket->millibytes, __ATOMIC_RELAXED);
+    if (deficit <= ZERO) {
+        return ZERO;
+    }
+    const int64_t per_ms = (int64_t)rate->bytes_per_s;
+    return (deficit + per_ms - 1) / per_ms;
+}
@@ -0,0 +1,61 @@
+#ifndef _TOKEN_BUCKET_H_
+#define _TOKEN_BUCKET_H_
+
+#include "rfc1928socks5.h"
+
+/*
+    The user and server buckets, shared by every shard: each shard draws
+    on them at the full configured rates, so the rates hold across the
+    shards however their relays are spread.
+*/
+struct ShapingBuckets
+{
+    struct TokenBucket server;
+    /* one per user, by the user's number; NULL when users aren't shaped */
+    struct TokenBucket* users;
+};
+
+/* full, as of now_ms */
+void token_bucket_construct(
+    struct TokenBucket* bucket,
+    const struct ShapingRate* rate,
+    const int64_t now_ms
+);
+
+/* user_count: zero when users aren't shaped */
+struct ShapingBuckets* shaping_buckets_construct(
+    const size_t user_count,
+    const struct ShapingRate* user_rate,
+    const struct ShapingRate* server_rate,
+    const int64_t now_ms
+);
+
+/* whole bytes that may be drawn as of now_ms; UINT64_MAX when unshaped */
+uint64_t token_bucket_available(
+    struct TokenBucket* bucket,
+    const struct ShapingRate* rate,
+    const int64_t now_ms
+);
+
+/*
+    At most what was last found available. Another thread may have drawn
+    on the same find: the bucket then goes below empty, and is found
+    empty until the debt is refilled.
+*/
+void token_bucket_draw(
+    struct TokenBucket* bucket,
+    const struct ShapingRate* rate,
+    const uint64_t bytes
+);
+
+/*
+    Milliseconds until enough is available for a wait to be worth
+    waking for: a sixty-fourth of a second's worth, or the whole burst
+    if that is less.
+*/
+int64_t token_bucket_refill_ms(
+    const struct TokenBucket* bucket,
+    const struct ShapingRate* rate
+);
+
+#endif
@@ -0,0 +1,1486 @@
+#define _GNU_SOURCE
+#include "udp_association.h"
+#include "access_policy.h"
+#include "client_table.h"
+#include "dns_resolver.h"
+#include "domain_index.h"
+#include "io_buffer_pool.h"
+#include "socket_context.h"
+#include "timer_wheel.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/udp.h>
+#include <stddef.h>
+#include <assert.h>
+
+enum {OK=0,ERR=-1};
+enum {ZERO=0};
+
+/* datagrams per recvmmsg/sendmmsg */
+enum {UDP_BATCH=32};
+/* the largest UDP payload (IPv6 without jumbograms) */
+enum {UDP_MAX_DATAGRAM=65527};
+/* a remote's datagram is received this far in, so its header can go in front of it */
+enum {UDP_HEADROOM=32};
+enum {UDP_BUFFER_SPACE=UDP_HEADROOM + UDP_MAX_DATAGRAM + 1};
+enum {UDP_FLOW_PROBES=8};
+/* how long a DOMAINNAME that failed to resolve stays failed */
+enum {UDP_UNRESOLVED_MS=1000};
+enum {UDP_SOCKET_BUFFER_SPACE=1 << 20};
+/* sends per sendmmsg; with segmentation one read can make many */
+enum {UDP_SEND_BATCH=64};
+enum {UDP_SEND_IOVS=1024};
+/* the kernel's UDP_MAX_SEGMENTS */
+enum {UDP_MAX_SEGMENTS=64};
+/* one segmented send is one UDP datagram to the kernel: IPv4 bounds it */
+enum {UDP_MAX_SEGMENTED_SPACE=65507};
+/* segments must fit the path MTU; this fits 1500 under IPv6 */
+enum {UDP_MAX_SEGMENT_SPACE=1500 - 40 - 8};
+/* FRAG: the high-order bit ends a sequence, the rest is the position in it */
+enum {UDP_FRAG_END=0x80, UDP_FRAG_POSITION=0x7F};
+/* "The reassembly timer MUST be no less than 5 seconds" */
+enum {UDP_REASSEMBLY_MS=5000};
+
+/*
+    +----+------+------+----------+----------+----------+
+    |RSV | FRAG | ATYP | DST.ADDR | DST.PORT |   DATA   |
+    +----+------+------+----------+----------+----------+
+    | 2  |  1   |  1   | Variable |    2     | Variable |
+    +----+------+------+----------+----------+----------+
+*/
+enum {UDP_HEADER_FIXED_SPACE=4, UDP_PORT_SPACE=2};
+enum {UDP_HEADER_SPACE_IPV4=UDP_HEADER_FIXED_SPACE + 4 + UDP_PORT_SPACE};
+enum {UDP_HEADER_SPACE_IPV6=UDP_HEADER_FIXED_SPACE + 16 + UDP_PORT_SPACE};
+
+static_assert(
+    UDP_HEADROOM >= UDP_HEADER_SPACE_IPV6,
+    "a header fits in front of every datagram received from a remote"
+);
+
+union UdpControl
+{
+    char space[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+};
+
+/* one per server: the messages of a batch point into it */
+struct UdpBatch
+{
+    struct mmsghdr recv_messages[UDP_BATCH];
+    struct iovec recv_iovs[UDP_BATCH];
+    struct sockaddr_storage sources[UDP_BATCH];
+    /* UDP_GRO: the segment size of a read holding several datagrams */
+    union UdpControl recv_controls[UDP_BATCH];
+    struct mmsghdr send_messages[UDP_SEND_BATCH];
+    struct sockaddr_storage destinations[UDP_SEND_BATCH];
+    /* UDP_SEGMENT: the segment size of a send of several datagrams */
+    union UdpControl send_controls[UDP_SEND_BATCH];
+    struct iovec send_iovs[UDP_SEND_IOVS];
+    size_t send_count;
+    size_t iov_count;
+    /* the last send queued: its destination and segments */
+    struct UdpEndpoint destination;
+    size_t segment_size;
+    size_t segment_count;
+    size_t send_space;
+    bool send_closed;
+    /* UDP_BATCH of UDP_BUFFER_SPACE; pages are touched only as datagrams need them */
+    char* buffers;
+};
+
+static int64_t now_ms(void)
+{
+    struct timespec ts = {0};
+    const int _ignored = clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int server_ensure_udp_batch(
+    struct Socks5Server* server)
+{
+    if (NULL != server->udp_batch) {
+        return OK;
+    }
+
+    struct UdpBatch* batch =
+        calloc(
+            1,
+            sizeof(struct UdpBatch)
+        );
+    if (NULL == batch) {
+        return ERR;
+    }
+
+    batch->buffers = malloc((size_t)UDP_BATCH * UDP_BUFFER_SPACE);
+    if (NULL == batch->buffers) {
+        free(batch);
+        return ERR;
+    }
+
+    server->udp_batch = batch;
+    return OK;
+}
+
+static char* batch_buffer(
+    struct UdpBatch* batch,
+    const size_t i)
+{
+    return &batch->buffers[i * UDP_BUFFER_SPACE];
+}
+
+static void endpoint_of_sockaddr(
+    const struct sockaddr_storage* address,
+    struct UdpEndpoint* endpoint)
+{
+    const void* _ = memset(endpoint, ZERO, sizeof(*endpoint));
+
+    if (AF_INET6 == address->ss_family) {
+        const struct sockaddr_in6* in6 =
+            (const struct sockaddr_in6*)address;
+        endpoint->addr = in6->sin6_addr;
+        endpoint->port = in6->sin6_port;
+        return;
+    }
+
+    const struct sockaddr_in* in =
+        (const struct sockaddr_in*)address;
+    endpoint->addr.s6_addr[10] = 0xFF;
+    endpoint->addr.s6_addr[11] = 0xFF;
+    _ = memcpy(&endpoint->addr.s6_addr[12], &in->sin_addr, 4);
+    endpoint->port = in->sin_port;
+}
+
+static bool endpoint_is_ipv4(
+    const struct UdpEndpoint* endpoint)
+{
+    return IN6_IS_ADDR_V4MAPPED(&endpoint->addr);
+}
+
+/* ZERO when a socket of family can't reach endpoint */
+static socklen_t sockaddr_of_endpoint(
+    const struct UdpEndpoint* endpoint,
+    const sa_family_t family,
+    struct sockaddr_storage* address)
+{
+    if (AF_INET6 == family) {
+        struct sockaddr_in6* in6 = (struct sockaddr_in6*)address;
+        const void* _ = memset(in6, ZERO, sizeof(*in6));
+        in6->sin6_family = AF_INET6;
+        in6->sin6_addr = endpoint->addr;
+        in6->sin6_port = endpoint->port;
+        return sizeof(*in6);
+    }
+
+    if (!endpoint_is_ipv4(endpoint)) {
+        return ZERO;
+    }
+
+    struct sockaddr_in* in = (struct sockaddr_in*)address;
+    const void* _ = memset(in, ZERO, sizeof(*in));
+    in->sin_family = AF_INET;
+    _ = memcpy(&in->sin_addr, &endpoint->addr.s6_addr[12], 4);
+    in->sin_port = endpoint->port;
+    return sizeof(*in);
+}
+
+static bool endpoint_equals(
+    const struct UdpEndpoint* a,
+    const struct UdpEndpoint* b)
+{
+    return a->port == b->port
+        && ZERO == memcmp(&a->addr, &b->addr, sizeof(a->addr));
+}
+
+static uint32_t hash_of_endpoint(
+    const struct UdpEndpoint* endpoint)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(endpoint->addr); i++) {
+        hash ^= endpoint->addr.s6_addr[i];
+        hash *= 16777619u;
+    }
+    hash ^= endpoint->port;
+    hash *= 16777619u;
+    return hash;
+}
+
+/*
+    Open addressing over a short probe window. Inserting into a full
+    window evicts its least recently used flow.
+*/
+static struct UdpFlow* association_flow_of(
+    struct UdpAssociation* association,
+    const struct UdpEndpoint* remote,
+    const bool insert)
+{
+    const uint32_t hash = hash_of_endpoint(remote);
+    struct UdpFlow* victim = NULL;
+
+    for (uint32_t probe = 0; probe < UDP_FLOW_PROBES; probe++) {
+        struct UdpFlow* flow =
+            &association->flows[(hash + probe) % UDP_FLOW_COUNT];
+
+        if (flow->used && endpoint_equals(&flow->remote, remote)) {
+            flow->last_used = association->datagram_count;
+            return flow;
+        }
+
+        if (!flow->used) {
+            if (NULL == victim || victim->used) {
+                victim = flow;
+            }
+        } else if (NULL == victim
+            || (victim->used
+                && association->datagram_count - flow->last_used
+                > association->datagram_count - victim->last_used)
+        ) {
+            victim = flow;
+        }
+    }
+
+    if (!insert) {
+        return NULL;
+    }
+
+    victim->remote = *remote;
+    victim->used = true;
+    victim->last_used = association->datagram_count;
+    return victim;
+}
+
+/*
+    The client's datagrams must come from the address it associated
+    from; the first to arrive fixes the port, if the request didn't.
+*/
+static bool association_admits_client(
+    struct UdpAssociation* association,
+    const struct UdpEndpoint* source)
+{
+    if (ZERO !=
+        memcmp(
+            &source->addr,
+            &association->client.addr,
+            sizeof(source->addr)
+        )
+    ) {
+        return false;
+    }
+
+    if (ZERO == association->client.port) {
+        association->client.port = source->port;
+        return true;
+    }
+
+    return source->port == association->client.port;
+}
+
+/*
+    Parses the header of a client's datagram. Returns its length, or
+    ZERO when the datagram is to be dropped. A DOMAINNAME destination
+    is left in *name for the caller to resolve.
+*/
+static size_t parse_udp_header(
+    const char data[],
+    const size_t len,
+    uint8_t* frag,
+    struct UdpEndpoint* destination,
+    const char** name,
+    uint8_t* name_len)
+{
+    if (len < UDP_HEADER_FIXED_SPACE + 1) {
+        return ZERO;
+    }
+
+    *frag = data[2];
+
+    const void* _ = memset(destination, ZERO, sizeof(*destination));
+    *name_len = ZERO;
+
+    size_t i = UDP_HEADER_FIXED_SPACE;
+    switch ((uint8_t)data[3]) {
+        case SOCKS5_ADDR_TYPE_IPV4:
+            if (len < UDP_HEADER_SPACE_IPV4) {
+                return ZERO;
+            }
+            destination->addr.s6_addr[10] = 0xFF;
+            destination->addr.s6_addr[11] = 0xFF;
+            _ = memcpy(&destination->addr.s6_addr[12], &data[i], 4);
+            i += 4;
+            break;
+        case SOCKS5_ADDR_TYPE_IPV6:
+            if (len < UDP_HEADER_SPACE_IPV6) {
+                return ZERO;
+            }
+            _ = memcpy(&destination->addr, &data[i], 16);
+            i += 16;
+            break;
+        case SOCKS5_ADDR_TYPE_DOMAINNAME:
+            *name_len = (uint8_t)data[i++];
+            if (ZERO == *name_len
+                || len < UDP_HEADER_FIXED_SPACE + 1 + *name_len + UDP_PORT_SPACE
+            ) {
+                return ZERO;
+            }
+            *name = &data[i];
+            i += *name_len;
+            break;
+        default:
+            return ZERO;
+    }
+
+    _ = memcpy(&destination->port, &data[i], UDP_PORT_SPACE);
+    return i + UDP_PORT_SPACE;
+}
+
+/* writes the header of a datagram from source to end right before payload; returns its length */
+static size_t build_udp_header_before(
+    char* payload,
+    const struct UdpEndpoint* source)
+{
+    const bool ipv4 = endpoint_is_ipv4(source);
+    const size_t header_len =
+        ipv4
+        ? UDP_HEADER_SPACE_IPV4
+        : UDP_HEADER_SPACE_IPV6;
+
+    char* header = payload - header_len;
+    header[0] = ZERO;
+    header[1] = ZERO;
+    header[2] = ZERO;
+    header[3] = ipv4 ? SOCKS5_ADDR_TYPE_IPV4 : SOCKS5_ADDR_TYPE_IPV6;
+    const void* _ =
+        ipv4
+        ? memcpy(&header[4], &source->addr.s6_addr[12], 4)
+        : memcpy(&header[4], &source->addr, 16);
+    _ = memcpy(
+        &header[header_len - UDP_PORT_SPACE],
+        &source->port,
+        UDP_PORT_SPACE
+    );
+    return header_len;
+}
+
+static void association_forget_answer(
+    struct UdpAssociation* association)
+{
+    dns_answer_release(association->resolved_answer);
+    association->resolved_answer = NULL;
+    association->resolved_name_len = ZERO;
+}
+
+static void association_remember_answer(
+    struct UdpAssociation* association,
+    const char* name,
+    const uint8_t name_len,
+    struct DnsAnswer* answer)
+{
+    association_forget_answer(association);
+
+    const void* _ = memmove(association->resolved_name, name, name_len);
+    association->resolved_name_len = name_len;
+    association->resolved_answer = answer;
+    association->resolved_expires_ms =
+        now_ms()
+        + (DNS_ANSWER_OK == answer->status
+            ? (int64_t)answer->ttl * 1000
+            : UDP_UNRESOLVED_MS);
+}
+
+/* OK: *destination is set from the remembered answer */
+static int association_destination_of_answer(
+    const struct UdpAssociation* association,
+    const char* name,
+    const uint8_t name_len,
+    struct UdpEndpoint* destination)
+{
+    const struct DnsAnswer* answer = association->resolved_answer;
+    if (NULL == answer
+        || DNS_ANSWER_OK != answer->status
+        || name_len != association->resolved_name_len
+        || ZERO != memcmp(name, association->resolved_name, name_len)
+        || now_ms() >= association->resolved_expires_ms
+    ) {
+        return ERR;
+    }
+
+    for (size_t i = 0; i < answer->address_count; i++) {
+        struct UdpEndpoint resolved;
+        endpoint_of_sockaddr(&answer->addresses[i], &resolved);
+        if (AF_INET6 == association->remote_family
+            || endpoint_is_ipv4(&resolved)
+        ) {
+            destination->addr = resolved.addr;
+            return OK;
+        }
+    }
+    return ERR;
+}
+
+/*
+    Datagrams to a name not yet resolved are dropped while it is; the
+    client's destination_waiter holds one lookup at a time.
+*/
+static int association_resolve_destination(
+    struct Socks5Server* server,
+    struct UdpAssociation* association,
+    const char* name,
+    const uint8_t name_len,
+    struct UdpEndpoint* destination)
+{
+    if (OK ==
+        association_destination_of_answer(
+            association,
+            name,
+            name_len,
+            destination
+        )
+    ) {
+        return OK;
+    }
+
+    const bool remembered =
+        name_len == association->resolved_name_len
+        && ZERO == memcmp(name, association->resolved_name, name_len)
+        && now_ms() < association->resolved_expires_ms;
+    if (remembered || ZERO != association->pending_name_len) {
+        return ERR;
+    }
+
+    struct Socks5Client* client = association->client_socket.client;
+    struct DnsAnswer* answer = NULL;
+    switch (
+        dns_resolver_resolve(
+            server->resolver,
+            name,
+            name_len,
+            &client->destination_waiter,
+            &answer
+        )
+    ) {
+        case DNS_RESOLVE_DONE:
+            association_remember_answer(
+                association,
+                name,
+                name_len,
+                answer
+            );
+            return association_destination_of_answer(
+                association,
+                name,
+                name_len,
+                destination
+            );
+        case DNS_RESOLVE_PENDING: {
+            const void* _ =
+                memmove(
+                    association->pending_name,
+                    name,
+                    name_len
+                );
+            association->pending_name_len = name_len;
+            return ERR;
+        }
+        case DNS_RESOLVE_ERR: default:
+            return ERR;
+    }
+}
+
+void udp_association_proc_resolved(
+    struct UdpAssociation* association,
+    struct DnsAnswer* answer)
+{
+    association_remember_answer(
+        association,
+        association->pending_name,
+        association->pending_name_len,
+        answer
+    );
+    association->pending_name_len = ZERO;
+}
+
+static void batch_prepare_recv(
+    struct UdpBatch* batch,
+    const size_t offset)
+{
+    for (size_t i = 0; i < UDP_BATCH; i++) {
+        batch->recv_iovs[i].iov_base = batch_buffer(batch, i) + offset;
+        batch->recv_iovs[i].iov_len = UDP_BUFFER_SPACE - offset;
+
+        struct msghdr* hdr = &batch->recv_messages[i].msg_hdr;
+        const void* _ = memset(hdr, ZERO, sizeof(*hdr));
+        hdr->msg_name = &batch->sources[i];
+        hdr->msg_namelen = sizeof(batch->sources[i]);
+        hdr->msg_iov = &batch->recv_iovs[i];
+        hdr->msg_iovlen = 1;
+        hdr->msg_control = batch->recv_controls[i].space;
+        hdr->msg_controllen = sizeof(batch->recv_controls[i].space);
+    }
+}
+
+/* UDP_GRO: a read may hold several datagrams, each segment_size but the last */
+static size_t segment_size_of(
+    const struct mmsghdr* message)
+{
+    const struct msghdr* hdr = &message->msg_hdr;
+    for (const struct cmsghdr* cmsg = CMSG_FIRSTHDR(hdr);
+        NULL != cmsg;
+        cmsg = CMSG_NXTHDR((struct msghdr*)hdr, (struct cmsghdr*)cmsg)
+    ) {
+        if (SOL_UDP == cmsg->cmsg_level && UDP_GRO == cmsg->cmsg_type) {
+            int segment_size = 0;
+            const void* _ = memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(segment_size));
+            return segment_size > 0 ? (size_t)segment_size : message->msg_len;
+        }
+    }
+    return message->msg_len;
+}
+
+static void batch_reset_sends(
+    struct UdpBatch* batch)
+{
+    batch->send_count = ZERO;
+    batch->iov_count = ZERO;
+}
+
+/* UDP may drop: a datagram that can't be sent now is lost, never waited on */
+static void batch_flush_sends(
+    struct UdpBatch* batch,
+    const int socket_fd,
+    bool* gso)
+{
+    size_t sent = 0;
+    while (sent < batch->send_count) {
+        const int ret =
+            sendmmsg(
+                socket_fd,
+                &batch->send_messages[sent],
+                batch->send_count - sent,
+                MSG_DONTWAIT
+            );
+        if (ERR != ret) {
+            sent += ret;
+            continue;
+        }
+
+        if (EAGAIN == errno || EWOULDBLOCK == errno || ENOBUFS == errno) {
+            break;
+        }
+        if (EINTR == errno) {
+            continue;
+        }
+
+        /* segmenting refused (no checksum offload, a path MTU under the segment size) */
+        if (ZERO != batch->send_messages[sent].msg_hdr.msg_controllen
+            && (EIO == errno || EINVAL == errno || EMSGSIZE == errno)
+        ) {
+            *gso = false;
+        }
+        /* what this one send was refused for says nothing of the rest */
+        sent++;
+    }
+
+    batch_reset_sends(batch);
+}
+
+/*
+    Queues one datagram, made of pieces, for destination. With gso a
+    datagram joins the send before it when that goes to the same
+    destination and the datagram is no larger than its segments: the
+    kernel then cuts one large send into them (UDP_SEGMENT).
+*/
+static void batch_queue_datagram(
+    struct UdpBatch* batch,
+    const int socket_fd,
+    bool* gso,
+    const struct UdpEndpoint* destination,
+    const sa_family_t family,
+    const struct iovec pieces[],
+    const size_t piece_count)
+{
+    size_t len = 0;
+    for (size_t i = 0; i < piece_count; i++) {
+        len += pieces[i].iov_len;
+    }
+
+    const bool joins =
+        *gso
+        && batch->send_count > ZERO
+        && !batch->send_closed
+        && len <= batch->segment_size
+        && batch->segment_count < UDP_MAX_SEGMENTS
+        && batch->send_space + len <= UDP_MAX_SEGMENTED_SPACE
+        && batch->iov_count + piece_count <= UDP_SEND_IOVS
+        && endpoint_equals(&batch->destination, destination);
+
+    if (!joins) {
+        if (UDP_SEND_BATCH == batch->send_count
+            || batch->iov_count + piece_count > UDP_SEND_IOVS
+        ) {
+            batch_flush_sends(batch, socket_fd, gso);
+        }
+
+        const socklen_t destination_len =
+            sockaddr_of_endpoint(
+                destination,
+                family,
+                &batch->destinations[batch->send_count]
+            );
+        if (ZERO == destination_len) {
+            return;
+        }
+
+        struct msghdr* hdr = &batch->send_messages[batch->send_count].msg_hdr;
+        const void* _ = memset(hdr, ZERO, sizeof(*hdr));
+        hdr->msg_name = &batch->destinations[batch->send_count];
+        hdr->msg_namelen = destination_len;
+        hdr->msg_iov = &batch->send_iovs[batch->iov_count];
+
+        batch->send_count++;
+        batch->destination = *destination;
+        batch->segment_size = len;
+        batch->segment_count = ZERO;
+        batch->send_space = ZERO;
+        /* a segment the size of a path MTU is all one send may safely hold */
+        batch->send_closed = len > UDP_MAX_SEGMENT_SPACE;
+    }
+
+    struct msghdr* hdr = &batch->send_messages[batch->send_count - 1].msg_hdr;
+    for (size_t i = 0; i < piece_count; i++) {
+        batch->send_iovs[batch->iov_count++] = pieces[i];
+    }
+    hdr->msg_iovlen += piece_count;
+    batch->segment_count++;
+    batch->send_space += len;
+
+    /* only the last segment may come up short */
+    if (len < batch->segment_size) {
+        batch->send_closed = true;
+    }
+
+    if (2 == batch->segment_count) {
+        union UdpControl* control = &batch->send_controls[batch->send_count - 1];
+        hdr->msg_control = control->space;
+        hdr->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(hdr);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        const uint16_t segment_size = (uint16_t)batch->segment_size;
+        const void* _ = memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+    }
+}
+
+/* ZERO when the socket is drained, ERR when it failed */
+static int batch_recv(
+    struct UdpBatch* batch,
+    const int socket_fd)
+{
+    for (;;) {
+        const int ret =
+            recvmmsg(
+                socket_fd,
+                batch->recv_messages,
+                UDP_BATCH,
+                MSG_DONTWAIT,
+                NULL
+            );
+        if (ERR != ret) {
+            return ret;
+        }
+
+        switch (errno) {
+            case EINTR:
+                continue;
+            case EAGAIN:
+            case ECONNREFUSED:
+            case EHOSTUNREACH:
+            case ENETUNREACH:
+                return ZERO;
+            default:
+                return ERR;
+        }
+    }
+}
+
+static void association_queue_to_remote(
+    struct Socks5Server* server,
+    struct UdpAssociation* association,
+    const struct UdpEndpoint* destination,
+    const struct iovec* payload)
+{
+    if (!access_policy_admits_in6(
+            server->cfg.access_policy,
+            ACCESS_POLICY_DESTINATION,
+            &destination->addr
+        )
+    ) {
+        return;
+    }
+
+    association->datagram_count++;
+    const struct UdpFlow* _ =
+        association_flow_of(
+            association,
+            destination,
+            true
+        );
+
+    batch_queue_datagram(
+        server->udp_batch,
+        association->remote_socket.socket_fd,
+        &association->remote_gso,
+        destination,
+        association->remote_family,
+        payload,
+        1
+    );
+}
+
+static void association_abandon_reassembly(
+    struct Socks5Server* server,
+    struct UdpAssociation* association)
+{
+    struct UdpReassembly* reassembly = &association->reassembly;
+
+    timer_wheel_unarm(&server->timers, &reassembly->timer);
+    io_buffer_pool_relinquish(
+        &server->io_buffers,
+        reassembly->space,
+        reassembly->capacity
+    );
+    server->udp_reassembly_space -= reassembly->capacity;
+
+    reassembly->space = NULL;
+    reassembly->capacity = ZERO;
+    reassembly->len = ZERO;
+    reassembly->position = ZERO;
+}
+
+static void association_proc_reassembly_timeout(
+    struct Socks5Server* server,
+    struct TimerWheelEntry* timer)
+{
+    struct UdpAssociation* association =
+        (struct UdpAssociation*)(
+            (char*)timer - offsetof(struct UdpAssociation, reassembly.timer)
+        );
+    association_abandon_reassembly(server, association);
+}
+
+/*
+    Grows the queue into the next buffer class as fragments need it.
+    ERR when the datagram would be too large or the server's
+    reassembly space is spent: the caller abandons the queue at once,
+    which frees its space for the others.
+*/
+static int reassembly_append(
+    struct Socks5Server* server,
+    struct UdpReassembly* reassembly,
+    const char data[],
+    const size_t len)
+{
+    const size_t least = reassembly->len + len;
+    if (least > UDP_MAX_DATAGRAM) {
+        return ERR;
+    }
+
+    if (least > reassembly->capacity) {
+        const size_t others_space = server->udp_reassembly_space - reassembly->capacity;
+        if (others_space + least > server->cfg.udp_reassembly_capacity) {
+            return ERR;
+        }
+
+        size_t capacity = ZERO;
+        char* space =
+            io_buffer_pool_acquire(
+                &server->io_buffers,
+                least,
+                &capacity
+            );
+        if (NULL == space) {
+            return ERR;
+        }
+        if (others_space + capacity > server->cfg.udp_reassembly_capacity) {
+            io_buffer_pool_relinquish(&server->io_buffers, space, capacity);
+            return ERR;
+        }
+
+        const void* _ = memcpy(space, reassembly->space, reassembly->len);
+        io_buffer_pool_relinquish(
+            &server->io_buffers,
+            reassembly->space,
+            reassembly->capacity
+        );
+        server->udp_reassembly_space = others_space + capacity;
+        reassembly->space = space;
+        reassembly->capacity = capacity;
+    }
+
+    const void* _ = memcpy(&reassembly->space[reassembly->len], data, len);
+    reassembly->len = least;
+    return OK;
+}
+
+/*
+    RFC 1928 7. A fragment is queued only right after the one before
+    it; any other abandons the queue, a position 1 then beginning the
+    next. The whole datagram goes to the first fragment's destination.
+*/
+static void association_reassemble(
+    struct Socks5Server* server,
+    struct UdpAssociation* association,
+    const uint8_t frag,
+    const struct UdpEndpoint* destination,
+    const char* name,
+    const uint8_t name_len,
+    const char data[],
+    const size_t len)
+{
+    struct UdpReassembly* reassembly = &association->reassembly;
+    const uint8_t position = frag & UDP_FRAG_POSITION;
+
+    if (ZERO != reassembly->position
+        && position != reassembly->position + 1
+    ) {
+        association_abandon_reassembly(server, association);
+    }
+
+    if (ZERO == reassembly->position) {
+        if (1 != position) {
+            return;
+        }
+
+        reassembly->destination = *destination;
+        if (ZERO != name_len
+            && OK !=
+            association_resolve_destination(
+                server,
+                association,
+                name,
+                name_len,
+                &reassembly->destination
+            )
+        ) {
+            return;
+        }
+
+        timer_wheel_arm(
+            &server->timers,
+            &reassembly->timer,
+            now_ms() + UDP_REASSEMBLY_MS
+        );
+    }
+
+    if (OK !=
+        reassembly_append(
+            server,
+            reassembly,
+            data,
+            len
+        )
+    ) {
+        association_abandon_reassembly(server, association);
+        return;
+    }
+    reassembly->position = position;
+
+    if (ZERO == (frag & UDP_FRAG_END)) {
+        return;
+    }
+
+    /* sent before the queue's space is given back */
+    const struct iovec payload = {
+        .iov_base = reassembly->space,
+        .iov_len = reassembly->len
+    };
+    association_queue_to_remote(
+        server,
+        association,
+        &reassembly->destination,
+        &payload
+    );
+    batch_flush_sends(
+        server->udp_batch,
+        association->remote_socket.socket_fd,
+        &association->remote_gso
+    );
+    association_abandon_reassembly(server, association);
+}
+
+/* the header of each of the client's datagrams is stepped over, not copied out */
+static void association_relay_datagram_from_client(
+    struct Socks5Server* server,
+    struct UdpAssociation* association,
+    char* datagram,
+    const size_t len)
+{
+    uint8_t frag = ZERO;
+    struct UdpEndpoint destination;
+    const char* name = NULL;
+    uint8_t name_len = ZERO;
+    const size_t header_len =
+        parse_udp_header(
+            datagram,
+            len,
+            &frag,
+            &destination,
+            &name,
+            &name_len
+        );
+    if (ZERO == header_len) {
+        return;
+    }
+
+    if (ZERO != name_len
+        && domain_index_holds(
+            server->cfg.domain_blocklist,
+            name,
+            name_len
+        )
+    ) {
+        return;
+    }
+
+    /* without reassembly: "drop any datagrams ... [it is] unable to relay" */
+    if (ZERO != frag) {
+        if (ZERO != server->cfg.udp_reassembly_capacity) {
+            association_reassemble(
+                server,
+                association,
+                frag,
+                &destination,
+                name,
+                name_len,
+                datagram + header_len,
+                len - header_len
+            );
+        }
+        return;
+    }
+
+    if (ZERO != name_len
+        && OK !=
+        association_resolve_destination(
+            server,
+            association,
+            name,
+            name_len,
+            &destination
+        )
+    ) {
+        return;
+    }
+
+    const struct iovec payload = {
+        .iov_base = datagram + header_len,
+        .iov_len = len - header_len
+    };
+    association_queue_to_remote(
+        server,
+        association,
+        &destination,
+        &payload
+    );
+}
+
+static int association_relay_from_client(
+    struct Socks5Server* server,
+    struct UdpAssociation* association)
+{
+    struct UdpBatch* batch = server->udp_batch;
+
+    for (;;) {
+        batch_prepare_recv(batch, ZERO);
+        const int recvd =
+            batch_recv(
+                batch,
+                association->client_socket.socket_fd
+            );
+        if (recvd <= ZERO) {
+            return recvd;
+        }
+
+        batch_reset_sends(batch);
+        for (int i = 0; i < recvd; i++) {
+            const struct mmsghdr* message = &batch->recv_messages[i];
+            if (message->msg_hdr.msg_flags & MSG_TRUNC) {
+                continue;
+            }
+
+            struct UdpEndpoint source;
+            endpoint_of_sockaddr(&batch->sources[i], &source);
+            if (!association_admits_client(association, &source)) {
+                continue;
+            }
+
+            char* read = batch_buffer(batch, i);
+            const size_t segment_size = segment_size_of(message);
+            for (size_t offset = 0; offset < message->msg_len; offset += segment_size) {
+                const size_t left = message->msg_len - offset;
+                association_relay_datagram_from_client(
+                    server,
+                    association,
+                    read + offset,
+                    left < segment_size ? left : segment_size
+                );
+            }
+        }
+
+        batch_flush_sends(
+            batch,
+            association->remote_socket.socket_fd,
+            &association->remote_gso
+        );
+
+        /* a short batch drained the socket */
+        if (recvd < UDP_BATCH) {
+            return OK;
+        }
+    }
+}
+
+static int association_relay_to_client(
+    struct Socks5Server* server,
+    struct UdpAssociation* association)
+{
+    struct UdpBatch* batch = server->udp_batch;
+
+    for (;;) {
+        batch_prepare_recv(batch, UDP_HEADROOM);
+        const int recvd =
+            batch_recv(
+                batch,
+                association->remote_socket.socket_fd
+            );
+        if (recvd <= ZERO) {
+            return recvd;
+        }
+
+        /* before the client's first datagram there is nowhere to relay to */
+        if (ZERO == association->client.port) {
+            continue;
+        }
+
+        batch_reset_sends(batch);
+        for (int i = 0; i < recvd; i++) {
+            const struct mmsghdr* message = &batch->recv_messages[i];
+            if (message->msg_hdr.msg_flags & MSG_TRUNC) {
+                continue;
+            }
+
+            struct UdpEndpoint source;
+            endpoint_of_sockaddr(&batch->sources[i], &source);
+            if (NULL ==
+                association_flow_of(
+                    association,
+                    &source,
+                    false
+                )
+            ) {
+                continue;
+            }
+
+            /*
+                One header serves every datagram of a read: they all
+                came from source. The first is already behind it; the
+                others are sent as header and datagram pieces.
+            */
+            char* read = batch_buffer(batch, i) + UDP_HEADROOM;
+            const size_t header_len =
+                build_udp_header_before(
+                    read,
+                    &source
+                );
+            const size_t segment_size = segment_size_of(message);
+
+            for (size_t offset = 0; offset < message->msg_len; offset += segment_size) {
+                const size_t left = message->msg_len - offset;
+                const size_t len = left < segment_size ? left : segment_size;
+                const struct iovec pieces[2] = {
+                    {.iov_base = read - header_len, .iov_len = header_len},
+                    {.iov_base = read + offset, .iov_len = len}
+                };
+                const struct iovec whole = {
+                    .iov_base = read - header_len,
+                    .iov_len = header_len + len
+                };
+                batch_queue_datagram(
+                    batch,
+                    association->client_socket.socket_fd,
+                    &association->client_gso,
+                    &association->client,
+                    association->client_family,
+                    ZERO == offset ? &whole : pieces,
+                    ZERO == offset ? 1 : 2
+                );
+            }
+        }
+
+        batch_flush_sends(
+            batch,
+            association->client_socket.socket_fd,
+            &association->client_gso
+        );
+
+        if (recvd < UDP_BATCH) {
+            return OK;
+        }
+    }
+}
+
+int udp_association_proc_readable(
+    struct Socks5Server* server,
+    struct UdpAssociation* association,
+    const int socket_fd)
+{
+    if (socket_fd == association->client_socket.socket_fd) {
+        return association_relay_from_client(server, association);
+    }
+    if (socket_fd == association->remote_socket.socket_fd) {
+        return association_relay_to_client(server, association);
+    }
+    return OK;
+}
+
+static int association_open_socket(
+    struct Socks5Server* server,
+    struct ClientSocket* client_socket,
+    bool* gso,
+    const sa_family_t family,
+    const struct sockaddr_storage* bind_address,
+    const socklen_t bind_address_len)
+{
+    const int socket_fd =
+        socket(
+            family,
+            SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            ZERO
+        );
+    if (ERR == socket_fd) {
+        return ERR;
+    }
+    client_socket->socket_fd = socket_fd;
+
+    const int buffer_space = UDP_SOCKET_BUFFER_SPACE;
+    int _ignored =
+        setsockopt(
+            socket_fd,
+            SOL_SOCKET,
+            SO_RCVBUF,
+            &buffer_space,
+            sizeof(buffer_space)
+        );
+    _ignored =
+        setsockopt(
+            socket_fd,
+            SOL_SOCKET,
+            SO_SNDBUF,
+            &buffer_space,
+            sizeof(buffer_space)
+        );
+
+    /*
+        Offloads, where the kernel has them: reads may coalesce datagrams
+        of one sender (UDP_GRO), sends may be cut into datagrams
+        (UDP_SEGMENT; setting a zero default only probes for it).
+    */
+    const int on = 1;
+    _ignored =
+        setsockopt(
+            socket_fd,
+            SOL_UDP,
+            UDP_GRO,
+            &on,
+            sizeof(on)
+        );
+    const int no_default_segment_size = 0;
+    *gso =
+        OK ==
+        setsockopt(
+            socket_fd,
+            SOL_UDP,
+            UDP_SEGMENT,
+            &no_default_segment_size,
+            sizeof(no_default_segment_size)
+        );
+
+    /* the remote socket reaches IPv4 remotes v4-mapped */
+    if (NULL == bind_address && AF_INET6 == family) {
+        const int v6only = 0;
+        if (OK !=
+            setsockopt(
+                socket_fd,
+                IPPROTO_IPV6,
+                IPV6_V6ONLY,
+                &v6only,
+                sizeof(v6only)
+            )
+        ) {
+            return ERR;
+        }
+    }
+
+    if (NULL != bind_address
+        && OK !=
+        bind(
+            socket_fd,
+            (const struct sockaddr*)bind_address,
+            bind_address_len
+        )
+    ) {
+        return ERR;
+    }
+
+    if (OK !=
+        client_table_track(
+            &server->clients,
+            socket_fd,
+            client_socket->client
+        )
+    ) {
+        return ERR;
+    }
+
+    if (OK !=
+        server->cfg.subscribe_socket(
+            server,
+            socket_fd,
+            FDIOEVENT_POLL_READABLE,
+            socket_context_of(client_socket, SOCKET_CONTEXT_CLIENT_SOCKET)
+        )
+    ) {
+        const int _ignored_too =
+            client_table_untrack(
+                &server->clients,
+                socket_fd,
+                client_socket->client
+            );
+        return ERR;
+    }
+
+    client_socket->subscribed = true;
+    return OK;
+}
+
+static int association_close_socket(
+    struct Socks5Server* server,
+    struct ClientSocket* client_socket)
+{
+    if (ERR == client_socket->socket_fd) {
+        return OK;
+    }
+
+    int ret = OK;
+    if (client_socket->subscribed) {
+        if (OK !=
+            client_table_untrack(
+                &server->clients,
+                client_socket->socket_fd,
+                client_socket->client
+            )
+        ) {
+            ret = ERR;
+        }
+        if (OK !=
+            server->cfg.unsubscribe_socket(
+                server,
+                client_socket->socket_fd
+            )
+        ) {
+            ret = ERR;
+        }
+    }
+
+    if (OK != close(client_socket->socket_fd)) {
+        ret = ERR;
+    }
+
+    client_socket->socket_fd = ERR;
+    client_socket->subscribed = false;
+    return ret;
+}
+
+/* DST.ADDR when the request names one, else the address of the TCP connection */
+static int association_expect_client(
+    struct UdpAssociation* association,
+    const struct Socks5Client* client,
+    const struct ClientRequest* request)
+{
+    struct sockaddr_storage peer = {0};
+    socklen_t peer_len = sizeof(peer);
+    if (OK !=
+        getpeername(
+            client->inbound_socket_fd,
+            (struct sockaddr*)&peer,
+            &peer_len
+        )
+    ) {
+        return ERR;
+    }
+    endpoint_of_sockaddr(&peer, &association->client);
+    association->client.port = request->dst_port;
+
+    static const char unspecified[SIXTEEN] = {0};
+    switch (request->addr_type) {
+        case SOCKS5_ADDR_TYPE_IPV4:
+            if (ZERO != memcmp(request->dst_addr.ipv4, unspecified, FOUR)) {
+                const void* _ = memset(&association->client.addr, ZERO, 10);
+                association->client.addr.s6_addr[10] = 0xFF;
+                association->client.addr.s6_addr[11] = 0xFF;
+                _ = memcpy(&association->client.addr.s6_addr[12], request->dst_addr.ipv4, FOUR);
+            }
+            return OK;
+        case SOCKS5_ADDR_TYPE_IPV6:
+            if (ZERO != memcmp(request->dst_addr.ipv6, unspecified, SIXTEEN)) {
+                const void* _ = memcpy(&association->client.addr, request->dst_addr.ipv6, SIXTEEN);
+            }
+            return OK;
+        default:
+            return OK;
+    }
+}
+
+struct UdpAssociation* udp_association_construct(
+    struct Socks5Server* server,
+    struct Socks5Client* client,
+    const struct ClientRequest* request)
+{
+    if (OK != server_ensure_udp_batch(server)) {
+        return NULL;
+    }
+
+    /* the client reaches the association where it reached the server */
+    struct sockaddr_storage local = {0};
+    socklen_t local_len = sizeof(local);
+    if (OK !=
+        getsockname(
+            client->inbound_socket_fd,
+            (struct sockaddr*)&local,
+            &local_len
+        )
+    ) {
+        return NULL;
+    }
+    if (AF_INET6 == local.ss_family) {
+        ((struct sockaddr_in6*)&local)->sin6_port = ZERO;
+    } else {
+        ((struct sockaddr_in*)&local)->sin_port = ZERO;
+    }
+
+    struct UdpAssociation* association =
+        calloc(
+            1,
+            sizeof(struct UdpAssociation)
+        );
+    if (NULL == association) {
+        return NULL;
+    }
+
+    association->client_socket.socket_fd = ERR;
+    association->client_socket.client = client;
+    association->remote_socket.socket_fd = ERR;
+    association->remote_socket.client = client;
+    association->client_family = local.ss_family;
+    association->remote_family = AF_INET6;
+    timer_wheel_entry_construct(
+        &association->reassembly.timer,
+        association_proc_reassembly_timeout
+    );
+
+    if (OK !=
+        association_expect_client(
+            association,
+            client,
+            request
+        )
+        || OK !=
+        association_open_socket(
+            server,
+            &association->client_socket,
+            &association->client_gso,
+            association->client_family,
+            &local,
+            local_len
+        )
+    ) {
+        const int _ignored = udp_association_destruct(server, association);
+        return NULL;
+    }
+
+    if (OK !=
+        association_open_socket(
+            server,
+            &association->remote_socket,
+            &association->remote_gso,
+            AF_INET6,
+            NULL,
+            ZERO
+        )
+    ) {
+        /* no IPv6 on this host: IPv4 remotes only */
+        const int _ignored =
+            association_close_socket(
+                server,
+                &association->remote_socket
+            );
+        association->remote_family = AF_INET;
+        if (OK !=
+            association_open_socket(
+                server,
+                &association->remote_socket,
+                &association->remote_gso,
+                AF_INET,
+                NULL,
+                ZERO
+            )
+        ) {
+            const int _ignored_too = udp_association_destruct(server, association);
+            return NULL;
+        }
+    }
+
+    return association;
+}
+
+int udp_association_local_address(
+    const struct UdpAssociation* association,
+    struct sockaddr_storage* address,
+    socklen_t* address_len)
+{
+    *address_len = sizeof(*address);
+    return getsockname(
+        association->client_socket.socket_fd,
+        (struct sockaddr*)address,
+        address_len
+    );
+}
+
+int udp_association_destruct(
+    struct Socks5Server* server,
+    struct UdpAssociation* association)
+{
+    int ret =
+        association_close_socket(
+            server,
+            &association->client_socket
+        );
+    if (OK !=
+        association_close_socket(
+            server,
+            &association->remote_socket
+        )
+    ) {
+        ret = ERR;
+    }
+
+    association_abandon_reassembly(server, association);
+    association_forget_answer(association);
+    free(association);
+    return ret;
+}
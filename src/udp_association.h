@@ -0,0 +1,111 @@
+#ifndef _UDP_ASSOCIATION_H_
+#define _UDP_ASSOCIATION_H_
+
+#include "rfc1928socks5.h"
+
+#include <netinet/in.h>
+
+/*
+    RFC 1928 7. Procedure for UDP-based clients. An association relays
+    between the client, on a socket bound next to the client's TCP
+    connection, and the remotes, on one socket of its own. Datagrams
+    move in batches of recvmmsg/sendmmsg; remotes are only heard from
+    once the client has sent to them. Where the kernel offers it, runs
+    of datagrams move as one: coalesced on receipt (UDP_GRO), cut up on
+    sending (UDP_SEGMENT). The client's fragmented datagrams are
+    reassembled when the server is configured to.
+*/
+
+enum {UDP_FLOW_COUNT=64};
+
+/* IPv4 endpoints are kept v4-mapped */
+struct UdpEndpoint
+{
+    struct in6_addr addr;
+    in_port_t port;
+};
+
+/* a remote the client sent to: the only ones whose datagrams are relayed back */
+struct UdpFlow
+{
+    struct UdpEndpoint remote;
+    bool used;
+    uint32_t last_used;
+};
+
+/*
+    The fragments of one of the client's datagrams, in order: FRAG
+    positions 1 up to the one queued last. Abandoned when its timer
+    runs out, when a fragment comes out of order, or when the server's
+    reassembly space can't hold the next.
+*/
+struct UdpReassembly
+{
+    struct TimerWheelEntry timer;
+    /* the first fragment's */
+    struct UdpEndpoint destination;
+    char* space;
+    size_t capacity;
+    size_t len;
+    /* ZERO while nothing is queued */
+    uint8_t position;
+};
+
+struct UdpAssociation
+{
+    struct ClientSocket client_socket;
+    struct ClientSocket remote_socket;
+    sa_family_t client_family;
+    sa_family_t remote_family;
+    /* the socket may send several datagrams at once (UDP_SEGMENT) */
+    bool client_gso;
+    bool remote_gso;
+    /* what the client's datagrams must come from; a zero port until the first fixes it */
+    struct UdpEndpoint client;
+    uint32_t datagram_count;
+    struct UdpFlow flows[UDP_FLOW_COUNT];
+    /* the last DOMAINNAME destination; others wait on the client's destination_waiter */
+    struct DnsAnswer* resolved_answer;
+    int64_t resolved_expires_ms;
+    uint8_t resolved_name_len;
+    uint8_t pending_name_len;
+    char resolved_name[UINT8_MAX + 1];
+    char pending_name[UINT8_MAX + 1];
+    struct UdpReassembly reassembly;
+};
+
+/*
+    request is the client's UDP ASSOCIATE: its DST.ADDR and DST.PORT,
+    when not zero, are where the client's datagrams are to come from.
+*/
+struct UdpAssociation* udp_association_construct(
+    struct Socks5Server* server,
+    struct Socks5Client* client,
+    const struct ClientRequest* request
+);
+
+/* the client socket's address: BND.ADDR and BND.PORT of the reply */
+int udp_association_local_address(
+    const struct UdpAssociation* association,
+    struct sockaddr_storage* address,
+    socklen_t* address_len
+);
+
+int udp_association_proc_readable(
+    struct Socks5Server* server,
+    struct UdpAssociation* association,
+    const int socket_fd
+);
+
+/* answer, to the client's destination_waiter, becomes the association's */
+void udp_association_proc_resolved(
+    struct UdpAssociation* association,
+    struct DnsAnswer* answer
+);
+
+int udp_association_destruct(
+    struct Socks5Server* server,
+    struct UdpAssociation* association
+);
+
+#endif
@@ -0,0 +1,174 @@
+#define _GNU_SOURCE
+#include "zerocopy.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+enum {OK=0,ERR=-1};
+enum {ZERO=0};
+
+void zerocopy_leg_construct(
+    struct ZerocopyLeg* leg)
+{
+    leg->enabled = false;
+    leg->sends = ZERO;
+    leg->completed = ZERO;
+    leg->reported = ZERO;
+    leg->space_sent = false;
+    leg->space_sends_through = ZERO;
+    leg->pin_count = ZERO;
+}
+
+void zerocopy_enable(
+    struct ZerocopyLeg* leg,
+    const int socket_fd)
+{
+    const int one = 1;
+    leg->enabled =
+        OK ==
+        setsockopt(
+            socket_fd,
+            SOL_SOCKET,
+            SO_ZEROCOPY,
+            &one,
+            sizeof(one)
+        );
+}
+
+int zerocopy_send_what_may(
+    struct ZerocopyLeg* leg,
+    const int socket_fd,
+    const char* space,
+    const size_t zero_point,
+    const size_t time,
+    bool* blocked_eagain)
+{
+    assert(zero_point < time);
+
+    ptrdiff_t i = zero_point;
+    int total_sent = 0;
+    int flags = MSG_ZEROCOPY | MSG_NOSIGNAL;
+
+    while ((size_t)i < time) {
+        const ssize_t sent =
+            send(
+                socket_fd,
+                &space[i],
+                time - i,
+                flags
+            );
+        if (sent == ZERO) {
+            return total_sent;
+        }
+        if (sent == ERR && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (NULL != blocked_eagain) {
+                *blocked_eagain = true;
+            }
+            return total_sent;
+        } else if (sent == ERR && errno == EINTR) {
+            continue;
+        } else if (sent == ERR && errno == ENOBUFS && ZERO != (flags & MSG_ZEROCOPY)) {
+            flags = MSG_NOSIGNAL;
+            continue;
+        } else if (sent == ERR) {
+            return ERR;
+        }
+
+        if (ZERO != (flags & MSG_ZEROCOPY)) {
+            leg->sends++;
+            leg->space_sent = true;
+            leg->space_sends_through = leg->sends;
+        }
+
+        i += sent;
+        total_sent += sent;
+    }
+
+    return total_sent;
+}
+
+/*
+    The kernel reports sends lo through hi done, merging ranges as they
+    queue up; for TCP they come in order. One out of order is only
+    counted, until every send made has been reported.
+*/
+static void zerocopy_complete(
+    struct ZerocopyLeg* leg,
+    const uint32_t lo,
+    const uint32_t hi,
+    const bool copied)
+{
+    leg->reported += hi - lo + 1;
+    if (lo == leg->completed) {
+        leg->completed = hi + 1;
+    }
+    if (leg->reported == leg->sends) {
+        leg->completed = leg->sends;
+    }
+
+    /* the pages were copied anyway: pinning them only cost */
+    if (copied) {
+        leg->enabled = false;
+    }
+}
+
+int zerocopy_reap(
+    struct ZerocopyLeg* leg,
+    const int socket_fd)
+{
+    for (;;) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+        struct msghdr msg = {
+            .msg_control = control,
+            .msg_controllen = sizeof(control)
+        };
+        const ssize_t got =
+            recvmsg(
+                socket_fd,
+                &msg,
+                MSG_ERRQUEUE
+            );
+        if (ERR == got && EINTR == errno) {
+            continue;
+        } else if (ERR == got && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+            return OK;
+        } else if (ERR == got) {
+            return ERR;
+        }
+
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            NULL != cmsg;
+            cmsg = CMSG_NXTHDR(&msg, cmsg)
+        ) {
+            if (!(SOL_IP == cmsg->cmsg_level && IP_RECVERR == cmsg->cmsg_type)
+                && !(SOL_IPV6 == cmsg->cmsg_level && IPV6_RECVERR == cmsg->cmsg_type)
+            ) {
+                continue;
+            }
+
+            const struct sock_extended_err* err =
+                (const struct sock_extended_err*)CMSG_DATA(cmsg);
+            if (SO_EE_ORIGIN_ZEROCOPY != err->ee_origin
+                || ZERO != err->ee_errno
+            ) {
+                continue;
+            }
+
+            zerocopy_complete(
+                leg,
+                err->ee_info,
+                err->ee_data,
+                ZERO != (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            );
+        }
+    }
+}
+
+bool zerocopy_done(
+    const struct ZerocopyLeg* leg,
+    const uint32_t sends_through)
+{
+    return (int32_t)(leg->completed - sends_through) >= ZERO;
+}
@@ -0,0 +1,52 @@
+#ifndef _ZEROCOPY_H_
+#define _ZEROCOPY_H_
+
+#include "rfc1928socks5.h"
+
+/*
+    MSG_ZEROCOPY sends (Documentation/networking/msg_zerocopy.rst): the
+    kernel sends from the caller's pages instead of a copy of them, and
+    says on the socket's error queue when it is done with them.
+*/
+
+/* off: nothing sent, nothing pinned */
+void zerocopy_leg_construct(
+    struct ZerocopyLeg* leg
+);
+
+/* SO_ZEROCOPY on socket_fd; the leg is left off if the kernel won't have it */
+void zerocopy_enable(
+    struct ZerocopyLeg* leg,
+    const int socket_fd
+);
+
+/*
+    As send_what_may, each send made with MSG_ZEROCOPY and numbered in
+    leg, space being the leg's buffer. What the socket's option memory
+    won't cover (ENOBUFS) is sent by copy.
+*/
+int zerocopy_send_what_may(
+    struct ZerocopyLeg* leg,
+    const int socket_fd,
+    const char* space,
+    const size_t zero_point,
+    const size_t time,
+    bool* blocked_eagain
+);
+
+/*
+    Reads what the socket's error queue holds into leg. Sends the kernel
+    reports having copied after all turn the leg off.
+*/
+int zerocopy_reap(
+    struct ZerocopyLeg* leg,
+    const int socket_fd
+);
+
+/* the sends numbered below sends_through are all done */
+bool zerocopy_done(
+    const struct ZerocopyLeg* leg,
+    const uint32_t sends_through
+);
+
+#endif
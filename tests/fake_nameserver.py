@@ -0,0 +1,174 @@
+"""
+A nameserver for the tests, on 127.0.0.1 over UDP and TCP at one port,
+answering A and AAAA queries from a zone the test fills in. Each name
+can have its answers delayed, be truncated over UDP (TC) so the
+resolver has to come back over TCP, be dropped unanswered, have forged
+answers race the real one, or not exist. Queries are counted by name,
+type and transport, and the source ports of UDP ones are kept.
+"""
+import socket
+import struct
+import threading
+import time
+
+TYPE_A = 1
+TYPE_AAAA = 28
+RCODE_NXDOMAIN = 3
+FLAGS_RESPONSE = 0x8180
+FLAG_TC = 0x0200
+
+
+class Name:
+    """What the nameserver does for one name."""
+
+    def __init__(self, a=(), aaaa=(), ttl=60, delay=None, truncated=False, dropped=False, forged=()):
+        self.addresses = {TYPE_A: list(a), TYPE_AAAA: list(aaaa)}
+        self.ttl = ttl
+        # seconds, or {TYPE_A: seconds, TYPE_AAAA: seconds}
+        self.delay = delay
+        self.truncated = truncated
+        self.dropped = dropped
+        # A answers sent ahead of the real one: with the query's ID and
+        # question but from another port, then from the right port with
+        # another question
+        self.forged = list(forged)
+
+    def delay_of(self, qtype):
+        if isinstance(self.delay, dict):
+            return self.delay.get(qtype)
+        return self.delay
+
+
+class FakeNameserver:
+
+    def __init__(self):
+        self.zone = {}
+        self.counts = {}
+        self.source_ports = {}
+        self.lock = threading.Lock()
+        self.udp, self.tcp = self._bind()
+        self.port = self.udp.getsockname()[1]
+        threading.Thread(target=self._serve_udp, daemon=True).start()
+        threading.Thread(target=self._serve_tcp, daemon=True).start()
+
+    def address(self):
+        """for --nameserver"""
+        return '127.0.0.1:%d' % self.port
+
+    def queries(self, name, qtype, transport='udp'):
+        with self.lock:
+            return self.counts.get((name, qtype, transport), 0)
+
+    def ports_queried_from(self, name, qtype):
+        with self.lock:
+            return list(self.source_ports.get((name, qtype), []))
+
+    @staticmethod
+    def _bind():
+        # a free UDP port whose TCP twin is free as well
+        while True:
+            udp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+            udp.bind(('127.0.0.1', 0))
+            tcp = socket.socket()
+            tcp.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+            try:
+                tcp.bind(udp.getsockname())
+            except OSError:
+                udp.close()
+                tcp.close()
+                continue
+            tcp.listen(16)
+            return udp, tcp
+
+    @staticmethod
+    def _question_of(query):
+        labels = []
+        i = 12
+        while query[i]:
+            labels.append(query[i + 1:i + 1 + query[i]].decode())
+            i += 1 + query[i]
+        qtype = struct.unpack('>H', query[i + 1:i + 3])[0]
+        return '.'.join(labels).lower(), qtype, query[12:i + 5]
+
+    @staticmethod
+    def _encode_question(name, qtype):
+        labels = b''.join(bytes([len(label)]) + label.encode() for label in name.split('.'))
+        return labels + b'\x00' + struct.pack('>HH', qtype, 1)
+
+    @staticmethod
+    def _response(qid, question, qtype, addresses, ttl):
+        family = socket.AF_INET if qtype == TYPE_A else socket.AF_INET6
+        records = b''
+        for address in addresses:
+            rdata = socket.inet_pton(family, address)
+            records += b'\xc0\x0c' + struct.pack('>HHIH', qtype, 1, ttl, len(rdata)) + rdata
+        return struct.pack('>6H', qid, FLAGS_RESPONSE, 1, len(addresses), 0, 0) + question + records
+
+    def _forge(self, query, peer):
+        qid = struct.unpack('>H', query[:2])[0]
+        name, qtype, question = self._question_of(query)
+        forged = self.zone[name].forged
+        with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as elsewhere:
+            elsewhere.sendto(self._response(qid, question, qtype, forged, 60), peer)
+        other_question = self._encode_question('other.' + name, qtype)
+        self.udp.sendto(self._response(qid, other_question, qtype, forged, 60), peer)
+
+    def _answer(self, query, transport, peer=None):
+        qid = struct.unpack('>H', query[:2])[0]
+        name, qtype, question = self._question_of(query)
+        with self.lock:
+            key = (name, qtype, transport)
+            self.counts[key] = self.counts.get(key, 0) + 1
+            if peer is not None:
+                self.source_ports.setdefault((name, qtype), []).append(peer[1])
+
+        entry = self.zone.get(name)
+        if entry is None:
+            return struct.pack('>6H', qid, FLAGS_RESPONSE | RCODE_NXDOMAIN, 1, 0, 0, 0) + question
+        if entry.dropped:
+            return None
+        delay = entry.delay_of(qtype)
+        if delay:
+            time.sleep(delay)
+        if entry.truncated and transport == 'udp':
+            return struct.pack('>6H', qid, FLAGS_RESPONSE | FLAG_TC, 1, 0, 0, 0) + question
+
+        if entry.forged and qtype == TYPE_A and transport == 'udp':
+            self._forge(query, peer)
+            time.sleep(0.05)
+        return self._response(qid, question, qtype, entry.addresses.get(qtype, []), entry.ttl)
+
+    def _serve_udp(self):
+        while True:
+            query, peer = self.udp.recvfrom(4096)
+            threading.Thread(target=self._reply_udp, args=(query, peer), daemon=True).start()
+
+    def _reply_udp(self, query, peer):
+        answer = self._answer(query, 'udp', peer)
+        if answer is not None:
+            self.udp.sendto(answer, peer)
+
+    def _serve_tcp(self):
+        while True:
+            conn, _ = self.tcp.accept()
+            threading.Thread(target=self._reply_tcp, args=(conn,), daemon=True).start()
+
+    def _reply_tcp(self, conn):
+        with conn:
+            length = conn.recv(2)
+            if len(length) < 2:
+                return
+            query = b''
+            while len(query) < struct.unpack('>H', length)[0]:
+                more = conn.recv(4096)
+                if not more:
+                    return
+                query += more
+            answer = self._answer(query, 'tcp')
+            if answer is None:
+                return
+            framed = struct.pack('>H', len(answer)) + answer
+            # in two segments: the resolver has to put a stream answer back together
+            conn.sendall(framed[:5])
+            time.sleep(0.01)
+            conn.sendall(framed[5:])
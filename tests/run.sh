@@ -0,0 +1,24 @@
+#!/bin/sh
+# runs each test against bin/program (./build.sh first) in each event model
+cd "$(dirname "$0")"
+
+failed=0
+run() {
+  python3 "$@" >/dev/null 2>&1
+  case $? in
+    0) echo "ok   $*" ;;
+    77) echo "skip $*" ;;
+    *) echo "FAIL $*"; failed=1 ;;
+  esac
+}
+
+for mode in "" "--splice" "--io-uring"; do
+  run test_pipelined_early_data.py $mode
+  run test_dns_resolver.py $mode
+done
+# TLS handshakes are made by the epoll event loop only
+for mode in "" "--splice"; do
+  run test_ktls_relay.py $mode
+done
+
+exit $failed
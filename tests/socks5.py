@@ -0,0 +1,121 @@
+"""
+Shared by the tests: runs bin/program (or $PROGRAM) with the flags a
+test is given on its command line, and talks SOCKS5 to it. The program
+listens on 1080, so tests run one at a time.
+"""
+import os
+import socket
+import struct
+import subprocess
+import sys
+import threading
+import time
+
+PROXY = ('127.0.0.1', 1080)
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+PROGRAM = os.environ.get('PROGRAM', os.path.join(ROOT, 'bin', 'program'))
+
+
+class Program:
+    """The program under test, for the length of a with block."""
+
+    def __init__(self, args):
+        self.args = args
+        self.process = None
+
+    def __enter__(self):
+        self.process = subprocess.Popen([PROGRAM] + self.args)
+        deadline = time.monotonic() + 5
+        while time.monotonic() < deadline:
+            if self.process.poll() is not None:
+                raise RuntimeError('program exited with %d' % self.process.returncode)
+            try:
+                socket.create_connection(PROXY, timeout=1).close()
+                return self
+            except OSError:
+                time.sleep(0.05)
+        raise RuntimeError('program never listened on %s:%d' % PROXY)
+
+    def __exit__(self, *_):
+        self.process.terminate()
+        self.process.wait()
+
+
+def recvn(sock, n):
+    """n bytes, or fewer if the peer closes first"""
+    got = b''
+    while len(got) < n:
+        more = sock.recv(n - len(got))
+        if not more:
+            break
+        got += more
+    return got
+
+
+def connect_request(port, address='127.0.0.1'):
+    return b'\x05\x01\x00\x01' + socket.inet_aton(address) + struct.pack('>H', port)
+
+
+def domain_connect_request(port, name):
+    name = name.encode()
+    return b'\x05\x01\x00\x03' + bytes([len(name)]) + name + struct.pack('>H', port)
+
+
+def sink_server():
+    """A listener counting what each connection sends until its end of stream."""
+    listener = socket.socket()
+    listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    listener.bind(('127.0.0.1', 0))
+    listener.listen(16)
+    received = []
+    done = threading.Event()
+
+    def serve():
+        while True:
+            conn, _ = listener.accept()
+            count = 0
+            while True:
+                data = conn.recv(1 << 20)
+                if not data:
+                    break
+                count += len(data)
+            received.append(count)
+            conn.close()
+            done.set()
+
+    threading.Thread(target=serve, daemon=True).start()
+    return listener.getsockname()[1], received, done
+
+
+def echo_server(dual_stack=False):
+    """A listener sending each connection back what it sends; dual_stack: on ::1 too."""
+    if dual_stack:
+        listener = socket.socket(socket.AF_INET6)
+        listener.setsockopt(socket.IPPROTO_IPV6, socket.IPV6_V6ONLY, 0)
+        listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        listener.bind(('::', 0))
+    else:
+        listener = socket.socket()
+        listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        listener.bind(('127.0.0.1', 0))
+    listener.listen(16)
+
+    def echo(conn):
+        while True:
+            data = conn.recv(1 << 20)
+            if not data:
+                break
+            conn.sendall(data)
+        conn.close()
+
+    def serve():
+        while True:
+            conn, _ = listener.accept()
+            threading.Thread(target=echo, args=(conn,), daemon=True).start()
+
+    threading.Thread(target=serve, daemon=True).start()
+    return listener.getsockname()[1]
+
+
+def program_args():
+    return sys.argv[1:]
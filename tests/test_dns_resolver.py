@@ -0,0 +1,120 @@
+"""
+CONNECTs to domain names, resolved by the program's own resolver against
+a fake nameserver (fake_nameserver.py): the cache is off so each one
+reaches the resolver.
+
+  - lookups of a name already being looked up wait on the query in
+    flight rather than sending their own
+  - an answer truncated over UDP is asked for again over TCP
+  - once one family has answered, the other gets the Resolution Delay
+    (RFC 8305 3) and no more: an AAAA answer in time is tried first,
+    a late one isn't waited for
+  - a name the nameserver never answers fails the CONNECT with X'04'
+    once the retries run out, each try from a port of its own, and the
+    resolver goes on answering
+  - an answer from another port, or to another question, is not taken
+    for the one awaited, though its ID matches
+
+    python3 tests/test_dns_resolver.py [program flags, e.g. --io-uring]
+"""
+from socks5 import Program, domain_connect_request, echo_server, program_args, recvn, PROXY
+from fake_nameserver import FakeNameserver, Name, TYPE_A, TYPE_AAAA
+import socket
+import threading
+import time
+
+SUCCEEDED = 0
+HOST_UNREACHABLE = 4
+ATYP_IPV4 = 1
+ATYP_IPV6 = 4
+LOOKUPS_COALESCED = 20
+# the resolver's, over UDP: each try gets 1.5s
+UDP_TRIES = 3
+UDP_TRY_SECONDS = 1.5
+
+
+def connect(port, name):
+    """the CONNECT reply, and the socket when it succeeded"""
+    client = socket.create_connection(PROXY)
+    client.sendall(b'\x05\x01\x00')
+    assert recvn(client, 2) == b'\x05\x00'
+    client.sendall(domain_connect_request(port, name))
+    reply = recvn(client, 4)
+    assert len(reply) == 4, (name, reply)
+    if reply[1] != SUCCEEDED:
+        client.close()
+        return reply, None
+    reply += recvn(client, (4 if reply[3] == ATYP_IPV4 else 16) + 2)
+    return reply, client
+
+
+def relay_once(port, name):
+    reply, client = connect(port, name)
+    assert reply[1] == SUCCEEDED, (name, reply)
+    client.sendall(b'hello')
+    assert recvn(client, 5) == b'hello'
+    client.close()
+    return reply
+
+
+nameserver = FakeNameserver()
+port = echo_server(dual_stack=True)
+
+with Program(['--nameserver', nameserver.address(), '--dns-cache', '0'] + program_args()):
+    nameserver.zone['slow.test'] = Name(a=['127.0.0.1'], delay=0.4)
+    replies = []
+    lookups = [
+        threading.Thread(target=lambda: replies.append(relay_once(port, 'slow.test')))
+        for _ in range(LOOKUPS_COALESCED)
+    ]
+    for lookup in lookups:
+        lookup.start()
+    for lookup in lookups:
+        lookup.join()
+    assert len(replies) == LOOKUPS_COALESCED, replies
+    assert nameserver.queries('slow.test', TYPE_A) == 1, nameserver.counts
+    assert nameserver.queries('slow.test', TYPE_AAAA) == 1, nameserver.counts
+    print('%d lookups, one query of each type' % LOOKUPS_COALESCED)
+
+    nameserver.zone['big.test'] = Name(a=['127.0.0.1'], truncated=True)
+    relay_once(port, 'big.test')
+    assert nameserver.queries('big.test', TYPE_A, 'udp') == 1, nameserver.counts
+    assert nameserver.queries('big.test', TYPE_A, 'tcp') == 1, nameserver.counts
+    print('truncated answer asked for again over TCP')
+
+    nameserver.zone['prompt.test'] = Name(a=['127.0.0.1'], aaaa=['::1'], delay={TYPE_AAAA: 0.01})
+    reply = relay_once(port, 'prompt.test')
+    assert reply[3] == ATYP_IPV6, reply
+    print('AAAA within the Resolution Delay tried first')
+
+    nameserver.zone['late.test'] = Name(a=['127.0.0.1'], aaaa=['::1'], delay={TYPE_AAAA: 2})
+    began = time.monotonic()
+    reply = relay_once(port, 'late.test')
+    waited = time.monotonic() - began
+    assert reply[3] == ATYP_IPV4, reply
+    assert waited < 1, waited
+    print('late AAAA not waited for: %.3fs' % waited)
+
+    nameserver.zone['dropped.test'] = Name(dropped=True)
+    began = time.monotonic()
+    reply, _ = connect(port, 'dropped.test')
+    waited = time.monotonic() - began
+    assert reply[1] == HOST_UNREACHABLE, reply
+    assert nameserver.queries('dropped.test', TYPE_A) == UDP_TRIES, nameserver.counts
+    assert UDP_TRIES * UDP_TRY_SECONDS <= waited < UDP_TRIES * UDP_TRY_SECONDS + 1, waited
+    ports = nameserver.ports_queried_from('dropped.test', TYPE_A)
+    assert len(set(ports)) == UDP_TRIES, ports
+    print('unanswered: X\'04\' after %.1fs, from ports %s' % (waited, ports))
+
+    # nothing listens on 127.0.0.2 at v4_port: taking a forged answer fails the CONNECT
+    v4_port = echo_server()
+    nameserver.zone['forged.test'] = Name(a=['127.0.0.1'], forged=['127.0.0.2'])
+    relay_once(v4_port, 'forged.test')
+    print('forged answers ignored')
+
+    reply, _ = connect(port, 'nonexistent.test')
+    assert reply[1] == HOST_UNREACHABLE, reply
+    relay_once(port, 'prompt.test')
+    print('still resolving')
+
+print('ok')
@@ -0,0 +1,76 @@
+"""
+Over --tls, a client's SOCKS5 session runs inside TLS 1.3 whose records
+the kernel seals and opens (kTLS): after the handshake the program
+relays plaintext as with any client, whichever way the bytes go.
+Exits 77, skipped, where the kernel has no tls ULP or there is no
+openssl to make a certificate with.
+
+    python3 tests/test_ktls_relay.py [program flags, e.g. --splice]
+"""
+from socks5 import Program, connect_request, echo_server, program_args, recvn, PROXY
+import errno
+import os
+import shutil
+import socket
+import ssl
+import subprocess
+import sys
+import tempfile
+
+TCP_ULP = getattr(socket, 'TCP_ULP', 31)
+SIZES = [1, 1000, 16384, 16385, 100000, 1 << 20]
+SKIPPED = 77
+
+
+def kernel_has_tls_ulp():
+    """as the program checks: a socket never connected gets ENOTCONN with the ULP, ENOENT without"""
+    probe = socket.socket()
+    try:
+        probe.setsockopt(socket.IPPROTO_TCP, TCP_ULP, b'tls')
+        return True
+    except OSError as e:
+        return e.errno == errno.ENOTCONN
+    finally:
+        probe.close()
+
+
+def self_signed(directory):
+    cert = os.path.join(directory, 'cert.pem')
+    key = os.path.join(directory, 'key.pem')
+    subprocess.run(
+        ['openssl', 'req', '-x509', '-newkey', 'rsa:2048', '-nodes',
+         '-keyout', key, '-out', cert, '-subj', '/CN=localhost', '-days', '1'],
+        check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    return cert, key
+
+
+if not kernel_has_tls_ulp() or shutil.which('openssl') is None:
+    print('skipped: no tls ULP in this kernel, or no openssl')
+    sys.exit(SKIPPED)
+
+with tempfile.TemporaryDirectory() as directory:
+    cert, key = self_signed(directory)
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+    context.check_hostname = False
+    context.verify_mode = ssl.CERT_NONE
+    port = echo_server()
+
+    with Program(['--tls', cert, key] + program_args()):
+        for size in SIZES:
+            client = context.wrap_socket(socket.create_connection(PROXY), server_hostname='localhost')
+            assert client.version() == 'TLSv1.3', client.version()
+
+            client.sendall(b'\x05\x01\x00')
+            assert recvn(client, 2) == b'\x05\x00'
+            client.sendall(connect_request(port))
+            reply = recvn(client, 10)
+            assert reply[1] == 0, reply
+
+            data = os.urandom(size)
+            client.sendall(data)
+            echoed = recvn(client, size)
+            assert echoed == data, (size, len(echoed))
+            client.close()
+            print('%d bytes relayed both ways over kTLS' % size)
+
+print('ok')
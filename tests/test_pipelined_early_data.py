@@ -0,0 +1,29 @@
+"""
+A client that sends its hello, CONNECT request and data in one go has
+all of the data relayed, however much of it arrives before the reply:
+the completion model buffers it in the client's upstream leg and holds
+back further reads rather than dropping the client.
+
+    python3 tests/test_pipelined_early_data.py [program flags, e.g. --io-uring]
+"""
+from socks5 import Program, connect_request, program_args, recvn, sink_server, PROXY
+import socket
+
+SIZES = [16000, 17000, 30000, 65536, 200000, 1 << 20]
+
+with Program(program_args()):
+    for size in SIZES:
+        port, received, done = sink_server()
+        client = socket.create_connection(PROXY)
+        client.sendall(b'\x05\x01\x00' + connect_request(port) + b'x' * size)
+
+        replies = recvn(client, 2 + 10)
+        assert replies[:2] == b'\x05\x00' and replies[3] == 0, (size, replies)
+        client.shutdown(socket.SHUT_WR)
+
+        assert done.wait(10), 'nothing reached the upstream for %d bytes' % size
+        assert received == [size], (size, received)
+        client.close()
+        print('%d early bytes relayed' % size)
+
+print('ok')